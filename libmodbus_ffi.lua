@@ -0,0 +1,131 @@
+--[[
+LuaJIT FFI fast path for lua-libmodbus.
+Loaded automatically by the C module when running under LuaJIT, don't
+require this directly.  It adds methods to contexts that read into and
+write from FFI arrays through the lmb_ffi_* C functions, so poll loops can
+stay JIT compiled, and values are never converted to lua numbers.
+
+  local regs = mb.ffi.registers(100)
+  local ok, err = dev:read_registers_into(0, 100, regs)
+  dev:write_registers_from(0x100, 4, regs)
+
+Bits are uint8_t arrays, registers uint16_t arrays, see mb.ffi.bits() and
+mb.ffi.registers().  Deadlines are as for the regular methods.
+--]]
+
+local ffi = require("ffi")
+
+ffi.cdef[[
+int lmb_ffi_abi(void);
+void *lmb_ffi_modbus(void *ctx);
+double lmb_ffi_monotonic(void);
+const char *lmb_ffi_strerror(int errnum);
+int lmb_ffi_read(void *ctx, int table, int addr, int count, void *dest, double deadline);
+int lmb_ffi_write(void *ctx, int table, int addr, int count, const void *src, double deadline);
+]]
+
+-- The C module itself, which is already loaded, so this is just a lookup
+local path = package.searchpath and package.searchpath("libmodbus", package.cpath)
+local C = path and ffi.load(path) or ffi.C
+
+-- Must match the C module, refuse to run against anything else
+local ABI = 1
+
+local BITS, INPUT_BITS, REGISTERS, INPUT_REGISTERS = 0, 1, 2, 3
+
+local u8 = ffi.typeof("uint8_t[?]")
+local u16 = ffi.typeof("uint16_t[?]")
+
+return function(mb, ctx_methods)
+	if C.lmb_ffi_abi() ~= ABI then
+		error("libmodbus_ffi.lua doesn't match the C module")
+	end
+
+	-- Handles are cached, getting them is a C call that would abort traces
+	local handles = setmetatable({}, { __mode = "k" })
+	local function handle(ctx)
+		local h = handles[ctx]
+		if not h then
+			h = ffi.cast("void *", ctx:_ptr())
+			handles[ctx] = h
+		end
+		return h
+	end
+
+	local function deadline(d)
+		if d == nil then
+			return 0
+		end
+		local rel
+		if type(d) == "table" then
+			if d.deadline then
+				if d.deadline < 0 then
+					error("deadline can't be negative", 3)
+				end
+				return d.deadline > 1 and d.deadline or 1
+			end
+			rel = d.timeout
+			if rel == nil then
+				return 0
+			end
+		else
+			rel = d
+		end
+		return C.lmb_ffi_monotonic() + (rel > 0 and rel or 0)
+	end
+
+	-- ffi.sizeof() of variable length arrays isn't compiled, so remember it
+	local sizes = setmetatable({}, { __mode = "k" })
+	local function check(buf, count, size)
+		local n = sizes[buf]
+		if not n then
+			n = ffi.sizeof(buf)
+			sizes[buf] = n
+		end
+		if n < count * size then
+			error("buffer too small for " .. count .. " values", 3)
+		end
+	end
+
+	local function err()
+		return nil, ffi.string(C.lmb_ffi_strerror(ffi.errno()))
+	end
+
+	local function reader(table, size)
+		return function(ctx, addr, count, buf, d)
+			check(buf, count, size)
+			if C.lmb_ffi_read(handle(ctx), table, addr, count, buf, deadline(d)) ~= count then
+				return err()
+			end
+			return buf
+		end
+	end
+
+	local function writer(table, size)
+		return function(ctx, addr, count, buf, d)
+			check(buf, count, size)
+			if C.lmb_ffi_write(handle(ctx), table, addr, count, buf, deadline(d)) ~= count then
+				return err()
+			end
+			return true
+		end
+	end
+
+	ctx_methods.read_bits_into = reader(BITS, 1)
+	ctx_methods.read_input_bits_into = reader(INPUT_BITS, 1)
+	ctx_methods.read_registers_into = reader(REGISTERS, 2)
+	ctx_methods.read_input_registers_into = reader(INPUT_REGISTERS, 2)
+	ctx_methods.write_bits_from = writer(BITS, 1)
+	ctx_methods.write_registers_from = writer(REGISTERS, 2)
+
+	-- The raw libmodbus modbus_t *, for calling libmodbus through the FFI
+	function ctx_methods.modbus_ptr(ctx)
+		return C.lmb_ffi_modbus(handle(ctx))
+	end
+
+	mb.ffi = {
+		abi = ABI,
+		bits = function(n) return u8(n) end,
+		registers = function(n) return u16(n) end,
+	}
+end
@@ -36,10 +36,32 @@ call them as member functions on the context returned by the new() functions.
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
 #include <sys/time.h>
 
 #if defined(WIN32)
 #include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/serial.h>
+#include <sys/ioctl.h>
 #endif
 
 #include <lua.h>
@@ -52,11 +74,107 @@ call them as member functions on the context returned by the new() functions.
 
 /* unique naming for userdata metatables */
 #define MODBUS_META_CTX	"modbus.ctx"
+#define MODBUS_META_SUB	"modbus.sub"
+#define MODBUS_META_SCHED	"modbus.sched"
+#define MODBUS_META_ARB	"modbus.arb"
+#define MODBUS_META_GW	"modbus.gw"
+#define MODBUS_META_HEDGE	"modbus.hedge"
+#define MODBUS_META_POOL	"modbus.pool"
+#define MODBUS_META_RING	"modbus.ring"
+#define MODBUS_META_CAP	"modbus.capture"
+#define MODBUS_META_SRV	"modbus.server"
+
+/* most split requests we'll have on the wire at once */
+#define LMB_MAX_PIPELINE 16
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/*
+ * Every heap allocation goes through these.  Build with
+ * EXTRA_CFLAGS=-DLMB_DEBUG_ALLOC to count them, see allocations(),
+ * steady state transactions should not add to the count.
+ */
+#if defined(LMB_DEBUG_ALLOC)
+static unsigned long lmb_alloc_count;
+
+static void *lmb_malloc(size_t n)
+{
+	lmb_alloc_count++;
+	return malloc(n);
+}
+
+static void *lmb_calloc(size_t n, size_t size)
+{
+	lmb_alloc_count++;
+	return calloc(n, size);
+}
+
+static void *lmb_realloc(void *p, size_t n)
+{
+	lmb_alloc_count++;
+	return realloc(p, n);
+}
+#else
+#define lmb_malloc malloc
+#define lmb_calloc calloc
+#define lmb_realloc realloc
+#endif
+
+/* Recursive mutexes, for contexts shared between lua states */
+#if defined(WIN32)
+typedef CRITICAL_SECTION lmb_mutex_t;
+#define lmb_mutex_init(m) InitializeCriticalSection(m)
+#define lmb_mutex_destroy(m) DeleteCriticalSection(m)
+#define lmb_mutex_lock(m) EnterCriticalSection(m)
+#define lmb_mutex_unlock(m) LeaveCriticalSection(m)
+#else
+typedef pthread_mutex_t lmb_mutex_t;
+
+static void lmb_mutex_init(lmb_mutex_t *m)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(m, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
 
+#define lmb_mutex_destroy(m) pthread_mutex_destroy(m)
+#define lmb_mutex_lock(m) pthread_mutex_lock(m)
+#define lmb_mutex_unlock(m) pthread_mutex_unlock(m)
+#endif
+
+/* The four modbus data tables */
+enum lmb_table {
+	LMB_BITS,
+	LMB_INPUT_BITS,
+	LMB_REGISTERS,
+	LMB_INPUT_REGISTERS,
+};
+
+static const char *const lmb_table_names[] = {
+	"bits", "input_bits", "registers", "input_registers", NULL
+};
+
+/* A cached block of one unit's table, see ctx:cache_add() */
 typedef struct {
-	lua_State *L;
+	enum lmb_table table;
+	int unit;
+	int addr;
+	int count;
+	uint64_t ttl;
+	/* monotonic time of the last refresh, 0 when stale */
+	uint64_t fetched;
+	uint16_t *vals;
+} lmb_cache_block_t;
+
+typedef struct lmb_ctx {
 	modbus_t *modbus;
 	size_t max_len;
+	/* for raw requests and responses, big enough for either transport */
+	uint8_t scratch[MODBUS_TCP_MAX_ADU_LENGTH];
 
 	/* only used for making tostring */
 	char *dev_host;
@@ -68,8 +186,75 @@ typedef struct {
 
 	/* used to prevent using tcp methods on a rtu context */
 	bool is_rtu;
+
+	/* libmodbus has no getter for this, needed for deadline retries */
+	int error_recovery;
+	/* configured timeouts, saved while a per call deadline is armed */
+	bool dl_armed;
+	uint32_t dl_response_us;
+	uint32_t dl_byte_us;
+
+	/* libmodbus has no getter for this in all versions */
+	int slave;
+	/* largest single requests the device accepts, bigger ones are split */
+	int max_read_regs;
+	int max_write_regs;
+	int max_read_bits;
+	int max_write_bits;
+	/* split requests allowed in flight at once, tcp only */
+	int pipeline;
+	/* transaction ids for requests we frame ourselves */
+	uint16_t tid;
+	/* single registers are written with FC06, for devices refusing FC16 */
+	bool single_write_fc06;
+	/* gaps between points write_points() may fill from the cache */
+	int write_gap;
+	lmb_cache_block_t *cache;
+	int cache_len;
+	uint32_t cache_hits;
+	uint32_t cache_misses;
+	/* rtu tuning, and transaction timing */
+	struct {
+		bool exact_t35;
+		bool adaptive;
+		uint32_t turnaround_us;
+		uint32_t byte_slack_us;
+		uint32_t n;
+		uint64_t ta_min;
+		uint64_t ta_max;
+		uint64_t ta_total;
+		uint64_t wire_total;
+		uint64_t elapsed_total;
+	} rtu;
+	/* frame capture, if attached, and the id its records carry */
+	struct lmb_capture *cap;
+	uint32_t id;
+	/*
+	 * Userdata handles on this context, in any lua state, plus shares
+	 * not attached yet.  Once shared, all use is under the lock.
+	 */
+	int refs;
+	int pending;
+	bool shared;
+	lmb_mutex_t lock;
+	struct lmb_ctx *next_shared;
 } ctx_t;
 
+/* A context userdata, one of possibly several handles on the context */
+typedef struct {
+	ctx_t *ctx;
+	/* this handle's own unit id, for shared contexts */
+	int slave;
+} ctx_box_t;
+
+/*
+ * A per call deadline, as absolute monotonic microseconds.
+ * at == 0 means no deadline was requested.
+ */
+typedef struct {
+	uint64_t at;
+} lmb_deadline_t;
+
 /*
  * Pushes either "true" or "nil, errormessage"
  * @param L
@@ -90,984 +275,11708 @@ static int libmodbus_rc_to_nil_error(lua_State *L, int rc, int expected)
 	}
 }
 
-/**
- * Returns the runtime linked version of libmodbus as a string.
- * The compile time version is available as a constant VERSION.
- * @function version
- * @return eg "3.0.6"
- * @see other_constants
- */
-static int libmodbus_version(lua_State *L)
+static uint64_t lmb_now_us(void)
 {
-	char version[16];
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	snprintf(version, sizeof(version) - 1, "%i.%i.%i",
-		libmodbus_version_major, libmodbus_version_minor, libmodbus_version_micro);
-	lua_pushstring(L, version);
-	return 1;
+static uint32_t timeout_get_us(modbus_t *modbus, bool byte)
+{
+	uint32_t sec, usec;
+#if LIBMODBUS_VERSION_CHECK(3,1,0)
+	if (byte) {
+		modbus_get_byte_timeout(modbus, &sec, &usec);
+	} else {
+		modbus_get_response_timeout(modbus, &sec, &usec);
+	}
+#else
+	struct timeval t;
+	if (byte) {
+		modbus_get_byte_timeout(modbus, &t);
+	} else {
+		modbus_get_response_timeout(modbus, &t);
+	}
+	sec = t.tv_sec;
+	usec = t.tv_usec;
+#endif
+	return sec * 1000000 + usec;
 }
 
-/**
- * Create a Modbus/RTU context
- * @function new_rtu
- * @param device (required)
- * @param baud rate, defaults to 19200
- * @param parity defaults to EVEN
- * @param databits defaults to 8
- * @param stopbits defaults to 1
- * @return a modbus context ready for use
- */
-static int libmodbus_new_rtu(lua_State *L)
+static void timeout_set_us(modbus_t *modbus, bool byte, uint32_t us)
 {
-	const char *device = luaL_checkstring(L, 1);
-	int baud = luaL_optnumber(L, 2, 19200);
-	const char *parityin = luaL_optstring(L, 3, "EVEN");
-	int databits = luaL_optnumber(L, 4, 8);
-	int stopbits = luaL_optnumber(L, 5, 1);
+#if LIBMODBUS_VERSION_CHECK(3,1,0)
+	if (byte) {
+		modbus_set_byte_timeout(modbus, us / 1000000, us % 1000000);
+	} else {
+		modbus_set_response_timeout(modbus, us / 1000000, us % 1000000);
+	}
+#else
+	struct timeval t = { us / 1000000, us % 1000000 };
+	if (byte) {
+		modbus_set_byte_timeout(modbus, &t);
+	} else {
+		modbus_set_response_timeout(modbus, &t);
+	}
+#endif
+}
 
-	/* just accept baud as is */
-	/* parity must be one of a few things... */
-	char parity;
-	switch (parityin[0]) {
-	case 'e':
-	case 'E':
-		parity = 'E';
-		break;
-	case 'n':
-	case 'N':
-		parity = 'N';
+/*
+ * Parses an optional deadline argument.
+ * nil/none is no deadline, a number is relative microseconds from now,
+ * a table may provide either "timeout" (relative) or "deadline" (absolute,
+ * as returned by monotonic()), and with neither is no deadline either
+ */
+static void deadline_opt(lua_State *L, int idx, lmb_deadline_t *dl)
+{
+	dl->at = 0;
+	switch (lua_type(L, idx)) {
+	case LUA_TNONE:
+	case LUA_TNIL:
+		return;
+	case LUA_TNUMBER: {
+		lua_Number rel = lua_tonumber(L, idx);
+		dl->at = lmb_now_us() + (rel > 0 ? rel : 0);
 		break;
-	case 'o':
-	case 'O':
-		parity = 'O';
+	}
+	case LUA_TTABLE:
+		lua_getfield(L, idx, "deadline");
+		lua_getfield(L, idx, "timeout");
+		if (lua_isnumber(L, -2)) {
+			lua_Number at = lua_tonumber(L, -2);
+			if (at < 0) {
+				luaL_argerror(L, idx, "deadline can't be negative");
+			}
+			dl->at = at;
+		} else if (lua_isnumber(L, -1)) {
+			lua_Number rel = lua_tonumber(L, -1);
+			dl->at = lmb_now_us() + (rel > 0 ? rel : 0);
+		} else {
+			lua_pop(L, 2);
+			return;
+		}
+		lua_pop(L, 2);
 		break;
 	default:
-		return luaL_argerror(L, 3, "Unrecognised parity");
+		luaL_argerror(L, idx, "deadline must be microseconds or a table");
 	}
-
-	ctx_t *ctx = (ctx_t *) lua_newuserdata(L, sizeof(ctx_t));
-
-	ctx->modbus = modbus_new_rtu(device, baud, parity, databits, stopbits);
-	ctx->max_len = MODBUS_RTU_MAX_ADU_LENGTH;
-	ctx->is_rtu = true;
-
-	if (ctx->modbus == NULL) {
-		return luaL_error(L, modbus_strerror(errno));
+	/* an already expired deadline must still read as "set" */
+	if (dl->at == 0) {
+		dl->at = 1;
 	}
+}
 
-	ctx->L = L;
+/*
+ * Parses the "deadline" field of an options table.  There a number is an
+ * absolute time, as returned by monotonic(), not a relative timeout, so
+ * it reads the same as {deadline=...} does as an argument.  Tables are as
+ * for deadline_opt().
+ */
+static void deadline_field(lua_State *L, int idx, lmb_deadline_t *dl)
+{
+	lua_getfield(L, idx, "deadline");
+	if (lua_type(L, -1) == LUA_TNUMBER) {
+		lua_Number at = lua_tonumber(L, -1);
+		if (at < 0) {
+			luaL_argerror(L, idx, "deadline can't be negative");
+		}
+		/* an already expired deadline must still read as "set" */
+		dl->at = at >= 1 ? at : 1;
+	} else {
+		deadline_opt(L, lua_gettop(L), dl);
+	}
+	lua_pop(L, 1);
+}
 
-	/* save data for nice string representations */
-	ctx->baud = baud;
-	ctx->databits = databits;
-	ctx->dev_host = strdup(device);
-	ctx->parity = parity;
-	ctx->stopbits = stopbits;
+/*
+ * Clamps the context's response and byte timeouts to whatever remains of
+ * the deadline.  libmodbus applies them to each wait on its own, so this
+ * bounds each wait, not the whole response: one trickling in byte by byte
+ * can still finish past the deadline.  Requests we frame ourselves check
+ * the remaining budget before every read instead, see wait_budget().
+ * Must be paired with deadline_disarm()
+ * @return 0 if armed (or no deadline) or -1 with errno = ETIMEDOUT if expired
+ */
+static int deadline_arm(ctx_t *ctx, const lmb_deadline_t *dl)
+{
+	if (!dl->at) {
+		return 0;
+	}
+	uint64_t now = lmb_now_us();
+	if (now >= dl->at) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	uint64_t left = dl->at - now;
 
-	/* Make sure unused fields are zeroed */
-	ctx->service = NULL;
+	ctx->dl_response_us = timeout_get_us(ctx->modbus, false);
+	ctx->dl_byte_us = timeout_get_us(ctx->modbus, true);
+	ctx->dl_armed = true;
+	if (left < ctx->dl_response_us) {
+		timeout_set_us(ctx->modbus, false, left);
+	}
+	/* a zero byte timeout means "disabled" to libmodbus, leave it so */
+	if (ctx->dl_byte_us && left < ctx->dl_byte_us) {
+		timeout_set_us(ctx->modbus, true, left);
+	}
+	/* libmodbus would retry link errors forever, we do it ourselves */
+	if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) {
+		modbus_set_error_recovery(ctx->modbus, ctx->error_recovery & ~MODBUS_ERROR_RECOVERY_LINK);
+	}
+	return 0;
+}
 
-	luaL_getmetatable(L, MODBUS_META_CTX);
-	// Can I put more functions in for rtu here? maybe?
-	lua_setmetatable(L, -2);
+static void deadline_disarm(ctx_t *ctx)
+{
+	if (!ctx->dl_armed) {
+		return;
+	}
+	int saved = errno;
+	timeout_set_us(ctx->modbus, false, ctx->dl_response_us);
+	timeout_set_us(ctx->modbus, true, ctx->dl_byte_us);
+	if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) {
+		modbus_set_error_recovery(ctx->modbus, ctx->error_recovery);
+	}
+	ctx->dl_armed = false;
+	errno = saved;
+}
 
-	return 1;
+/*
+ * Decides whether a failed call under a deadline should be tried again.
+ * Only link level failures are retried, and only if link recovery was
+ * requested, reconnecting within the remaining budget.
+ * errno is preserved from the original failure if we give up.
+ */
+static bool deadline_retry(ctx_t *ctx, const lmb_deadline_t *dl)
+{
+	int saved = errno;
+	if (!dl->at || !(ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK)) {
+		return false;
+	}
+	/* protocol errors and exceptions aren't going to improve */
+	if (saved >= MODBUS_ENOBASE || lmb_now_us() >= dl->at) {
+		return false;
+	}
+	modbus_close(ctx->modbus);
+	if (deadline_arm(ctx, dl) < 0) {
+		errno = saved;
+		return false;
+	}
+	int rc = modbus_connect(ctx->modbus);
+	deadline_disarm(ctx);
+	errno = saved;
+	return rc == 0;
 }
 
+/* Every shared context, so handles can be checked when attached */
+static ctx_t *lmb_shares;
+/* ids for capture records, never reused */
+static uint32_t lmb_ctx_ids;
+#if defined(WIN32)
+static SRWLOCK lmb_shares_lock = SRWLOCK_INIT;
+#define shares_lock() AcquireSRWLockExclusive(&lmb_shares_lock)
+#define shares_unlock() ReleaseSRWLockExclusive(&lmb_shares_lock)
+#else
+static pthread_mutex_t lmb_shares_lock = PTHREAD_MUTEX_INITIALIZER;
+#define shares_lock() pthread_mutex_lock(&lmb_shares_lock)
+#define shares_unlock() pthread_mutex_unlock(&lmb_shares_lock)
+#endif
 
-/**
- * Create a Modbus/TCP context
- * @function new_tcp_pi
- * @param host eg "192.168.1.100" or "modbus.example.org"
- * @param service eg "502" or "mbap"
- * @return a modbus context ready for use
+/*
+ * Serialises use of shared contexts.  Only ever held around plain C, or
+ * a protected call, so lua errors can't leave it locked.
  */
-static int libmodbus_new_tcp_pi(lua_State *L)
+static void ctx_lock(ctx_t *ctx)
 {
-	const char *host = luaL_checkstring(L, 1);
-	const char *service = luaL_checkstring(L, 2);
-
-	// Do we really need any of this? no callbacks in libmodbus?
-	ctx_t *ctx = (ctx_t *) lua_newuserdata(L, sizeof(ctx_t));
+	if (ctx->shared) {
+		lmb_mutex_lock(&ctx->lock);
+	}
+}
 
-	ctx->modbus = modbus_new_tcp_pi(host, service);
-	ctx->max_len = MODBUS_TCP_MAX_ADU_LENGTH;
-	ctx->is_rtu = false;
+static void ctx_unlock(ctx_t *ctx)
+{
+	if (ctx->shared) {
+		lmb_mutex_unlock(&ctx->lock);
+	}
+}
 
-	if (ctx->modbus == NULL) {
-		return luaL_error(L, modbus_strerror(errno));
+/*
+ * Addresses another unit for a while, returning the one to go back to
+ * with ctx_unit_restore()
+ */
+static int ctx_unit_switch(ctx_t *ctx, int unit)
+{
+	int prev = ctx->slave;
+	if (unit != prev && modbus_set_slave(ctx->modbus, unit) == 0) {
+		ctx->slave = unit;
 	}
+	return prev;
+}
 
-	ctx->L = L;
+static void ctx_unit_restore(ctx_t *ctx, int prev)
+{
+	/* rtu contexts start without a valid unit, which can't be set back */
+	if (prev >= 0 && prev != ctx->slave && modbus_set_slave(ctx->modbus, prev) == 0) {
+		ctx->slave = prev;
+	}
+}
 
-	/* save data for nice string representations */
-	ctx->dev_host = strdup(host);
-	ctx->service = strdup(service);
-	ctx->databits = 0;
+static void lmb_sleep_us(uint64_t us)
+{
+#if defined(WIN32)
+	Sleep((DWORD)((us + 999) / 1000));
+#else
+	struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+	}
+#endif
+}
 
-	luaL_getmetatable(L, MODBUS_META_CTX);
-	// Can I put more functions in for tcp here? maybe?
-	lua_setmetatable(L, -2);
+static void ctx_init_limits(ctx_t *ctx)
+{
+	ctx->max_read_regs = MODBUS_MAX_READ_REGISTERS;
+	ctx->max_write_regs = MODBUS_MAX_WRITE_REGISTERS;
+	ctx->max_read_bits = MODBUS_MAX_READ_BITS;
+	ctx->max_write_bits = MODBUS_MAX_WRITE_BITS;
+	ctx->pipeline = 1;
+}
 
-	return 1;
+/* Time on the wire for one character, in microseconds */
+static uint32_t rtu_char_us(const ctx_t *ctx)
+{
+	int bits = 1 + ctx->databits + (ctx->parity != 'N') + ctx->stopbits;
+	return (bits * 1000000 + ctx->baud - 1) / ctx->baud;
 }
 
-/** Write a 32bit (u)int to 2x16bit registers
- * @function set_s32
- * @param num 32bit number
- * @return reg1 upper 16bits
- * @return reg2 lower 16bits
+/*
+ * Modbus/RTU's 3.5 character silent interval.  The spec fixes it at 1750us
+ * above 19200 baud, unless tuned for exact timing.
  */
-static int helper_set_s32(lua_State *L)
+static uint32_t rtu_t35_us(const ctx_t *ctx)
 {
-	/* truncate as necessary */
-	//const uint32_t toval = (uint32_t)luaL_checknumber(L, 1);
-	lua_Number n = luaL_checknumber(L, 1);
-	int32_t toval = (int32_t)n;
-	lua_pushinteger(L, toval >> 16);
-	lua_pushinteger(L, toval & 0xffff);
-	return 2;
+	if (ctx->baud > 19200 && !ctx->rtu.exact_t35) {
+		return 1750;
+	}
+	int bits = 1 + ctx->databits + (ctx->parity != 'N') + ctx->stopbits;
+	return (35 * bits * 100000 + ctx->baud - 1) / ctx->baud;
 }
 
-/** Write a bit float to 2x16bit registers
- * @function set_f32
- * @param num floating point number
- * @return reg1 upper 16bits of a 32bit float
- * @return reg2 lower 16bits of a 32bit float
+/*
+ * How long we may wait for the response (or the next bytes of it), as per
+ * the context's timeouts, but never beyond the deadline.
  */
-static int helper_set_f32(lua_State *L)
+static uint64_t wait_budget(ctx_t *ctx, const lmb_deadline_t *dl, bool byte)
 {
-	/* truncate to float if necessary */
-	const float in = (float)luaL_checknumber(L, 1);
-	uint32_t out;
-	memcpy(&out, &in, sizeof(out));
-	lua_pushinteger(L, out >> 16);
-	lua_pushinteger(L, out & 0xffff);
-	return 2;
+	uint64_t us = timeout_get_us(ctx->modbus, byte);
+	if (byte && us == 0) {
+		us = timeout_get_us(ctx->modbus, false);
+	}
+	if (dl && dl->at) {
+		uint64_t now = lmb_now_us();
+		uint64_t left = now < dl->at ? dl->at - now : 0;
+		if (left < us) {
+			us = left;
+		}
+	}
+	return us;
 }
 
+static int sock_wait(int s, bool for_write, uint64_t us)
+{
+	fd_set fds;
+	struct timeval tv;
+	int rc;
 
-/**
- * 16bit register as number to signed 16bit
- * @function get_s16
- * @param 1 16bit register
- * @return signed 16bit number
- */
-static int helper_get_s16(lua_State *L)
+	do {
+		FD_ZERO(&fds);
+		FD_SET(s, &fds);
+		tv.tv_sec = us / 1000000;
+		tv.tv_usec = us % 1000000;
+		rc = select(s + 1, for_write ? NULL : &fds, for_write ? &fds : NULL, NULL, &tv);
+	} while (rc < 0 && errno == EINTR);
+	if (rc == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return rc < 0 ? -1 : 0;
+}
+
+static int sock_send_all(int s, const uint8_t *buf, int len)
 {
-	const int16_t in = luaL_checknumber(L, 1);
-	lua_pushinteger(L, in);
-	return 1;
+	int sent = 0;
+	while (sent < len) {
+		int rc = send(s, (const char *)buf + sent, len - sent, MSG_NOSIGNAL);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc <= 0) {
+			return -1;
+		}
+		sent += rc;
+	}
+	return sent;
 }
 
-/**
- * 2x16bit registers as number to signed 32 bit
+/* Reads exactly len bytes from a socket, or a serial port on posix */
+static int fd_recv_all(ctx_t *ctx, int s, uint8_t *buf, int len, const lmb_deadline_t *dl, bool first)
+{
+	int got = 0;
+	while (got < len) {
+		if (sock_wait(s, false, wait_budget(ctx, dl, !first || got > 0)) < 0) {
+			return -1;
+		}
+#if defined(WIN32)
+		int rc = recv(s, (char *)buf + got, len - got, 0);
+#else
+		int rc = read(s, buf + got, len - got);
+#endif
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if (rc < 0) {
+			return -1;
+		}
+		got += rc;
+	}
+	return got;
+}
+
+/* Checks a response pdu for exceptions and the expected function code */
+static int pdu_check(const uint8_t *rsp, int len, uint8_t fc)
+{
+	if (len >= 2 && rsp[0] == (fc | 0x80)) {
+		errno = MODBUS_ENOBASE + rsp[1];
+		return -1;
+	}
+	if (len < 1 || rsp[0] != fc) {
+		errno = EMBBADDATA;
+		return -1;
+	}
+	return 0;
+}
+
+static uint16_t crc16(const uint8_t *buf, int len)
+{
+	uint16_t crc = 0xffff;
+	for (int i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (int b = 0; b < 8; b++) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+		}
+	}
+	return crc;
+}
+
+/*
+ * Frame capture.  Contexts with a capture attached record every ADU they
+ * send and receive into a byte ring, which any number of contexts can share.
+ * Each record is a fixed header and the ADU as it was on the wire, and the
+ * oldest records are overwritten once the ring is full.  Transactions that
+ * libmodbus does itself are recorded as rebuilt frames, only the
+ * Modbus/TCP transaction ids of those differ from the wire.
+ */
+enum lmb_cap_dir {
+	LMB_CAP_TX = 0,
+	LMB_CAP_RX = 1,
+};
+
+typedef struct {
+	uint64_t ts;
+	uint32_t ctx;
+	uint16_t len;
+	uint8_t dir;
+	uint8_t rtu;
+} lmb_cap_rec_t;
+
+typedef struct lmb_capture {
+	lmb_mutex_t lock;
+	int refs;
+	uint8_t *buf;
+	size_t size;
+	/* offset of the oldest record, and bytes held */
+	size_t head;
+	size_t used;
+	uint32_t records;
+	uint64_t captured;
+	uint64_t overwritten;
+	/* realtime and monotonic clocks at creation, for dumping */
+	uint64_t wall0;
+	uint64_t mono0;
+} lmb_capture_t;
+
+static void cap_copy_in(lmb_capture_t *cap, size_t off, const void *src, size_t n)
+{
+	off %= cap->size;
+	size_t first = cap->size - off < n ? cap->size - off : n;
+	memcpy(&cap->buf[off], src, first);
+	memcpy(cap->buf, (const uint8_t *)src + first, n - first);
+}
+
+static void cap_copy_out(const lmb_capture_t *cap, size_t off, void *dst, size_t n)
+{
+	off %= cap->size;
+	size_t first = cap->size - off < n ? cap->size - off : n;
+	memcpy(dst, &cap->buf[off], first);
+	memcpy((uint8_t *)dst + first, cap->buf, n - first);
+}
+
+/* Appends a record of two byte runs, making room as needed.  Caller locks */
+static void cap_put(lmb_capture_t *cap, const lmb_cap_rec_t *rec, const uint8_t *a, int alen, const uint8_t *b, int blen)
+{
+	size_t need = sizeof(*rec) + rec->len;
+	if (need > cap->size) {
+		return;
+	}
+	while (cap->size - cap->used < need) {
+		lmb_cap_rec_t old;
+		cap_copy_out(cap, cap->head, &old, sizeof(old));
+		cap->head = (cap->head + sizeof(old) + old.len) % cap->size;
+		cap->used -= sizeof(old) + old.len;
+		cap->records--;
+		cap->overwritten++;
+	}
+	size_t off = cap->head + cap->used;
+	cap_copy_in(cap, off, rec, sizeof(*rec));
+	cap_copy_in(cap, off + sizeof(*rec), a, alen);
+	if (blen) {
+		cap_copy_in(cap, off + sizeof(*rec) + alen, b, blen);
+	}
+	cap->used += need;
+	cap->records++;
+	cap->captured++;
+}
+
+/*
+ * Records an ADU sent or received on a context, given as two runs of bytes.
+ * @param ts monotonic timestamp, or 0 for now
+ */
+static void cap_adu(ctx_t *ctx, enum lmb_cap_dir dir, const uint8_t *a, int alen, const uint8_t *b, int blen, uint64_t ts)
+{
+	lmb_capture_t *cap = ctx->cap;
+	if (!cap) {
+		return;
+	}
+	int saved = errno;
+	lmb_cap_rec_t rec = {
+		.ts = ts ? ts : lmb_now_us(),
+		.ctx = ctx->id,
+		.len = alen + blen,
+		.dir = dir,
+		.rtu = ctx->is_rtu,
+	};
+
+	lmb_mutex_lock(&cap->lock);
+	cap_put(cap, &rec, a, alen, b, blen);
+	lmb_mutex_unlock(&cap->lock);
+	errno = saved;
+}
+
+/* Records a pdu, framed for the context's transport */
+static void cap_pdu(ctx_t *ctx, enum lmb_cap_dir dir, int unit, uint16_t tid, const uint8_t *pdu, int len, uint64_t ts)
+{
+	uint8_t hdr[7];
+
+	if (!ctx->cap) {
+		return;
+	}
+	if (ctx->is_rtu) {
+		uint8_t adu[MODBUS_RTU_MAX_ADU_LENGTH];
+		if (len > MODBUS_RTU_MAX_ADU_LENGTH - 3) {
+			return;
+		}
+		adu[0] = unit;
+		memcpy(&adu[1], pdu, len);
+		uint16_t crc = crc16(adu, len + 1);
+		adu[len + 1] = crc & 0xff;
+		adu[len + 2] = crc >> 8;
+		cap_adu(ctx, dir, adu, len + 3, NULL, 0, ts);
+		return;
+	}
+	hdr[0] = tid >> 8;
+	hdr[1] = tid & 0xff;
+	hdr[2] = 0;
+	hdr[3] = 0;
+	hdr[4] = (len + 1) >> 8;
+	hdr[5] = (len + 1) & 0xff;
+	hdr[6] = unit;
+	cap_adu(ctx, dir, hdr, sizeof(hdr), pdu, len, ts);
+}
+
+/*
+ * Records a transaction libmodbus did for us, from its request and response
+ * pdus.  Exceptions are rebuilt from errno when there's no response pdu.
+ * @param rsplen length of the response pdu, or < 0 if there was none
+ * @param t0 when the request was sent
+ */
+static void cap_exchange(ctx_t *ctx, const uint8_t *req, int reqlen, const uint8_t *rsp, int rsplen, uint64_t t0)
+{
+	if (!ctx->cap) {
+		return;
+	}
+	int saved = errno;
+	uint16_t tid = ++ctx->tid;
+
+	cap_pdu(ctx, LMB_CAP_TX, ctx->slave, tid, req, reqlen, t0);
+	if (ctx->slave == MODBUS_BROADCAST_ADDRESS) {
+		return;
+	}
+	if (rsplen >= 0) {
+		cap_pdu(ctx, LMB_CAP_RX, ctx->slave, tid, rsp, rsplen, 0);
+	} else if (saved > MODBUS_ENOBASE && saved <= EMBXGTAR) {
+		uint8_t exc[2] = { req[0] | 0x80, saved - MODBUS_ENOBASE };
+		cap_pdu(ctx, LMB_CAP_RX, ctx->slave, tid, exc, sizeof(exc), 0);
+	}
+	errno = saved;
+}
+
+/* Drops a reference to a capture, the last one frees it */
+static void cap_release(lmb_capture_t *cap)
+{
+	lmb_mutex_lock(&cap->lock);
+	bool last = --cap->refs == 0;
+	lmb_mutex_unlock(&cap->lock);
+	if (last) {
+		lmb_mutex_destroy(&cap->lock);
+		free(cap->buf);
+		free(cap);
+	}
+}
+
+/* Records a FC05/FC06 write libmodbus did, their responses are echoes */
+static void cap_write_single(ctx_t *ctx, uint8_t fc, int addr, uint16_t val, int rc, uint64_t t0)
+{
+	const uint8_t pdu[] = { fc, addr >> 8, addr & 0xff, val >> 8, val & 0xff };
+	cap_exchange(ctx, pdu, sizeof(pdu), pdu, rc == 1 ? (int)sizeof(pdu) : -1, t0);
+}
+
+/*
+ * Our own Modbus/TCP framing.  libmodbus only allows a single request in
+ * flight, and its raw requests always go out with transaction id 0, so
+ * responses couldn't be matched up.
+ * @return bytes sent or -1
+ */
+static int tcp_send_pdu(ctx_t *ctx, int unit, const uint8_t *pdu, int len, uint16_t *tid)
+{
+	uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+	int s = modbus_get_socket(ctx->modbus);
+
+	if (s < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if (len < 1 || len > MODBUS_MAX_PDU_LENGTH) {
+		errno = EINVAL;
+		return -1;
+	}
+	*tid = ++ctx->tid;
+	adu[0] = *tid >> 8;
+	adu[1] = *tid & 0xff;
+	adu[2] = 0;
+	adu[3] = 0;
+	adu[4] = (len + 1) >> 8;
+	adu[5] = (len + 1) & 0xff;
+	adu[6] = unit;
+	memcpy(&adu[7], pdu, len);
+	cap_adu(ctx, LMB_CAP_TX, adu, len + 7, NULL, 0, 0);
+	return sock_send_all(s, adu, len + 7);
+}
+
+/*
+ * Receives one Modbus/TCP response, within the response timeout and deadline
+ * @return the length of the pdu, or -1
+ */
+static int tcp_recv_pdu(ctx_t *ctx, const lmb_deadline_t *dl, uint8_t *pdu, uint16_t *tid, int *unit)
+{
+	uint8_t hdr[7];
+	int s = modbus_get_socket(ctx->modbus);
+
+	if (s < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if (fd_recv_all(ctx, s, hdr, sizeof(hdr), dl, true) < 0) {
+		return -1;
+	}
+	int len = hdr[4] << 8 | hdr[5];
+	if (hdr[2] || hdr[3] || len < 2 || len > MODBUS_MAX_PDU_LENGTH + 1) {
+		errno = EMBBADDATA;
+		return -1;
+	}
+	if (fd_recv_all(ctx, s, pdu, len - 1, dl, false) < 0) {
+		return -1;
+	}
+	cap_adu(ctx, LMB_CAP_RX, hdr, sizeof(hdr), pdu, len - 1, 0);
+	*tid = hdr[0] << 8 | hdr[1];
+	*unit = hdr[6];
+	return len - 1;
+}
+
+/*
+ * Bytes following the function code of a response whose length is fixed,
+ * or -1 if it carries its own length.
+ */
+static int rtu_fixed_response_length(uint8_t fc)
+{
+	if (fc & 0x80) {
+		return 1;
+	}
+	switch (fc) {
+	case MODBUS_FC_READ_EXCEPTION_STATUS:
+		return 1;
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+	case 0x08: /* diagnostics */
+	case 0x0b: /* get comm event counter */
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		return 4;
+	case MODBUS_FC_MASK_WRITE_REGISTER:
+		return 6;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Receives one Modbus/RTU response.  libmodbus can only frame the function
+ * codes it implements itself, so this knows the rest too.
+ * @param pdu receives the pdu, must hold MODBUS_MAX_PDU_LENGTH
+ * @return the length of the pdu, or -1
+ */
+static int rtu_recv_pdu(ctx_t *ctx, const lmb_deadline_t *dl, uint8_t *pdu, int *unit)
+{
+	uint8_t adu[MODBUS_RTU_MAX_ADU_LENGTH];
+	int s = modbus_get_socket(ctx->modbus);
+	int len = 2;
+
+	if (s < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if (fd_recv_all(ctx, s, adu, 2, dl, true) < 0) {
+		return -1;
+	}
+	int fc = adu[1];
+	int rest = rtu_fixed_response_length(fc);
+	if (rest < 0) {
+		switch (fc) {
+		case 0x18: /* read fifo queue, 16bit byte count */
+			if (fd_recv_all(ctx, s, &adu[len], 2, dl, false) < 0) {
+				return -1;
+			}
+			rest = adu[len] << 8 | adu[len + 1];
+			len += 2;
+			break;
+		case 0x2b: {
+			/* encapsulated interface, walk the device id objects */
+			if (fd_recv_all(ctx, s, &adu[len], 6, dl, false) < 0) {
+				return -1;
+			}
+			if (adu[len] != 0x0e) {
+				errno = EMBBADDATA;
+				return -1;
+			}
+			int objects = adu[len + 5];
+			len += 6;
+			rest = 0;
+			for (int i = 0; i < objects; i++) {
+				if (len + 2 > MODBUS_RTU_MAX_ADU_LENGTH - 2 ||
+					fd_recv_all(ctx, s, &adu[len], 2, dl, false) < 0) {
+					return -1;
+				}
+				int olen = adu[len + 1];
+				len += 2;
+				if (len + olen > MODBUS_RTU_MAX_ADU_LENGTH - 2 ||
+					fd_recv_all(ctx, s, &adu[len], olen, dl, false) < 0) {
+					return -1;
+				}
+				len += olen;
+			}
+			break;
+		}
+		default:
+			/* byte count */
+			if (fd_recv_all(ctx, s, &adu[len], 1, dl, false) < 0) {
+				return -1;
+			}
+			rest = adu[len];
+			len += 1;
+			break;
+		}
+	}
+	if (len + rest + 2 > MODBUS_RTU_MAX_ADU_LENGTH) {
+		errno = EMBBADDATA;
+		return -1;
+	}
+	if (fd_recv_all(ctx, s, &adu[len], rest + 2, dl, false) < 0) {
+		return -1;
+	}
+	len += rest + 2;
+	cap_adu(ctx, LMB_CAP_RX, adu, len, NULL, 0, 0);
+	if (crc16(adu, len - 2) != (adu[len - 2] | adu[len - 1] << 8)) {
+		errno = EMBBADCRC;
+		return -1;
+	}
+	*unit = adu[0];
+	memcpy(pdu, &adu[1], len - 3);
+	return len - 3;
+}
+
+/*
+ * A single request/response on either transport, framed by us rather than
+ * libmodbus, for function codes it doesn't support.
+ * @param unit the unit id to address
+ * @param rsp receives the response pdu, must hold MODBUS_MAX_PDU_LENGTH
+ * @return the length of the response pdu, or -1.  Exception responses are
+ * turned into errors here, as libmodbus does.
+ */
+static int raw_transact(ctx_t *ctx, int unit, const uint8_t *req, int len, uint8_t *rsp, const lmb_deadline_t *dl)
+{
+	int rlen, runit;
+
+	if (unit < 0 || unit > 0xff) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ctx->is_rtu) {
+		uint8_t raw[MODBUS_MAX_PDU_LENGTH + 1];
+		if (len > MODBUS_MAX_PDU_LENGTH) {
+			errno = EINVAL;
+			return -1;
+		}
+		raw[0] = unit;
+		memcpy(&raw[1], req, len);
+		cap_pdu(ctx, LMB_CAP_TX, unit, 0, req, len, 0);
+		if (modbus_send_raw_request(ctx->modbus, raw, len + 1) < 0) {
+			return -1;
+		}
+		rlen = rtu_recv_pdu(ctx, dl, rsp, &runit);
+	} else {
+		uint16_t tid, rtid;
+		if (tcp_send_pdu(ctx, unit, req, len, &tid) < 0) {
+			return -1;
+		}
+		/* skip over any stale responses to earlier, abandoned requests */
+		do {
+			rlen = tcp_recv_pdu(ctx, dl, rsp, &rtid, &runit);
+		} while (rlen >= 0 && rtid != tid);
+	}
+	if (rlen < 0) {
+		return -1;
+	}
+	if (runit != unit) {
+		errno = EMBBADDATA;
+		return -1;
+	}
+	if (pdu_check(rsp, rlen, req[0]) < 0) {
+		return -1;
+	}
+	return rlen;
+}
+
+/**
+ * Returns the monotonic clock, in microseconds.
+ * Most read and write methods accept an optional trailing deadline argument.
+ * This can be a number, in microseconds relative to now, or a table with
+ * either a "timeout" field (relative microseconds) or a "deadline" field,
+ * an absolute time from this function.  A table with neither is no
+ * deadline.  The context's response and byte timeouts are clamped to the
+ * remaining budget for each request, and reconnection attempts (with
+ * ERROR_RECOVERY_LINK) stop when it runs out.
+ * <p>For requests libmodbus frames itself, the reads and writes that aren't
+ * pipelined, the clamp bounds each wait, for the response and then for each
+ * byte of it, not the call as a whole.  A response arriving slowly, byte by
+ * byte, can so finish past the deadline.  Pipelined requests, and those
+ * this module frames itself (file records, FIFO queues and the like),
+ * recheck the remaining budget before every read, and never overrun it.
+ * An expired deadline fails with a timeout error without touching the bus.
+ * @function monotonic
+ * @return microseconds, from an arbitrary starting point
+ * @usage
+ *  local regs, err = dev:read_registers(0x2000, 10, 20000) -- 20ms budget
+ *  local t = mb.monotonic() + 80000
+ *  dev:read_registers(0x2000, 10, {deadline=t})
+ *  dev:write_register(0x2010, 5, {deadline=t})
+ */
+static int libmodbus_monotonic(lua_State *L)
+{
+	lua_pushnumber(L, lmb_now_us());
+	return 1;
+}
+
+#if defined(LMB_DEBUG_ALLOC)
+/**
+ * Count of heap allocations made by this module so far.
+ * Only available when built with -DLMB_DEBUG_ALLOC, for checking that
+ * repeated transactions don't allocate.
+ * @function allocations
+ * @return count
+ * @usage
+ *  local n = mb.allocations()
+ *  dev:read_registers(0, 10)
+ *  assert(mb.allocations() == n)
+ */
+static int libmodbus_allocations(lua_State *L)
+{
+	lua_pushnumber(L, lmb_alloc_count);
+	return 1;
+}
+#endif
+
+/**
+ * Returns the runtime linked version of libmodbus as a string.
+ * The compile time version is available as a constant VERSION.
+ * @function version
+ * @return eg "3.0.6"
+ * @see other_constants
+ */
+static int libmodbus_version(lua_State *L)
+{
+	char version[16];
+
+	snprintf(version, sizeof(version) - 1, "%i.%i.%i",
+		libmodbus_version_major, libmodbus_version_minor, libmodbus_version_micro);
+	lua_pushstring(L, version);
+	return 1;
+}
+
+/*
+ * Pushes an empty context userdata.  Pushed first, so a context allocated
+ * afterwards can't leak if pushing fails.
+ */
+static ctx_box_t *ctx_box_new(lua_State *L)
+{
+	ctx_box_t *box = lua_newuserdata(L, sizeof(*box));
+	box->ctx = NULL;
+	box->slave = -1;
+	luaL_getmetatable(L, MODBUS_META_CTX);
+	lua_setmetatable(L, -2);
+	return box;
+}
+
+static ctx_t *ctx_alloc(lua_State *L)
+{
+	ctx_t *ctx = lmb_calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		luaL_error(L, "out of memory");
+	}
+	ctx->refs = 1;
+	shares_lock();
+	ctx->id = ++lmb_ctx_ids;
+	shares_unlock();
+	return ctx;
+}
+
+/**
+ * Create a Modbus/RTU context
+ * @function new_rtu
+ * @param device (required)
+ * @param baud rate, defaults to 19200
+ * @param parity defaults to EVEN
+ * @param databits defaults to 8
+ * @param stopbits defaults to 1
+ * @return a modbus context ready for use
+ */
+static int libmodbus_new_rtu(lua_State *L)
+{
+	const char *device = luaL_checkstring(L, 1);
+	int baud = luaL_optnumber(L, 2, 19200);
+	const char *parityin = luaL_optstring(L, 3, "EVEN");
+	int databits = luaL_optnumber(L, 4, 8);
+	int stopbits = luaL_optnumber(L, 5, 1);
+
+	/* just accept baud as is */
+	/* parity must be one of a few things... */
+	char parity;
+	switch (parityin[0]) {
+	case 'e':
+	case 'E':
+		parity = 'E';
+		break;
+	case 'n':
+	case 'N':
+		parity = 'N';
+		break;
+	case 'o':
+	case 'O':
+		parity = 'O';
+		break;
+	default:
+		return luaL_argerror(L, 3, "Unrecognised parity");
+	}
+
+	ctx_box_t *box = ctx_box_new(L);
+	ctx_t *ctx = ctx_alloc(L);
+
+	ctx->modbus = modbus_new_rtu(device, baud, parity, databits, stopbits);
+	ctx->max_len = MODBUS_RTU_MAX_ADU_LENGTH;
+	ctx->is_rtu = true;
+	ctx->slave = -1;
+	ctx_init_limits(ctx);
+
+	if (ctx->modbus == NULL) {
+		int err = errno;
+		free(ctx);
+		return luaL_error(L, modbus_strerror(err));
+	}
+
+	/* save data for nice string representations */
+	ctx->baud = baud;
+	ctx->databits = databits;
+	ctx->dev_host = strdup(device);
+	ctx->parity = parity;
+	ctx->stopbits = stopbits;
+
+	/* Make sure unused fields are zeroed */
+	ctx->service = NULL;
+
+	box->ctx = ctx;
+	box->slave = ctx->slave;
+	return 1;
+}
+
+
+/**
+ * Create a Modbus/TCP context
+ * @function new_tcp_pi
+ * @param host eg "192.168.1.100" or "modbus.example.org"
+ * @param service eg "502" or "mbap"
+ * @return a modbus context ready for use
+ */
+static int libmodbus_new_tcp_pi(lua_State *L)
+{
+	const char *host = luaL_checkstring(L, 1);
+	const char *service = luaL_checkstring(L, 2);
+
+	ctx_box_t *box = ctx_box_new(L);
+	ctx_t *ctx = ctx_alloc(L);
+
+	ctx->modbus = modbus_new_tcp_pi(host, service);
+	ctx->max_len = MODBUS_TCP_MAX_ADU_LENGTH;
+	ctx->is_rtu = false;
+	ctx->slave = MODBUS_TCP_SLAVE;
+	/*
+	 * libmodbus counts its own transaction ids up from 0 on the same
+	 * connection, start ours half way round so a late answer to one of
+	 * its requests isn't taken for one of ours
+	 */
+	ctx->tid = 0x8000;
+	ctx_init_limits(ctx);
+
+	if (ctx->modbus == NULL) {
+		int err = errno;
+		free(ctx);
+		return luaL_error(L, modbus_strerror(err));
+	}
+
+	/* save data for nice string representations */
+	ctx->dev_host = strdup(host);
+	ctx->service = strdup(service);
+	ctx->databits = 0;
+
+	box->ctx = ctx;
+	box->slave = ctx->slave;
+	return 1;
+}
+
+/** Write a 32bit (u)int to 2x16bit registers
+ * @function set_s32
+ * @param num 32bit number
+ * @return reg1 upper 16bits
+ * @return reg2 lower 16bits
+ */
+static int helper_set_s32(lua_State *L)
+{
+	/* truncate as necessary */
+	//const uint32_t toval = (uint32_t)luaL_checknumber(L, 1);
+	lua_Number n = luaL_checknumber(L, 1);
+	int32_t toval = (int32_t)n;
+	lua_pushinteger(L, toval >> 16);
+	lua_pushinteger(L, toval & 0xffff);
+	return 2;
+}
+
+/** Write a bit float to 2x16bit registers
+ * @function set_f32
+ * @param num floating point number
+ * @return reg1 upper 16bits of a 32bit float
+ * @return reg2 lower 16bits of a 32bit float
+ */
+static int helper_set_f32(lua_State *L)
+{
+	/* truncate to float if necessary */
+	const float in = (float)luaL_checknumber(L, 1);
+	uint32_t out;
+	memcpy(&out, &in, sizeof(out));
+	lua_pushinteger(L, out >> 16);
+	lua_pushinteger(L, out & 0xffff);
+	return 2;
+}
+
+
+/**
+ * 16bit register as number to signed 16bit
+ * @function get_s16
+ * @param 1 16bit register
+ * @return signed 16bit number
+ */
+static int helper_get_s16(lua_State *L)
+{
+	const int16_t in = luaL_checknumber(L, 1);
+	lua_pushinteger(L, in);
+	return 1;
+}
+
+/**
+ * 2x16bit registers as number to signed 32 bit
  * @function get_s32
  * @param 1 16bit register
  * @param 2 16bit register
- * @return 32bit number
+ * @return 32bit number
+ */
+static int helper_get_s32(lua_State *L)
+{
+	const uint16_t in1 = luaL_checknumber(L, 1);
+	const uint16_t in2 = luaL_checknumber(L, 2);
+	int32_t out = in1 << 16 | in2;
+	lua_pushinteger(L, out);
+	return 1;
+}
+
+/**
+ * 2x16bit registers as number to signed 32 bit (reverse order)
+ * @function get_s32le
+ * @param 1 16bit register
+ * @param 2 16bit register
+ * @return 32bit number
+ */
+static int helper_get_s32le(lua_State *L)
+{
+	const uint16_t in2 = luaL_checknumber(L, 1);
+	const uint16_t in1 = luaL_checknumber(L, 2);
+	int32_t out = in1 << 16 | in2;
+	lua_pushinteger(L, out);
+	return 1;
+}
+
+
+/**
+ * 2x16bit registers as number to unsigned 32 bit
+ * @function get_u32
+ * @param 1 16bit register
+ * @param 2 16bit register
+ * @return 32bit number
+ */
+static int helper_get_u32(lua_State *L)
+{
+	const uint16_t in1 = luaL_checknumber(L, 1);
+	const uint16_t in2 = luaL_checknumber(L, 2);
+	uint32_t out = in1 << 16 | in2;
+	lua_pushnumber(L, out);
+	return 1;
+}
+
+/**
+ * 2x16bit registers as number to unsigned 32 bit (reversed order)
+ * @function get_u32le
+ * @param 1 16bit register
+ * @param 2 16bit register
+ * @return 32bit number
+ */
+static int helper_get_u32le(lua_State *L)
+{
+	const uint16_t in2 = luaL_checknumber(L, 1);
+	const uint16_t in1 = luaL_checknumber(L, 2);
+	uint32_t out = in1 << 16 | in2;
+	lua_pushnumber(L, out);
+	return 1;
+}
+
+/**
+ * 2x16bit registers as number to 32 bit float
+ * @function get_f32
+ * @param 1 16bit register
+ * @param 2 16bit register
+ * @return 32bit float
+ */
+static int helper_get_f32(lua_State *L)
+{
+	const uint16_t in1 = luaL_checknumber(L, 1);
+	const uint16_t in2 = luaL_checknumber(L, 2);
+
+	uint32_t inval = in1<<16 | in2;
+	float f;
+	memcpy(&f, &inval, sizeof(f));
+
+	lua_pushnumber(L, f);
+	return 1;
+}
+
+/**
+ * 2x16bit registers as number to 32 bit float (Reversed order)
+ * @function get_f32le
+ * @param 1 16bit register
+ * @param 2 16bit register
+ * @return 32bit float
+ */
+static int helper_get_f32le(lua_State *L)
+{
+	const uint16_t in2 = luaL_checknumber(L, 1);
+	const uint16_t in1 = luaL_checknumber(L, 2);
+
+	uint32_t inval = in1<<16 | in2;
+	float f;
+	memcpy(&f, &inval, sizeof(f));
+
+	lua_pushnumber(L, f);
+	return 1;
+}
+
+/**
+ * 4x16bit registers as number to signed 64 bit
+ * @function get_s64
+ * @param 1 16bit register
+ * @param 2 16bit register
+ * @param 3 16bit register
+ * @param 4 16bit register
+ * @return 64bit number
+ */
+static int helper_get_s64(lua_State *L)
+{
+	const uint16_t in1 = luaL_checknumber(L, 1);
+	const uint16_t in2 = luaL_checknumber(L, 2);
+	const uint16_t in3 = luaL_checknumber(L, 3);
+	const uint16_t in4 = luaL_checknumber(L, 4);
+	int64_t out = in1;
+	out = out << 16 | in2;
+	out = out << 16 | in3;
+	out = out << 16 | in4;
+	lua_pushnumber(L, out);
+	return 1;
+}
+
+/**
+ * 4x16bit registers as number to unsigned 64 bit
+ * @function get_u64
+ * @param 1 16bit register
+ * @param 2 16bit register
+ * @param 3 16bit register
+ * @param 4 16bit register
+ * @return 64bit number
+ */
+static int helper_get_u64(lua_State *L)
+{
+	const uint16_t in1 = luaL_checknumber(L, 1);
+	const uint16_t in2 = luaL_checknumber(L, 2);
+	const uint16_t in3 = luaL_checknumber(L, 3);
+	const uint16_t in4 = luaL_checknumber(L, 4);
+	uint64_t out = (uint64_t)in1 << 48 | (uint64_t)in2 << 32 | (uint64_t)in3 << 16 | in4;
+	lua_pushnumber(L, out);
+	return 1;
+}
+
+/*
+ * Typed values spread over consecutive registers, shared by everything
+ * decoding or encoding more than one register at a time.
+ * Orders are named for a 32bit value ABCD, A being the most significant
+ * byte.  CDAB swaps words, BADC bytes within words, DCBA both, and
+ * extend to 64bit values the same way.
+ */
+enum lmb_type {
+	LMB_U16,
+	LMB_S16,
+	LMB_U32,
+	LMB_S32,
+	LMB_U64,
+	LMB_S64,
+	LMB_F32,
+	LMB_F64,
+};
+
+static const char *const lmb_type_names[] = {
+	"u16", "s16", "u32", "s32", "u64", "s64", "f32", "f64", NULL
+};
+
+enum lmb_order {
+	LMB_ABCD,
+	LMB_CDAB,
+	LMB_BADC,
+	LMB_DCBA,
+};
+
+static const char *const lmb_order_names[] = {
+	"abcd", "cdab", "badc", "dcba", NULL
+};
+
+static int lmb_type_words(enum lmb_type type)
+{
+	static const int words[] = {
+		[LMB_U16] = 1, [LMB_S16] = 1,
+		[LMB_U32] = 2, [LMB_S32] = 2, [LMB_F32] = 2,
+		[LMB_U64] = 4, [LMB_S64] = 4, [LMB_F64] = 4,
+	};
+	return words[type];
+}
+
+/* Registers to the raw bits of a value, most significant first */
+static uint64_t lmb_gather(const uint16_t *regs, int words, enum lmb_order order)
+{
+	bool wswap = order == LMB_CDAB || order == LMB_DCBA;
+	bool bswap = order == LMB_BADC || order == LMB_DCBA;
+	uint64_t v = 0;
+
+	for (int i = 0; i < words; i++) {
+		uint16_t w = regs[wswap ? words - 1 - i : i];
+		if (bswap) {
+			w = (uint16_t)(w >> 8 | w << 8);
+		}
+		v = v << 16 | w;
+	}
+	return v;
+}
+
+static lua_Number lmb_decode(const uint16_t *regs, enum lmb_type type, enum lmb_order order)
+{
+	uint64_t v = lmb_gather(regs, lmb_type_words(type), order);
+	uint32_t v32 = (uint32_t)v;
+	float f;
+	double d;
+
+	switch (type) {
+	case LMB_U16:
+		return (uint16_t)v;
+	case LMB_S16:
+		return (int16_t)v;
+	case LMB_U32:
+		return v32;
+	case LMB_S32:
+		return (int32_t)v32;
+	case LMB_U64:
+		return (lua_Number)v;
+	case LMB_S64:
+		return (lua_Number)(int64_t)v;
+	case LMB_F32:
+		memcpy(&f, &v32, sizeof(f));
+		return f;
+	case LMB_F64:
+	default:
+		memcpy(&d, &v, sizeof(d));
+		return d;
+	}
+}
+
+/* The raw bits of a value to registers, the inverse of lmb_gather() */
+static void lmb_scatter(uint16_t *regs, uint64_t v, int words, enum lmb_order order)
+{
+	bool wswap = order == LMB_CDAB || order == LMB_DCBA;
+	bool bswap = order == LMB_BADC || order == LMB_DCBA;
+
+	for (int i = words - 1; i >= 0; i--) {
+		uint16_t w = v & 0xffff;
+		v >>= 16;
+		if (bswap) {
+			w = (uint16_t)(w >> 8 | w << 8);
+		}
+		regs[wswap ? words - 1 - i : i] = w;
+	}
+}
+
+/* Integers are truncated to the type's width, as set_s32() does */
+static uint64_t lmb_int_bits(lua_Number n)
+{
+	if (n >= 9223372036854775808.0) {
+		return n < 18446744073709551616.0 ? (uint64_t)n : UINT64_MAX;
+	}
+	if (!(n > -9223372036854775808.0)) {
+		/* and nan, which has no better answer */
+		return n != n ? 0 : (uint64_t)INT64_MIN;
+	}
+	return (uint64_t)(int64_t)n;
+}
+
+static void lmb_encode(uint16_t *regs, lua_Number n, enum lmb_type type, enum lmb_order order)
+{
+	uint64_t v;
+	uint32_t v32;
+	float f;
+	double d;
+
+	switch (type) {
+	case LMB_F32:
+		f = (float)n;
+		memcpy(&v32, &f, sizeof(v32));
+		v = v32;
+		break;
+	case LMB_F64:
+		d = n;
+		memcpy(&v, &d, sizeof(v));
+		break;
+	default:
+		v = lmb_int_bits(n);
+		break;
+	}
+	lmb_scatter(regs, v, lmb_type_words(type), order);
+}
+
+/*
+ * Encodes the array of numbers at idx, as type and order, into registers
+ * @param regs room for count values of the type
+ */
+static void lmb_encode_array(lua_State *L, int idx, int count, enum lmb_type type, enum lmb_order order, uint16_t *regs)
+{
+	int words = lmb_type_words(type);
+
+	for (int i = 0; i < count; i++) {
+		lua_rawgeti(L, idx, i + 1);
+		if (lua_type(L, -1) != LUA_TNUMBER) {
+			luaL_argerror(L, idx, "table values must be numeric");
+		}
+		lmb_encode(&regs[i * words], lua_tonumber(L, -1), type, order);
+		lua_pop(L, 1);
+	}
+}
+
+/**
+ * Encode an array of values into registers, as for @{ctx:write_registers_as}.
+ * @function encode
+ * @param type one of "u16", "s16", "u32", "s32", "u64", "s64", "f32", "f64"
+ * @param values array of numbers
+ * @param[opt] order one of "abcd", "cdab", "badc", "dcba", default "abcd"
+ * @return array of register values, ready for @{ctx:write_registers}
+ * @usage
+ *  local regs = mb.encode("f32", {1.5, -2}, "cdab")
+ *  -- {0, 0x3fc0, 0, 0xc000}
+ */
+static int helper_encode(lua_State *L)
+{
+	enum lmb_type type = luaL_checkoption(L, 1, NULL, lmb_type_names);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	enum lmb_order order = luaL_checkoption(L, 3, "abcd", lmb_order_names);
+	int count = lua_rawlen(L, 2);
+	int words = lmb_type_words(type);
+
+	uint16_t *regs = lua_newuserdata(L, (count ? count : 1) * words * sizeof(*regs));
+	lmb_encode_array(L, 2, count, type, order, regs);
+	lua_createtable(L, count * words, 0);
+	for (int i = 0; i < count * words; i++) {
+		lua_pushinteger(L, regs[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+
+static void cache_free(ctx_t *ctx)
+{
+	for (int i = 0; i < ctx->cache_len; i++) {
+		free(ctx->cache[i].vals);
+	}
+	free(ctx->cache);
+	ctx->cache = NULL;
+	ctx->cache_len = 0;
+}
+
+static ctx_box_t * ctx_box_check(lua_State *L, int i)
+{
+	return (ctx_box_t *) luaL_checkudata(L, i, MODBUS_META_CTX);
+}
+
+static ctx_t * ctx_check(lua_State *L, int i)
+{
+	return ctx_box_check(L, i)->ctx;
+}
+
+/* Closes the connection, and frees all but the context itself */
+static void ctx_teardown(ctx_t *ctx)
+{
+	if (!ctx->modbus) {
+		return;
+	}
+	modbus_close(ctx->modbus);
+	modbus_free(ctx->modbus);
+	ctx->modbus = NULL;
+	cache_free(ctx);
+	free(ctx->dev_host);
+	ctx->dev_host = NULL;
+	free(ctx->service);
+	ctx->service = NULL;
+	if (ctx->cap) {
+		cap_release(ctx->cap);
+		ctx->cap = NULL;
+	}
+}
+
+/* Drops a handle's reference, the last one frees the context */
+static void ctx_release(ctx_t *ctx)
+{
+	shares_lock();
+	bool last = --ctx->refs == 0;
+	if (last && ctx->shared) {
+		ctx_t **p = &lmb_shares;
+		while (*p != ctx) {
+			p = &(*p)->next_shared;
+		}
+		*p = ctx->next_shared;
+	}
+	shares_unlock();
+
+	if (last) {
+		ctx_teardown(ctx);
+		if (ctx->shared) {
+			lmb_mutex_destroy(&ctx->lock);
+		}
+		free(ctx);
+	}
+}
+
+static int ctx_box_gc(lua_State *L)
+{
+	ctx_box_t *box = lua_touserdata(L, 1);
+	if (box && box->ctx) {
+		ctx_release(box->ctx);
+		box->ctx = NULL;
+	}
+	return 0;
+}
+
+/**
+ * Close the context now, rather than when it's garbage collected.
+ * A shared context stays open until the last handle on it, in any state,
+ * is destroyed, this only gives up this one.
+ * @function ctx:destroy
+ */
+static int ctx_destroy(lua_State *L)
+{
+	ctx_box_t *box = ctx_box_check(L, 1);
+	ctx_t *ctx = box->ctx;
+
+	ctx_lock(ctx);
+	shares_lock();
+	bool last = ctx->refs == 1;
+	shares_unlock();
+	if (last) {
+		ctx_teardown(ctx);
+	}
+	ctx_unlock(ctx);
+
+	/*
+	 * remove all methods operating on ctx.  Subscriptions and the like may
+	 * still refer to it, so it's only released when collected.
+	 */
+	lua_newtable(L);
+	lua_pushcfunction(L, ctx_box_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+
+	/* Nothing to return on stack */
+	return 0;
+}
+
+/*
+ * Every context method is called through this, with the method as
+ * upvalue.  Shared contexts are locked for the whole call, protected so
+ * errors can't leave them locked, and switched to this handle's unit id.
+ */
+static int ctx_call(lua_State *L)
+{
+	ctx_box_t *box = ctx_box_check(L, 1);
+	ctx_t *ctx = box->ctx;
+
+	if (!ctx->shared) {
+		return lua_tocfunction(L, lua_upvalueindex(1))(L);
+	}
+	lmb_mutex_lock(&ctx->lock);
+	if (ctx->modbus && box->slave >= 0) {
+		ctx_unit_switch(ctx, box->slave);
+	}
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	int rc = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+	box->slave = ctx->slave;
+	lmb_mutex_unlock(&ctx->lock);
+	if (rc != 0) {
+		return lua_error(L);
+	}
+	return lua_gettop(L);
+}
+
+/* As luaL_setfuncs, but with methods wrapped by ctx_call */
+static void ctx_setfuncs(lua_State *L, const luaL_Reg *l)
+{
+	for (; l->name; l++) {
+		lua_pushcfunction(L, l->func);
+		if (strncmp(l->name, "__", 2) != 0) {
+			lua_pushcclosure(L, ctx_call, 1);
+		}
+		lua_setfield(L, -2, l->name);
+	}
+}
+
+/**
+ * Share this context with another lua state in the same process, such as
+ * another thread with lanes or effil.  Each handle, in any state, can be
+ * used at the same time, transactions are serialised.  Each handle has
+ * its own unit id, see @{set_slave}, all other settings are common.
+ * Gateways and hedge groups can't use shared contexts.
+ * @function ctx:share
+ * @return a handle to pass to @{attach}, exactly once.  Each call
+ *  returns a new one, which keeps the context alive until attached.
+ * @usage
+ *  local h = dev:share()
+ *  lanes.gen("*", function(h)
+ *    local dev = require("libmodbus").attach(h)
+ *    return dev:read_registers(0, 10)
+ *  end)(h)
+ */
+static int ctx_share(lua_State *L)
+{
+	ctx_box_t *box = ctx_box_check(L, 1);
+	ctx_t *ctx = box->ctx;
+
+	shares_lock();
+	if (!ctx->shared) {
+		lmb_mutex_init(&ctx->lock);
+		ctx->shared = true;
+		ctx->next_shared = lmb_shares;
+		lmb_shares = ctx;
+		box->slave = ctx->slave;
+	}
+	ctx->refs++;
+	ctx->pending++;
+	shares_unlock();
+
+	lua_pushlightuserdata(L, ctx);
+	return 1;
+}
+
+/**
+ * Attach to a context shared from another lua state.
+ * @function attach
+ * @param handle from @{ctx:share}
+ * @return a context, using the same connection
+ */
+static int libmodbus_attach(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	void *handle = lua_touserdata(L, 1);
+	ctx_box_t *box = ctx_box_new(L);
+	ctx_t *ctx;
+
+	shares_lock();
+	for (ctx = lmb_shares; ctx && (ctx != handle || ctx->pending == 0); ctx = ctx->next_shared) {
+	}
+	if (ctx) {
+		ctx->pending--;
+		box->ctx = ctx;
+	}
+	shares_unlock();
+	if (!ctx) {
+		return luaL_argerror(L, 1, "not a handle from share(), or already attached");
+	}
+
+	ctx_lock(ctx);
+	box->slave = ctx->slave;
+	ctx_unlock(ctx);
+	return 1;
+}
+
+static int ctx_tostring(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	if (ctx->databits) {
+		lua_pushfstring(L, "ModbusRTU<%s@%d/%c%d>", ctx->dev_host, ctx->databits, ctx->parity, ctx->stopbits);
+	} else {
+		lua_pushfstring(L, "ModbusTCP<%s@%s>", ctx->dev_host, ctx->service);
+	}
+	return 1;
+}
+
+/** Context Methods.
+ * These functions are members of a modbus context, from either new_rtu() or new_tcp_pi()
+ * @section context_methods
+ */
+
+/**
+ * Connect, see modbus_connect()
+ * @function ctx:connect
+ */
+static int ctx_connect(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	int rc = modbus_connect(ctx->modbus);
+	
+	return libmodbus_rc_to_nil_error(L, rc, 0);
+}
+
+/**
+ * Close, see modbus_close()
+ * @function ctx:close
+ */
+static int ctx_close(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	modbus_close(ctx->modbus);
+
+	return 0;
+}
+
+/**
+ * Set debug
+ * @function ctx:set_debug
+ * @param enable optional bool, defaults to true
+ */
+static int ctx_set_debug(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	bool opt;
+	if (lua_isnil(L, -1)) {
+		opt = true;
+	} else {
+		opt = lua_toboolean(L, -1);
+	}
+	modbus_set_debug(ctx->modbus, opt);
+	return 0;
+}
+
+/**
+ * Set error recovery, see modbus_set_error_recovery.
+ * The arguments will be or'd together.
+ * @function ctx:set_error_recovery
+ * @param a one of @{error_recovery_constants}
+ * @param b one of @{error_recovery_constants}
+ */
+static int ctx_set_error_recovery(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int opt = luaL_checkinteger(L, 2);
+	int opt2 = luaL_optinteger(L, 3, 0);
+	
+	int rc = modbus_set_error_recovery(ctx->modbus, opt | opt2);
+	if (rc == 0) {
+		ctx->error_recovery = opt | opt2;
+	}
+
+	return libmodbus_rc_to_nil_error(L, rc, 0);
+}
+
+/**
+ * See also modbus_set_byte_timeout
+ * @function ctx:set_byte_timeout
+ * @param seconds (required)
+ * @param microseconds (optional, defaults to 0)
+ */
+static int ctx_set_byte_timeout(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int opt = luaL_checkinteger(L, 2);
+	int opt2 = luaL_optinteger(L, 3, 0);
+
+#if LIBMODBUS_VERSION_CHECK(3,1,0)
+	modbus_set_byte_timeout(ctx->modbus, opt, opt2);
+#else
+	struct timeval t = { opt, opt2 };
+	modbus_set_byte_timeout(ctx->modbus, &t);
+#endif
+
+	return 0;
+}
+
+/**
+ * @function ctx:get_byte_timeout
+ * @return[1] seconds
+ * @return[1] microseconds
+ */
+static int ctx_get_byte_timeout(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	uint32_t opt1, opt2;
+	
+#if LIBMODBUS_VERSION_CHECK(3,1,0)
+	modbus_get_byte_timeout(ctx->modbus, &opt1, &opt2);
+#else
+	struct timeval t;
+	modbus_get_byte_timeout(ctx->modbus, &t);
+	opt1 = t.tv_sec;
+	opt2 = t.tv_usec;
+#endif
+	lua_pushnumber(L, opt1);
+	lua_pushnumber(L, opt2);
+
+	return 2;
+}
+
+/**
+ * @function ctx:set_response_timeout
+ * @param seconds (required)
+ * @param microseconds (optional, defaults to 0)
+ */
+static int ctx_set_response_timeout(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int opt = luaL_checkinteger(L, 2);
+	int opt2 = luaL_optinteger(L, 3, 0);
+
+#if LIBMODBUS_VERSION_CHECK(3,1,0)
+	modbus_set_response_timeout(ctx->modbus, opt, opt2);
+#else
+	struct timeval t = { opt, opt2 };
+	modbus_set_response_timeout(ctx->modbus, &t);
+#endif
+
+	return 0;
+}
+
+/**
+ * @function ctx:get_response_timeout
+ * @return[1] seconds
+ * @return[1] microseconds
+ */
+static int ctx_get_response_timeout(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	uint32_t opt1, opt2;
+	
+#if LIBMODBUS_VERSION_CHECK(3,1,0)
+	modbus_get_response_timeout(ctx->modbus, &opt1, &opt2);
+#else
+	struct timeval t;
+	modbus_get_response_timeout(ctx->modbus, &t);
+	opt1 = t.tv_sec;
+	opt2 = t.tv_usec;
+#endif
+	lua_pushnumber(L, opt1);
+	lua_pushnumber(L, opt2);
+
+	return 2;
+}
+
+/**
+ * @function ctx:get_socket
+ * @return the socket number
+ */
+static int ctx_get_socket(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	lua_pushinteger(L, modbus_get_socket(ctx->modbus));
+
+	return 1;
+}
+
+/**
+ * @function ctx:set_socket
+ * @param sock integer socket number to set
+ */
+static int ctx_set_socket(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int newfd = luaL_checknumber(L, 2);
+
+	modbus_set_socket(ctx->modbus, newfd);
+
+	return 0;
+}
+
+/**
+ * @function ctx:rtu_get_serial_mode
+ * @return @{rtu_constants} the serial mode, either RTU_RS232 or RTU_RS485
+ */
+static int ctx_rtu_get_serial_mode(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	if (!ctx->is_rtu) {
+		return luaL_error(L, "Cannot call RTU methods on an TCP context");
+	}
+
+	lua_pushinteger(L, modbus_rtu_get_serial_mode(ctx->modbus));
+
+	return 1;
+}
+
+/**
+ * Sets the mode of a serial port.
+ * Remember, this is only required if your kernel is handling rs485 natively.
+ * If you are using a USB adapter, you do NOT need this.
+ * @function ctx:rtu_set_serial_mode
+ * @param mode The selected serial mode from @{rtu_constants}, either RTU_RS232 or RTU_RS485.
+ */
+static int ctx_rtu_set_serial_mode(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	if (!ctx->is_rtu) {
+		return luaL_error(L, "Cannot call RTU methods on an TCP context");
+	}
+	int mode = luaL_checknumber(L, 2);
+
+	int rc = modbus_rtu_set_serial_mode(ctx->modbus, mode);
+
+	return libmodbus_rc_to_nil_error(L, rc, 0);
+}
+
+/**
+ * @function ctx:rtu_get_rts
+ * @return @{rtu_rts_constants} the RTS handling mode, up/down/none
+ */
+static int ctx_rtu_get_rts(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	if (!ctx->is_rtu) {
+		return luaL_error(L, "Cannot call RTU methods on an TCP context");
+	}
+
+	lua_pushinteger(L, modbus_rtu_get_rts(ctx->modbus));
+
+	return 1;
+}
+
+/**
+ * Sets the RTS handling of a serial port.
+ * @function ctx:rtu_set_rts
+ * @param mode The selected RTS handling mode from @{rtu_rts_constants}, up/down/none.
+ */
+static int ctx_rtu_set_rts(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	if (!ctx->is_rtu) {
+		return luaL_error(L, "Cannot call RTU methods on an TCP context");
+	}
+	int mode = luaL_checknumber(L, 2);
+
+	int rc = modbus_rtu_set_rts(ctx->modbus, mode);
+
+	return libmodbus_rc_to_nil_error(L, rc, 0);
+}
+
+/**
+ * @function ctx:rtu_get_rts_delay
+ * @return usecs
+ */
+static int ctx_rtu_get_rts_delay(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	if (!ctx->is_rtu) {
+		return luaL_error(L, "Cannot call RTU methods on an TCP context");
+	}
+
+	lua_pushinteger(L, modbus_rtu_get_rts_delay(ctx->modbus));
+
+	return 1;
+}
+
+/**
+ * Sets the RTS delay of a serial port.
+ * @function ctx:rtu_set_rts_delay
+ * @param usecs
+ */
+static int ctx_rtu_set_rts_delay(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	if (!ctx->is_rtu) {
+		return luaL_error(L, "Cannot call RTU methods on an TCP context");
+	}
+	int usecs = luaL_checknumber(L, 2);
+
+	int rc = modbus_rtu_set_rts_delay(ctx->modbus, usecs);
+
+	return libmodbus_rc_to_nil_error(L, rc, 0);
+}
+
+/**
+ * Tune a connected RTU context for low latency.
+ * Only the options given are changed.
+ * @function ctx:rtu_tune
+ * @param opts table of options
+ *  <ul>
+ *  <li>low_latency true to set the Linux ASYNC_LOW_LATENCY serial flag,
+ *  which for USB serial adapters drops the latency timer to 1ms</li>
+ *  <li>vmin, vtime termios read settings, libmodbus expects 0, 0</li>
+ *  <li>exact_t35 true to time the 3.5 character interval from the line
+ *  settings even above 19200 baud, rather than the spec's fixed 1750us</li>
+ *  <li>adaptive true to size response and byte timeouts per request from
+ *  the frame lengths, instead of using the configured timeouts.  Requires
+ *  turnaround, the most the device may take to respond, in microseconds,
+ *  and optionally byte_slack, allowed on top of 3.5 characters between bytes</li>
+ *  </ul>
+ * @return[1] table with t35 and char, the microseconds used for each, and
+ *  low_latency, whether the flag is set, if it was requested
+ * @return[2] nil
+ * @return[2] error message
+ * @usage
+ *  rtu:connect()
+ *  rtu:rtu_tune{low_latency=true, exact_t35=true, adaptive=true, turnaround=5000}
+ */
+static int ctx_rtu_tune(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	if (!ctx->is_rtu) {
+		return luaL_error(L, "Cannot call RTU methods on an TCP context");
+	}
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	lua_getfield(L, 2, "low_latency");
+	int low_latency = lua_isnil(L, -1) ? -1 : lua_toboolean(L, -1);
+	lua_getfield(L, 2, "vmin");
+	int vmin = luaL_optinteger(L, -1, -1);
+	lua_getfield(L, 2, "vtime");
+	int vtime = luaL_optinteger(L, -1, -1);
+	lua_getfield(L, 2, "exact_t35");
+	int exact = lua_isnil(L, -1) ? -1 : lua_toboolean(L, -1);
+	lua_getfield(L, 2, "adaptive");
+	int adaptive = lua_isnil(L, -1) ? -1 : lua_toboolean(L, -1);
+	lua_getfield(L, 2, "turnaround");
+	lua_Number turnaround = luaL_optnumber(L, -1, ctx->rtu.turnaround_us);
+	lua_getfield(L, 2, "byte_slack");
+	lua_Number slack = luaL_optnumber(L, -1, ctx->rtu.byte_slack_us);
+	lua_pop(L, 7);
+
+	if (vmin > 255 || vtime > 255) {
+		return luaL_argerror(L, 2, "vmin and vtime must be 0-255");
+	}
+	if (adaptive == 1 && turnaround <= 0) {
+		return luaL_argerror(L, 2, "adaptive timeouts need a turnaround");
+	}
+	if (turnaround < 0 || turnaround > 10e6 || slack < 0 || slack > 10e6) {
+		return luaL_argerror(L, 2, "turnaround and byte_slack must be 0-10s");
+	}
+
+	int s = modbus_get_socket(ctx->modbus);
+	if ((vmin >= 0 || vtime >= 0 || low_latency >= 0) && s < 0) {
+		errno = EBADF;
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+#if defined(WIN32)
+	if (vmin >= 0 || vtime >= 0) {
+		errno = ENOTSUP;
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+#else
+	if (vmin >= 0 || vtime >= 0) {
+		struct termios tios;
+		if (tcgetattr(s, &tios) < 0) {
+			return libmodbus_rc_to_nil_error(L, -1, 0);
+		}
+		if (vmin >= 0) {
+			tios.c_cc[VMIN] = vmin;
+		}
+		if (vtime >= 0) {
+			tios.c_cc[VTIME] = vtime;
+		}
+		if (tcsetattr(s, TCSANOW, &tios) < 0) {
+			return libmodbus_rc_to_nil_error(L, -1, 0);
+		}
+	}
+#endif
+
+	lua_newtable(L);
+	if (low_latency >= 0) {
+		bool set = false;
+#if defined(__linux__)
+		/* not all serial drivers (or ptys) support this, that's not an error */
+		struct serial_struct ser;
+		if (ioctl(s, TIOCGSERIAL, &ser) == 0) {
+			if (low_latency) {
+				ser.flags |= ASYNC_LOW_LATENCY;
+			} else {
+				ser.flags &= ~ASYNC_LOW_LATENCY;
+			}
+			if (ioctl(s, TIOCSSERIAL, &ser) == 0 && ioctl(s, TIOCGSERIAL, &ser) == 0) {
+				set = (ser.flags & ASYNC_LOW_LATENCY) != 0;
+			}
+		}
+#endif
+		lua_pushboolean(L, set);
+		lua_setfield(L, -2, "low_latency");
+	}
+	if (exact >= 0) {
+		ctx->rtu.exact_t35 = exact;
+	}
+	if (adaptive >= 0) {
+		ctx->rtu.adaptive = adaptive;
+	}
+	ctx->rtu.turnaround_us = turnaround;
+	ctx->rtu.byte_slack_us = slack;
+
+	lua_pushinteger(L, rtu_t35_us(ctx));
+	lua_setfield(L, -2, "t35");
+	lua_pushinteger(L, rtu_char_us(ctx));
+	lua_setfield(L, -2, "char");
+	return 1;
+}
+
+/**
+ * Timing of RTU transactions.
+ * Turnaround is the time a transaction took beyond sending the request
+ * and response at the line speed, so includes the device's processing
+ * time and any latency in the serial driver or adapter.
+ * @function ctx:rtu_get_stats
+ * @param[opt] reset true to start counting afresh
+ * @return table with transactions, turnaround_min, turnaround_avg,
+ *  turnaround_max, wire_avg and elapsed_avg, all in microseconds
+ */
+static int ctx_rtu_get_stats(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	if (!ctx->is_rtu) {
+		return luaL_error(L, "Cannot call RTU methods on an TCP context");
+	}
+	uint32_t n = ctx->rtu.n;
+
+	lua_newtable(L);
+	lua_pushnumber(L, n);
+	lua_setfield(L, -2, "transactions");
+	if (n) {
+		lua_pushnumber(L, ctx->rtu.ta_min);
+		lua_setfield(L, -2, "turnaround_min");
+		lua_pushnumber(L, ctx->rtu.ta_total / n);
+		lua_setfield(L, -2, "turnaround_avg");
+		lua_pushnumber(L, ctx->rtu.ta_max);
+		lua_setfield(L, -2, "turnaround_max");
+		lua_pushnumber(L, ctx->rtu.wire_total / n);
+		lua_setfield(L, -2, "wire_avg");
+		lua_pushnumber(L, ctx->rtu.elapsed_total / n);
+		lua_setfield(L, -2, "elapsed_avg");
+	}
+	if (lua_toboolean(L, 2)) {
+		ctx->rtu.n = 0;
+		ctx->rtu.ta_min = ctx->rtu.ta_max = ctx->rtu.ta_total = 0;
+		ctx->rtu.wire_total = ctx->rtu.elapsed_total = 0;
+	}
+	return 1;
+}
+
+/**
+ * Returns the header length of the transport
+ * @function ctx:get_header_length
+ * @return the length in bytes
+ */
+static int ctx_get_header_length(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	lua_pushinteger(L, modbus_get_header_length(ctx->modbus));
+
+	return 1;
+}
+
+/**
+ * @function ctx:set_slave
+ * @param unitid the unit address / slave id to use
+ */
+static int ctx_set_slave(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int slave = luaL_checknumber(L, 2);
+
+	int rc = modbus_set_slave(ctx->modbus, slave);
+	if (rc == 0) {
+		ctx->slave = slave;
+	}
+
+	return libmodbus_rc_to_nil_error(L, rc, 0);
+}
+
+/*
+ * One logical read or write, split into requests no bigger than the
+ * context's limits.  Values move between lua and the wire one request at
+ * a time, so arbitrarily large transfers need no large buffers.
+ */
+typedef struct {
+	enum lmb_table table;
+	bool write;
+	int addr;
+	int count;
+	/* stack index of the result table (reads) or the values (writes) */
+	int idx;
+	/* writes only, values are idx..idx+count-1 on the stack, not a table */
+	bool varargs;
+	/* caller's native values instead of lua ones, uint8_t bits or uint16_t */
+	void *buf;
+	/* values completed so far, reported on partial write failures */
+	int done;
+	/* write single registers with FC06 rather than FC16 */
+	bool fc06;
+	/* write single bits with FC05 rather than FC15 */
+	bool fc05;
+	lmb_deadline_t dl;
+} lmb_xfer_t;
+
+typedef union {
+	uint8_t bits[MODBUS_MAX_READ_BITS];
+	uint16_t regs[MODBUS_MAX_READ_REGISTERS];
+} lmb_chunk_t;
+
+static int xfer_limit(ctx_t *ctx, const lmb_xfer_t *x)
+{
+	switch (x->table) {
+	case LMB_BITS:
+		return x->write ? ctx->max_write_bits : ctx->max_read_bits;
+	case LMB_INPUT_BITS:
+		return ctx->max_read_bits;
+	case LMB_REGISTERS:
+		return x->write ? ctx->max_write_regs : ctx->max_read_regs;
+	case LMB_INPUT_REGISTERS:
+	default:
+		return ctx->max_read_regs;
+	}
+}
+
+/* Fetch write values [off, off+n) from lua into the chunk buffer */
+static void xfer_load(lua_State *L, const lmb_xfer_t *x, int off, int n, lmb_chunk_t *c)
+{
+	if (x->buf) {
+		if (x->table == LMB_BITS) {
+			const uint8_t *src = (const uint8_t *)x->buf + off;
+			for (int i = 0; i < n; i++) {
+				c->bits[i] = src[i] != 0;
+			}
+		} else {
+			memcpy(c->regs, (const uint16_t *)x->buf + off, n * sizeof(c->regs[0]));
+		}
+		return;
+	}
+	for (int i = 0; i < n; i++) {
+		if (x->varargs) {
+			lua_pushvalue(L, x->idx + off + i);
+		} else {
+			lua_rawgeti(L, x->idx, off + i + 1);
+		}
+		if (x->table == LMB_BITS) {
+			if (lua_type(L, -1) == LUA_TBOOLEAN) {
+				c->bits[i] = lua_toboolean(L, -1);
+			} else {
+				c->bits[i] = lua_tonumber(L, -1);
+			}
+		} else {
+			/* This preserves sign and fractions better than tointeger() */
+			lua_Number n = lua_tonumber(L, -1);
+			c->regs[i] = (int16_t)n;
+		}
+		lua_pop(L, 1);
+	}
+}
+
+/* Store read values [off, off+n) into the result table */
+static void xfer_store(lua_State *L, const lmb_xfer_t *x, int off, int n, const lmb_chunk_t *c)
+{
+	bool bits = x->table == LMB_BITS || x->table == LMB_INPUT_BITS;
+	if (x->buf) {
+		if (bits) {
+			memcpy((uint8_t *)x->buf + off, c->bits, n);
+		} else {
+			memcpy((uint16_t *)x->buf + off, c->regs, n * sizeof(c->regs[0]));
+		}
+		return;
+	}
+	/* nota bene, lua style offsets! */
+	for (int i = 0; i < n; i++) {
+		/* TODO - push number or push bool? what's a better lua api? */
+		lua_pushnumber(L, bits ? c->bits[i] : c->regs[i]);
+		lua_rawseti(L, x->idx, off + i + 1);
+	}
+}
+
+/* Length of the RTU request and response frames for a transfer chunk */
+static void rtu_frame_lengths(const lmb_xfer_t *x, int n, int *req, int *rsp)
+{
+	bool bits = x->table == LMB_BITS || x->table == LMB_INPUT_BITS;
+	int data = bits ? (n + 7) / 8 : n * 2;
+
+	/* unit and crc around the pdu */
+	if (!x->write) {
+		*req = 3 + 5;
+		*rsp = 3 + 2 + data;
+	} else if (!bits && n == 1 && x->fc06) {
+		*req = 3 + 5;
+		*rsp = 3 + 5;
+	} else {
+		*req = 3 + 6 + data;
+		*rsp = 3 + 5;
+	}
+}
+
+/*
+ * With adaptive timeouts, waits are sized from the frames involved:
+ * the request may still be leaving the uart when libmodbus starts
+ * waiting, then the device turns around, and the response is sent.
+ */
+static void rtu_adapt_begin(ctx_t *ctx, const lmb_xfer_t *x, int n, uint32_t saved[2])
+{
+	int req, rsp;
+
+	saved[0] = timeout_get_us(ctx->modbus, false);
+	saved[1] = timeout_get_us(ctx->modbus, true);
+	rtu_frame_lengths(x, n, &req, &rsp);
+	uint32_t ch = rtu_char_us(ctx);
+	timeout_set_us(ctx->modbus, false, req * ch + rtu_t35_us(ctx) + ctx->rtu.turnaround_us);
+	timeout_set_us(ctx->modbus, true, rtu_t35_us(ctx) + ctx->rtu.byte_slack_us);
+}
+
+static void rtu_adapt_end(ctx_t *ctx, const uint32_t saved[2])
+{
+	timeout_set_us(ctx->modbus, false, saved[0]);
+	timeout_set_us(ctx->modbus, true, saved[1]);
+}
+
+/* Records how long the device took, beyond the time both frames took to send */
+static void rtu_account(ctx_t *ctx, const lmb_xfer_t *x, int n, uint64_t elapsed)
+{
+	int req, rsp;
+	rtu_frame_lengths(x, n, &req, &rsp);
+	uint64_t wire = (uint64_t)(req + rsp) * rtu_char_us(ctx);
+	uint64_t ta = elapsed > wire ? elapsed - wire : 0;
+
+	if (ctx->rtu.n == 0 || ta < ctx->rtu.ta_min) {
+		ctx->rtu.ta_min = ta;
+	}
+	if (ta > ctx->rtu.ta_max) {
+		ctx->rtu.ta_max = ta;
+	}
+	ctx->rtu.ta_total += ta;
+	ctx->rtu.wire_total += wire;
+	ctx->rtu.elapsed_total += elapsed;
+	ctx->rtu.n++;
+}
+
+/* Builds the request pdu for one request of the transfer */
+static int xfer_build_pdu(const lmb_xfer_t *x, int addr, int n, const lmb_chunk_t *c, uint8_t *pdu)
+{
+	static const uint8_t read_fc[] = {
+		[LMB_BITS] = MODBUS_FC_READ_COILS,
+		[LMB_INPUT_BITS] = MODBUS_FC_READ_DISCRETE_INPUTS,
+		[LMB_REGISTERS] = MODBUS_FC_READ_HOLDING_REGISTERS,
+		[LMB_INPUT_REGISTERS] = MODBUS_FC_READ_INPUT_REGISTERS,
+	};
+	int len = 5;
+
+	pdu[1] = addr >> 8;
+	pdu[2] = addr & 0xff;
+	pdu[3] = n >> 8;
+	pdu[4] = n & 0xff;
+	if (!x->write) {
+		pdu[0] = read_fc[x->table];
+	} else if (x->table == LMB_BITS && n == 1 && x->fc05) {
+		pdu[0] = MODBUS_FC_WRITE_SINGLE_COIL;
+		pdu[3] = c->bits[0] ? 0xff : 0;
+		pdu[4] = 0;
+	} else if (x->table == LMB_BITS) {
+		pdu[0] = MODBUS_FC_WRITE_MULTIPLE_COILS;
+		pdu[5] = (n + 7) / 8;
+		memset(&pdu[6], 0, pdu[5]);
+		for (int i = 0; i < n; i++) {
+			if (c->bits[i]) {
+				pdu[6 + i / 8] |= 1 << (i % 8);
+			}
+		}
+		len = 6 + pdu[5];
+	} else if (n == 1 && x->fc06) {
+		pdu[0] = MODBUS_FC_WRITE_SINGLE_REGISTER;
+		pdu[3] = c->regs[0] >> 8;
+		pdu[4] = c->regs[0] & 0xff;
+	} else {
+		pdu[0] = MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+		pdu[5] = n * 2;
+		for (int i = 0; i < n; i++) {
+			pdu[6 + i * 2] = c->regs[i] >> 8;
+			pdu[7 + i * 2] = c->regs[i] & 0xff;
+		}
+		len = 6 + n * 2;
+	}
+	return len;
+}
+
+/* Records a request of the transfer done by libmodbus, see cap_exchange() */
+static void cap_xfer(ctx_t *ctx, const lmb_xfer_t *x, int addr, int n, const lmb_chunk_t *c, int rc, uint64_t t0)
+{
+	uint8_t req[MODBUS_MAX_PDU_LENGTH];
+	uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+	int reqlen = xfer_build_pdu(x, addr, n, c, req);
+	int rsplen = -1;
+
+	if (rc == n && x->write) {
+		/* write responses echo the start of the request */
+		memcpy(rsp, req, 5);
+		rsplen = 5;
+	} else if (rc == n && (x->table == LMB_BITS || x->table == LMB_INPUT_BITS)) {
+		rsp[0] = req[0];
+		rsp[1] = (n + 7) / 8;
+		memset(&rsp[2], 0, rsp[1]);
+		for (int i = 0; i < n; i++) {
+			if (c->bits[i]) {
+				rsp[2 + i / 8] |= 1 << (i % 8);
+			}
+		}
+		rsplen = 2 + rsp[1];
+	} else if (rc == n) {
+		rsp[0] = req[0];
+		rsp[1] = n * 2;
+		for (int i = 0; i < n; i++) {
+			rsp[2 + i * 2] = c->regs[i] >> 8;
+			rsp[3 + i * 2] = c->regs[i] & 0xff;
+		}
+		rsplen = 2 + n * 2;
+	}
+	cap_exchange(ctx, req, reqlen, rsp, rsplen, t0);
+}
+
+/* A single request of the transfer through libmodbus */
+static int xfer_chunk(ctx_t *ctx, lmb_xfer_t *x, int addr, int n, lmb_chunk_t *c)
+{
+	bool adapt = ctx->is_rtu && ctx->rtu.adaptive && n > 0;
+	uint32_t saved[2];
+	int rc;
+
+	if (adapt) {
+		rtu_adapt_begin(ctx, x, n, saved);
+	}
+	do {
+		if (deadline_arm(ctx, &x->dl) < 0) {
+			rc = -1;
+			break;
+		}
+		uint64_t start = lmb_now_us();
+		switch (x->table) {
+		case LMB_BITS:
+			if (x->write && n == 1 && x->fc05) {
+				rc = modbus_write_bit(ctx->modbus, addr, c->bits[0]);
+			} else if (x->write) {
+				rc = modbus_write_bits(ctx->modbus, addr, n, c->bits);
+			} else {
+				rc = modbus_read_bits(ctx->modbus, addr, n, c->bits);
+			}
+			break;
+		case LMB_INPUT_BITS:
+			rc = modbus_read_input_bits(ctx->modbus, addr, n, c->bits);
+			break;
+		case LMB_REGISTERS:
+			if (x->write && n == 1 && x->fc06) {
+				rc = modbus_write_register(ctx->modbus, addr, c->regs[0]);
+			} else if (x->write) {
+				rc = modbus_write_registers(ctx->modbus, addr, n, c->regs);
+			} else {
+				rc = modbus_read_registers(ctx->modbus, addr, n, c->regs);
+			}
+			break;
+		case LMB_INPUT_REGISTERS:
+		default:
+			rc = modbus_read_input_registers(ctx->modbus, addr, n, c->regs);
+			break;
+		}
+		if (ctx->cap) {
+			cap_xfer(ctx, x, addr, n, c, rc, start);
+		}
+		/* broadcasts have no response to time */
+		if (ctx->is_rtu && rc == n && ctx->slave != 0) {
+			rtu_account(ctx, x, n, lmb_now_us() - start);
+		}
+		deadline_disarm(ctx);
+	} while (rc != n && deadline_retry(ctx, &x->dl));
+	if (adapt) {
+		rtu_adapt_end(ctx, saved);
+	}
+	return rc;
+}
+
+/* Validates a response to xfer_build_pdu(), extracting read values */
+static int xfer_parse_pdu(const lmb_xfer_t *x, const uint8_t *req, int n, const uint8_t *rsp, int len, lmb_chunk_t *c)
+{
+	if (pdu_check(rsp, len, req[0]) < 0) {
+		return -1;
+	}
+	if (x->write) {
+		/* echo of address and quantity */
+		if (len != 5 || memcmp(&rsp[1], &req[1], 4) != 0) {
+			errno = EMBBADDATA;
+			return -1;
+		}
+		return n;
+	}
+	bool bits = x->table == LMB_BITS || x->table == LMB_INPUT_BITS;
+	int bc = bits ? (n + 7) / 8 : n * 2;
+	if (len != bc + 2 || rsp[1] != bc) {
+		errno = EMBBADDATA;
+		return -1;
+	}
+	for (int i = 0; i < n; i++) {
+		if (bits) {
+			c->bits[i] = (rsp[2 + i / 8] >> (i % 8)) & 1;
+		} else {
+			c->regs[i] = rsp[2 + i * 2] << 8 | rsp[3 + i * 2];
+		}
+	}
+	return n;
+}
+
+/* A request of a pipelined transfer, waiting for its response */
+typedef struct {
+	uint16_t tid;
+	int off;
+	int n;
+	uint8_t req[5];
+} lmb_inflight_t;
+
+/* Whether tid is one of the outstanding requests, from tail on */
+static bool inflight_has(const lmb_inflight_t *inflight, int tail, int outstanding, int depth, uint16_t tid)
+{
+	for (int k = 0, i = tail; k < outstanding; k++, i = (i + 1) % depth) {
+		if (inflight[i].tid == tid) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Runs the transfer with up to depth requests in flight on a Modbus/TCP
+ * connection.  Responses are expected in order, as Modbus/TCP servers
+ * process a connection's requests sequentially.
+ */
+static int xfer_pipelined(lua_State *L, ctx_t *ctx, lmb_xfer_t *x, int per, int depth)
+{
+	lmb_inflight_t inflight[LMB_MAX_PIPELINE];
+	uint8_t pdu[MODBUS_MAX_PDU_LENGTH];
+	lmb_chunk_t c;
+	int head = 0, tail = 0, outstanding = 0, sent = 0;
+	int unit = ctx->slave;
+	/* whether a request failed, so later ones don't add to what's done */
+	bool gap = false;
+
+	while (sent < x->count || outstanding) {
+		while (sent < x->count && outstanding < depth) {
+			int n = x->count - sent < per ? x->count - sent : per;
+			if (x->write) {
+				xfer_load(L, x, sent, n, &c);
+			}
+			int len = xfer_build_pdu(x, x->addr + sent, n, &c, pdu);
+			if (tcp_send_pdu(ctx, unit, pdu, len, &inflight[head].tid) < 0) {
+				goto fail;
+			}
+			inflight[head].off = sent;
+			inflight[head].n = n;
+			memcpy(inflight[head].req, pdu, 5);
+			head = (head + 1) % depth;
+			outstanding++;
+			sent += n;
+		}
+
+		uint16_t tid;
+		int runit;
+		int len = tcp_recv_pdu(ctx, &x->dl, pdu, &tid, &runit);
+		if (len < 0) {
+			goto fail;
+		}
+		if (tid != inflight[tail].tid) {
+			if (!inflight_has(inflight, tail, outstanding, depth, tid)) {
+				/* a late answer to an earlier, abandoned request, as raw_transact() */
+				continue;
+			}
+			gap = true;
+			errno = EMBBADDATA;
+			goto fail;
+		}
+		int n = inflight[tail].n;
+		int off = inflight[tail].off;
+		if (runit != unit || xfer_parse_pdu(x, inflight[tail].req, n, pdu, len, &c) < 0) {
+			if (runit != unit) {
+				errno = EMBBADDATA;
+			}
+			/* this one is accounted for, the rest may still be coming */
+			tail = (tail + 1) % depth;
+			outstanding--;
+			gap = true;
+			goto fail;
+		}
+		tail = (tail + 1) % depth;
+		outstanding--;
+		if (!x->write) {
+			xfer_store(L, x, off, n, &c);
+		}
+		x->done += n;
+	}
+	return x->count;
+
+fail: {
+		int saved = errno;
+		/*
+		 * Late responses would be mistaken for answers to the next request.
+		 * Those carrying on from what's done still count, so a retry from
+		 * there doesn't write anything twice.
+		 */
+		if (saved != ETIMEDOUT) {
+			while (outstanding > 0) {
+				uint16_t tid;
+				int runit;
+				int len = tcp_recv_pdu(ctx, &x->dl, pdu, &tid, &runit);
+				if (len < 0) {
+					break;
+				}
+				if (tid != inflight[tail].tid) {
+					if (inflight_has(inflight, tail, outstanding, depth, tid)) {
+						gap = true;
+						outstanding--;
+					}
+					continue;
+				}
+				int n = inflight[tail].n;
+				int off = inflight[tail].off;
+				if (!gap && runit == unit && xfer_parse_pdu(x, inflight[tail].req, n, pdu, len, &c) == n) {
+					if (!x->write) {
+						xfer_store(L, x, off, n, &c);
+					}
+					x->done += n;
+				} else {
+					gap = true;
+				}
+				tail = (tail + 1) % depth;
+				outstanding--;
+			}
+		}
+		if (outstanding > 0) {
+			modbus_flush(ctx->modbus);
+		}
+		errno = saved;
+		return -1;
+	}
+}
+
+/* Runs the whole transfer, returns count on success, or -1 with errno */
+static int xfer_run(lua_State *L, ctx_t *ctx, lmb_xfer_t *x)
+{
+	int per = xfer_limit(ctx, x);
+	lmb_chunk_t c;
+	int off = 0;
+
+	x->fc06 = ctx->single_write_fc06;
+	if (ctx->pipeline > 1 && !ctx->is_rtu && x->count > per) {
+		return xfer_pipelined(L, ctx, x, per, ctx->pipeline);
+	}
+
+	do {
+		int n = x->count - off < per ? x->count - off : per;
+		if (x->write) {
+			xfer_load(L, x, off, n, &c);
+		}
+		int rc = xfer_chunk(ctx, x, x->addr + off, n, &c);
+		if (rc != n) {
+			return -1;
+		}
+		if (!x->write) {
+			xfer_store(L, x, off, n, &c);
+		}
+		x->done += n;
+		off += n;
+	} while (off < x->count);
+	return x->count;
+}
+
+/* Checks an address range is within the 16bit modbus address space */
+static void xfer_check_range(lua_State *L, int addr, int count, int arg, const char *msg)
+{
+	if (addr < 0 || addr > 0xffff) {
+		luaL_argerror(L, 2, "address out of range");
+	}
+	if (count < 1) {
+		luaL_argerror(L, arg, "count must be at least 1");
+	}
+	if (count > 0x10000 - addr) {
+		luaL_argerror(L, arg, msg);
+	}
+}
+
+/* Reads count values into out, one per bit or register */
+static int xfer_chunk_buf(ctx_t *ctx, enum lmb_table table, int addr, int count, uint16_t *out, const lmb_deadline_t *dl)
+{
+	lmb_xfer_t x = { .table = table, .count = count, .dl = *dl };
+	bool bits = table == LMB_BITS || table == LMB_INPUT_BITS;
+	int per = xfer_limit(ctx, &x);
+	lmb_chunk_t c;
+
+	for (int off = 0; off < count; off += per) {
+		int n = count - off < per ? count - off : per;
+		if (xfer_chunk(ctx, &x, addr + off, n, &c) != n) {
+			return -1;
+		}
+		for (int i = 0; i < n; i++) {
+			out[off + i] = bits ? c.bits[i] : c.regs[i];
+		}
+	}
+	return count;
+}
+
+/*
+ * Read-through cache.  Blocks of a unit's address space are defined up
+ * front.  Reads falling entirely within a block are served from it while
+ * it's fresh, and refresh the whole block when it's not, so any number of
+ * readers of overlapping ranges cost one transaction per block per ttl.
+ */
+static lmb_cache_block_t *cache_find(ctx_t *ctx, enum lmb_table table, int addr, int count)
+{
+	lmb_cache_block_t *found = NULL;
+	uint64_t now = lmb_now_us();
+
+	if (count < 1) {
+		return NULL;
+	}
+	for (int i = 0; i < ctx->cache_len; i++) {
+		lmb_cache_block_t *b = &ctx->cache[i];
+		if (b->table != table || b->unit != ctx->slave ||
+			addr < b->addr || addr + count > b->addr + b->count) {
+			continue;
+		}
+		if (b->fetched && now - b->fetched < b->ttl) {
+			return b;
+		}
+		if (!found) {
+			found = b;
+		}
+	}
+	return found;
+}
+
+static int cache_fill(ctx_t *ctx, lmb_cache_block_t *b, const lmb_deadline_t *dl)
+{
+	uint64_t start = lmb_now_us();
+
+	if (b->fetched && start - b->fetched < b->ttl) {
+		ctx->cache_hits++;
+		return 0;
+	}
+	ctx->cache_misses++;
+	b->fetched = 0;
+	if (xfer_chunk_buf(ctx, b->table, b->addr, b->count, b->vals, dl) < 0) {
+		return -1;
+	}
+	/* age from when we asked, not when the last answer came */
+	b->fetched = start ? start : 1;
+	return 0;
+}
+
+/* Forgets cached values a write to unit changed, a broadcast changes every unit's */
+static void cache_invalidate_unit(ctx_t *ctx, int unit, enum lmb_table table, int addr, int count)
+{
+	for (int i = 0; i < ctx->cache_len; i++) {
+		lmb_cache_block_t *b = &ctx->cache[i];
+		if (b->table == table && (unit == MODBUS_BROADCAST_ADDRESS || b->unit == unit) &&
+			addr < b->addr + b->count && addr + count > b->addr) {
+			b->fetched = 0;
+		}
+	}
+}
+
+static void cache_invalidate(ctx_t *ctx, enum lmb_table table, int addr, int count)
+{
+	cache_invalidate_unit(ctx, ctx->slave, table, addr, count);
+}
+
+static int _ctx_read(lua_State *L, enum lmb_table table)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lmb_xfer_t x = { .table = table };
+	x.addr = luaL_checknumber(L, 2);
+	x.count = luaL_checknumber(L, 3);
+	bool bits = table == LMB_BITS || table == LMB_INPUT_BITS;
+
+	xfer_check_range(L, x.addr, x.count, 3, bits ? "requested too many bits" : "requested too many registers");
+	deadline_opt(L, 4, &x.dl);
+
+	lmb_cache_block_t *b = cache_find(ctx, table, x.addr, x.count);
+	if (b) {
+		if (cache_fill(ctx, b, &x.dl) < 0) {
+			return libmodbus_rc_to_nil_error(L, -1, 0);
+		}
+		lua_createtable(L, x.count, 0);
+		for (int i = 0; i < x.count; i++) {
+			lua_pushnumber(L, b->vals[x.addr - b->addr + i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+		return 1;
+	}
+
+	lua_createtable(L, x.count > 0 ? x.count : 0, 0);
+	x.idx = lua_gettop(L);
+	int rc = xfer_run(L, ctx, &x);
+	if (rc != x.count) {
+		lua_pop(L, 1);
+		return libmodbus_rc_to_nil_error(L, rc, x.count);
+	}
+	return 1;
+}
+
+/**
+ * Reads of any size are split into as many requests as required, see
+ * @{set_request_limits}
+ * @function ctx:read_input_bits
+ * @param address
+ * @param count up to the end of the address space
+ * @param[opt] deadline see @{monotonic}, covering all requests
+ * @return an array of results
+ */
+static int ctx_read_input_bits(lua_State *L)
+{
+	return _ctx_read(L, LMB_INPUT_BITS);
+}
+
+/**
+ * @function ctx:read_bits
+ * @param address
+ * @param count up to the end of the address space
+ * @param[opt] deadline see @{monotonic}, covering all requests
+ * @return an array of results
+ */
+static int ctx_read_bits(lua_State *L)
+{
+	return _ctx_read(L, LMB_BITS);
+}
+
+/**
+ * @function ctx:read_input_registers
+ * @param address
+ * @param count up to the end of the address space
+ * @param[opt] deadline see @{monotonic}, covering all requests
+ * @return an array of results
+ */
+static int ctx_read_input_registers(lua_State *L)
+{
+	return _ctx_read(L, LMB_INPUT_REGISTERS);
+}
+
+/**
+ * @function ctx:read_registers
+ * @param address
+ * @param count up to the end of the address space
+ * @param[opt] deadline see @{monotonic}, covering all requests
+ * @return an array of results
+ */
+static int ctx_read_registers(lua_State *L)
+{
+	return _ctx_read(L, LMB_REGISTERS);
+}
+
+/**
+ * @function ctx:report_slave_id
+ * @param[opt] deadline see @{monotonic}
+ * @return a luastring with the raw result (lua strings can contain nulls)
+ */
+static int ctx_report_slave_id(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	lmb_deadline_t dl;
+	int rc;
+	deadline_opt(L, 2, &dl);
+
+	uint8_t *buf = ctx->scratch;
+	do {
+		if (deadline_arm(ctx, &dl) < 0) {
+			rc = -1;
+			break;
+		}
+		uint64_t t0 = lmb_now_us();
+#if LIBMODBUS_VERSION_CHECK(3,1,0)
+		rc = modbus_report_slave_id(ctx->modbus, ctx->max_len, buf);
+#else
+		rc = modbus_report_slave_id(ctx->modbus, buf);
+#endif
+		if (ctx->cap) {
+			const uint8_t req[] = { MODBUS_FC_REPORT_SLAVE_ID };
+			uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+			int rsplen = -1;
+			if (rc >= 0 && rc <= MODBUS_MAX_PDU_LENGTH - 2) {
+				rsp[0] = req[0];
+				rsp[1] = rc;
+				memcpy(&rsp[2], buf, rc);
+				rsplen = rc + 2;
+			}
+			cap_exchange(ctx, req, sizeof(req), rsp, rsplen, t0);
+		}
+		deadline_disarm(ctx);
+	} while (rc < 0 && deadline_retry(ctx, &dl));
+	if (rc < 0) {
+		return libmodbus_rc_to_nil_error(L, rc, 0);
+	}
+
+	lua_pushlstring(L, (char *)buf, rc);
+	return 1;
+}
+
+/**
+ * @function ctx:write_bit
+ * @param address
+ * @param value either a number or a boolean
+ * @param[opt] deadline see @{monotonic}
+ */
+static int ctx_write_bit(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int addr = luaL_checknumber(L, 2);
+	int val;
+
+	if (lua_type(L, 3) == LUA_TNUMBER) {
+		val = lua_tonumber(L, 3);
+	} else if (lua_type(L, 3) == LUA_TBOOLEAN) {
+		val = lua_toboolean(L, 3);
+	} else {
+		return luaL_argerror(L, 3, "bit must be numeric or boolean");
+	}
+	lmb_deadline_t dl;
+	int rc;
+	deadline_opt(L, 4, &dl);
+
+	do {
+		if (deadline_arm(ctx, &dl) < 0) {
+			rc = -1;
+			break;
+		}
+		uint64_t t0 = lmb_now_us();
+		rc = modbus_write_bit(ctx->modbus, addr, val);
+		if (ctx->cap) {
+			cap_write_single(ctx, MODBUS_FC_WRITE_SINGLE_COIL, addr, val ? 0xff00 : 0, rc, t0);
+		}
+		deadline_disarm(ctx);
+	} while (rc != 1 && deadline_retry(ctx, &dl));
+	cache_invalidate(ctx, LMB_BITS, addr, 1);
+
+	return libmodbus_rc_to_nil_error(L, rc, 1);
+}
+
+/**
+ * @function ctx:write_register
+ * @param address
+ * @param value
+ * @param[opt] deadline see @{monotonic}
+ */
+static int ctx_write_register(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int addr = luaL_checknumber(L, 2);
+	int val = luaL_checknumber(L, 3);
+	lmb_deadline_t dl;
+	int rc;
+	deadline_opt(L, 4, &dl);
+
+	do {
+		if (deadline_arm(ctx, &dl) < 0) {
+			rc = -1;
+			break;
+		}
+		uint64_t t0 = lmb_now_us();
+		rc = modbus_write_register(ctx->modbus, addr, val);
+		if (ctx->cap) {
+			cap_write_single(ctx, MODBUS_FC_WRITE_SINGLE_REGISTER, addr, val, rc, t0);
+		}
+		deadline_disarm(ctx);
+	} while (rc != 1 && deadline_retry(ctx, &dl));
+	cache_invalidate(ctx, LMB_REGISTERS, addr, 1);
+
+	return libmodbus_rc_to_nil_error(L, rc, 1);
+}
+
+
+/*
+ * Pushes the result of a write transfer, "true" or "nil, err, written"
+ */
+static int xfer_write_result(lua_State *L, const lmb_xfer_t *x, int rc)
+{
+	if (rc == x->count) {
+		lua_pushboolean(L, true);
+		return 1;
+	}
+	libmodbus_rc_to_nil_error(L, rc, x->count);
+	lua_pushinteger(L, x->done);
+	return 3;
+}
+
+/**
+ * Writes of any size are split into as many requests as required, see
+ * @{set_request_limits}.  If a later request fails, earlier ones have
+ * already been written, the count of values written is returned too.
+ * When pipelined, requests after the failed one may have been written as
+ * well, they aren't counted.
+ * @function ctx:write_bits
+ * @param address
+ * @param value as a lua array table
+ * @param[opt] deadline see @{monotonic}, covering all requests
+ * @return[1] true
+ * @return[2] nil
+ * @return[2] error message
+ * @return[2] count of values successfully written
+ */
+static int ctx_write_bits(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lmb_xfer_t x = { .table = LMB_BITS, .write = true, .idx = 3 };
+	x.addr = luaL_checknumber(L, 2);
+
+	/*
+	 * TODO - could allow just a series of arguments too? easier for
+	 * smaller sets?"?)
+	 */
+	luaL_checktype(L, 3, LUA_TTABLE);
+	/* array style table only! */
+	x.count = lua_rawlen(L, 3);
+	xfer_check_range(L, x.addr, x.count, 3, "requested too many bits");
+	deadline_opt(L, 4, &x.dl);
+
+	/* Check everything up front, rather than fail after partial writes */
+	for (int i = 1; i <= x.count; i++) {
+		lua_rawgeti(L, 3, i);
+		int t = lua_type(L, -1);
+		lua_pop(L, 1);
+		if (t != LUA_TNUMBER && t != LUA_TBOOLEAN) {
+			return luaL_argerror(L, 3, "table values must be numeric or bool");
+		}
+	}
+
+	int rc = xfer_run(L, ctx, &x);
+	/* even failed writes may have changed something */
+	cache_invalidate(ctx, x.table, x.addr, x.count);
+	return xfer_write_result(L, &x, rc);
+}
+
+
+/**
+ * @function ctx:write_registers
+ * @param address base address to write to
+ * @param value as a lua array table, or a sequence of values.
+ * @param[opt] deadline see @{monotonic}, only with the table form
+ * @return[1] true
+ * @return[2] nil
+ * @return[2] error message
+ * @return[2] count of values successfully written
+ * @usage either
+ *  ctx:write_registers(0x2000, {1,2,3})
+ *  ctx:write_registers(0x2000, 1, 2, 3)
+ *  ctx:write_registers(0x2000, {1,2,3}, 50000)
+ */
+static int ctx_write_registers(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lmb_xfer_t x = { .table = LMB_REGISTERS, .write = true };
+	x.addr = luaL_checknumber(L, 2);
+
+	if (lua_type(L, 3) == LUA_TTABLE) {
+		/* array style table only! */
+		x.count = lua_rawlen(L, 3);
+		x.idx = 3;
+		xfer_check_range(L, x.addr, x.count, 3, "requested too many registers");
+		deadline_opt(L, 4, &x.dl);
+
+		for (int i = 1; i <= x.count; i++) {
+			lua_rawgeti(L, 3, i);
+			int t = lua_type(L, -1);
+			lua_pop(L, 1);
+			/* user beware! we're not range checking your values */
+			if (t != LUA_TNUMBER) {
+				return luaL_argerror(L, 3, "table values must be numeric yo");
+			}
+		}
+	} else {
+		/* Assume sequence of values then... */
+		int total_args = lua_gettop(L);
+		if (total_args < 3) {
+			return luaL_argerror(L, 3, "No values provided to write!");
+		}
+		x.count = total_args - 2;
+		x.idx = 3;
+		x.varargs = true;
+		xfer_check_range(L, x.addr, x.count, 3, "requested too many registers");
+	}
+
+	int rc = xfer_run(L, ctx, &x);
+	/* even failed writes may have changed something */
+	cache_invalidate(ctx, x.table, x.addr, x.count);
+	return xfer_write_result(L, &x, rc);
+}
+
+/**
+ * Write typed values to consecutive registers.
+ * The values are encoded in a single pass, and written as by
+ * @{write_registers}, split into as many requests as required.
+ * @function ctx:write_registers_as
+ * @param address
+ * @param values array of numbers
+ * @param type one of "u16", "s16", "u32", "s32", "u64", "s64", "f32", "f64"
+ * @param[opt] order one of "abcd", "cdab", "badc", "dcba", default "abcd",
+ *  see @{encode}
+ * @param[opt] deadline see @{monotonic}, covering all requests
+ * @return[1] true
+ * @return[2] nil
+ * @return[2] error message
+ * @return[2] count of values successfully written
+ * @usage
+ *  dev:write_registers_as(0x1000, setpoints, "f32", "cdab")
+ */
+static int ctx_write_registers_as(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lmb_xfer_t x = { .table = LMB_REGISTERS, .write = true };
+	x.addr = luaL_checknumber(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	enum lmb_type type = luaL_checkoption(L, 4, NULL, lmb_type_names);
+	enum lmb_order order = luaL_checkoption(L, 5, "abcd", lmb_order_names);
+	int count = lua_rawlen(L, 3);
+	int words = lmb_type_words(type);
+
+	x.count = count * words;
+	xfer_check_range(L, x.addr, x.count, 3, "requested too many registers");
+	deadline_opt(L, 6, &x.dl);
+	x.buf = lua_newuserdata(L, (x.count ? x.count : 1) * sizeof(uint16_t));
+	lmb_encode_array(L, 3, count, type, order, x.buf);
+
+	int rc = xfer_run(L, ctx, &x);
+	/* even failed writes may have changed something */
+	cache_invalidate(ctx, x.table, x.addr, x.count);
+	if (rc == x.count) {
+		lua_pushboolean(L, true);
+		return 1;
+	}
+	libmodbus_rc_to_nil_error(L, rc, x.count);
+	lua_pushinteger(L, x.done / words);
+	return 3;
+}
+
+/* A point of write_points(), in the order it's written */
+typedef struct {
+	bool bits;
+	uint16_t addr;
+	uint16_t value;
+	/* index in the caller's array */
+	int idx;
+	/* errno of its write, 0 once written */
+	int err;
+} lmb_wpoint_t;
+
+static int wpoint_cmp(const void *a, const void *b)
+{
+	const lmb_wpoint_t *x = a;
+	const lmb_wpoint_t *y = b;
+	if (x->bits != y->bits) {
+		return x->bits ? 1 : -1;
+	}
+	if (x->addr != y->addr) {
+		return x->addr < y->addr ? -1 : 1;
+	}
+	return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+/* A fresh cached block holding all of [addr, addr+count), or NULL */
+static lmb_cache_block_t *cache_fresh(ctx_t *ctx, enum lmb_table table, int addr, int count)
+{
+	lmb_cache_block_t *b = cache_find(ctx, table, addr, count);
+	if (!b || !b->fetched || lmb_now_us() - b->fetched >= b->ttl) {
+		return NULL;
+	}
+	return b;
+}
+
+/**
+ * Write scattered registers and bits in as few requests as possible.
+ * Points are sorted, and adjacent ones merged into FC16 and FC15 requests
+ * within the write request limits, see @{set_request_limits}.  Isolated
+ * points are written with FC06 and FC05.  With a write_gap in the
+ * context's profile, points separated by up to that many other values
+ * are merged too, rewriting those from the cache, but only while a fresh
+ * cached block holds them, see @{cache_add}.  If an address appears more
+ * than once, only the last value is written.
+ * @function ctx:write_points
+ * @param points array of tables, each with addr and value, and
+ *  optionally table, "registers" (the default) or "bits"
+ * @param[opt] deadline see @{monotonic}, covering all requests
+ * @return array of results, in the order of points, each true or an
+ *  error message
+ * @return the number of points that failed
+ * @usage
+ *  local res, failed = dev:write_points{
+ *    {addr=0x100, value=20}, {addr=0x101, value=21}, {addr=0x140, value=1},
+ *    {table="bits", addr=3, value=true},
+ *  }
+ *  -- one FC16, one FC06 and one FC05 request
+ */
+static int ctx_write_points(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lmb_deadline_t dl;
+	deadline_opt(L, 3, &dl);
+	int npoints = lua_rawlen(L, 2);
+
+	lmb_wpoint_t *points = lua_newuserdata(L, (npoints ? npoints : 1) * sizeof(*points));
+	for (int i = 0; i < npoints; i++) {
+		lmb_wpoint_t *p = &points[i];
+		lua_rawgeti(L, 2, i + 1);
+		luaL_checktype(L, -1, LUA_TTABLE);
+		lua_getfield(L, -1, "table");
+		enum lmb_table table = luaL_checkoption(L, -1, "registers", lmb_table_names);
+		lua_getfield(L, -2, "addr");
+		int addr = luaL_checkinteger(L, -1);
+		lua_getfield(L, -3, "value");
+		if (table != LMB_REGISTERS && table != LMB_BITS) {
+			return luaL_error(L, "point %d: only registers and bits can be written", i + 1);
+		}
+		if (addr < 0 || addr > 0xffff) {
+			return luaL_error(L, "point %d: address out of range", i + 1);
+		}
+		if (table == LMB_BITS && lua_type(L, -1) == LUA_TBOOLEAN) {
+			p->value = lua_toboolean(L, -1);
+		} else if (lua_type(L, -1) == LUA_TNUMBER) {
+			lua_Number n = lua_tonumber(L, -1);
+			/* as for write_bits and write_registers */
+			p->value = table == LMB_BITS ? n != 0 : (uint16_t)(int16_t)n;
+		} else {
+			return luaL_error(L, "point %d: value must be numeric", i + 1);
+		}
+		lua_pop(L, 4);
+		p->bits = table == LMB_BITS;
+		p->addr = addr;
+		p->idx = i;
+		p->err = 0;
+	}
+	qsort(points, npoints, sizeof(*points), wpoint_cmp);
+
+	int i = 0;
+	while (i < npoints) {
+		lmb_xfer_t x = { .table = points[i].bits ? LMB_BITS : LMB_REGISTERS, .write = true,
+			.fc06 = true, .fc05 = true, .dl = dl };
+		int per = xfer_limit(ctx, &x);
+		int start = points[i].addr;
+		lmb_chunk_t c;
+
+		/* extend the run while the next point is adjacent, or the gap is cached */
+		int end = i + 1;
+		while (end < npoints && points[end].bits == points[i].bits) {
+			int last = points[end - 1].addr;
+			int gap = points[end].addr - last - 1;
+			if (points[end].addr - start >= per) {
+				break;
+			}
+			if (gap > 0 && (gap > ctx->write_gap || !cache_fresh(ctx, x.table, last + 1, gap))) {
+				break;
+			}
+			end++;
+		}
+		int n = points[end - 1].addr - start + 1;
+		for (int j = i; j < end; j++) {
+			int off = points[j].addr - start;
+			if (j > i && points[j].addr - points[j - 1].addr > 1) {
+				int last = points[j - 1].addr;
+				lmb_cache_block_t *b = cache_fresh(ctx, x.table, last + 1, points[j].addr - last - 1);
+				for (int a = last + 1; a < points[j].addr; a++) {
+					if (x.table == LMB_BITS) {
+						c.bits[a - start] = b->vals[a - b->addr];
+					} else {
+						c.regs[a - start] = b->vals[a - b->addr];
+					}
+				}
+			}
+			/* duplicates are sorted by index, the last one wins */
+			if (x.table == LMB_BITS) {
+				c.bits[off] = points[j].value;
+			} else {
+				c.regs[off] = points[j].value;
+			}
+		}
+
+		int err = 0;
+		if (xfer_chunk(ctx, &x, start, n, &c) != n) {
+			err = errno ? errno : EIO;
+		}
+		cache_invalidate(ctx, x.table, start, n);
+		for (int j = i; j < end; j++) {
+			points[j].err = err;
+		}
+		i = end;
+	}
+
+	int failed = 0;
+	lua_createtable(L, npoints, 0);
+	for (int j = 0; j < npoints; j++) {
+		if (points[j].err) {
+			lua_pushstring(L, modbus_strerror(points[j].err));
+			failed++;
+		} else {
+			lua_pushboolean(L, true);
+		}
+		lua_rawseti(L, -2, points[j].idx + 1);
+	}
+	lua_pushinteger(L, failed);
+	return 2;
+}
+
+/*
+ * File records.  Any number of record reads or writes are packed into as
+ * few requests as the protocol and the request limits allow, long ones
+ * split over several sub-requests, and on Modbus/TCP pipelined as for
+ * split register reads.
+ */
+#define LMB_FREC_REF	6
+#define LMB_FREC_MAX_RECORD	0x270f
+/* data bytes of a read request or response, and of a write request */
+#define LMB_FREC_READ_BYTES	0xf5
+#define LMB_FREC_WRITE_BYTES	0xfb
+#define LMB_FREC_MAX_SUBS	(LMB_FREC_READ_BYTES / 7)
+
+typedef struct {
+	int file;
+	int record;
+	int count;
+} lmb_frec_t;
+
+/* The part of a record in one request */
+typedef struct {
+	int req;
+	int off;
+	int n;
+} lmb_frec_sub_t;
+
+typedef struct {
+	int nsubs;
+	lmb_frec_sub_t subs[LMB_FREC_MAX_SUBS];
+} lmb_frec_frame_t;
+
+typedef struct {
+	const lmb_frec_t *reqs;
+	int nreqs;
+	bool write;
+	/* the records table, for the values to write */
+	int idx;
+	/* the table of result arrays, for reads */
+	int results;
+	/* registers per request */
+	int limit;
+	/* where the next request starts */
+	int req;
+	int off;
+	lmb_deadline_t dl;
+} lmb_frec_job_t;
+
+/*
+ * Validates the records table at idx, leaving an array of them on the stack
+ * @return the number of records
+ */
+static int frec_check(lua_State *L, int idx, bool write, lmb_frec_t **out)
+{
+	luaL_checktype(L, idx, LUA_TTABLE);
+	int nreqs = lua_rawlen(L, idx);
+	lmb_frec_t *reqs = lua_newuserdata(L, (nreqs ? nreqs : 1) * sizeof(*reqs));
+
+	for (int i = 1; i <= nreqs; i++) {
+		lmb_frec_t *r = &reqs[i - 1];
+		lua_rawgeti(L, idx, i);
+		luaL_checktype(L, -1, LUA_TTABLE);
+		lua_getfield(L, -1, "file");
+		r->file = luaL_checkinteger(L, -1);
+		lua_getfield(L, -2, "record");
+		r->record = luaL_checkinteger(L, -1);
+		if (write) {
+			lua_getfield(L, -3, "values");
+			luaL_checktype(L, -1, LUA_TTABLE);
+			r->count = lua_rawlen(L, -1);
+			for (int j = 1; j <= r->count; j++) {
+				lua_rawgeti(L, -1, j);
+				int t = lua_type(L, -1);
+				lua_pop(L, 1);
+				if (t != LUA_TNUMBER) {
+					return luaL_error(L, "record %d: values must be numeric", i);
+				}
+			}
+		} else {
+			lua_getfield(L, -3, "count");
+			r->count = luaL_checkinteger(L, -1);
+		}
+		lua_pop(L, 4);
+		if (r->file < 1 || r->file > 0xffff) {
+			return luaL_error(L, "record %d: file must be between 1 and 65535", i);
+		}
+		if (r->record < 0 || r->count < 1 || r->record + r->count - 1 > LMB_FREC_MAX_RECORD) {
+			return luaL_error(L, "record %d: records must be within 0-%d", i, LMB_FREC_MAX_RECORD);
+		}
+	}
+	*out = reqs;
+	return nreqs;
+}
+
+/* Builds the job's next request, returns its length, or 0 when all are done */
+static int frec_build(lua_State *L, lmb_frec_job_t *job, lmb_frec_frame_t *f, uint8_t *pdu)
+{
+	int bytes = 0, regs = 0;
+	int len = 2;
+
+	f->nsubs = 0;
+	while (job->req < job->nreqs && f->nsubs < LMB_FREC_MAX_SUBS) {
+		const lmb_frec_t *r = &job->reqs[job->req];
+		/* writes are limited by the request, reads by the response */
+		int room = job->write ? (LMB_FREC_WRITE_BYTES - bytes - 7) / 2 : (LMB_FREC_READ_BYTES - bytes - 2) / 2;
+		if (room > job->limit - regs) {
+			room = job->limit - regs;
+		}
+		int n = r->count - job->off < room ? r->count - job->off : room;
+		if (n < 1) {
+			break;
+		}
+		int record = r->record + job->off;
+		pdu[len] = LMB_FREC_REF;
+		pdu[len + 1] = r->file >> 8;
+		pdu[len + 2] = r->file & 0xff;
+		pdu[len + 3] = record >> 8;
+		pdu[len + 4] = record & 0xff;
+		pdu[len + 5] = n >> 8;
+		pdu[len + 6] = n & 0xff;
+		len += 7;
+		if (job->write) {
+			lua_rawgeti(L, job->idx, job->req + 1);
+			lua_getfield(L, -1, "values");
+			for (int i = 0; i < n; i++) {
+				lua_rawgeti(L, -1, job->off + i + 1);
+				/* as for write_registers, keeping the sign */
+				uint16_t v = (int16_t)lua_tonumber(L, -1);
+				lua_pop(L, 1);
+				pdu[len++] = v >> 8;
+				pdu[len++] = v & 0xff;
+			}
+			lua_pop(L, 2);
+			bytes += 7 + n * 2;
+		} else {
+			bytes += 2 + n * 2;
+		}
+		f->subs[f->nsubs].req = job->req;
+		f->subs[f->nsubs].off = job->off;
+		f->subs[f->nsubs].n = n;
+		f->nsubs++;
+		regs += n;
+		job->off += n;
+		if (job->off == r->count) {
+			job->req++;
+			job->off = 0;
+		}
+	}
+	if (!f->nsubs) {
+		return 0;
+	}
+	pdu[0] = job->write ? 0x15 : 0x14;
+	pdu[1] = len - 2;
+	return len;
+}
+
+/* Validates a response to frec_build(), storing read values in the results */
+static int frec_parse(lua_State *L, const lmb_frec_job_t *job, const lmb_frec_frame_t *f,
+	const uint8_t *req, int reqlen, const uint8_t *rsp, int len)
+{
+	if (pdu_check(rsp, len, req[0]) < 0) {
+		return -1;
+	}
+	if (job->write) {
+		/* an echo of the request */
+		if (len != reqlen || memcmp(rsp, req, len) != 0) {
+			errno = EMBBADDATA;
+			return -1;
+		}
+		return 0;
+	}
+	if (len < 2 || rsp[1] != len - 2) {
+		errno = EMBBADDATA;
+		return -1;
+	}
+	int pos = 2;
+	for (int s = 0; s < f->nsubs; s++) {
+		const lmb_frec_sub_t *sub = &f->subs[s];
+		if (pos + 2 + sub->n * 2 > len || rsp[pos] != 1 + sub->n * 2 || rsp[pos + 1] != LMB_FREC_REF) {
+			errno = EMBBADDATA;
+			return -1;
+		}
+		lua_rawgeti(L, job->results, sub->req + 1);
+		for (int i = 0; i < sub->n; i++) {
+			lua_pushnumber(L, rsp[pos + 2 + i * 2] << 8 | rsp[pos + 3 + i * 2]);
+			lua_rawseti(L, -2, sub->off + i + 1);
+		}
+		lua_pop(L, 1);
+		pos += 2 + sub->n * 2;
+	}
+	if (pos != len) {
+		errno = EMBBADDATA;
+		return -1;
+	}
+	return 0;
+}
+
+/* One request of our own framing, under a deadline, retried as libmodbus' */
+static int raw_call(ctx_t *ctx, const uint8_t *req, int len, uint8_t *rsp, const lmb_deadline_t *dl)
+{
+	int rc;
+
+	do {
+		if (deadline_arm(ctx, dl) < 0) {
+			return -1;
+		}
+		rc = raw_transact(ctx, ctx->slave, req, len, rsp, dl);
+		if (rc < 0 && ctx->is_rtu) {
+			/* a late reply mustn't be taken for the next one */
+			modbus_flush(ctx->modbus);
+		}
+		deadline_disarm(ctx);
+	} while (rc < 0 && deadline_retry(ctx, dl));
+	return rc;
+}
+
+/* Runs all of the job's requests, as xfer_run() and xfer_pipelined() */
+static int frec_run(lua_State *L, ctx_t *ctx, lmb_frec_job_t *job)
+{
+	struct {
+		uint16_t tid;
+		int len;
+		uint8_t req[MODBUS_MAX_PDU_LENGTH];
+		lmb_frec_frame_t f;
+	} inflight[LMB_MAX_PIPELINE];
+	uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+	int depth = !ctx->is_rtu && ctx->pipeline > 1 ? ctx->pipeline : 1;
+	int head = 0, tail = 0, outstanding = 0;
+	int unit = ctx->slave;
+	bool more = true;
+
+	if (depth == 1) {
+		int len;
+		while ((len = frec_build(L, job, &inflight[0].f, inflight[0].req)) > 0) {
+			int rlen = raw_call(ctx, inflight[0].req, len, rsp, &job->dl);
+			if (rlen < 0 || frec_parse(L, job, &inflight[0].f, inflight[0].req, len, rsp, rlen) < 0) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	while (more || outstanding) {
+		while (more && outstanding < depth) {
+			int len = frec_build(L, job, &inflight[head].f, inflight[head].req);
+			if (len == 0) {
+				more = false;
+				break;
+			}
+			if (tcp_send_pdu(ctx, unit, inflight[head].req, len, &inflight[head].tid) < 0) {
+				goto fail;
+			}
+			inflight[head].len = len;
+			head = (head + 1) % depth;
+			outstanding++;
+		}
+		if (!outstanding) {
+			break;
+		}
+
+		uint16_t tid;
+		int runit;
+		int len = tcp_recv_pdu(ctx, &job->dl, rsp, &tid, &runit);
+		if (len < 0) {
+			goto fail;
+		}
+		if (tid != inflight[tail].tid || runit != unit) {
+			errno = EMBBADDATA;
+			goto fail;
+		}
+		outstanding--;
+		if (frec_parse(L, job, &inflight[tail].f, inflight[tail].req, inflight[tail].len, rsp, len) < 0) {
+			goto fail;
+		}
+		tail = (tail + 1) % depth;
+	}
+	return 0;
+
+fail: {
+		int saved = errno;
+		/* Late responses would be mistaken for answers to the next request */
+		if (saved != ETIMEDOUT) {
+			while (outstanding > 0) {
+				uint16_t tid;
+				int runit;
+				if (tcp_recv_pdu(ctx, &job->dl, rsp, &tid, &runit) < 0) {
+					break;
+				}
+				outstanding--;
+			}
+		}
+		if (outstanding > 0) {
+			modbus_flush(ctx->modbus);
+		}
+		errno = saved;
+		return -1;
+	}
+}
+
+/**
+ * Read file records (FC20).
+ * All the records are read in as few requests as possible, several
+ * records per request, and those longer than fit in one are split.
+ * The read_registers request limit also applies, see @{set_request_limits},
+ * and on Modbus/TCP, so does pipelining.
+ * @function ctx:read_file_record
+ * @param records array of tables, each with file (1-65535), record
+ *  (0-9999) and count, the number of registers to read from there
+ * @param[opt] deadline see @{monotonic}, covering all requests
+ * @return array of results, in the order of records, each an array of
+ *  register values
+ * @usage
+ *  local r = dev:read_file_record{
+ *    {file=4, record=0, count=200},
+ *    {file=5, record=10, count=8},
+ *  }
+ *  -- r[1] has 200 registers, r[2] 8, both read in 2 requests
+ */
+static int ctx_read_file_record(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lmb_frec_job_t job = { .idx = 2, .limit = ctx->max_read_regs };
+	lmb_frec_t *reqs;
+
+	deadline_opt(L, 3, &job.dl);
+	job.nreqs = frec_check(L, 2, false, &reqs);
+	job.reqs = reqs;
+
+	lua_createtable(L, job.nreqs, 0);
+	job.results = lua_gettop(L);
+	for (int i = 0; i < job.nreqs; i++) {
+		lua_createtable(L, reqs[i].count, 0);
+		lua_rawseti(L, job.results, i + 1);
+	}
+	if (frec_run(L, ctx, &job) < 0) {
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+	return 1;
+}
+
+/**
+ * Write file records (FC21).
+ * Packed into requests as for @{read_file_record}, with the
+ * write_registers request limit.
+ * @function ctx:write_file_record
+ * @param records array of tables, each with file (1-65535), record
+ *  (0-9999) and values, an array of register values to write there
+ * @param[opt] deadline see @{monotonic}, covering all requests
+ * @return true, or nil and an error.  Some requests may have been
+ *  written before one failed.
+ */
+static int ctx_write_file_record(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lmb_frec_job_t job = { .write = true, .idx = 2, .limit = ctx->max_write_regs };
+	lmb_frec_t *reqs;
+
+	deadline_opt(L, 3, &job.dl);
+	job.nreqs = frec_check(L, 2, true, &reqs);
+	job.reqs = reqs;
+
+	int rc = frec_run(L, ctx, &job);
+	return libmodbus_rc_to_nil_error(L, rc, 0);
+}
+
+/**
+ * Read a FIFO queue (FC24).
+ * @function ctx:read_fifo_queue
+ * @param address the queue's pointer register
+ * @param[opt] deadline see @{monotonic}
+ * @return array of the queued register values, up to 31, empty if the
+ *  queue is
+ */
+static int ctx_read_fifo_queue(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int addr = luaL_checkinteger(L, 2);
+	lmb_deadline_t dl;
+	uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+
+	if (addr < 0 || addr > 0xffff) {
+		return luaL_argerror(L, 2, "address out of range");
+	}
+	deadline_opt(L, 3, &dl);
+
+	const uint8_t req[] = { 0x18, addr >> 8, addr & 0xff };
+	int len = raw_call(ctx, req, sizeof(req), rsp, &dl);
+	if (len < 0) {
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+	/* byte count, then the number of values, both 16bit */
+	int count = len >= 5 ? rsp[3] << 8 | rsp[4] : 0;
+	if (len < 5 || (rsp[1] << 8 | rsp[2]) != len - 3 || count > 31 || len != 5 + count * 2) {
+		errno = EMBBADDATA;
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+	lua_createtable(L, count, 0);
+	for (int i = 0; i < count; i++) {
+		lua_pushnumber(L, rsp[5 + i * 2] << 8 | rsp[6 + i * 2]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+/* Compares a chunk read back against the values written */
+static bool chunk_equal(const lmb_xfer_t *x, int n, const lmb_chunk_t *a, const lmb_chunk_t *b)
+{
+	if (x->table == LMB_BITS) {
+		for (int i = 0; i < n; i++) {
+			if (!a->bits[i] != !b->bits[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+	return memcmp(a->regs, b->regs, n * sizeof(a->regs[0])) == 0;
+}
+
+/* Pushes true, false or an error message for one unit's read back */
+static void bcast_verify_unit(lua_State *L, ctx_t *ctx, const lmb_xfer_t *w, int unit, uint64_t timeout)
+{
+	lmb_xfer_t r = { .table = w->table, .count = w->count };
+	int per = xfer_limit(ctx, &r);
+	lmb_chunk_t got, want;
+	bool same = true;
+
+	if (timeout) {
+		r.dl.at = lmb_now_us() + timeout;
+	}
+	int prev = ctx_unit_switch(ctx, unit);
+	for (int off = 0; off < w->count && same; off += per) {
+		int n = w->count - off < per ? w->count - off : per;
+		if (ctx->slave != unit || xfer_chunk(ctx, &r, w->addr + off, n, &got) != n) {
+			ctx_unit_restore(ctx, prev);
+			lua_pushstring(L, modbus_strerror(errno));
+			return;
+		}
+		xfer_load(L, w, off, n, &want);
+		same = chunk_equal(w, n, &got, &want);
+	}
+	ctx_unit_restore(ctx, prev);
+	lua_pushboolean(L, same);
+}
+
+/*
+ * Reads back from several units at once on Modbus/TCP, for writes that
+ * fit in a single request.  Results go in the table on top of the stack.
+ */
+static void bcast_verify_pipelined(lua_State *L, ctx_t *ctx, const lmb_xfer_t *w, int units, int nunits, uint64_t timeout)
+{
+	lmb_xfer_t r = { .table = w->table, .count = w->count };
+	struct {
+		uint16_t tid;
+		int unit;
+	} inflight[LMB_MAX_PIPELINE];
+	uint8_t req[5], pdu[MODBUS_MAX_PDU_LENGTH];
+	lmb_chunk_t got, want;
+	int depth = ctx->pipeline;
+	int head = 0, tail = 0, outstanding = 0, sent = 0;
+
+	xfer_load(L, w, 0, w->count, &want);
+	xfer_build_pdu(&r, w->addr, w->count, NULL, req);
+	while (sent < nunits || outstanding) {
+		while (sent < nunits && outstanding < depth) {
+			lua_rawgeti(L, units, ++sent);
+			int unit = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			if (tcp_send_pdu(ctx, unit, req, sizeof(req), &inflight[head].tid) < 0) {
+				lua_pushstring(L, modbus_strerror(errno));
+				lua_rawseti(L, -2, unit);
+				continue;
+			}
+			inflight[head].unit = unit;
+			head = (head + 1) % depth;
+			outstanding++;
+		}
+		if (!outstanding) {
+			break;
+		}
+		uint16_t tid;
+		int runit;
+		int unit = inflight[tail].unit;
+		if (timeout) {
+			r.dl.at = lmb_now_us() + timeout;
+		}
+		int len = tcp_recv_pdu(ctx, &r.dl, pdu, &tid, &runit);
+		if (len < 0 || tid != inflight[tail].tid || runit != unit) {
+			if (len >= 0) {
+				errno = EMBBADDATA;
+			}
+			/* can't tell what belongs to what anymore */
+			int saved = errno;
+			modbus_flush(ctx->modbus);
+			while (outstanding--) {
+				lua_pushstring(L, modbus_strerror(saved));
+				lua_rawseti(L, -2, inflight[tail].unit);
+				tail = (tail + 1) % depth;
+			}
+			outstanding = 0;
+			continue;
+		}
+		if (xfer_parse_pdu(&r, req, w->count, pdu, len, &got) < 0) {
+			lua_pushstring(L, modbus_strerror(errno));
+		} else {
+			lua_pushboolean(L, chunk_equal(w, w->count, &got, &want));
+		}
+		lua_rawseti(L, -2, unit);
+		tail = (tail + 1) % depth;
+		outstanding--;
+	}
+}
+
+/**
+ * Write the same values to every device on the line at once.
+ * The writes go to the broadcast address, which devices never answer,
+ * so after each request there is a wait for it to be sent and for the
+ * devices to act on it.  Optionally, units that need confirmation are
+ * then read back, several at once on Modbus/TCP if pipelining is enabled.
+ * @function ctx:broadcast_write
+ * @param opts table of options
+ *  <ul>
+ *  <li>table "bits" or "registers"</li>
+ *  <li>addr</li>
+ *  <li>values array of values to write</li>
+ *  <li>turnaround (optional) microseconds to give devices after each
+ *  broadcast, default 100000, as suggested by the serial line spec.  On
+ *  Modbus/TCP, any answers to the broadcast arriving within it are
+ *  discarded.</li>
+ *  <li>verify (optional) array of units to read back from</li>
+ *  <li>timeout (optional) microseconds to wait for each read back,
+ *  instead of the response timeout</li>
+ *  </ul>
+ * @return[1] table keyed by verified unit, true if the values matched,
+ *  false if not, or an error message.  Empty without verify.
+ * @return[2] nil
+ * @return[2] error message
+ * @return[2] count of values broadcast before the failure
+ * @usage
+ *  local res = rtu:broadcast_write{table="registers", addr=0x300, values={2, 1500},
+ *  	verify={3, 17}}
+ *  for unit, ok in pairs(res) do if ok ~= true then print(unit, ok) end end
+ */
+static int ctx_broadcast_write(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	static const char *const tables[] = { "bits", "", "registers", NULL };
+	lmb_xfer_t x = { .write = true, .fc06 = ctx->single_write_fc06 };
+
+	lua_getfield(L, 2, "table");
+	x.table = luaL_checkoption(L, -1, NULL, tables);
+	lua_getfield(L, 2, "addr");
+	x.addr = luaL_checknumber(L, -1);
+	lua_getfield(L, 2, "turnaround");
+	lua_Number turnaround = luaL_optnumber(L, -1, 100000);
+	lua_getfield(L, 2, "timeout");
+	lua_Number timeout = luaL_optnumber(L, -1, 0);
+	lua_getfield(L, 2, "verify");
+	int units = lua_gettop(L);
+	int nunits = 0;
+	if (!lua_isnil(L, units)) {
+		luaL_checktype(L, units, LUA_TTABLE);
+		nunits = lua_rawlen(L, units);
+		for (int i = 1; i <= nunits; i++) {
+			lua_rawgeti(L, units, i);
+			int u = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			if (u < 1 || u > 247) {
+				return luaL_argerror(L, 2, "verify units must be 1-247");
+			}
+		}
+	}
+	lua_getfield(L, 2, "values");
+	x.idx = lua_gettop(L);
+	luaL_checktype(L, x.idx, LUA_TTABLE);
+	x.count = lua_rawlen(L, x.idx);
+	if (x.addr < 0 || x.addr > 0xffff || x.count < 1 || x.count > 0x10000 - x.addr) {
+		return luaL_argerror(L, 2, "range out of bounds");
+	}
+	if (turnaround < 0 || timeout < 0) {
+		return luaL_argerror(L, 2, "turnaround and timeout must not be negative");
+	}
+	for (int i = 1; i <= x.count; i++) {
+		lua_rawgeti(L, x.idx, i);
+		int t = lua_type(L, -1);
+		lua_pop(L, 1);
+		if (t != LUA_TNUMBER && (t != LUA_TBOOLEAN || x.table != LMB_BITS)) {
+			return luaL_argerror(L, 2, "values must be numeric (or bool for bits)");
+		}
+	}
+
+	int per = xfer_limit(ctx, &x);
+	uint8_t pdu[MODBUS_MAX_PDU_LENGTH + 1];
+	lmb_chunk_t c;
+	for (int off = 0; off < x.count; off += per) {
+		int n = x.count - off < per ? x.count - off : per;
+		xfer_load(L, &x, off, n, &c);
+		int len = xfer_build_pdu(&x, x.addr + off, n, &c, &pdu[1]);
+		int rc;
+		if (ctx->is_rtu) {
+			pdu[0] = MODBUS_BROADCAST_ADDRESS;
+			cap_pdu(ctx, LMB_CAP_TX, MODBUS_BROADCAST_ADDRESS, 0, &pdu[1], len, 0);
+			rc = modbus_send_raw_request(ctx->modbus, pdu, len + 1);
+		} else {
+			uint16_t tid;
+			rc = tcp_send_pdu(ctx, MODBUS_BROADCAST_ADDRESS, &pdu[1], len, &tid);
+		}
+		if (rc < 0) {
+			libmodbus_rc_to_nil_error(L, -1, 0);
+			lua_pushinteger(L, off);
+			return 3;
+		}
+		if (ctx->is_rtu) {
+			/* the request may still be leaving the uart */
+			lmb_sleep_us(turnaround + (uint64_t)(len + 3) * rtu_char_us(ctx) + rtu_t35_us(ctx));
+		} else {
+			/*
+			 * Plenty of TCP devices and gateways answer unit 0 anyway, that
+			 * mustn't be left for the next request to take as its own, so
+			 * the whole turnaround is spent discarding whatever comes back.
+			 * Each wait is cut short by the response timeout, so go again.
+			 */
+			lmb_deadline_t drain = { .at = lmb_now_us() + (uint64_t)turnaround };
+			uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+			uint16_t rtid;
+			int runit;
+			uint64_t now;
+			while ((now = lmb_now_us()) < drain.at) {
+				if (tcp_recv_pdu(ctx, &drain, rsp, &rtid, &runit) >= 0 || errno == ETIMEDOUT) {
+					continue;
+				}
+				if (errno == EMBBADDATA) {
+					modbus_flush(ctx->modbus);
+					continue;
+				}
+				/* nothing more will come, but the devices still need the time */
+				now = lmb_now_us();
+				if (now < drain.at) {
+					lmb_sleep_us(drain.at - now);
+				}
+				break;
+			}
+			modbus_flush(ctx->modbus);
+		}
+	}
+	cache_invalidate_unit(ctx, MODBUS_BROADCAST_ADDRESS, x.table, x.addr, x.count);
+
+	lua_newtable(L);
+	if (nunits && !ctx->is_rtu && ctx->pipeline > 1 && x.count <= per) {
+		bcast_verify_pipelined(L, ctx, &x, units, nunits, timeout);
+	} else {
+		for (int i = 1; i <= nunits; i++) {
+			lua_rawgeti(L, units, i);
+			int unit = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			bcast_verify_unit(L, ctx, &x, unit, timeout);
+			lua_rawseti(L, -2, unit);
+		}
+	}
+	return 1;
+}
+
+/**
+ * Limit how much is requested in a single request.
+ * Many devices accept less than the protocol maximum per request.
+ * Reads and writes larger than these limits are transparently split.
+ * Only the fields provided are changed, each from 1 up to the protocol limit.
+ * @function ctx:set_request_limits
+ * @param limits table with any of the fields:
+ *  read_registers, write_registers, read_bits, write_bits, and
+ *  pipeline, the number of split requests allowed in flight at once
+ *  (Modbus/TCP only, defaults to 1)
+ * @usage
+ *  dev:set_request_limits{read_registers=64, write_registers=32}
+ *  local regs = dev:read_registers(0, 1000) -- 16 requests
+ *  dev:set_request_limits{pipeline=4} -- 4 requests on the wire at once
+ */
+static int ctx_set_request_limits(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	static const struct {
+		const char *name;
+		int max;
+		size_t offset;
+	} limits[] = {
+		{"read_registers", MODBUS_MAX_READ_REGISTERS, offsetof(ctx_t, max_read_regs)},
+		{"write_registers", MODBUS_MAX_WRITE_REGISTERS, offsetof(ctx_t, max_write_regs)},
+		{"read_bits", MODBUS_MAX_READ_BITS, offsetof(ctx_t, max_read_bits)},
+		{"write_bits", MODBUS_MAX_WRITE_BITS, offsetof(ctx_t, max_write_bits)},
+		{"pipeline", LMB_MAX_PIPELINE, offsetof(ctx_t, pipeline)},
+	};
+
+	/* validate everything before changing anything */
+	for (int pass = 0; pass < 2; pass++) {
+		for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+			lua_getfield(L, 2, limits[i].name);
+			if (!lua_isnil(L, -1)) {
+				int v = lua_tonumber(L, -1);
+				if (v < 1 || v > limits[i].max) {
+					return luaL_error(L, "%s must be between 1 and %d", limits[i].name, limits[i].max);
+				}
+				if (ctx->is_rtu && v > 1 && limits[i].offset == offsetof(ctx_t, pipeline)) {
+					return luaL_error(L, "Cannot pipeline requests on an RTU context");
+				}
+				if (pass) {
+					*(int *)((char *)ctx + limits[i].offset) = v;
+				}
+			}
+			lua_pop(L, 1);
+		}
+	}
+	return 0;
+}
+
+/**
+ * @function ctx:get_request_limits
+ * @return table of limits, as per @{set_request_limits}
+ */
+static int ctx_get_request_limits(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	lua_newtable(L);
+	lua_pushinteger(L, ctx->max_read_regs);
+	lua_setfield(L, -2, "read_registers");
+	lua_pushinteger(L, ctx->max_write_regs);
+	lua_setfield(L, -2, "write_registers");
+	lua_pushinteger(L, ctx->max_read_bits);
+	lua_setfield(L, -2, "read_bits");
+	lua_pushinteger(L, ctx->max_write_bits);
+	lua_setfield(L, -2, "write_bits");
+	lua_pushinteger(L, ctx->pipeline);
+	lua_setfield(L, -2, "pipeline");
+	return 1;
+}
+
+/**
+ * Cache a block of a device's address space.
+ * Reads that fall entirely within the block are served from memory for
+ * ttl microseconds after the block was last read from the device.
+ * Once stale, the next such read refreshes the whole block, in as few
+ * requests as the request limits allow.  Writes through this context
+ * to any part of the block make it stale, writes by anyone else are
+ * only seen after ttl.  Reads not within a single block go straight
+ * to the device as usual.
+ * @function ctx:cache_add
+ * @param block table with fields
+ *  <ul>
+ *  <li>table one of "bits", "input_bits", "registers" or "input_registers"</li>
+ *  <li>addr first address of the block</li>
+ *  <li>count number of values in the block</li>
+ *  <li>ttl microseconds the values stay fresh</li>
+ *  <li>unit (optional) defaults to the current slave</li>
+ *  </ul>
+ * @usage
+ *  dev:cache_add{table="registers", addr=0x2000, count=60, ttl=500000}
+ *  local v = dev:read_registers(0x2010, 2) -- refreshes the block
+ *  local w = dev:read_registers(0x2000, 4) -- from memory
+ */
+static int ctx_cache_add(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	lua_getfield(L, 2, "table");
+	enum lmb_table table = luaL_checkoption(L, -1, NULL, lmb_table_names);
+	lua_getfield(L, 2, "addr");
+	int addr = luaL_checknumber(L, -1);
+	lua_getfield(L, 2, "count");
+	int count = luaL_checknumber(L, -1);
+	lua_getfield(L, 2, "ttl");
+	lua_Number ttl = luaL_checknumber(L, -1);
+	lua_getfield(L, 2, "unit");
+	int unit = luaL_optinteger(L, -1, ctx->slave);
+	lua_pop(L, 5);
+
+	if (addr < 0 || addr > 0xffff || count < 1 || count > 0x10000 - addr) {
+		return luaL_argerror(L, 2, "block out of range");
+	}
+	if (ttl < 0) {
+		return luaL_argerror(L, 2, "ttl must not be negative");
+	}
+	if (unit < 0 || unit > 0xff) {
+		return luaL_argerror(L, 2, "unit required, or set_slave first");
+	}
+
+	uint16_t *vals = lmb_malloc(count * sizeof(*vals));
+	lmb_cache_block_t *blocks = vals ? lmb_realloc(ctx->cache, (ctx->cache_len + 1) * sizeof(*blocks)) : NULL;
+	if (!blocks) {
+		free(vals);
+		return luaL_error(L, "out of memory");
+	}
+	ctx->cache = blocks;
+	ctx->cache[ctx->cache_len++] = (lmb_cache_block_t) {
+		.table = table,
+		.unit = unit,
+		.addr = addr,
+		.count = count,
+		.ttl = ttl,
+		.vals = vals,
+	};
+	return 0;
+}
+
+/**
+ * Mark cached blocks stale, so the next read goes to the device.
+ * @function ctx:cache_invalidate
+ * @param[opt] table as per @{cache_add}, all blocks if not given
+ * @param[opt] address only blocks including this address
+ * @param[opt] count and the following count-1 addresses, default 1
+ */
+static int ctx_cache_invalidate(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	if (lua_isnoneornil(L, 2)) {
+		for (int i = 0; i < ctx->cache_len; i++) {
+			ctx->cache[i].fetched = 0;
+		}
+		return 0;
+	}
+	enum lmb_table table = luaL_checkoption(L, 2, NULL, lmb_table_names);
+	int addr = luaL_optinteger(L, 3, 0);
+	int count = lua_isnoneornil(L, 3) ? 0x10000 : luaL_optinteger(L, 4, 1);
+	cache_invalidate(ctx, table, addr, count);
+	return 0;
+}
+
+/**
+ * Remove all cached blocks.
+ * @function ctx:cache_clear
+ */
+static int ctx_cache_clear(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	cache_free(ctx);
+	return 0;
+}
+
+/**
+ * @function ctx:cache_stats
+ * @return table with the number of blocks, and of reads served from
+ *  memory (hits) and from the device (misses)
+ */
+static int ctx_cache_stats(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	lua_newtable(L);
+	lua_pushinteger(L, ctx->cache_len);
+	lua_setfield(L, -2, "blocks");
+	lua_pushnumber(L, ctx->cache_hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushnumber(L, ctx->cache_misses);
+	lua_setfield(L, -2, "misses");
+	return 1;
+}
+
+/*
+ * Reads count values into out, one per bit or register, from the cache
+ * if a block covers them, or the device.
+ */
+static int xfer_read_buf(ctx_t *ctx, enum lmb_table table, int addr, int count, uint16_t *out, const lmb_deadline_t *dl)
+{
+	lmb_cache_block_t *b = cache_find(ctx, table, addr, count);
+	if (b) {
+		if (cache_fill(ctx, b, dl) < 0) {
+			return -1;
+		}
+		memcpy(out, &b->vals[addr - b->addr], count * sizeof(*out));
+		return count;
+	}
+
+	return xfer_chunk_buf(ctx, table, addr, count, out, dl);
+}
+
+
+/** Subscriptions.
+ * A subscription watches a range of one unit's table, and each poll
+ * returns only what changed since the last values reported.
+ * @section subscriptions
+ */
+
+typedef struct {
+	enum lmb_type type;
+	enum lmb_order order;
+	/* registers from the start of the range */
+	int offset;
+	/* report only changes of at least this much, or this percentage */
+	lua_Number deadband;
+	bool percent;
+	/* last value reported */
+	lua_Number last;
+	/* identifies the point in ring buffers */
+	uint32_t id;
+} lmb_point_t;
+
+typedef struct {
+	/* keeps the context alive as long as we are */
+	int ctx_ref;
+	ctx_t *ctx;
+	enum lmb_table table;
+	int unit;
+	int addr;
+	int count;
+	bool primed;
+	int npoints;
+	/* both live in the same userdata, after this header */
+	lmb_point_t *points;
+	uint16_t *vals;
+} lmb_sub_t;
+
+static lmb_sub_t *sub_check(lua_State *L, int i)
+{
+	return (lmb_sub_t *) luaL_checkudata(L, i, MODBUS_META_SUB);
+}
+
+/* Reads the options of a point from the table at idx, over defaults in p */
+static void sub_point_opts(lua_State *L, int idx, lmb_point_t *p)
+{
+	lua_getfield(L, idx, "type");
+	if (!lua_isnil(L, -1)) {
+		p->type = luaL_checkoption(L, -1, NULL, lmb_type_names);
+	}
+	lua_getfield(L, idx, "order");
+	if (!lua_isnil(L, -1)) {
+		p->order = luaL_checkoption(L, -1, NULL, lmb_order_names);
+	}
+	lua_getfield(L, idx, "deadband");
+	if (!lua_isnil(L, -1)) {
+		p->deadband = luaL_checknumber(L, -1);
+		p->percent = false;
+	}
+	lua_getfield(L, idx, "deadband_pct");
+	if (!lua_isnil(L, -1)) {
+		p->deadband = luaL_checknumber(L, -1);
+		p->percent = true;
+	}
+	lua_pop(L, 4);
+	if (p->deadband < 0) {
+		luaL_error(L, "deadbands must not be negative");
+	}
+}
+
+/* Whether n can be a point id, a whole number that fits in 32 bits */
+static bool point_id_ok(lua_Number n)
+{
+	return n >= 0 && n <= UINT32_MAX && n == floor(n);
+}
+
+/**
+ * Subscribe to changes in a range of values.
+ * Register ranges are decoded into points, by default one u16 per
+ * register.  Points only count as changed when they move by at least
+ * their deadband from the value last reported, so slow drifts are still
+ * reported eventually.  Bit ranges report every bit that changed.
+ * Polls go through the cache, if a cache block covers the range.
+ * @function ctx:subscribe
+ * @param opts table of options
+ *  <ul>
+ *  <li>table one of "bits", "input_bits", "registers" or "input_registers"</li>
+ *  <li>addr, count the range to watch</li>
+ *  <li>unit (optional) defaults to the current slave</li>
+ *  <li>type one of "u16", "s16", "u32", "s32", "u64", "s64", "f32", "f64", default "u16"</li>
+ *  <li>order one of "abcd", "cdab", "badc", "dcba", default "abcd"</li>
+ *  <li>deadband absolute deadband, default 0, any change</li>
+ *  <li>deadband_pct deadband as a percentage of the last value reported</li>
+ *  <li>points (optional) array of points, each with an offset in registers
+ *  from addr, and optionally any of type, order, deadband, deadband_pct
+ *  and id.  Without points, the whole range is split into points of the given type.</li>
+ *  <li>id (optional) base for the ids of points without their own, which
+ *  are this plus their index.  Only used with @{ring:poll}.</li>
+ *  </ul>
+ * @return a subscription
+ * @usage
+ *  local sub = dev:subscribe{table="registers", addr=0x100, count=8, points={
+ *  	{offset=0, type="f32", deadband=0.5},
+ *  	{offset=2, type="u32", order="cdab", deadband_pct=1},
+ *  	{offset=4, type="s16"}}}
+ *  local changed = sub:poll() -- {[1]=230.5, [3]=-4}
+ */
+static int ctx_subscribe(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lmb_point_t def = { .type = LMB_U16, .order = LMB_ABCD };
+
+	lua_getfield(L, 2, "table");
+	enum lmb_table table = luaL_checkoption(L, -1, NULL, lmb_table_names);
+	lua_getfield(L, 2, "addr");
+	int addr = luaL_checknumber(L, -1);
+	lua_getfield(L, 2, "count");
+	int count = luaL_checknumber(L, -1);
+	lua_getfield(L, 2, "unit");
+	int unit = luaL_optinteger(L, -1, ctx->slave);
+	lua_getfield(L, 2, "id");
+	lua_Number id_base = luaL_optnumber(L, -1, 0);
+	lua_pop(L, 5);
+	sub_point_opts(L, 2, &def);
+
+	bool bits = table == LMB_BITS || table == LMB_INPUT_BITS;
+	if (addr < 0 || addr > 0xffff || count < 1 || count > 0x10000 - addr) {
+		return luaL_argerror(L, 2, "range out of bounds");
+	}
+	if (unit < 0 || unit > 0xff) {
+		return luaL_argerror(L, 2, "unit required, or set_slave first");
+	}
+
+	int npoints;
+	lua_getfield(L, 2, "points");
+	bool explicit = !lua_isnil(L, -1);
+	if (explicit) {
+		luaL_checktype(L, -1, LUA_TTABLE);
+		if (bits) {
+			return luaL_argerror(L, 2, "points only apply to registers");
+		}
+		npoints = lua_rawlen(L, -1);
+	} else {
+		npoints = bits ? count : count / lmb_type_words(def.type);
+	}
+	if (npoints < 1) {
+		return luaL_argerror(L, 2, "nothing to watch");
+	}
+	if (!point_id_ok(id_base) || id_base + npoints > UINT32_MAX) {
+		return luaL_argerror(L, 2, "ids must be 32 bit unsigned");
+	}
+
+	lmb_sub_t *sub = lua_newuserdata(L, sizeof(*sub) + npoints * sizeof(lmb_point_t) + count * sizeof(uint16_t));
+	memset(sub, 0, sizeof(*sub));
+	sub->points = (lmb_point_t *)(sub + 1);
+	sub->vals = (uint16_t *)(sub->points + npoints);
+	sub->ctx = ctx;
+	sub->ctx_ref = LUA_NOREF;
+	sub->table = table;
+	sub->unit = unit;
+	sub->addr = addr;
+	sub->count = count;
+	sub->npoints = npoints;
+	luaL_getmetatable(L, MODBUS_META_SUB);
+	lua_setmetatable(L, -2);
+
+	for (int i = 0; i < npoints; i++) {
+		lmb_point_t *p = &sub->points[i];
+		*p = def;
+		p->id = id_base + i + 1;
+		if (explicit) {
+			lua_rawgeti(L, -2, i + 1);
+			luaL_checktype(L, -1, LUA_TTABLE);
+			lua_getfield(L, -1, "offset");
+			p->offset = luaL_checknumber(L, -1);
+			lua_getfield(L, -2, "id");
+			lua_Number id = luaL_optnumber(L, -1, p->id);
+			lua_pop(L, 2);
+			if (!point_id_ok(id)) {
+				return luaL_error(L, "point %d id must be 32 bit unsigned", i + 1);
+			}
+			p->id = id;
+			sub_point_opts(L, lua_gettop(L), p);
+			lua_pop(L, 1);
+			if (p->offset < 0 || p->offset + lmb_type_words(p->type) > count) {
+				return luaL_error(L, "point %d is outside the range", i + 1);
+			}
+		} else {
+			p->offset = bits ? i : i * lmb_type_words(def.type);
+		}
+	}
+
+	lua_pushvalue(L, 1);
+	sub->ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+static bool sub_changed(const lmb_point_t *p, lua_Number v)
+{
+	/* NaNs never compare equal, only report going into or out of NaN */
+	if (v != v || p->last != p->last) {
+		return (v != v) != (p->last != p->last);
+	}
+	lua_Number d = v > p->last ? v - p->last : p->last - v;
+	if (p->percent) {
+		lua_Number base = p->last < 0 ? -p->last : p->last;
+		return d > 0 && d >= base * p->deadband / 100;
+	}
+	return d > 0 && d >= p->deadband;
+}
+
+/* Reads the subscription's range into its vals, 0 or -1 */
+static int sub_fetch(lmb_sub_t *sub, const lmb_deadline_t *dl)
+{
+	ctx_t *ctx = sub->ctx;
+	ctx_lock(ctx);
+	int prev = ctx_unit_switch(ctx, sub->unit);
+	int rc = ctx->slave == sub->unit ? xfer_read_buf(ctx, sub->table, sub->addr, sub->count, sub->vals, dl) : -1;
+	int err = errno;
+	ctx_unit_restore(ctx, prev);
+	ctx_unlock(ctx);
+	errno = err;
+	return rc == sub->count ? 0 : -1;
+}
+
+static lua_Number sub_value(const lmb_sub_t *sub, const lmb_point_t *p)
+{
+	if (sub->table == LMB_BITS || sub->table == LMB_INPUT_BITS) {
+		return sub->vals[p->offset];
+	}
+	return lmb_decode(&sub->vals[p->offset], p->type, p->order);
+}
+
+/* Polls a subscription, pushing the changes, or nil, err */
+static int sub_read(lua_State *L, lmb_sub_t *sub, const lmb_deadline_t *dl)
+{
+	if (sub_fetch(sub, dl) < 0) {
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+
+	lua_newtable(L);
+	for (int i = 0; i < sub->npoints; i++) {
+		lmb_point_t *p = &sub->points[i];
+		lua_Number v = sub_value(sub, p);
+		if (!sub->primed || sub_changed(p, v)) {
+			p->last = v;
+			lua_pushnumber(L, v);
+			lua_rawseti(L, -2, i + 1);
+		}
+	}
+	sub->primed = true;
+	return 1;
+}
+
+/**
+ * Read the range, and return what changed.
+ * The first poll, or the first after @{sub:reset}, reports every point.
+ * @function sub:poll
+ * @param[opt] deadline see @{monotonic}
+ * @return[1] table of changed values, keyed by point (or bit) index
+ * @return[2] nil
+ * @return[2] error message
+ */
+static int sub_poll(lua_State *L)
+{
+	lmb_sub_t *sub = sub_check(L, 1);
+	lmb_deadline_t dl;
+	deadline_opt(L, 2, &dl);
+
+	if (!sub->ctx->modbus) {
+		return luaL_error(L, "context was destroyed");
+	}
+	return sub_read(L, sub, &dl);
+}
+
+/**
+ * Report every point again on the next poll.
+ * @function sub:reset
+ */
+static int sub_reset(lua_State *L)
+{
+	lmb_sub_t *sub = sub_check(L, 1);
+	sub->primed = false;
+	return 0;
+}
+
+static int sub_gc(lua_State *L)
+{
+	lmb_sub_t *sub = sub_check(L, 1);
+	luaL_unref(L, LUA_REGISTRYINDEX, sub->ctx_ref);
+	sub->ctx_ref = LUA_NOREF;
+	return 0;
+}
+
+static int sub_tostring(lua_State *L)
+{
+	lmb_sub_t *sub = sub_check(L, 1);
+	lua_pushfstring(L, "ModbusSubscription<%s@%d+%d unit %d>",
+		lmb_table_names[sub->table], sub->addr, sub->count, sub->unit);
+	return 1;
+}
+
+static const struct luaL_Reg sub_M[] = {
+	{"poll",		sub_poll},
+	{"reset",		sub_reset},
+	{"__gc",		sub_gc},
+	{"__tostring",		sub_tostring},
+	{NULL, NULL}
+};
+
+/** Scheduler.
+ * Runs poll jobs at fixed rates, from a hierarchical timer wheel.
+ * Jobs are rescheduled from when they were due, not when they ran, so
+ * they don't drift.  Jobs without an explicit phase are spread over their
+ * interval, so jobs on the same bus don't all fall due at once.  Due jobs
+ * run highest priority first, and results come back in batches from
+ * @{sched:run}.
+ * @section scheduler
+ */
+
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_LEVELS	4
+
+typedef struct lmb_job {
+	/* wheel slot or ready list links */
+	struct lmb_job *next;
+	struct lmb_job **pprev;
+	int id;
+	int priority;
+	/* monotonic microseconds */
+	uint64_t due;
+	uint64_t interval;
+	int ctx_ref;
+	ctx_t *ctx;
+	/* a subscription to poll, or a plain range to read */
+	int sub_ref;
+	lmb_sub_t *sub;
+	enum lmb_table table;
+	int unit;
+	int addr;
+	int count;
+	/* stats */
+	uint32_t runs;
+	uint32_t errors;
+	uint32_t overruns;
+	uint64_t late_max;
+	uint64_t late_total;
+	uint16_t vals[];
+} lmb_job_t;
+
+typedef struct {
+	uint64_t tick_us;
+	uint64_t epoch;
+	/* last tick processed */
+	uint64_t cur;
+	lmb_job_t *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+	/* due jobs, in the order to run them */
+	lmb_job_t *ready;
+	/* by id - 1, NULL once removed */
+	lmb_job_t **jobs;
+	int njobs;
+} lmb_sched_t;
+
+static lmb_sched_t *sched_check(lua_State *L, int i)
+{
+	return (lmb_sched_t *) luaL_checkudata(L, i, MODBUS_META_SCHED);
+}
+
+static void job_link(lmb_job_t **head, lmb_job_t *job)
+{
+	job->next = *head;
+	job->pprev = head;
+	if (*head) {
+		(*head)->pprev = &job->next;
+	}
+	*head = job;
+}
+
+static void job_unlink(lmb_job_t *job)
+{
+	if (job->pprev) {
+		*job->pprev = job->next;
+		if (job->next) {
+			job->next->pprev = job->pprev;
+		}
+	}
+	job->next = NULL;
+	job->pprev = NULL;
+}
+
+static void sched_make_ready(lmb_sched_t *s, lmb_job_t *job)
+{
+	lmb_job_t **pos = &s->ready;
+	while (*pos && ((*pos)->priority > job->priority ||
+		((*pos)->priority == job->priority && (*pos)->due <= job->due))) {
+		pos = &(*pos)->next;
+	}
+	job_link(pos, job);
+}
+
+static void sched_insert(lmb_sched_t *s, lmb_job_t *job)
+{
+	/* round up, jobs may run late by a tick, but never early */
+	uint64_t t = job->due > s->epoch ? (job->due - s->epoch + s->tick_us - 1) / s->tick_us : 0;
+
+	if (t <= s->cur) {
+		sched_make_ready(s, job);
+		return;
+	}
+	uint64_t delta = t - s->cur;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) {
+		level++;
+	}
+	if (delta >= (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) {
+		/* beyond the wheel, park it in the furthest slot and look again then */
+		t = s->cur + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	}
+	int slot = (t >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+	job_link(&s->wheel[level][slot], job);
+}
+
+/* Moves a slot's jobs down a level, once the lower level is about to reach them */
+static void sched_cascade(lmb_sched_t *s, int level)
+{
+	int slot = (s->cur >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+	lmb_job_t *job = s->wheel[level][slot];
+
+	if (slot == 0 && level < WHEEL_LEVELS - 1) {
+		sched_cascade(s, level + 1);
+	}
+	s->wheel[level][slot] = NULL;
+	while (job) {
+		lmb_job_t *next = job->next;
+		job->next = NULL;
+		job->pprev = NULL;
+		sched_insert(s, job);
+		job = next;
+	}
+}
+
+/* Processes every tick up to now, making due jobs ready */
+static void sched_advance(lmb_sched_t *s, uint64_t now)
+{
+	uint64_t now_tick = now > s->epoch ? (now - s->epoch) / s->tick_us : 0;
+
+	while (s->cur < now_tick) {
+		s->cur++;
+		if ((s->cur & (WHEEL_SIZE - 1)) == 0) {
+			sched_cascade(s, 1);
+		}
+		lmb_job_t *job = s->wheel[0][s->cur & (WHEEL_SIZE - 1)];
+		s->wheel[0][s->cur & (WHEEL_SIZE - 1)] = NULL;
+		while (job) {
+			lmb_job_t *next = job->next;
+			job->next = NULL;
+			job->pprev = NULL;
+			sched_insert(s, job);
+			job = next;
+		}
+	}
+}
+
+/*
+ * When anything next needs doing.  Only the lowest level is searched,
+ * so idle schedulers wake once per lap of it, to cascade.
+ */
+static uint64_t sched_next_wake(lmb_sched_t *s)
+{
+	uint64_t t = s->cur + 1;
+	while (!s->wheel[0][t & (WHEEL_SIZE - 1)] && (t & (WHEEL_SIZE - 1)) != 0) {
+		t++;
+	}
+	return s->epoch + t * s->tick_us;
+}
+
+
+static void job_free(lua_State *L, lmb_job_t *job)
+{
+	job_unlink(job);
+	luaL_unref(L, LUA_REGISTRYINDEX, job->ctx_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, job->sub_ref);
+	free(job);
+}
+
+/**
+ * Create a scheduler.
+ * @function new_scheduler
+ * @param[opt] opts table with tick, the timer resolution in microseconds,
+ *  default 1000
+ * @return a scheduler
+ * @usage
+ *  local sch = mb.new_scheduler()
+ *  sch:add{ctx=dev, table="registers", addr=0, count=20, interval=100000, priority=1}
+ *  sch:add{sub=dev:subscribe{table="registers", addr=0x200, count=40}, interval=1000000}
+ *  while true do
+ *  	for _, r in ipairs(sch:run()) do ... end
+ *  end
+ */
+static int libmodbus_new_scheduler(lua_State *L)
+{
+	lua_Number tick = 1000;
+
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		lua_getfield(L, 1, "tick");
+		tick = luaL_optnumber(L, -1, tick);
+		lua_pop(L, 1);
+	}
+	if (tick < 1 || tick > 1000000) {
+		return luaL_argerror(L, 1, "tick must be between 1us and 1s");
+	}
+	lmb_sched_t *s = lua_newuserdata(L, sizeof(*s));
+	memset(s, 0, sizeof(*s));
+	s->tick_us = tick;
+	s->epoch = lmb_now_us();
+	luaL_getmetatable(L, MODBUS_META_SCHED);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/* The k-th point of a low discrepancy sequence in [0, 1), 0, 1/2, 1/4, 3/4, ... */
+static lua_Number spread(unsigned k)
+{
+	lua_Number v = 0, f = 0.5;
+	for (; k; k >>= 1, f /= 2) {
+		if (k & 1) {
+			v += f;
+		}
+	}
+	return v;
+}
+
+/**
+ * Add a job.
+ * A job either polls a subscription, or reads a plain range.
+ * Each run may take at most the job's interval.
+ * @function sched:add
+ * @param job table with fields
+ *  <ul>
+ *  <li>sub a subscription, from @{ctx:subscribe}, or</li>
+ *  <li>ctx, table, addr, count and optionally unit, as for @{ctx:cache_add}</li>
+ *  <li>interval microseconds between runs</li>
+ *  <li>phase (optional) microseconds into the interval to run at,
+ *  otherwise spread out from other jobs on the same context</li>
+ *  <li>priority (optional) higher runs first when due together, default 0</li>
+ *  </ul>
+ * @return job id
+ */
+static int sched_add(lua_State *L)
+{
+	lmb_sched_t *s = sched_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lmb_job_t tmpl = { .ctx_ref = LUA_NOREF, .sub_ref = LUA_NOREF };
+
+	lua_getfield(L, 2, "interval");
+	lua_Number interval = luaL_checknumber(L, -1);
+	lua_getfield(L, 2, "priority");
+	tmpl.priority = luaL_optinteger(L, -1, 0);
+	lua_getfield(L, 2, "sub");
+	if (!lua_isnil(L, -1)) {
+		tmpl.sub = luaL_checkudata(L, -1, MODBUS_META_SUB);
+		tmpl.ctx = tmpl.sub->ctx;
+	} else {
+		lua_getfield(L, 2, "ctx");
+		tmpl.ctx = ctx_check(L, -1);
+		lua_getfield(L, 2, "table");
+		tmpl.table = luaL_checkoption(L, -1, NULL, lmb_table_names);
+		lua_getfield(L, 2, "addr");
+		tmpl.addr = luaL_checknumber(L, -1);
+		lua_getfield(L, 2, "count");
+		tmpl.count = luaL_checknumber(L, -1);
+		lua_getfield(L, 2, "unit");
+		tmpl.unit = luaL_optinteger(L, -1, tmpl.ctx->slave);
+		lua_pop(L, 5);
+		if (tmpl.addr < 0 || tmpl.addr > 0xffff || tmpl.count < 1 || tmpl.count > 0x10000 - tmpl.addr) {
+			return luaL_argerror(L, 2, "range out of bounds");
+		}
+		if (tmpl.unit < 0 || tmpl.unit > 0xff) {
+			return luaL_argerror(L, 2, "unit required, or set_slave first");
+		}
+	}
+	if (interval < s->tick_us || interval > 86400e6) {
+		return luaL_argerror(L, 2, "interval must be between one tick and a day");
+	}
+	tmpl.interval = interval;
+
+	lua_getfield(L, 2, "phase");
+	lua_Number phase;
+	if (lua_isnil(L, -1)) {
+		unsigned k = 0;
+		for (int i = 0; i < s->njobs; i++) {
+			k += s->jobs[i] && s->jobs[i]->ctx == tmpl.ctx;
+		}
+		phase = spread(k) * interval;
+	} else {
+		phase = luaL_checknumber(L, -1);
+		if (phase < 0 || phase >= interval) {
+			return luaL_argerror(L, 2, "phase must be within the interval");
+		}
+	}
+
+	lmb_job_t **jobs = lmb_realloc(s->jobs, (s->njobs + 1) * sizeof(*jobs));
+	if (!jobs) {
+		return luaL_error(L, "out of memory");
+	}
+	s->jobs = jobs;
+	lmb_job_t *job = lmb_malloc(sizeof(*job) + tmpl.count * sizeof(uint16_t));
+	if (!job) {
+		return luaL_error(L, "out of memory");
+	}
+	*job = tmpl;
+	job->id = ++s->njobs;
+	s->jobs[job->id - 1] = job;
+
+	/* first run at the next time the phase comes around */
+	uint64_t now = lmb_now_us();
+	job->due = s->epoch + (uint64_t)phase;
+	if (job->due < now) {
+		job->due += ((now - job->due) / job->interval + 1) * job->interval;
+	}
+
+	if (job->sub) {
+		lua_getfield(L, 2, "sub");
+		job->sub_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		/* the subscription keeps its context */
+	} else {
+		lua_getfield(L, 2, "ctx");
+		job->ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	sched_insert(s, job);
+	lua_pushinteger(L, job->id);
+	return 1;
+}
+
+/**
+ * Remove a job.
+ * @function sched:remove
+ * @param id as returned by @{sched:add}
+ */
+static int sched_remove(lua_State *L)
+{
+	lmb_sched_t *s = sched_check(L, 1);
+	int id = luaL_checkinteger(L, 2);
+
+	if (id >= 1 && id <= s->njobs && s->jobs[id - 1]) {
+		job_free(L, s->jobs[id - 1]);
+		s->jobs[id - 1] = NULL;
+	}
+	return 0;
+}
+
+/* Runs a job, leaving its result table on the stack */
+static void sched_run_job(lua_State *L, lmb_sched_t *s, lmb_job_t *job)
+{
+	uint64_t start = lmb_now_us();
+	uint64_t late = start > job->due ? start - job->due : 0;
+	/* a run can't take longer than the job's period */
+	lmb_deadline_t dl = { .at = start + job->interval };
+	ctx_t *ctx = job->ctx;
+
+	job->runs++;
+	job->late_total += late;
+	if (late > job->late_max) {
+		job->late_max = late;
+	}
+
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, job->id);
+	lua_setfield(L, -2, "id");
+	lua_pushnumber(L, job->due);
+	lua_setfield(L, -2, "due");
+	lua_pushnumber(L, start);
+	lua_setfield(L, -2, "started");
+
+	if (!ctx->modbus) {
+		job->errors++;
+		lua_pushliteral(L, "context was destroyed");
+		lua_setfield(L, -2, "err");
+	} else if (job->sub) {
+		if (sub_read(L, job->sub, &dl) == 1) {
+			lua_setfield(L, -2, "values");
+		} else {
+			job->errors++;
+			lua_setfield(L, -3, "err");
+			lua_pop(L, 1);
+		}
+	} else {
+		ctx_lock(ctx);
+		int prev = ctx_unit_switch(ctx, job->unit);
+		int rc = ctx->slave == job->unit ? xfer_read_buf(ctx, job->table, job->addr, job->count, job->vals, &dl) : -1;
+		int err = errno;
+		ctx_unit_restore(ctx, prev);
+		ctx_unlock(ctx);
+		errno = err;
+		if (rc == job->count) {
+			lua_createtable(L, job->count, 0);
+			for (int i = 0; i < job->count; i++) {
+				lua_pushnumber(L, job->vals[i]);
+				lua_rawseti(L, -2, i + 1);
+			}
+			lua_setfield(L, -2, "values");
+		} else {
+			job->errors++;
+			lua_pushstring(L, modbus_strerror(errno));
+			lua_setfield(L, -2, "err");
+		}
+	}
+
+	/* reschedule from when it was due, skipping any periods missed */
+	uint64_t now = lmb_now_us();
+	job->due += job->interval;
+	if (job->due <= now) {
+		uint64_t missed = (now - job->due) / job->interval + 1;
+		job->overruns += missed;
+		job->due += missed * job->interval;
+	}
+	sched_insert(s, job);
+}
+
+/**
+ * Run due jobs, waiting for them as needed.
+ * Returns as soon as one or more jobs have run, with the results of all
+ * that were due by then, or when the timeout runs out.
+ * @function sched:run
+ * @param[opt] timeout microseconds to wait at most, default forever
+ * @return array of results, each a table with id, due and started times,
+ *  and either values, or err.  Subscription jobs return the changes, as per
+ *  @{sub:poll}, range jobs every value.
+ */
+static int sched_run(lua_State *L)
+{
+	lmb_sched_t *s = sched_check(L, 1);
+	uint64_t until = UINT64_MAX;
+	if (!lua_isnoneornil(L, 2)) {
+		lua_Number timeout = luaL_checknumber(L, 2);
+		if (timeout < 0) {
+			return luaL_argerror(L, 2, "timeout can't be negative");
+		}
+		if (timeout < 1e18) {
+			until = lmb_now_us() + (uint64_t)timeout;
+		}
+	}
+	int n = 0;
+
+	lua_newtable(L);
+	for (;;) {
+		uint64_t now = lmb_now_us();
+		sched_advance(s, now);
+		while (s->ready) {
+			lmb_job_t *job = s->ready;
+			job_unlink(job);
+			sched_run_job(L, s, job);
+			lua_rawseti(L, -2, ++n);
+			/* anything that fell due meanwhile goes in this batch too */
+			sched_advance(s, lmb_now_us());
+		}
+		now = lmb_now_us();
+		if (n > 0 || now >= until) {
+			break;
+		}
+		bool any = false;
+		for (int i = 0; i < s->njobs && !any; i++) {
+			any = s->jobs[i] != NULL;
+		}
+		if (!any) {
+			break;
+		}
+		uint64_t wake = sched_next_wake(s);
+		if (wake > until) {
+			wake = until;
+		}
+		if (wake > now) {
+			lmb_sleep_us(wake - now);
+		}
+	}
+	return 1;
+}
+
+/**
+ * Timing statistics.
+ * @function sched:stats
+ * @return table keyed by job id, of runs, errors, overruns (periods
+ *  skipped because the job was still running, or late) and late_max and
+ *  late_avg, how late jobs started in microseconds
+ */
+static int sched_stats(lua_State *L)
+{
+	lmb_sched_t *s = sched_check(L, 1);
+
+	lua_newtable(L);
+	for (int i = 0; i < s->njobs; i++) {
+		lmb_job_t *job = s->jobs[i];
+		if (!job) {
+			continue;
+		}
+		lua_createtable(L, 0, 5);
+		lua_pushnumber(L, job->runs);
+		lua_setfield(L, -2, "runs");
+		lua_pushnumber(L, job->errors);
+		lua_setfield(L, -2, "errors");
+		lua_pushnumber(L, job->overruns);
+		lua_setfield(L, -2, "overruns");
+		lua_pushnumber(L, job->late_max);
+		lua_setfield(L, -2, "late_max");
+		lua_pushnumber(L, job->runs ? job->late_total / job->runs : 0);
+		lua_setfield(L, -2, "late_avg");
+		lua_rawseti(L, -2, job->id);
+	}
+	return 1;
+}
+
+static int sched_gc(lua_State *L)
+{
+	lmb_sched_t *s = sched_check(L, 1);
+
+	for (int i = 0; i < s->njobs; i++) {
+		if (s->jobs[i]) {
+			job_free(L, s->jobs[i]);
+		}
+	}
+	free(s->jobs);
+	s->jobs = NULL;
+	s->njobs = 0;
+	return 0;
+}
+
+static const struct luaL_Reg sched_M[] = {
+	{"add",			sched_add},
+	{"remove",		sched_remove},
+	{"run",			sched_run},
+	{"stats",		sched_stats},
+	{"__gc",		sched_gc},
+	{NULL, NULL}
+};
+
+/** Arbiter.
+ * Shares one context, typically a serial line, between several users.
+ * Requests are queued by priority, and run one transaction at a time,
+ * so an urgent request waits at most for the transaction on the wire,
+ * even if a large, split, read was queued before it.
+ * @section arbiter
+ */
+
+static const char *const arb_class_names[] = {
+	"trend", "alarm", "control", NULL
+};
+
+typedef struct lmb_arb_req {
+	/* finished requests are kept for reuse, rather than freed */
+	struct lmb_arb_req *next_spare;
+	int cap;
+	int id;
+	int priority;
+	enum lmb_table table;
+	bool write;
+	int unit;
+	int addr;
+	int count;
+	int done;
+	lmb_deadline_t dl;
+	uint64_t queued;
+	uint16_t vals[];
+} lmb_arb_req_t;
+
+typedef struct {
+	int ctx_ref;
+	ctx_t *ctx;
+	uint32_t gap_us;
+	/* when the bus last went quiet */
+	uint64_t last_end;
+	int next_id;
+	lmb_arb_req_t **queue;
+	int len;
+	int cap;
+	lmb_arb_req_t *spare;
+	/* worst wait from queueing to first transaction, per class */
+	uint64_t wait_max[3];
+	uint32_t transactions;
+} lmb_arb_t;
+
+static lmb_arb_t *arb_check(lua_State *L, int i)
+{
+	return (lmb_arb_t *) luaL_checkudata(L, i, MODBUS_META_ARB);
+}
+
+/**
+ * Create an arbiter for a context.
+ * All traffic on the context should then go through the arbiter.
+ * @function ctx:new_arbiter
+ * @param[opt] opts table with gap, the idle time between transactions
+ *  in microseconds.  For RTU contexts, this defaults to 3.5 character
+ *  times plus the RTS delay if RTS control is enabled, and 0 for TCP.
+ * @return an arbiter
+ * @usage
+ *  local arb = rtu:new_arbiter()
+ *  arb:submit{table="registers", addr=0, count=2000, unit=3, priority="trend"}
+ *  arb:submit{table="registers", values={1}, addr=0x100, unit=7, priority="control"}
+ *  for _, r in ipairs(arb:run(20000)) do ... end
+ */
+static int ctx_new_arbiter(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Number gap = -1;
+
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "gap");
+		gap = luaL_optnumber(L, -1, -1);
+		lua_pop(L, 1);
+	}
+	if (gap < 0) {
+		gap = 0;
+		if (ctx->is_rtu) {
+			gap = rtu_t35_us(ctx);
+			if (modbus_rtu_get_rts(ctx->modbus) != MODBUS_RTU_RTS_NONE) {
+				gap += modbus_rtu_get_rts_delay(ctx->modbus);
+			}
+		}
+	}
+
+	lmb_arb_t *arb = lua_newuserdata(L, sizeof(*arb));
+	memset(arb, 0, sizeof(*arb));
+	arb->ctx = ctx;
+	arb->ctx_ref = LUA_NOREF;
+	arb->gap_us = gap;
+	luaL_getmetatable(L, MODBUS_META_ARB);
+	lua_setmetatable(L, -2);
+
+	lua_pushvalue(L, 1);
+	arb->ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+/**
+ * Queue a read or write.
+ * @function arb:submit
+ * @param req table with fields
+ *  <ul>
+ *  <li>table one of "bits", "input_bits", "registers" or "input_registers"</li>
+ *  <li>addr</li>
+ *  <li>count to read, or values, an array to write</li>
+ *  <li>unit (optional) defaults to the context's current slave</li>
+ *  <li>priority (optional) "control", "alarm" or "trend" (the default),
+ *  or a number, higher first.  The classes are 2, 1 and 0.</li>
+ *  <li>deadline (optional) absolute time, from @{monotonic}, the request
+ *  fails if it can't complete by then, including time spent queued</li>
+ *  </ul>
+ * @return request id
+ */
+static int arb_submit(lua_State *L)
+{
+	lmb_arb_t *arb = arb_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lmb_arb_req_t tmpl = { 0 };
+
+	lua_getfield(L, 2, "table");
+	tmpl.table = luaL_checkoption(L, -1, NULL, lmb_table_names);
+	lua_getfield(L, 2, "addr");
+	tmpl.addr = luaL_checknumber(L, -1);
+	lua_getfield(L, 2, "unit");
+	tmpl.unit = luaL_optinteger(L, -1, arb->ctx->slave);
+	lua_getfield(L, 2, "priority");
+	if (lua_type(L, -1) == LUA_TNUMBER) {
+		tmpl.priority = lua_tonumber(L, -1);
+	} else {
+		tmpl.priority = luaL_checkoption(L, -1, "trend", arb_class_names);
+	}
+	deadline_field(L, 2, &tmpl.dl);
+	lua_pop(L, 4);
+
+	lua_getfield(L, 2, "values");
+	tmpl.write = !lua_isnil(L, -1);
+	if (tmpl.write) {
+		luaL_checktype(L, -1, LUA_TTABLE);
+		if (tmpl.table == LMB_INPUT_BITS || tmpl.table == LMB_INPUT_REGISTERS) {
+			return luaL_argerror(L, 2, "input tables are read only");
+		}
+		tmpl.count = lua_rawlen(L, -1);
+	} else {
+		lua_getfield(L, 2, "count");
+		tmpl.count = luaL_checknumber(L, -1);
+		lua_pop(L, 1);
+	}
+	if (tmpl.addr < 0 || tmpl.addr > 0xffff || tmpl.count < 1 || tmpl.count > 0x10000 - tmpl.addr) {
+		return luaL_argerror(L, 2, "range out of bounds");
+	}
+	if (tmpl.unit < 0 || tmpl.unit > 0xff) {
+		return luaL_argerror(L, 2, "unit required, or set_slave first");
+	}
+
+	if (arb->len == arb->cap) {
+		int cap = arb->cap ? arb->cap * 2 : 8;
+		lmb_arb_req_t **q = lmb_realloc(arb->queue, cap * sizeof(*q));
+		if (!q) {
+			return luaL_error(L, "out of memory");
+		}
+		arb->queue = q;
+		arb->cap = cap;
+	}
+	/* the smallest spare that fits, so big ones stay for big requests */
+	lmb_arb_req_t **sp = NULL;
+	for (lmb_arb_req_t **p = &arb->spare; *p; p = &(*p)->next_spare) {
+		if ((*p)->cap >= tmpl.count && (!sp || (*p)->cap < (*sp)->cap)) {
+			sp = p;
+		}
+	}
+	lmb_arb_req_t *req = sp ? *sp : NULL;
+	if (req) {
+		*sp = req->next_spare;
+		tmpl.cap = req->cap;
+	} else {
+		req = lmb_malloc(sizeof(*req) + tmpl.count * sizeof(uint16_t));
+		if (!req) {
+			return luaL_error(L, "out of memory");
+		}
+		tmpl.cap = tmpl.count;
+	}
+	*req = tmpl;
+	if (req->write) {
+		for (int i = 0; i < req->count; i++) {
+			lua_rawgeti(L, -1, i + 1);
+			if (lua_type(L, -1) == LUA_TBOOLEAN) {
+				req->vals[i] = lua_toboolean(L, -1);
+			} else if (lua_type(L, -1) == LUA_TNUMBER) {
+				lua_Number n = lua_tonumber(L, -1);
+				req->vals[i] = req->table == LMB_BITS ? n != 0 : (uint16_t)(int16_t)n;
+			} else {
+				req->next_spare = arb->spare;
+				arb->spare = req;
+				return luaL_argerror(L, 2, "values must be numeric or bool");
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+
+	req->id = ++arb->next_id;
+	req->queued = lmb_now_us();
+	arb->queue[arb->len++] = req;
+	lua_pushinteger(L, req->id);
+	return 1;
+}
+
+/* Removes a request from the queue, keeping the order of the rest */
+static void arb_dequeue(lmb_arb_t *arb, int i)
+{
+	arb->queue[i]->next_spare = arb->spare;
+	arb->spare = arb->queue[i];
+	memmove(&arb->queue[i], &arb->queue[i + 1], (arb->len - i - 1) * sizeof(arb->queue[0]));
+	arb->len--;
+}
+
+/**
+ * Cancel a queued request.
+ * Part of a split request may already have been done.
+ * @function arb:cancel
+ * @param id as returned by @{arb:submit}
+ * @return true if it was still queued
+ */
+static int arb_cancel(lua_State *L)
+{
+	lmb_arb_t *arb = arb_check(L, 1);
+	int id = luaL_checkinteger(L, 2);
+
+	for (int i = 0; i < arb->len; i++) {
+		if (arb->queue[i]->id == id) {
+			arb_dequeue(arb, i);
+			lua_pushboolean(L, true);
+			return 1;
+		}
+	}
+	lua_pushboolean(L, false);
+	return 1;
+}
+
+/* Pushes the result of a finished request */
+static void arb_push_result(lua_State *L, lmb_arb_req_t *req, int rc)
+{
+	lua_createtable(L, 0, 3);
+	lua_pushinteger(L, req->id);
+	lua_setfield(L, -2, "id");
+	if (rc < 0) {
+		lua_pushstring(L, modbus_strerror(errno));
+		lua_setfield(L, -2, "err");
+		lua_pushinteger(L, req->done);
+		lua_setfield(L, -2, "done");
+	} else if (req->write) {
+		lua_pushboolean(L, true);
+		lua_setfield(L, -2, "ok");
+	} else {
+		lua_createtable(L, req->count, 0);
+		for (int i = 0; i < req->count; i++) {
+			lua_pushnumber(L, req->vals[i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_setfield(L, -2, "values");
+	}
+}
+
+/* One transaction of the request, returns -1 on failure */
+static int arb_step(lmb_arb_t *arb, lmb_arb_req_t *req)
+{
+	ctx_t *ctx = arb->ctx;
+	lmb_xfer_t x = { .table = req->table, .write = req->write, .count = req->count,
+		.fc06 = ctx->single_write_fc06, .dl = req->dl };
+	bool bits = req->table == LMB_BITS || req->table == LMB_INPUT_BITS;
+	int per = xfer_limit(ctx, &x);
+	int n = req->count - req->done < per ? req->count - req->done : per;
+	lmb_chunk_t c;
+
+	if (req->write) {
+		for (int i = 0; i < n; i++) {
+			if (bits) {
+				c.bits[i] = req->vals[req->done + i];
+			} else {
+				c.regs[i] = req->vals[req->done + i];
+			}
+		}
+	}
+	ctx_lock(ctx);
+	int prev = ctx_unit_switch(ctx, req->unit);
+	int rc = ctx->slave == req->unit ? xfer_chunk(ctx, &x, req->addr + req->done, n, &c) : -1;
+	int err = errno;
+	ctx_unit_restore(ctx, prev);
+	if (req->write) {
+		cache_invalidate(ctx, req->table, req->addr + req->done, n);
+	}
+	ctx_unlock(ctx);
+	errno = err;
+	if (rc != n) {
+		return -1;
+	}
+	if (!req->write) {
+		for (int i = 0; i < n; i++) {
+			req->vals[req->done + i] = bits ? c.bits[i] : c.regs[i];
+		}
+	}
+	req->done += n;
+	return 0;
+}
+
+/**
+ * Run queued requests.
+ * Each transaction goes to the highest priority request queued at the
+ * time, oldest first within a priority, so requests submitted between
+ * calls overtake lower priority ones already in progress.
+ * @function arb:run
+ * @param[opt] budget microseconds to run for, at least one transaction
+ *  is always attempted.  By default runs until the queue is empty.
+ * @return array of results, for requests that finished, each with id,
+ *  and either values (reads), ok (writes), or err and done, the count
+ *  of values completed
+ */
+static int arb_run(lua_State *L)
+{
+	lmb_arb_t *arb = arb_check(L, 1);
+	uint64_t until = UINT64_MAX;
+	if (!lua_isnoneornil(L, 2)) {
+		lua_Number budget = luaL_checknumber(L, 2);
+		if (budget < 0) {
+			return luaL_argerror(L, 2, "budget can't be negative");
+		}
+		if (budget < 1e18) {
+			until = lmb_now_us() + (uint64_t)budget;
+		}
+	}
+	int n = 0;
+
+	if (!arb->ctx->modbus) {
+		return luaL_error(L, "context was destroyed");
+	}
+	lua_newtable(L);
+	while (arb->len > 0) {
+		int best = 0;
+		for (int i = 1; i < arb->len; i++) {
+			if (arb->queue[i]->priority > arb->queue[best]->priority) {
+				best = i;
+			}
+		}
+		lmb_arb_req_t *req = arb->queue[best];
+
+		uint64_t now = lmb_now_us();
+		if (now < arb->last_end + arb->gap_us) {
+			lmb_sleep_us(arb->last_end + arb->gap_us - now);
+			now = lmb_now_us();
+		}
+		if (req->done == 0) {
+			int cls = req->priority < 0 ? 0 : req->priority > 2 ? 2 : req->priority;
+			if (now - req->queued > arb->wait_max[cls]) {
+				arb->wait_max[cls] = now - req->queued;
+			}
+		}
+		int rc = arb_step(arb, req);
+		arb->transactions++;
+		arb->last_end = lmb_now_us();
+		if (rc < 0 || req->done == req->count) {
+			arb_push_result(L, req, rc);
+			lua_rawseti(L, -2, ++n);
+			arb_dequeue(arb, best);
+		}
+		if (arb->last_end >= until) {
+			break;
+		}
+	}
+	return 1;
+}
+
+/**
+ * @function arb:stats
+ * @return table with queued, the number of requests waiting,
+ *  transactions, the total run, and wait_max, a table of the longest
+ *  wait before a request's first transaction, in microseconds, per class
+ */
+static int arb_stats(lua_State *L)
+{
+	lmb_arb_t *arb = arb_check(L, 1);
+
+	lua_newtable(L);
+	lua_pushinteger(L, arb->len);
+	lua_setfield(L, -2, "queued");
+	lua_pushnumber(L, arb->transactions);
+	lua_setfield(L, -2, "transactions");
+	lua_pushnumber(L, arb->gap_us);
+	lua_setfield(L, -2, "gap");
+	lua_newtable(L);
+	for (int i = 0; i < 3; i++) {
+		lua_pushnumber(L, arb->wait_max[i]);
+		lua_setfield(L, -2, arb_class_names[i]);
+	}
+	lua_setfield(L, -2, "wait_max");
+	return 1;
+}
+
+static int arb_gc(lua_State *L)
+{
+	lmb_arb_t *arb = arb_check(L, 1);
+
+	while (arb->len > 0) {
+		arb_dequeue(arb, arb->len - 1);
+	}
+	free(arb->queue);
+	arb->queue = NULL;
+	arb->cap = 0;
+	while (arb->spare) {
+		lmb_arb_req_t *next = arb->spare->next_spare;
+		free(arb->spare);
+		arb->spare = next;
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, arb->ctx_ref);
+	arb->ctx_ref = LUA_NOREF;
+	return 0;
+}
+
+static const struct luaL_Reg arb_M[] = {
+	{"submit",		arb_submit},
+	{"cancel",		arb_cancel},
+	{"run",			arb_run},
+	{"stats",		arb_stats},
+	{"__gc",		arb_gc},
+	{NULL, NULL}
+};
+
+/** Device profiles.
+ * Field devices often accept less than the protocol allows, or lack
+ * optional function codes.  These can be probed once, saved, and applied
+ * to contexts at startup instead of being rediscovered.
+ * A profile is a plain table, with any of the fields:
+ *
+ *  - read_registers, write_registers: largest accepted requests
+ *  - fc16_single: whether FC16 is accepted for a single register.
+ *    When false, single register writes use FC06 instead.
+ *  - fc22, fc23, fc43: mask write, write and read, and read device identification
+ *  - latency: typical (median) request latency in microseconds
+ *  - latency_max: slowest probe request in microseconds
+ *  - response_timeout, byte_timeout: in microseconds, as probed, twice
+ *    the slowest request and that request's time, each with some headroom
+ *  - write_gap: how many unchanged registers or bits @{write_points} may
+ *    rewrite, from the cache, to merge writes either side of them.
+ *    Never probed, only for devices where rewriting a value is harmless.
+ * @section profiles
+ */
+
+/* Headroom on the slowest probe request for the timeouts in a profile */
+#define LMB_PROBE_MARGIN_US 20000
+
+/* Reads or writes n values under a fresh per request deadline */
+static int probe_xfer(ctx_t *ctx, enum lmb_table table, bool write, int addr, int n, lmb_chunk_t *c, uint32_t timeout)
+{
+	lmb_xfer_t x = { .table = table, .write = write, .count = n };
+	if (timeout) {
+		x.dl.at = lmb_now_us() + timeout;
+	}
+	return xfer_chunk(ctx, &x, addr, n, c);
+}
+
+/*
+ * Finds the largest n in [1, hi] for which try(n) succeeds, assuming
+ * everything smaller would too.  Tries hi first, most devices manage it.
+ * @return the largest good n, or 0 if even 1 fails
+ */
+static int probe_search(ctx_t *ctx, enum lmb_table table, bool write, int addr, int hi, lmb_chunk_t *c, uint32_t timeout)
+{
+	int lo = 0;
+
+	if (write) {
+		/* write back what's there, after reading it */
+		if (probe_xfer(ctx, table, false, addr, hi, c, timeout) != hi) {
+			return 0;
+		}
+	}
+	if (probe_xfer(ctx, table, write, addr, hi, c, timeout) == hi) {
+		return hi;
+	}
+	/* invariant: lo works (or is 0), hi doesn't */
+	while (hi - lo > 1) {
+		int mid = lo + (hi - lo) / 2;
+		if (probe_xfer(ctx, table, write, addr, mid, c, timeout) == mid) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Classifies the outcome of a function code probe.
+ * Pushes true if the device understood the request, false if it refused the
+ * function, or silently ignored it, and nil if we can't tell.
+ */
+static void probe_push_fc(lua_State *L, int rc)
+{
+	if (rc >= 0) {
+		lua_pushboolean(L, true);
+	} else if (errno == EMBXILFUN || errno == ETIMEDOUT) {
+		lua_pushboolean(L, false);
+	} else if (errno > MODBUS_ENOBASE && errno < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX) {
+		/* any other exception means it knew what we asked for */
+		lua_pushboolean(L, true);
+	} else {
+		lua_pushnil(L);
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Probe what the device can do.
+ * Finds the largest read (and optionally write) request that succeeds at
+ * the given address, which function codes are supported and how quickly
+ * the device responds.  Write probes only write back values just read,
+ * and FC22 uses a mask that leaves the register unchanged, but they are
+ * still writes, so are only done on request.
+ * @function ctx:probe_capabilities
+ * @param opts table of options
+ *  <ul>
+ *  <li>addr (required) the register to probe at, subsequent registers must be readable too</li>
+ *  <li>input true to probe input registers instead of holding registers</li>
+ *  <li>write true to also probe write sizes and FC16, FC22 and FC23</li>
+ *  <li>samples number of requests to time, defaults to 5</li>
+ *  <li>timeout microseconds to wait for each probe, defaults to the response timeout</li>
+ *  </ul>
+ * @return[1] a profile table, see @{profiles}
+ * @return[2] nil
+ * @return[2] error message, if not even a single register could be read
+ * @usage
+ *  local p = assert(dev:probe_capabilities{addr=0x2000, timeout=200000})
+ *  dev:apply_profile(p)
+ */
+static int ctx_probe_capabilities(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	lua_getfield(L, 2, "addr");
+	int addr = luaL_checknumber(L, -1);
+	lua_getfield(L, 2, "input");
+	enum lmb_table table = lua_toboolean(L, -1) ? LMB_INPUT_REGISTERS : LMB_REGISTERS;
+	lua_getfield(L, 2, "write");
+	bool write = lua_toboolean(L, -1) && table == LMB_REGISTERS;
+	lua_getfield(L, 2, "samples");
+	int samples = luaL_optinteger(L, -1, 5);
+	lua_getfield(L, 2, "timeout");
+	lua_Number timeout_opt = luaL_optnumber(L, -1, 0);
+	lua_pop(L, 5);
+
+	if (addr < 0 || addr > 0xffff) {
+		return luaL_argerror(L, 2, "addr out of range");
+	}
+	if (timeout_opt < 0 || timeout_opt > UINT32_MAX) {
+		return luaL_argerror(L, 2, "timeout can't be negative");
+	}
+	uint32_t timeout = timeout_opt;
+	if (samples < 1 || samples > 100) {
+		return luaL_argerror(L, 2, "samples must be between 1 and 100");
+	}
+
+	lmb_chunk_t c;
+	int room = 0x10000 - addr;
+	int max_read = probe_search(ctx, table, false, addr,
+		room < MODBUS_MAX_READ_REGISTERS ? room : MODBUS_MAX_READ_REGISTERS, &c, timeout);
+	if (max_read == 0) {
+		/* one register at the address should always work */
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+
+	lua_newtable(L);
+	lua_pushinteger(L, max_read);
+	lua_setfield(L, -2, "read_registers");
+
+	/* time single register reads */
+	uint64_t lat[100];
+	int good = 0;
+	for (int i = 0; i < samples; i++) {
+		uint64_t t0 = lmb_now_us();
+		if (probe_xfer(ctx, table, false, addr, 1, &c, timeout) == 1) {
+			lat[good++] = lmb_now_us() - t0;
+		}
+	}
+	if (good) {
+		qsort(lat, good, sizeof(lat[0]), cmp_u64);
+		lua_pushinteger(L, lat[good / 2]);
+		lua_setfield(L, -2, "latency");
+		lua_pushinteger(L, lat[good - 1]);
+		lua_setfield(L, -2, "latency_max");
+		/* a gap within a response is never longer than the whole exchange */
+		lua_pushinteger(L, 2 * lat[good - 1] + LMB_PROBE_MARGIN_US);
+		lua_setfield(L, -2, "response_timeout");
+		lua_pushinteger(L, lat[good - 1] + LMB_PROBE_MARGIN_US);
+		lua_setfield(L, -2, "byte_timeout");
+	}
+
+	if (write) {
+		int hi = max_read < MODBUS_MAX_WRITE_REGISTERS ? max_read : MODBUS_MAX_WRITE_REGISTERS;
+		int max_write = probe_search(ctx, LMB_REGISTERS, true, addr, hi, &c, timeout);
+		lua_pushinteger(L, max_write);
+		lua_setfield(L, -2, "write_registers");
+
+		int rc = probe_xfer(ctx, LMB_REGISTERS, false, addr, 1, &c, timeout);
+		if (rc == 1) {
+			rc = probe_xfer(ctx, LMB_REGISTERS, true, addr, 1, &c, timeout);
+			lua_pushboolean(L, rc == 1);
+			lua_setfield(L, -2, "fc16_single");
+		}
+
+		lmb_deadline_t dl = { 0 };
+		if (timeout) {
+			dl.at = lmb_now_us() + timeout;
+		}
+		/* and with all ones leaves the register untouched */
+		if (deadline_arm(ctx, &dl) == 0) {
+			uint64_t t0 = lmb_now_us();
+			rc = modbus_mask_write_register(ctx->modbus, addr, 0xffff, 0);
+			if (ctx->cap) {
+				const uint8_t pdu[] = { MODBUS_FC_MASK_WRITE_REGISTER, addr >> 8, addr & 0xff, 0xff, 0xff, 0, 0 };
+				cap_exchange(ctx, pdu, sizeof(pdu), pdu, rc == 1 ? (int)sizeof(pdu) : -1, t0);
+			}
+			deadline_disarm(ctx);
+		} else {
+			rc = -1;
+		}
+		probe_push_fc(L, rc);
+		lua_setfield(L, -2, "fc22");
+
+		if (probe_xfer(ctx, LMB_REGISTERS, false, addr, 1, &c, timeout) == 1) {
+			uint16_t v = c.regs[0];
+			if (timeout) {
+				dl.at = lmb_now_us() + timeout;
+			}
+			if (deadline_arm(ctx, &dl) == 0) {
+				uint64_t t0 = lmb_now_us();
+				rc = modbus_write_and_read_registers(ctx->modbus, addr, 1, &v, addr, 1, c.regs);
+				if (ctx->cap) {
+					const uint8_t req[] = { MODBUS_FC_WRITE_AND_READ_REGISTERS, addr >> 8, addr & 0xff, 0, 1,
+						addr >> 8, addr & 0xff, 0, 1, 2, v >> 8, v & 0xff };
+					const uint8_t rsp[] = { MODBUS_FC_WRITE_AND_READ_REGISTERS, 2, c.regs[0] >> 8, c.regs[0] & 0xff };
+					cap_exchange(ctx, req, sizeof(req), rsp, rc == 1 ? (int)sizeof(rsp) : -1, t0);
+				}
+				deadline_disarm(ctx);
+			} else {
+				rc = -1;
+			}
+			probe_push_fc(L, rc);
+			lua_setfield(L, -2, "fc23");
+		}
+	}
+
+	/* read device identification, basic, from the start */
+	const uint8_t req[] = { 0x2b, 0x0e, 0x01, 0x00 };
+	uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+	lmb_deadline_t dl = { 0 };
+	if (timeout) {
+		dl.at = lmb_now_us() + timeout;
+	}
+	probe_push_fc(L, raw_transact(ctx, ctx->slave, req, sizeof(req), rsp, &dl));
+	lua_setfield(L, -2, "fc43");
+
+	return 1;
+}
+
+/**
+ * Apply a profile to this context.
+ * Sets request limits, timeouts, single register write behaviour and
+ * the write_points() gap from whichever fields the profile has.
+ * @function ctx:apply_profile
+ * @param profile a profile table, see @{profiles}
+ */
+static int ctx_apply_profile(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	lua_getfield(L, 2, "read_registers");
+	if (lua_isnumber(L, -1)) {
+		int v = lua_tonumber(L, -1);
+		if (v >= 1 && v <= MODBUS_MAX_READ_REGISTERS) {
+			ctx->max_read_regs = v;
+		}
+	}
+	lua_getfield(L, 2, "write_registers");
+	if (lua_isnumber(L, -1)) {
+		int v = lua_tonumber(L, -1);
+		if (v >= 1 && v <= MODBUS_MAX_WRITE_REGISTERS) {
+			ctx->max_write_regs = v;
+		}
+	}
+	lua_getfield(L, 2, "fc16_single");
+	if (lua_isboolean(L, -1)) {
+		ctx->single_write_fc06 = !lua_toboolean(L, -1);
+	}
+	lua_getfield(L, 2, "response_timeout");
+	if (lua_isnumber(L, -1) && lua_tonumber(L, -1) > 0) {
+		timeout_set_us(ctx->modbus, false, lua_tonumber(L, -1));
+	}
+	lua_getfield(L, 2, "byte_timeout");
+	if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 0) {
+		timeout_set_us(ctx->modbus, true, lua_tonumber(L, -1));
+	}
+	lua_getfield(L, 2, "write_gap");
+	if (lua_isnumber(L, -1)) {
+		int v = lua_tonumber(L, -1);
+		if (v >= 0 && v < MODBUS_MAX_WRITE_REGISTERS) {
+			ctx->write_gap = v;
+		}
+	}
+	lua_pop(L, 6);
+	return 0;
+}
+
+static int file_error(lua_State *L, const char *path)
+{
+	lua_pushnil(L);
+	lua_pushfstring(L, "%s: %s", path, strerror(errno));
+	return 2;
+}
+
+/* profile keys and whether they are booleans, in file order */
+static const struct {
+	const char *name;
+	bool boolean;
+} profile_keys[] = {
+	{"read_registers", false},
+	{"write_registers", false},
+	{"fc16_single", true},
+	{"fc22", true},
+	{"fc23", true},
+	{"fc43", true},
+	{"latency", false},
+	{"latency_max", false},
+	{"response_timeout", false},
+	{"byte_timeout", false},
+	{"write_gap", false},
+};
+
+/**
+ * Save profiles to a file.
+ * The format is one line per device, "name key=value ...", so it can be
+ * edited or generated by hand too.
+ * @function save_profiles
+ * @param path the file to write
+ * @param profiles table of profiles, keyed by device name.
+ *  Names may not contain whitespace or "=".
+ * @return true or nil, error message
+ * @usage
+ *  mb.save_profiles("/etc/site/modbus.profiles", {meter12=p})
+ */
+static int libmodbus_save_profiles(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	/* check names first, so we don't leave half a file behind */
+	lua_pushnil(L);
+	while (lua_next(L, 2)) {
+		if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TTABLE) {
+			return luaL_argerror(L, 2, "profiles must be tables keyed by name");
+		}
+		const char *name = lua_tostring(L, -2);
+		if (!*name || strpbrk(name, " \t\r\n=")) {
+			return luaL_argerror(L, 2, "profile names may not contain whitespace or '='");
+		}
+		lua_pop(L, 1);
+	}
+
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		return file_error(L, path);
+	}
+	lua_pushnil(L);
+	while (lua_next(L, 2)) {
+		fputs(lua_tostring(L, -2), f);
+		for (size_t i = 0; i < sizeof(profile_keys) / sizeof(profile_keys[0]); i++) {
+			lua_getfield(L, -1, profile_keys[i].name);
+			if (profile_keys[i].boolean && lua_isboolean(L, -1)) {
+				fprintf(f, " %s=%s", profile_keys[i].name, lua_toboolean(L, -1) ? "true" : "false");
+			} else if (!profile_keys[i].boolean && lua_isnumber(L, -1)) {
+				fprintf(f, " %s=%.0f", profile_keys[i].name, (double)lua_tonumber(L, -1));
+			}
+			lua_pop(L, 1);
+		}
+		fputc('\n', f);
+		lua_pop(L, 1);
+	}
+	if (fclose(f) != 0) {
+		return file_error(L, path);
+	}
+	lua_pushboolean(L, true);
+	return 1;
+}
+
+/**
+ * Load profiles saved with @{save_profiles}.
+ * Unknown keys are ignored, blank lines and lines starting with # are skipped.
+ * @function load_profiles
+ * @param path the file to read
+ * @return table of profiles keyed by device name, or nil, error message
+ */
+static int libmodbus_load_profiles(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	char line[1024];
+
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return file_error(L, path);
+	}
+	lua_newtable(L);
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line;
+		char *end;
+
+		p += strspn(p, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') {
+			continue;
+		}
+		end = p + strcspn(p, " \t\r\n");
+		lua_pushlstring(L, p, end - p);
+		lua_newtable(L);
+		p = end;
+		for (;;) {
+			p += strspn(p, " \t\r\n");
+			if (!*p) {
+				break;
+			}
+			end = p + strcspn(p, " \t\r\n");
+			char *eq = memchr(p, '=', end - p);
+			if (eq) {
+				for (size_t i = 0; i < sizeof(profile_keys) / sizeof(profile_keys[0]); i++) {
+					if (strlen(profile_keys[i].name) != (size_t)(eq - p) ||
+						strncmp(p, profile_keys[i].name, eq - p) != 0) {
+						continue;
+					}
+					if (profile_keys[i].boolean) {
+						lua_pushboolean(L, strncmp(eq + 1, "true", 4) == 0);
+					} else {
+						lua_pushnumber(L, strtod(eq + 1, NULL));
+					}
+					lua_setfield(L, -2, profile_keys[i].name);
+					break;
+				}
+			}
+			p = end;
+		}
+		lua_settable(L, -3);
+	}
+	fclose(f);
+	return 1;
+}
+
+
+/*
+ * Non-blocking connects, many at once.  Each connection can optionally send
+ * a request once connected and wait for a single Modbus/TCP response to it.
+ */
+enum lmb_nb_state {
+	LMB_NB_PENDING,
+	LMB_NB_CONNECTING,
+	LMB_NB_READING,
+	LMB_NB_DONE,
+};
+
+typedef struct {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int fd;
+	int err;
+	enum lmb_nb_state state;
+	bool connected;
+	uint64_t started;
+	uint64_t connect_us;
+	/* optional request to send once connected, and the response to it */
+	const uint8_t *req;
+	int req_len;
+	uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+	int rsp_len;
+	uint64_t rtt_us;
+	/* whether the last wait found it ready */
+	bool ready;
+} lmb_nbconn_t;
+
+static void nb_close(int fd)
+{
+#if defined(WIN32)
+	closesocket(fd);
+#else
+	close(fd);
+#endif
+}
+
+static void nb_finish(lmb_nbconn_t *c, int err)
+{
+	c->state = LMB_NB_DONE;
+	c->err = err;
+	if (err && c->fd >= 0) {
+		nb_close(c->fd);
+		c->fd = -1;
+	}
+}
+
+static void nb_start(lmb_nbconn_t *c, uint64_t now)
+{
+	c->started = now;
+	c->fd = socket(c->addr.ss_family, SOCK_STREAM, 0);
+	if (c->fd < 0) {
+		nb_finish(c, errno);
+		return;
+	}
+#if defined(WIN32)
+	u_long on = 1;
+	ioctlsocket(c->fd, FIONBIO, &on);
+#else
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+#endif
+	if (connect(c->fd, (struct sockaddr *)&c->addr, c->addrlen) < 0) {
+#if defined(WIN32)
+		if (WSAGetLastError() != WSAEWOULDBLOCK) {
+			nb_finish(c, ECONNREFUSED);
+			return;
+		}
+#else
+		if (errno != EINPROGRESS) {
+			nb_finish(c, errno);
+			return;
+		}
+#endif
+	}
+	/* completion, even immediate, is picked up as writable */
+	c->state = LMB_NB_CONNECTING;
+}
+
+static void nb_connected(lmb_nbconn_t *c, uint64_t now)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (char *)&err, &len) < 0) {
+		err = errno;
+	}
+	if (err) {
+		nb_finish(c, err);
+		return;
+	}
+	c->connected = true;
+	c->connect_us = now - c->started;
+	/* back to blocking, as libmodbus expects, and no delays for small frames */
+#if defined(WIN32)
+	u_long off = 0;
+	ioctlsocket(c->fd, FIONBIO, &off);
+#else
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+#endif
+	int on = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+	if (!c->req) {
+		nb_finish(c, 0);
+		return;
+	}
+	c->started = now;
+	if (sock_send_all(c->fd, c->req, c->req_len) < 0) {
+		nb_finish(c, errno);
+		return;
+	}
+	c->state = LMB_NB_READING;
+}
+
+static void nb_readable(lmb_nbconn_t *c, uint64_t now)
+{
+	int want = 7;
+	if (c->rsp_len >= 6) {
+		want = 6 + (c->rsp[4] << 8 | c->rsp[5]);
+		if (want < 8 || want > MODBUS_TCP_MAX_ADU_LENGTH) {
+			nb_finish(c, EMBBADDATA);
+			return;
+		}
+	}
+	int rc = recv(c->fd, (char *)c->rsp + c->rsp_len, want - c->rsp_len, 0);
+	if (rc < 0 && errno == EINTR) {
+		return;
+	}
+	if (rc <= 0) {
+		nb_finish(c, rc == 0 ? ECONNRESET : errno);
+		return;
+	}
+	c->rsp_len += rc;
+	if (c->rsp_len == want && want > 7) {
+		c->rtt_us = now - c->started;
+		nb_finish(c, 0);
+	}
+}
+
+/* how many hosts we set up at a time, and most connects in progress at once */
+#define LMB_SCAN_BATCH 256
+
+/*
+ * Waits up to us for connections in progress to become ready, flagging
+ * them.  Polls where poll is to be had, so descriptors past FD_SETSIZE
+ * are fine.
+ * @return the count ready, or -1 with errno set
+ */
+static int nb_wait(lmb_nbconn_t *c, int first, int next, uint64_t us)
+{
+#if defined(WIN32)
+	fd_set rfds, wfds;
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	for (int i = first; i < next; i++) {
+		if (c[i].state != LMB_NB_DONE) {
+			FD_SET(c[i].fd, c[i].state == LMB_NB_CONNECTING ? &wfds : &rfds);
+		}
+	}
+	struct timeval tv = { .tv_sec = us / 1000000, .tv_usec = us % 1000000 };
+	int rc = select(0, &rfds, &wfds, NULL, &tv);
+	for (int i = first; i < next; i++) {
+		c[i].ready = rc > 0 && c[i].state != LMB_NB_DONE &&
+			FD_ISSET(c[i].fd, c[i].state == LMB_NB_CONNECTING ? &wfds : &rfds);
+	}
+#else
+	struct pollfd pfd[LMB_SCAN_BATCH];
+	int k = 0;
+	for (int i = first; i < next; i++) {
+		if (c[i].state != LMB_NB_DONE) {
+			pfd[k].fd = c[i].fd;
+			pfd[k].events = c[i].state == LMB_NB_CONNECTING ? POLLOUT : POLLIN;
+			k++;
+		}
+	}
+	/* rounded up, so a wait never ends just short of a deadline */
+	int ms = us >= 86400000000ULL ? 86400000 : (int)((us + 999) / 1000);
+	int rc = poll(pfd, k, ms);
+	k = 0;
+	for (int i = first; i < next; i++) {
+		c[i].ready = false;
+		if (c[i].state != LMB_NB_DONE) {
+			/* errors and hangups too, the handlers find out which */
+			c[i].ready = rc > 0 && pfd[k].revents;
+			k++;
+		}
+	}
+#endif
+	return rc;
+}
+
+/*
+ * Runs connections until all are done, with at most concurrency of them in
+ * progress at any time.  Failed connections are closed, successful ones
+ * are left open in fd, for the caller.
+ * @param connect_us how long to wait for each connection
+ * @param response_us how long to wait for each response, if a request is set
+ */
+static void nb_run(lmb_nbconn_t *c, int n, int concurrency, uint64_t connect_us, uint64_t response_us)
+{
+	int first = 0, next = 0;
+
+#if defined(WIN32)
+	/* there, FD_SETSIZE is how many a set holds */
+	if (concurrency > FD_SETSIZE) {
+		concurrency = FD_SETSIZE;
+	}
+#endif
+	for (;;) {
+		uint64_t now = lmb_now_us();
+		int active = 0;
+		for (int i = first; i < next; i++) {
+			active += c[i].state != LMB_NB_DONE;
+		}
+		while (active < concurrency && next < n) {
+			/* some may have failed before even starting */
+			if (c[next].state == LMB_NB_PENDING) {
+				nb_start(&c[next], now);
+				active++;
+			}
+			next++;
+		}
+		while (first < next && c[first].state == LMB_NB_DONE) {
+			first++;
+		}
+		if (first == n) {
+			return;
+		}
+
+		int waiting = 0;
+		uint64_t wake = UINT64_MAX;
+		for (int i = first; i < next; i++) {
+			if (c[i].state == LMB_NB_DONE) {
+				continue;
+			}
+			bool conn = c[i].state == LMB_NB_CONNECTING;
+			uint64_t at = c[i].started + (conn ? connect_us : response_us);
+			if (at < wake) {
+				wake = at;
+			}
+			waiting++;
+		}
+		if (!waiting) {
+			continue;
+		}
+		int rc = nb_wait(c, first, next, wake > now ? wake - now : 0);
+		if (rc < 0 && errno != EINTR) {
+			int err = errno;
+			for (int i = first; i < next; i++) {
+				if (c[i].state != LMB_NB_DONE) {
+					nb_finish(&c[i], err);
+				}
+			}
+			continue;
+		}
+
+		now = lmb_now_us();
+		for (int i = first; i < next; i++) {
+			lmb_nbconn_t *ci = &c[i];
+			if (ci->state == LMB_NB_CONNECTING) {
+				if (ci->ready) {
+					nb_connected(ci, now);
+				} else if (now >= ci->started + connect_us) {
+					nb_finish(ci, ETIMEDOUT);
+				}
+			} else if (ci->state == LMB_NB_READING) {
+				if (ci->ready) {
+					nb_readable(ci, now);
+				} else if (now >= ci->started + response_us) {
+					nb_finish(ci, ETIMEDOUT);
+				}
+			}
+		}
+	}
+}
+
+/* Where a host list is up to, entries can be addresses, names or IPv4 subnets */
+typedef struct {
+	int idx;
+	int entry;
+	int entries;
+	uint32_t next;
+	uint32_t last;
+	const char *port;
+} lmb_hostiter_t;
+
+static void hostiter_init(lua_State *L, lmb_hostiter_t *it, int idx, const char *port)
+{
+	it->idx = idx;
+	it->entry = 0;
+	it->entries = lua_type(L, idx) == LUA_TTABLE ? (int)lua_rawlen(L, idx) : 1;
+	it->next = 1;
+	it->last = 0;
+	it->port = port;
+}
+
+/*
+ * Fills in the next address to try.
+ * @return false when there are no more, raises errors for bad entries
+ */
+static bool hostiter_next(lua_State *L, lmb_hostiter_t *it, lmb_nbconn_t *c)
+{
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+	while (it->next > it->last) {
+		if (it->entry >= it->entries) {
+			return false;
+		}
+		it->entry++;
+		if (lua_type(L, it->idx) == LUA_TTABLE) {
+			lua_rawgeti(L, it->idx, it->entry);
+		} else {
+			lua_pushvalue(L, it->idx);
+		}
+		const char *host = lua_tostring(L, -1);
+		if (!host) {
+			luaL_error(L, "hosts must be strings");
+		}
+		const char *slash = strchr(host, '/');
+		if (slash) {
+			char net[INET_ADDRSTRLEN];
+			struct in_addr in;
+			int bits = atoi(slash + 1);
+			size_t nlen = slash - host;
+			if (nlen >= sizeof(net)) {
+				nlen = sizeof(net) - 1;
+			}
+			memcpy(net, host, nlen);
+			net[nlen] = '\0';
+			if (inet_pton(AF_INET, net, &in) != 1 || bits < 16 || bits > 32) {
+				luaL_error(L, "bad subnet %s, IPv4 /16 to /32 only", host);
+			}
+			uint32_t mask = bits == 32 ? 0xffffffff : ~(0xffffffffu >> bits);
+			it->next = ntohl(in.s_addr) & mask;
+			it->last = it->next | ~mask;
+			if (bits < 31) {
+				/* skip the network and broadcast addresses */
+				it->next++;
+				it->last--;
+			}
+			lua_pop(L, 1);
+			continue;
+		}
+		struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICSERV };
+		struct addrinfo *ai;
+		int rc = getaddrinfo(host, it->port, &hints, &ai);
+		if (rc) {
+			/* unresolvable names are just not there */
+			c->err = EHOSTUNREACH;
+			c->state = LMB_NB_DONE;
+			lua_pop(L, 1);
+			return true;
+		}
+		memcpy(&c->addr, ai->ai_addr, ai->ai_addrlen);
+		c->addrlen = ai->ai_addrlen;
+		freeaddrinfo(ai);
+		lua_pop(L, 1);
+		return true;
+	}
+	struct sockaddr_in *sin = (struct sockaddr_in *)&c->addr;
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(atoi(it->port));
+	sin->sin_addr.s_addr = htonl(it->next++);
+	c->addrlen = sizeof(*sin);
+	/* don't wrap around after 255.255.255.255 */
+	if (it->next == 0) {
+		it->last = 0;
+		it->next = 1;
+	}
+	return true;
+}
+
+static void push_sockaddr(lua_State *L, const lmb_nbconn_t *c)
+{
+	char buf[INET6_ADDRSTRLEN];
+	const void *a = c->addr.ss_family == AF_INET6 ?
+		(const void *)&((const struct sockaddr_in6 *)&c->addr)->sin6_addr :
+		(const void *)&((const struct sockaddr_in *)&c->addr)->sin_addr;
+	if (!inet_ntop(c->addr.ss_family, a, buf, sizeof(buf))) {
+		buf[0] = '\0';
+	}
+	lua_pushstring(L, buf);
+}
+
+/* Sets id or err of the responder table on the top of the stack from a report slave id response */
+static void scan_set_id(lua_State *L, const uint8_t *pdu, int len)
+{
+	if (pdu_check(pdu, len, MODBUS_FC_REPORT_SLAVE_ID) < 0) {
+		lua_pushstring(L, modbus_strerror(errno));
+		lua_setfield(L, -2, "err");
+	} else if (len < 2 || pdu[1] > len - 2) {
+		lua_pushstring(L, modbus_strerror(EMBBADDATA));
+		lua_setfield(L, -2, "err");
+	} else {
+		lua_pushlstring(L, (const char *)&pdu[2], pdu[1]);
+		lua_setfield(L, -2, "id");
+	}
+}
+
+static int scan_hosts(lua_State *L, uint64_t started)
+{
+	lua_getfield(L, 1, "port");
+	const char *port = luaL_optstring(L, -1, "502");
+	lua_getfield(L, 1, "unit");
+	int unit = luaL_optinteger(L, -1, MODBUS_TCP_SLAVE);
+	lua_getfield(L, 1, "timeout");
+	lua_Number timeout = luaL_optnumber(L, -1, 500000);
+	lua_getfield(L, 1, "concurrency");
+	int concurrency = luaL_optinteger(L, -1, 64);
+	lua_pop(L, 3);
+	lua_getfield(L, 1, "hosts");
+	int hidx = lua_gettop(L);
+	if (unit < 0 || unit > 0xff || timeout <= 0 || concurrency < 1) {
+		return luaL_argerror(L, 1, "unit must be 0-255, timeout and concurrency positive");
+	}
+	if (concurrency > LMB_SCAN_BATCH) {
+		concurrency = LMB_SCAN_BATCH;
+	}
+
+	uint8_t req[8] = { 0, 1, 0, 0, 0, 2, unit, MODBUS_FC_REPORT_SLAVE_ID };
+	lmb_nbconn_t *c = lua_newuserdata(L, sizeof(*c) * LMB_SCAN_BATCH);
+	lmb_hostiter_t it;
+	hostiter_init(L, &it, hidx, port);
+	lua_newtable(L);
+	int found = 0, probed = 0;
+	for (;;) {
+		int n = 0;
+		while (n < LMB_SCAN_BATCH && hostiter_next(L, &it, &c[n])) {
+			c[n].req = req;
+			c[n].req_len = sizeof(req);
+			n++;
+		}
+		if (n == 0) {
+			break;
+		}
+		probed += n;
+		nb_run(c, n, concurrency, timeout, timeout);
+		for (int i = 0; i < n; i++) {
+			/* only those that accepted the connection are of interest */
+			if (!c[i].connected) {
+				continue;
+			}
+			lua_newtable(L);
+			push_sockaddr(L, &c[i]);
+			lua_setfield(L, -2, "host");
+			lua_pushnumber(L, c[i].connect_us);
+			lua_setfield(L, -2, "connect");
+			if (c[i].err) {
+				lua_pushstring(L, modbus_strerror(c[i].err));
+				lua_setfield(L, -2, "err");
+			} else {
+				lua_pushnumber(L, c[i].rtt_us);
+				lua_setfield(L, -2, "rtt");
+				scan_set_id(L, &c[i].rsp[7], c[i].rsp_len - 7);
+			}
+			if (c[i].fd >= 0) {
+				nb_close(c[i].fd);
+			}
+			lua_rawseti(L, -2, ++found);
+		}
+	}
+
+	lua_newtable(L);
+	lua_pushinteger(L, probed);
+	lua_setfield(L, -2, "probed");
+	lua_pushnumber(L, lmb_now_us() - started);
+	lua_setfield(L, -2, "elapsed");
+	return 2;
+}
+
+static int scan_units(lua_State *L, uint64_t started)
+{
+	lua_getfield(L, 1, "ctx");
+	ctx_t *ctx = ctx_check(L, -1);
+	lua_getfield(L, 1, "first");
+	int first = luaL_optinteger(L, -1, 1);
+	lua_getfield(L, 1, "last");
+	int last = luaL_optinteger(L, -1, 247);
+	lua_getfield(L, 1, "timeout");
+	lua_Number timeout = luaL_optnumber(L, -1, timeout_get_us(ctx->modbus, false));
+	lua_getfield(L, 1, "min_timeout");
+	lua_Number min_timeout = luaL_optnumber(L, -1, 10000);
+	lua_getfield(L, 1, "factor");
+	lua_Number factor = luaL_optnumber(L, -1, 3);
+	lua_getfield(L, 1, "adaptive");
+	bool adaptive = lua_isnil(L, -1) || lua_toboolean(L, -1);
+	lua_pop(L, 7);
+	if (first < 1 || last > 247 || first > last) {
+		return luaL_argerror(L, 1, "units must be within 1-247");
+	}
+	if (timeout <= 0 || min_timeout <= 0 || factor < 1) {
+		return luaL_argerror(L, 1, "timeouts must be positive, factor at least 1");
+	}
+	if (modbus_get_socket(ctx->modbus) < 0) {
+		errno = EBADF;
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+
+	uint32_t current = timeout;
+	uint32_t ch = ctx->is_rtu ? rtu_char_us(ctx) : 0;
+	const uint8_t req[1] = { MODBUS_FC_REPORT_SLAVE_ID };
+	uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+	bool adapted = false;
+	int found = 0;
+
+	lua_newtable(L);
+	for (int unit = first; unit <= last; unit++) {
+		/* shared contexts get their own timeouts back between probes */
+		ctx_lock(ctx);
+		uint32_t saved = timeout_get_us(ctx->modbus, false);
+		timeout_set_us(ctx->modbus, false, current);
+		uint64_t t0 = lmb_now_us();
+		int len = raw_transact(ctx, unit, req, sizeof(req), rsp, NULL);
+		uint64_t rtt = lmb_now_us() - t0;
+		int err = errno;
+		if (len < 0) {
+			/* a late reply mustn't be taken for the next unit's */
+			modbus_flush(ctx->modbus);
+		}
+		timeout_set_us(ctx->modbus, false, saved);
+		ctx_unlock(ctx);
+		errno = err;
+		if (len < 0 && errno == ETIMEDOUT) {
+			continue;
+		}
+		lua_newtable(L);
+		lua_pushinteger(L, unit);
+		lua_setfield(L, -2, "unit");
+		lua_pushnumber(L, rtt);
+		lua_setfield(L, -2, "rtt");
+		if (len < 0) {
+			/* something answered, but garbled, or a collision */
+			lua_pushstring(L, modbus_strerror(errno));
+			lua_setfield(L, -2, "err");
+		} else {
+			scan_set_id(L, rsp, len);
+		}
+		lua_rawseti(L, -2, ++found);
+
+		if (adaptive && len > 0) {
+			/* the device's own latency, without the frames on the wire */
+			uint64_t wire = (uint64_t)(4 + len + 3) * ch;
+			uint64_t lat = rtt > wire ? rtt - wire : 0;
+			uint64_t t = lat * factor + (ctx->is_rtu ? 4 * ch + rtu_t35_us(ctx) : 0);
+			if (t < min_timeout) {
+				t = min_timeout;
+			}
+			/* only ever grows after the first, slower devices may follow */
+			if (!adapted || t > current) {
+				current = t;
+			}
+			adapted = true;
+		}
+	}
+
+	lua_newtable(L);
+	lua_pushinteger(L, last - first + 1);
+	lua_setfield(L, -2, "probed");
+	lua_pushnumber(L, lmb_now_us() - started);
+	lua_setfield(L, -2, "elapsed");
+	lua_pushnumber(L, current);
+	lua_setfield(L, -2, "timeout");
+	return 2;
+}
+
+/**
+ * Find what answers, on a bus or in a network.
+ * With a context, sweeps its unit ids with report slave id requests.  The
+ * response timeout starts at "timeout", and once a device answers, is cut
+ * down to "factor" times its latency, so silent ids don't cost the full
+ * timeout each.  It only grows again for slower devices that still answer
+ * within it, so turn "adaptive" off for lines with very mixed devices.
+ * <p>With "hosts", connects to each in parallel instead, and sends a report
+ * slave id to those accepting connections.
+ * @function scan
+ * @param opts table of options, either
+ *  <ul>
+ *  <li>ctx an open context, RTU or a TCP gateway</li>
+ *  <li>first, last unit ids to sweep, defaults to 1 and 247</li>
+ *  <li>timeout microseconds, defaults to the context's response timeout</li>
+ *  <li>min_timeout microseconds, lower bound of the adapted timeout, defaults to 10000</li>
+ *  <li>factor multiple of the measured latency to wait, defaults to 3</li>
+ *  <li>adaptive false to keep the timeout fixed</li>
+ *  </ul>
+ *  or
+ *  <ul>
+ *  <li>hosts an address, name or IPv4 subnet ("192.168.1.0/24",
+ *  /16 at most), or an array of them</li>
+ *  <li>port defaults to "502"</li>
+ *  <li>unit to send the report slave id to, defaults to 255</li>
+ *  <li>timeout microseconds, for each connect and response, defaults to 500000</li>
+ *  <li>concurrency connections in progress at once, defaults to 64</li>
+ *  </ul>
+ * @return[1] array of responders, each a table with "unit" or "host" and
+ *  "connect" time, "rtt", and either "id", the raw report slave id data,
+ *  or "err" if it answered, but not usefully
+ * @return[1] table with "probed", "elapsed" and (units only) the final "timeout"
+ * @return[2] nil
+ * @return[2] error message, if the context isn't open
+ * @usage
+ *  local dev = mb.new_rtu("/dev/ttyUSB0", 19200)
+ *  dev:connect()
+ *  for _, r in ipairs(mb.scan{ctx=dev, timeout=200000}) do print(r.unit, r.id) end
+ *  local hosts, stats = mb.scan{hosts="10.1.2.0/24", timeout=300000}
+ */
+static int libmodbus_scan(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	uint64_t started = lmb_now_us();
+
+	lua_getfield(L, 1, "ctx");
+	bool bus = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+	if (bus) {
+		return scan_units(L, started);
+	}
+	lua_getfield(L, 1, "hosts");
+	bool net = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+	if (!net) {
+		return luaL_argerror(L, 1, "either ctx or hosts is required");
+	}
+	return scan_hosts(L, started);
+}
+
+/* A context to connect, and the lookup of its address */
+typedef struct {
+	ctx_t *ctx;
+	int res;
+} lmb_connect_t;
+
+typedef struct {
+	const char *host;
+	const char *service;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int gai_err;
+} lmb_resolved_t;
+
+/* Lookups shared out between threads, each taking the next one left */
+typedef struct {
+	lmb_resolved_t *res;
+	int n;
+	int next;
+	lmb_mutex_t lock;
+} lmb_resolver_t;
+
+/* most threads looking up names at once, the caller's included */
+#define LMB_RESOLVE_THREADS 8
+
+static void *resolve_worker(void *arg)
+{
+	lmb_resolver_t *rs = arg;
+
+	for (;;) {
+		lmb_mutex_lock(&rs->lock);
+		int i = rs->next++;
+		lmb_mutex_unlock(&rs->lock);
+		if (i >= rs->n) {
+			return NULL;
+		}
+		lmb_resolved_t *r = &rs->res[i];
+		struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+		struct addrinfo *ai;
+		r->gai_err = getaddrinfo(r->host, r->service, &hints, &ai);
+		if (!r->gai_err) {
+			memcpy(&r->addr, ai->ai_addr, ai->ai_addrlen);
+			r->addrlen = ai->ai_addrlen;
+			freeaddrinfo(ai);
+		}
+	}
+}
+
+/*
+ * Looks up addresses in parallel, as getaddrinfo blocks, and a name that
+ * doesn't resolve can take seconds to say so.  On Windows they're looked
+ * up one after another.  If threads can't be had, the caller does the
+ * lookups itself.
+ */
+static void resolve_all(lmb_resolved_t *res, int n)
+{
+	lmb_resolver_t rs = { .res = res, .n = n };
+	lmb_mutex_init(&rs.lock);
+#if !defined(WIN32)
+	pthread_t threads[LMB_RESOLVE_THREADS - 1];
+	int started = 0;
+	while (started < LMB_RESOLVE_THREADS - 1 && started < n - 1 &&
+			pthread_create(&threads[started], NULL, resolve_worker, &rs) == 0) {
+		started++;
+	}
+#endif
+	resolve_worker(&rs);
+#if !defined(WIN32)
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+#endif
+	lmb_mutex_destroy(&rs.lock);
+}
+
+/*
+ * Finds the lookup for a TCP context's host and service, adding it if no
+ * context before it shares them, through the cache table at cidx.
+ * @return the index of the lookup in res
+ */
+static int connect_lookup(lua_State *L, int cidx, const ctx_t *ctx, lmb_resolved_t *res, int *nres)
+{
+	lua_pushfstring(L, "%s\n%s", ctx->dev_host, ctx->service);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, cidx);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lmb_resolved_t *r = &res[*nres];
+		memset(r, 0, sizeof(*r));
+		r->host = ctx->dev_host;
+		r->service = ctx->service;
+		lua_pushinteger(L, (*nres)++);
+		lua_pushvalue(L, -1);
+		lua_insert(L, -3);
+		lua_rawset(L, cidx);
+	} else {
+		lua_remove(L, -2);
+	}
+	int i = (int)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return i;
+}
+
+/**
+ * Connect many contexts at once.
+ * TCP contexts are connected in parallel, without blocking, so hosts that
+ * don't answer cost one timeout between them, not one each.  Each host
+ * and service is only looked up once, however many contexts share it,
+ * and up to 8 lookups run at once, on threads of their own.
+ * RTU contexts are connected one after another, as by @{ctx:connect}, and
+ * contexts already connected are left as they are.
+ * @function connect_all
+ * @param contexts array of contexts
+ * @param[opt] opts table of options
+ *  <ul>
+ *  <li>timeout microseconds for each connect, defaults to 2000000</li>
+ *  <li>concurrency connects in progress at once, defaults to 64</li>
+ *  </ul>
+ * @return array with, for each context in turn, true if it's connected,
+ *  or the error message
+ * @return count of contexts connected
+ * @usage
+ *  local devs = {}
+ *  for i, host in ipairs(hosts) do devs[i] = mb.new_tcp_pi(host, "502") end
+ *  local res, n = mb.connect_all(devs, {timeout=1000000})
+ *  for i, r in ipairs(res) do
+ *    if r ~= true then print(hosts[i], r) end
+ *  end
+ */
+static int libmodbus_connect_all(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 2);
+	lua_Number timeout = 2000000;
+	int concurrency = 64;
+	if (!lua_isnil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "timeout");
+		timeout = luaL_optnumber(L, -1, timeout);
+		lua_getfield(L, 2, "concurrency");
+		concurrency = luaL_optinteger(L, -1, concurrency);
+		lua_pop(L, 2);
+	}
+	if (timeout <= 0 || concurrency < 1) {
+		return luaL_argerror(L, 2, "timeout and concurrency must be positive");
+	}
+	if (concurrency > LMB_SCAN_BATCH) {
+		concurrency = LMB_SCAN_BATCH;
+	}
+
+	int n = lua_rawlen(L, 1);
+	lmb_connect_t *jobs = lua_newuserdata(L, n * sizeof(*jobs) + 1);
+	lmb_nbconn_t *c = lua_newuserdata(L, n * sizeof(*c) + 1);
+	lmb_resolved_t *res = lua_newuserdata(L, n * sizeof(*res) + 1);
+	int nres = 0;
+	lua_newtable(L);
+	int cidx = lua_gettop(L);
+	for (int i = 0; i < n; i++) {
+		lua_rawgeti(L, 1, i + 1);
+		jobs[i].ctx = ctx_check(L, -1);
+		jobs[i].res = -1;
+		lua_pop(L, 1);
+	}
+
+	for (int i = 0; i < n; i++) {
+		ctx_t *ctx = jobs[i].ctx;
+		memset(&c[i], 0, sizeof(c[i]));
+		c[i].fd = -1;
+		c[i].state = LMB_NB_DONE;
+		ctx_lock(ctx);
+		if (!ctx->modbus) {
+			c[i].err = EBADF;
+		} else if (modbus_get_socket(ctx->modbus) >= 0) {
+			/* already connected */
+		} else if (ctx->is_rtu) {
+			if (modbus_connect(ctx->modbus) < 0) {
+				c[i].err = errno;
+			}
+		} else if (!ctx->dev_host || !ctx->service) {
+			c[i].err = ENOMEM;
+		} else {
+			c[i].state = LMB_NB_PENDING;
+		}
+		ctx_unlock(ctx);
+		if (c[i].state == LMB_NB_PENDING) {
+			jobs[i].res = connect_lookup(L, cidx, ctx, res, &nres);
+		}
+	}
+
+	resolve_all(res, nres);
+	for (int i = 0; i < n; i++) {
+		if (jobs[i].res < 0) {
+			continue;
+		}
+		const lmb_resolved_t *r = &res[jobs[i].res];
+		if (r->gai_err) {
+			c[i].state = LMB_NB_DONE;
+		} else {
+			memcpy(&c[i].addr, &r->addr, r->addrlen);
+			c[i].addrlen = r->addrlen;
+		}
+	}
+
+	nb_run(c, n, concurrency, timeout, 0);
+
+	int connected = 0;
+	lua_createtable(L, n, 0);
+	for (int i = 0; i < n; i++) {
+		ctx_t *ctx = jobs[i].ctx;
+		if (c[i].fd >= 0) {
+			ctx_lock(ctx);
+			/* someone else may have got there first, on a shared context */
+			if (ctx->modbus && modbus_get_socket(ctx->modbus) < 0) {
+				modbus_set_socket(ctx->modbus, c[i].fd);
+			} else {
+				nb_close(c[i].fd);
+			}
+			ctx_unlock(ctx);
+		}
+		if (jobs[i].res >= 0 && res[jobs[i].res].gai_err) {
+			lua_pushstring(L, gai_strerror(res[jobs[i].res].gai_err));
+		} else if (c[i].err) {
+			lua_pushstring(L, modbus_strerror(c[i].err));
+		} else {
+			lua_pushboolean(L, 1);
+			connected++;
+		}
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushinteger(L, connected);
+	return 2;
+}
+
+/** Gateway.
+ * Fronts RTU lines for Modbus/TCP clients.  Requests are queued per line,
+ * in the order they arrive, and forwarded as soon as the line is free.
+ * All lines and clients are served from a single thread, by waiting on
+ * every socket and serial port at once, so a slow device only holds up
+ * its own line.  Responses go back to the client that asked, with its
+ * own transaction id.
+ *
+ * The gateway answers itself with exception GATEWAY_PATH for units it
+ * has no route to, GATEWAY_TARGET when the device doesn't answer within
+ * the line context's response timeout (or the answer is garbled), and
+ * SLAVE_OR_SERVER_BUSY when the line's queue is full.
+ *
+ * The line contexts should not be used directly while the gateway has
+ * requests in flight on them.
+ * @section gateway
+ */
+
+typedef struct {
+	int client;
+	uint32_t gen;
+	uint8_t hdr[7];
+	uint8_t pdu[MODBUS_MAX_PDU_LENGTH];
+	int len;
+} lmb_gw_req_t;
+
+typedef struct {
+	int fd;
+	/* bumped on close, so responses don't go to a new client in the same slot */
+	uint32_t gen;
+	uint8_t rx[MODBUS_TCP_MAX_ADU_LENGTH];
+	int rx_len;
+} lmb_gw_client_t;
+
+typedef struct {
+	ctx_t *ctx;
+	int ctx_ref;
+	lmb_gw_req_t *queue;
+	int head;
+	int len;
+	bool busy;
+	lmb_gw_req_t cur;
+	uint8_t rx[MODBUS_RTU_MAX_ADU_LENGTH];
+	int rx_len;
+	uint64_t sent;
+	uint64_t last_rx;
+	/* no new request before this, for the interframe gap, or broadcasts */
+	uint64_t ready_at;
+	uint32_t transactions;
+	uint32_t timeouts;
+	uint32_t errors;
+	int queue_max;
+} lmb_gw_line_t;
+
+typedef struct {
+	int listen_fd;
+	int qlen;
+	int nlines;
+	int nclients;
+	uint32_t turnaround_us;
+	int16_t route[256];
+	lmb_gw_line_t *lines;
+	lmb_gw_client_t *clients;
+	uint32_t accepted;
+	uint32_t rejected;
+	uint32_t requests;
+	uint32_t responses;
+	uint32_t path_errors;
+	uint32_t busy_errors;
+} lmb_gw_t;
+
+static lmb_gw_t *gw_check(lua_State *L, int i)
+{
+	return (lmb_gw_t *) luaL_checkudata(L, i, MODBUS_META_GW);
+}
+
+/*
+ * How long an RTU response starting with these bytes is, crc included.
+ * The incremental counterpart of @{rtu_recv_pdu}.
+ * @return the length, 0 if more bytes are needed to tell, or -1 if too long
+ */
+static int rtu_response_length(const uint8_t *adu, int len)
+{
+	int total;
+
+	if (len < 2) {
+		return 0;
+	}
+	int rest = rtu_fixed_response_length(adu[1]);
+	if (rest >= 0) {
+		total = 2 + rest + 2;
+	} else if (adu[1] == 0x18) {
+		if (len < 4) {
+			return 0;
+		}
+		total = 4 + (adu[2] << 8 | adu[3]) + 2;
+	} else if (adu[1] == 0x2b) {
+		if (len < 8) {
+			return 0;
+		}
+		int pos = 8;
+		for (int i = 0; i < adu[7] && pos <= MODBUS_RTU_MAX_ADU_LENGTH; i++) {
+			if (len < pos + 2) {
+				return 0;
+			}
+			pos += 2 + adu[pos + 1];
+		}
+		total = pos + 2;
+	} else {
+		if (len < 3) {
+			return 0;
+		}
+		total = 3 + adu[2] + 2;
+	}
+	return total > MODBUS_RTU_MAX_ADU_LENGTH ? -1 : total;
+}
+
+/*
+ * How long an RTU request starting with these bytes is, crc included.
+ * @return the length, 0 if more bytes are needed to tell, or -1 for
+ * function codes we don't know the framing of
+ */
+static int rtu_request_length(const uint8_t *adu, int len)
+{
+	if (len < 2) {
+		return 0;
+	}
+	switch (adu[1]) {
+	case MODBUS_FC_READ_COILS:
+	case MODBUS_FC_READ_DISCRETE_INPUTS:
+	case MODBUS_FC_READ_HOLDING_REGISTERS:
+	case MODBUS_FC_READ_INPUT_REGISTERS:
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+	case 0x08: /* diagnostics */
+		return 8;
+	case MODBUS_FC_READ_EXCEPTION_STATUS:
+	case 0x0b: /* get comm event counter */
+	case 0x0c: /* get comm event log */
+	case MODBUS_FC_REPORT_SLAVE_ID:
+		return 4;
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		return len < 7 ? 0 : 9 + adu[6];
+	case 0x14: /* read file record */
+	case 0x15: /* write file record */
+		return len < 3 ? 0 : 5 + adu[2];
+	case MODBUS_FC_MASK_WRITE_REGISTER:
+		return 10;
+	case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+		return len < 11 ? 0 : 13 + adu[10];
+	case 0x18: /* read fifo queue */
+		return 6;
+	case 0x2b: /* encapsulated interface */
+		return 7;
+	default:
+		return -1;
+	}
+}
+
+static void gw_client_close(lmb_gw_client_t *c)
+{
+	if (c->fd >= 0) {
+		nb_close(c->fd);
+	}
+	c->fd = -1;
+	c->gen++;
+	c->rx_len = 0;
+}
+
+/* Sends a response pdu back, with the client's own mbap header */
+static void gw_reply(lmb_gw_t *gw, const lmb_gw_req_t *r, const uint8_t *pdu, int len)
+{
+	lmb_gw_client_t *c = &gw->clients[r->client];
+	uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+
+	if (c->fd < 0 || c->gen != r->gen) {
+		return;
+	}
+	memcpy(adu, r->hdr, 7);
+	adu[4] = (len + 1) >> 8;
+	adu[5] = (len + 1) & 0xff;
+	memcpy(&adu[7], pdu, len);
+	if (sock_send_all(c->fd, adu, len + 7) < 0) {
+		gw_client_close(c);
+		return;
+	}
+	gw->responses++;
+}
+
+static void gw_exception(lmb_gw_t *gw, const lmb_gw_req_t *r, int code)
+{
+	uint8_t pdu[2] = { r->pdu[0] | 0x80, code };
+	gw_reply(gw, r, pdu, sizeof(pdu));
+}
+
+/* Queues or refuses one request from a client */
+static void gw_request(lmb_gw_t *gw, int client, const uint8_t *adu, int len)
+{
+	lmb_gw_req_t r = { .client = client, .gen = gw->clients[client].gen, .len = len - 7 };
+	memcpy(r.hdr, adu, 7);
+	memcpy(r.pdu, &adu[7], r.len);
+	gw->requests++;
+
+	int li = gw->route[adu[6]];
+	if (li < 0 || !gw->lines[li].ctx->modbus) {
+		gw->path_errors++;
+		gw_exception(gw, &r, MODBUS_EXCEPTION_GATEWAY_PATH);
+		return;
+	}
+	lmb_gw_line_t *line = &gw->lines[li];
+	if (line->len == gw->qlen) {
+		gw->busy_errors++;
+		gw_exception(gw, &r, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+		return;
+	}
+	line->queue[(line->head + line->len) % gw->qlen] = r;
+	line->len++;
+	if (line->len > line->queue_max) {
+		line->queue_max = line->len;
+	}
+}
+
+/* Reads what a client sent, and takes off any complete requests */
+static void gw_client_read(lmb_gw_t *gw, int client)
+{
+	lmb_gw_client_t *c = &gw->clients[client];
+	int rc = recv(c->fd, (char *)c->rx + c->rx_len, sizeof(c->rx) - c->rx_len, 0);
+	if (rc < 0 && errno == EINTR) {
+		return;
+	}
+	if (rc <= 0) {
+		gw_client_close(c);
+		return;
+	}
+	c->rx_len += rc;
+	while (c->rx_len >= 7) {
+		int len = 6 + (c->rx[4] << 8 | c->rx[5]);
+		if (c->rx[2] || c->rx[3] || len < 8 || len > MODBUS_TCP_MAX_ADU_LENGTH) {
+			/* not Modbus/TCP, nothing sensible to answer */
+			gw_client_close(c);
+			return;
+		}
+		if (c->rx_len < len) {
+			break;
+		}
+		gw_request(gw, client, c->rx, len);
+		memmove(c->rx, c->rx + len, c->rx_len - len);
+		c->rx_len -= len;
+	}
+}
+
+static void gw_accept(lmb_gw_t *gw)
+{
+	int fd = accept(gw->listen_fd, NULL, NULL);
+	if (fd < 0) {
+		return;
+	}
+#if !defined(WIN32)
+	if (fd >= FD_SETSIZE) {
+		gw->rejected++;
+		nb_close(fd);
+		return;
+	}
+#endif
+	for (int i = 0; i < gw->nclients; i++) {
+		if (gw->clients[i].fd < 0) {
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+			gw->clients[i].fd = fd;
+			gw->accepted++;
+			return;
+		}
+	}
+	gw->rejected++;
+	nb_close(fd);
+}
+
+/* Starts the next request on an idle line, skipping those whose client left */
+static void gw_line_start(lmb_gw_t *gw, lmb_gw_line_t *line, uint64_t now)
+{
+	while (!line->busy && line->len > 0 && now >= line->ready_at) {
+		lmb_gw_req_t *r = &line->queue[line->head];
+		line->head = (line->head + 1) % gw->qlen;
+		line->len--;
+		if (gw->clients[r->client].gen != r->gen) {
+			continue;
+		}
+		line->cur = *r;
+		if (!line->ctx->modbus || modbus_get_socket(line->ctx->modbus) < 0) {
+			gw->path_errors++;
+			gw_exception(gw, &line->cur, MODBUS_EXCEPTION_GATEWAY_PATH);
+			continue;
+		}
+		uint8_t raw[MODBUS_MAX_PDU_LENGTH + 1];
+		raw[0] = line->cur.hdr[6];
+		memcpy(&raw[1], line->cur.pdu, line->cur.len);
+		/* anything left over belongs to an earlier, failed transaction */
+		modbus_flush(line->ctx->modbus);
+		line->rx_len = 0;
+		cap_pdu(line->ctx, LMB_CAP_TX, raw[0], 0, line->cur.pdu, line->cur.len, 0);
+		if (modbus_send_raw_request(line->ctx->modbus, raw, line->cur.len + 1) < 0) {
+			line->errors++;
+			gw_exception(gw, &line->cur, MODBUS_EXCEPTION_GATEWAY_TARGET);
+			continue;
+		}
+		line->sent = lmb_now_us();
+		line->transactions++;
+		if (raw[0] == MODBUS_BROADCAST_ADDRESS) {
+			/* nothing comes back, just give the slaves time */
+			line->ready_at = line->sent + gw->turnaround_us;
+			continue;
+		}
+		line->busy = true;
+	}
+}
+
+/* When the line gives up on the response, or 0 if it isn't waiting */
+static uint64_t gw_line_expiry(lmb_gw_line_t *line)
+{
+	if (!line->busy) {
+		return 0;
+	}
+	if (line->rx_len == 0) {
+		return line->sent + timeout_get_us(line->ctx->modbus, false);
+	}
+	uint32_t byte = timeout_get_us(line->ctx->modbus, true);
+	return line->last_rx + (byte ? byte : timeout_get_us(line->ctx->modbus, false));
+}
+
+static void gw_line_done(lmb_gw_t *gw, lmb_gw_line_t *line, int exception, uint64_t now)
+{
+	if (exception) {
+		gw_exception(gw, &line->cur, exception);
+	} else {
+		gw_reply(gw, &line->cur, &line->rx[1], line->rx_len - 3);
+	}
+	line->busy = false;
+	line->ready_at = now + rtu_t35_us(line->ctx);
+}
+
+static void gw_line_read(lmb_gw_t *gw, lmb_gw_line_t *line, uint64_t now)
+{
+	int s = modbus_get_socket(line->ctx->modbus);
+#if defined(WIN32)
+	int rc = recv(s, (char *)line->rx + line->rx_len, sizeof(line->rx) - line->rx_len, 0);
+#else
+	int rc = read(s, line->rx + line->rx_len, sizeof(line->rx) - line->rx_len);
+#endif
+	if (rc < 0 && errno == EINTR) {
+		return;
+	}
+	if (rc <= 0) {
+		line->errors++;
+		gw_line_done(gw, line, MODBUS_EXCEPTION_GATEWAY_TARGET, now);
+		return;
+	}
+	line->rx_len += rc;
+	line->last_rx = now;
+	int want = rtu_response_length(line->rx, line->rx_len);
+	if (want == 0 || (want > 0 && line->rx_len < want)) {
+		return;
+	}
+	cap_adu(line->ctx, LMB_CAP_RX, line->rx, want > 0 ? want : line->rx_len, NULL, 0, now);
+	if (want < 0 || line->rx[0] != line->cur.hdr[6] ||
+		crc16(line->rx, want - 2) != (line->rx[want - 2] | line->rx[want - 1] << 8)) {
+		line->errors++;
+		gw_line_done(gw, line, MODBUS_EXCEPTION_GATEWAY_TARGET, now);
+		return;
+	}
+	line->rx_len = want;
+	gw_line_done(gw, line, 0, now);
+}
+
+/**
+ * Create a gateway.
+ * @function new_gateway
+ * @param opts table of options
+ *  <ul>
+ *  <li>listen (required) a listening socket, from @{tcp_pi_listen}</li>
+ *  <li>lines (required) array of tables, each with "ctx", a connected
+ *  RTU context, and "units", an array of the unit ids behind it</li>
+ *  <li>clients most clients connected at once, more are turned away, defaults to 16</li>
+ *  <li>queue most requests waiting per line, defaults to 32</li>
+ *  <li>turnaround microseconds to leave the line quiet after a broadcast, defaults to 100000</li>
+ *  </ul>
+ * @return a gateway
+ * @usage
+ *  local srv = mb.new_tcp_pi("0.0.0.0", "502")
+ *  local gw = mb.new_gateway{listen=srv:tcp_pi_listen(16), lines={
+ *      {ctx=line1, units={1, 2, 3}},
+ *      {ctx=line2, units={10, 11}},
+ *  }}
+ *  while true do gw:run(1000000) end
+ */
+static int libmodbus_new_gateway(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "listen");
+	int listen_fd = luaL_checkinteger(L, -1);
+	lua_getfield(L, 1, "clients");
+	int nclients = luaL_optinteger(L, -1, 16);
+	lua_getfield(L, 1, "queue");
+	int qlen = luaL_optinteger(L, -1, 32);
+	lua_getfield(L, 1, "turnaround");
+	lua_Number turnaround = luaL_optnumber(L, -1, 100000);
+	lua_pop(L, 4);
+	if (listen_fd < 0 || nclients < 1 || qlen < 1 || turnaround < 0) {
+		return luaL_argerror(L, 1, "listen, clients and queue must be positive, turnaround not negative");
+	}
+#if !defined(WIN32)
+	if (listen_fd >= FD_SETSIZE) {
+		return luaL_argerror(L, 1, "listen socket too high to select on");
+	}
+#endif
+	lua_getfield(L, 1, "lines");
+	int lidx = lua_gettop(L);
+	luaL_checktype(L, lidx, LUA_TTABLE);
+	int nlines = lua_rawlen(L, lidx);
+	if (nlines < 1) {
+		return luaL_argerror(L, 1, "at least one line is required");
+	}
+
+	lmb_gw_t *gw = lua_newuserdata(L, sizeof(*gw));
+	memset(gw, 0, sizeof(*gw));
+	gw->listen_fd = listen_fd;
+	gw->qlen = qlen;
+	gw->turnaround_us = turnaround;
+	for (int i = 0; i < 256; i++) {
+		gw->route[i] = -1;
+	}
+	luaL_getmetatable(L, MODBUS_META_GW);
+	lua_setmetatable(L, -2);
+
+	/* from here on, __gc cleans up whatever we got to */
+	gw->lines = lmb_calloc(nlines, sizeof(*gw->lines));
+	gw->clients = lmb_calloc(nclients, sizeof(*gw->clients));
+	if (!gw->lines || !gw->clients) {
+		return luaL_error(L, "out of memory");
+	}
+	gw->nclients = nclients;
+	for (int i = 0; i < nclients; i++) {
+		gw->clients[i].fd = -1;
+	}
+	for (int i = 0; i < nlines; i++) {
+		gw->lines[i].ctx_ref = LUA_NOREF;
+	}
+	gw->nlines = nlines;
+
+	for (int i = 0; i < nlines; i++) {
+		lmb_gw_line_t *line = &gw->lines[i];
+		lua_rawgeti(L, lidx, i + 1);
+		if (!lua_istable(L, -1)) {
+			return luaL_argerror(L, 1, "lines must be tables");
+		}
+		lua_getfield(L, -1, "ctx");
+		line->ctx = ctx_check(L, -1);
+		if (!line->ctx->is_rtu) {
+			return luaL_argerror(L, 1, "lines must be RTU contexts");
+		}
+		if (line->ctx->shared) {
+			return luaL_argerror(L, 1, "lines can't be shared contexts");
+		}
+		if (!line->ctx->modbus || modbus_get_socket(line->ctx->modbus) < 0) {
+			return luaL_argerror(L, 1, "lines must be connected");
+		}
+#if !defined(WIN32)
+		if (modbus_get_socket(line->ctx->modbus) >= FD_SETSIZE) {
+			return luaL_argerror(L, 1, "line too high to select on");
+		}
+#endif
+		line->ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		line->queue = lmb_calloc(qlen, sizeof(*line->queue));
+		if (!line->queue) {
+			return luaL_error(L, "out of memory");
+		}
+		lua_getfield(L, -1, "units");
+		luaL_checktype(L, -1, LUA_TTABLE);
+		int n = lua_rawlen(L, -1);
+		for (int u = 1; u <= n; u++) {
+			lua_rawgeti(L, -1, u);
+			int unit = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			if (unit < 0 || unit > 247 || gw->route[unit] >= 0) {
+				return luaL_error(L, "unit %d invalid, or on more than one line", unit);
+			}
+			gw->route[unit] = i;
+		}
+		lua_pop(L, 2);
+	}
+	lua_pushvalue(L, lidx + 1);
+	return 1;
+}
+
+/**
+ * Serve clients and lines for a while.
+ * @function gw:run
+ * @param[opt] timeout microseconds to run for, defaults to 0, just
+ *  handling whatever is ready.  Lines may still have requests in flight
+ *  when it returns, they continue on the next call.
+ * @return[1] count of responses sent back to clients
+ * @return[2] nil
+ * @return[2] error message
+ */
+static int gw_run(lua_State *L)
+{
+	lmb_gw_t *gw = gw_check(L, 1);
+	lua_Number timeout = luaL_optnumber(L, 2, 0);
+	uint64_t end = lmb_now_us() + (timeout > 0 ? (uint64_t)timeout : 0);
+	uint32_t before = gw->responses;
+
+	/* requests stay in flight between calls, which sharing would break */
+	for (int i = 0; i < gw->nlines; i++) {
+		if (gw->lines[i].ctx->shared) {
+			return luaL_error(L, "line %d was shared since", i + 1);
+		}
+	}
+
+	for (;;) {
+		uint64_t now = lmb_now_us();
+		uint64_t wake = end;
+		fd_set rfds;
+		int maxfd = gw->listen_fd;
+
+		FD_ZERO(&rfds);
+		FD_SET(gw->listen_fd, &rfds);
+		for (int i = 0; i < gw->nclients; i++) {
+			int fd = gw->clients[i].fd;
+			if (fd >= 0) {
+				FD_SET(fd, &rfds);
+				maxfd = fd > maxfd ? fd : maxfd;
+			}
+		}
+		for (int i = 0; i < gw->nlines; i++) {
+			lmb_gw_line_t *line = &gw->lines[i];
+			if (line->busy && !line->ctx->modbus) {
+				/* closed under us */
+				line->busy = false;
+				gw->path_errors++;
+				gw_exception(gw, &line->cur, MODBUS_EXCEPTION_GATEWAY_PATH);
+			}
+			gw_line_start(gw, line, now);
+			if (line->busy) {
+				int s = modbus_get_socket(line->ctx->modbus);
+				FD_SET(s, &rfds);
+				maxfd = s > maxfd ? s : maxfd;
+				uint64_t at = gw_line_expiry(line);
+				wake = at < wake ? at : wake;
+			} else if (line->len > 0 && line->ready_at < wake) {
+				wake = line->ready_at;
+			}
+		}
+
+		uint64_t us = wake > now ? wake - now : 0;
+		struct timeval tv = { .tv_sec = us / 1000000, .tv_usec = us % 1000000 };
+		int rc = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+		if (rc < 0 && errno != EINTR) {
+			return libmodbus_rc_to_nil_error(L, -1, 0);
+		}
+
+		now = lmb_now_us();
+		if (rc > 0) {
+			for (int i = 0; i < gw->nlines; i++) {
+				lmb_gw_line_t *line = &gw->lines[i];
+				if (line->busy && FD_ISSET(modbus_get_socket(line->ctx->modbus), &rfds)) {
+					gw_line_read(gw, line, now);
+				}
+			}
+			for (int i = 0; i < gw->nclients; i++) {
+				int fd = gw->clients[i].fd;
+				if (fd >= 0 && FD_ISSET(fd, &rfds)) {
+					gw_client_read(gw, i);
+				}
+			}
+			if (FD_ISSET(gw->listen_fd, &rfds)) {
+				gw_accept(gw);
+			}
+		}
+		for (int i = 0; i < gw->nlines; i++) {
+			lmb_gw_line_t *line = &gw->lines[i];
+			if (line->busy && now >= gw_line_expiry(line)) {
+				line->timeouts++;
+				gw_line_done(gw, line, MODBUS_EXCEPTION_GATEWAY_TARGET, now);
+			}
+			gw_line_start(gw, line, now);
+		}
+		if (now >= end) {
+			break;
+		}
+	}
+	lua_pushinteger(L, gw->responses - before);
+	return 1;
+}
+
+/**
+ * @function gw:stats
+ * @return table with clients (connected now), accepted, rejected, requests,
+ *  responses, path_errors, busy_errors, and lines, an array with queued,
+ *  queue_max, transactions, timeouts and errors for each line
+ */
+static int gw_stats(lua_State *L)
+{
+	lmb_gw_t *gw = gw_check(L, 1);
+	int clients = 0;
+
+	for (int i = 0; i < gw->nclients; i++) {
+		clients += gw->clients[i].fd >= 0;
+	}
+	lua_newtable(L);
+	lua_pushinteger(L, clients);
+	lua_setfield(L, -2, "clients");
+	lua_pushnumber(L, gw->accepted);
+	lua_setfield(L, -2, "accepted");
+	lua_pushnumber(L, gw->rejected);
+	lua_setfield(L, -2, "rejected");
+	lua_pushnumber(L, gw->requests);
+	lua_setfield(L, -2, "requests");
+	lua_pushnumber(L, gw->responses);
+	lua_setfield(L, -2, "responses");
+	lua_pushnumber(L, gw->path_errors);
+	lua_setfield(L, -2, "path_errors");
+	lua_pushnumber(L, gw->busy_errors);
+	lua_setfield(L, -2, "busy_errors");
+	lua_newtable(L);
+	for (int i = 0; i < gw->nlines; i++) {
+		lmb_gw_line_t *line = &gw->lines[i];
+		lua_newtable(L);
+		lua_pushinteger(L, line->len + line->busy);
+		lua_setfield(L, -2, "queued");
+		lua_pushinteger(L, line->queue_max);
+		lua_setfield(L, -2, "queue_max");
+		lua_pushnumber(L, line->transactions);
+		lua_setfield(L, -2, "transactions");
+		lua_pushnumber(L, line->timeouts);
+		lua_setfield(L, -2, "timeouts");
+		lua_pushnumber(L, line->errors);
+		lua_setfield(L, -2, "errors");
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "lines");
+	return 1;
+}
+
+/**
+ * Disconnect all clients, and drop queued requests.
+ * The listening socket is left alone, it belongs to the caller.
+ * @function gw:close
+ */
+static int gw_close(lua_State *L)
+{
+	lmb_gw_t *gw = gw_check(L, 1);
+
+	for (int i = 0; i < gw->nclients; i++) {
+		if (gw->clients[i].fd >= 0) {
+			gw_client_close(&gw->clients[i]);
+		}
+	}
+	for (int i = 0; i < gw->nlines; i++) {
+		gw->lines[i].len = 0;
+		gw->lines[i].busy = false;
+	}
+	return 0;
+}
+
+static int gw_gc(lua_State *L)
+{
+	lmb_gw_t *gw = gw_check(L, 1);
+
+	gw_close(L);
+	for (int i = 0; i < gw->nlines; i++) {
+		free(gw->lines[i].queue);
+		luaL_unref(L, LUA_REGISTRYINDEX, gw->lines[i].ctx_ref);
+	}
+	free(gw->lines);
+	free(gw->clients);
+	gw->lines = NULL;
+	gw->clients = NULL;
+	gw->nlines = 0;
+	gw->nclients = 0;
+	return 0;
+}
+
+static const struct luaL_Reg gw_M[] = {
+	{"run",			gw_run},
+	{"stats",		gw_stats},
+	{"close",		gw_close},
+	{"__gc",		gw_gc},
+	{NULL, NULL}
+};
+
+/** Modbus/TCP server.
+ * Serves a register image to any number of clients, entirely in C.  Each
+ * client has a small queue of requests, and the queues are served round
+ * robin, one request per client per round, so one client polling in a
+ * tight loop can't hold up the others.  An optional per client rate limit
+ * holds requests over the rate back in the queue, and a request arriving
+ * to a full queue is answered with a busy exception straight away.
+ * Clients that stop reading their responses, or go quiet for too long,
+ * are disconnected.
+ *
+ * A server can also present many virtual devices, each with an image of
+ * its own, picked by the unit id of the request, and serve them on an RTU
+ * line as well as over TCP.
+ * @section server
+ */
+
+/* What to do with requests for units that have no image of their own */
+enum lmb_srv_unknown {
+	LMB_UNKNOWN_DEFAULT,
+	LMB_UNKNOWN_EXCEPTION,
+	LMB_UNKNOWN_IGNORE,
+};
+
+static const char *const lmb_srv_unknown_names[] = {
+	"default", "exception", "ignore", NULL
+};
+
+/* The four tables of a device, bits are stored one per value too */
+typedef struct {
+	uint16_t *vals[4];
+	int count[4];
+} lmb_image_t;
+
+typedef struct {
+	uint8_t hdr[7];
+	uint8_t pdu[MODBUS_MAX_PDU_LENGTH];
+	int len;
+	uint64_t arrived;
+} lmb_srv_req_t;
+
+typedef struct {
+	int fd;
+	uint8_t rx[MODBUS_TCP_MAX_ADU_LENGTH];
+	int rx_len;
+	lmb_srv_req_t *queue;
+	int head;
+	int len;
+	/* rate limit, requests that may be served now */
+	double tokens;
+	uint64_t refilled;
+	uint64_t last_rx;
+} lmb_srv_client_t;
+
+typedef struct {
+	/* -1 when only serving an RTU line */
+	int listen_fd;
+	int nclients;
+	int qlen;
+	/* requests per second per client, 0 for no limit, and the burst allowed */
+	double rate;
+	double burst;
+	uint64_t idle_us;
+	/* the client served first in the next round */
+	int rr;
+	lmb_image_t image;
+	/* images of the virtual devices, by unit id, NULL for none */
+	lmb_image_t *units[256];
+	enum lmb_srv_unknown unknown;
+	/* whether the RTU line answers units without an image from the default one */
+	bool rtu_default;
+	/* the RTU line, if any, and the request being received on it */
+	ctx_t *rtu;
+	int rtu_ref;
+	uint8_t rtu_rx[MODBUS_RTU_MAX_ADU_LENGTH];
+	int rtu_rx_len;
+	uint64_t rtu_last_rx;
+	lmb_srv_client_t *clients;
+	uint32_t accepted;
+	uint32_t rejected;
+	uint32_t evicted;
+	uint32_t requests;
+	uint32_t responses;
+	uint32_t exceptions;
+	uint32_t busy_errors;
+	uint32_t unknown_units;
+	uint32_t rtu_errors;
+	uint64_t wait_total;
+	uint64_t wait_max;
+	int queue_max;
+} lmb_srv_t;
+
+static lmb_srv_t *srv_check(lua_State *L, int i)
+{
+	return (lmb_srv_t *) luaL_checkudata(L, i, MODBUS_META_SRV);
+}
+
+static int image_alloc(lmb_image_t *img, const int count[4])
+{
+	for (int t = 0; t < 4; t++) {
+		img->count[t] = count[t];
+		img->vals[t] = count[t] ? lmb_calloc(count[t], sizeof(uint16_t)) : NULL;
+		if (count[t] && !img->vals[t]) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void image_free(lmb_image_t *img)
+{
+	for (int t = 0; t < 4; t++) {
+		free(img->vals[t]);
+		img->vals[t] = NULL;
+		img->count[t] = 0;
+	}
+}
+
+static int image_exception(const uint8_t *req, int code, uint8_t *rsp)
+{
+	rsp[0] = req[0] | 0x80;
+	rsp[1] = code;
+	return 2;
+}
+
+/* Packs n bits of the image into rsp, after the byte count */
+static int image_read_bits(const uint16_t *vals, int n, uint8_t *rsp)
+{
+	rsp[1] = (n + 7) / 8;
+	memset(&rsp[2], 0, rsp[1]);
+	for (int i = 0; i < n; i++) {
+		if (vals[i]) {
+			rsp[2 + i / 8] |= 1 << (i % 8);
+		}
+	}
+	return 2 + rsp[1];
+}
+
+static int image_read_regs(const uint16_t *vals, int n, uint8_t *rsp)
+{
+	rsp[1] = n * 2;
+	for (int i = 0; i < n; i++) {
+		rsp[2 + i * 2] = vals[i] >> 8;
+		rsp[3 + i * 2] = vals[i] & 0xff;
+	}
+	return 2 + n * 2;
+}
+
+/*
+ * Answers a request pdu from the image, as a device would.
+ * @param rsp receives the response pdu, must hold MODBUS_MAX_PDU_LENGTH
+ * @return the length of the response pdu, exceptions included
+ */
+static int image_reply(lmb_image_t *img, const uint8_t *req, int len, uint8_t *rsp)
+{
+	enum lmb_table table;
+	uint8_t fc = req[0];
+
+	switch (fc) {
+	case MODBUS_FC_READ_COILS:
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+		table = LMB_BITS;
+		break;
+	case MODBUS_FC_READ_DISCRETE_INPUTS:
+		table = LMB_INPUT_BITS;
+		break;
+	case MODBUS_FC_READ_HOLDING_REGISTERS:
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+	case MODBUS_FC_MASK_WRITE_REGISTER:
+	case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+		table = LMB_REGISTERS;
+		break;
+	case MODBUS_FC_READ_INPUT_REGISTERS:
+		table = LMB_INPUT_REGISTERS;
+		break;
+	default:
+		return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, rsp);
+	}
+	if (len < 5) {
+		return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+	}
+	uint16_t *vals = img->vals[table];
+	int count = img->count[table];
+	int addr = req[1] << 8 | req[2];
+	int n = req[3] << 8 | req[4];
+
+	rsp[0] = fc;
+	switch (fc) {
+	case MODBUS_FC_READ_COILS:
+	case MODBUS_FC_READ_DISCRETE_INPUTS:
+		if (n < 1 || n > MODBUS_MAX_READ_BITS) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		}
+		if (addr + n > count) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		}
+		return image_read_bits(&vals[addr], n, rsp);
+	case MODBUS_FC_READ_HOLDING_REGISTERS:
+	case MODBUS_FC_READ_INPUT_REGISTERS:
+		if (n < 1 || n > MODBUS_MAX_READ_REGISTERS) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		}
+		if (addr + n > count) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		}
+		return image_read_regs(&vals[addr], n, rsp);
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+		if (n != 0xff00 && n != 0) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		}
+		if (addr >= count) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		}
+		vals[addr] = n != 0;
+		memcpy(rsp, req, 5);
+		return 5;
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+		if (addr >= count) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		}
+		vals[addr] = n;
+		memcpy(rsp, req, 5);
+		return 5;
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+		if (n < 1 || n > MODBUS_MAX_WRITE_BITS || len < 6 || req[5] != (n + 7) / 8 || len != 6 + req[5]) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		}
+		if (addr + n > count) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		}
+		for (int i = 0; i < n; i++) {
+			vals[addr + i] = (req[6 + i / 8] >> (i % 8)) & 1;
+		}
+		memcpy(rsp, req, 5);
+		return 5;
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		if (n < 1 || n > MODBUS_MAX_WRITE_REGISTERS || len < 6 || req[5] != n * 2 || len != 6 + n * 2) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		}
+		if (addr + n > count) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		}
+		for (int i = 0; i < n; i++) {
+			vals[addr + i] = req[6 + i * 2] << 8 | req[7 + i * 2];
+		}
+		memcpy(rsp, req, 5);
+		return 5;
+	case MODBUS_FC_MASK_WRITE_REGISTER: {
+		if (len != 7) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		}
+		if (addr >= count) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		}
+		uint16_t and = n;
+		uint16_t or = req[5] << 8 | req[6];
+		vals[addr] = (vals[addr] & and) | (or & ~and);
+		memcpy(rsp, req, 7);
+		return 7;
+	}
+	case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+	default: {
+		if (len < 10) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		}
+		int waddr = req[5] << 8 | req[6];
+		int wn = req[7] << 8 | req[8];
+		if (n < 1 || n > MODBUS_MAX_WR_READ_REGISTERS || wn < 1 || wn > MODBUS_MAX_WR_WRITE_REGISTERS ||
+			req[9] != wn * 2 || len != 10 + wn * 2) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp);
+		}
+		if (addr + n > count || waddr + wn > count) {
+			return image_exception(req, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp);
+		}
+		/* the write happens first */
+		for (int i = 0; i < wn; i++) {
+			vals[waddr + i] = req[10 + i * 2] << 8 | req[11 + i * 2];
+		}
+		return image_read_regs(&vals[addr], n, rsp);
+	}
+	}
+}
+
+static void srv_client_close(lmb_srv_client_t *c)
+{
+	if (c->fd >= 0) {
+		nb_close(c->fd);
+	}
+	c->fd = -1;
+	c->rx_len = 0;
+	c->len = 0;
+}
+
+/*
+ * Sends a response without blocking, a client that doesn't read its
+ * responses mustn't hold up the others, so it's dropped instead.
+ */
+static void srv_send(lmb_srv_t *srv, lmb_srv_client_t *c, const uint8_t *hdr, const uint8_t *pdu, int len)
+{
+	uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+
+	memcpy(adu, hdr, 7);
+	adu[4] = (len + 1) >> 8;
+	adu[5] = (len + 1) & 0xff;
+	memcpy(&adu[7], pdu, len);
+	int rc;
+	do {
+		rc = send(c->fd, (const char *)adu, len + 7, MSG_NOSIGNAL);
+	} while (rc < 0 && errno == EINTR);
+	if (rc != len + 7) {
+		srv->evicted += rc >= 0 || errno == EAGAIN || errno == EWOULDBLOCK;
+		srv_client_close(c);
+		return;
+	}
+	srv->responses++;
+	if (pdu[0] & 0x80) {
+		srv->exceptions++;
+	}
+}
+
+/* Queues a request from a client, or refuses it if the queue is full */
+static void srv_request(lmb_srv_t *srv, lmb_srv_client_t *c, const uint8_t *adu, int len, uint64_t now)
+{
+	srv->requests++;
+	if (c->len == srv->qlen) {
+		uint8_t pdu[2] = { adu[7] | 0x80, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY };
+		srv->busy_errors++;
+		srv_send(srv, c, adu, pdu, sizeof(pdu));
+		return;
+	}
+	lmb_srv_req_t *r = &c->queue[(c->head + c->len) % srv->qlen];
+	memcpy(r->hdr, adu, 7);
+	r->len = len - 7;
+	memcpy(r->pdu, &adu[7], r->len);
+	r->arrived = now;
+	c->len++;
+	if (c->len > srv->queue_max) {
+		srv->queue_max = c->len;
+	}
+}
+
+static void srv_client_read(lmb_srv_t *srv, lmb_srv_client_t *c, uint64_t now)
+{
+	int rc = recv(c->fd, (char *)c->rx + c->rx_len, sizeof(c->rx) - c->rx_len, 0);
+	if (rc < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if (rc <= 0) {
+		srv_client_close(c);
+		return;
+	}
+	c->rx_len += rc;
+	c->last_rx = now;
+	while (c->fd >= 0 && c->rx_len >= 7) {
+		int len = 6 + (c->rx[4] << 8 | c->rx[5]);
+		if (c->rx[2] || c->rx[3] || len < 8 || len > MODBUS_TCP_MAX_ADU_LENGTH) {
+			/* not Modbus/TCP, nothing sensible to answer */
+			srv_client_close(c);
+			return;
+		}
+		if (c->rx_len < len) {
+			break;
+		}
+		srv_request(srv, c, c->rx, len, now);
+		memmove(c->rx, c->rx + len, c->rx_len - len);
+		c->rx_len -= len;
+	}
+}
+
+static void srv_accept(lmb_srv_t *srv, uint64_t now)
+{
+	int fd = accept(srv->listen_fd, NULL, NULL);
+	if (fd < 0) {
+		return;
+	}
+#if !defined(WIN32)
+	if (fd >= FD_SETSIZE) {
+		srv->rejected++;
+		nb_close(fd);
+		return;
+	}
+#endif
+	for (int i = 0; i < srv->nclients; i++) {
+		lmb_srv_client_t *c = &srv->clients[i];
+		if (c->fd < 0) {
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+#if defined(WIN32)
+			u_long nb = 1;
+			ioctlsocket(fd, FIONBIO, &nb);
+#else
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+			c->fd = fd;
+			c->tokens = srv->burst;
+			c->refilled = now;
+			c->last_rx = now;
+			srv->accepted++;
+			return;
+		}
+	}
+	srv->rejected++;
+	nb_close(fd);
+}
+
+/* Tops up a client's rate limit tokens */
+static void srv_refill(lmb_srv_t *srv, lmb_srv_client_t *c, uint64_t now)
+{
+	c->tokens += (now - c->refilled) * srv->rate / 1000000;
+	if (c->tokens > srv->burst) {
+		c->tokens = srv->burst;
+	}
+	c->refilled = now;
+}
+
+/* The image answering for a unit, or NULL if it isn't to be answered from one */
+static lmb_image_t *srv_image(lmb_srv_t *srv, int unit)
+{
+	if (srv->units[unit]) {
+		return srv->units[unit];
+	}
+	srv->unknown_units++;
+	return srv->unknown == LMB_UNKNOWN_DEFAULT ? &srv->image : NULL;
+}
+
+/*
+ * Serves queued requests, one per client per round, until no client has
+ * anything it may be served
+ * @return when a client held back by its rate limit may be served, or 0
+ */
+static uint64_t srv_serve(lmb_srv_t *srv, uint64_t now)
+{
+	uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+	uint64_t next = 0;
+	bool more = true;
+
+	while (more) {
+		more = false;
+		for (int k = 0; k < srv->nclients; k++) {
+			lmb_srv_client_t *c = &srv->clients[(srv->rr + k) % srv->nclients];
+			if (c->fd < 0 || c->len == 0) {
+				continue;
+			}
+			if (srv->rate > 0) {
+				srv_refill(srv, c, now);
+				if (c->tokens < 1) {
+					uint64_t at = now + (uint64_t)((1 - c->tokens) * 1000000 / srv->rate) + 1;
+					next = !next || at < next ? at : next;
+					continue;
+				}
+				c->tokens -= 1;
+			}
+			lmb_srv_req_t *r = &c->queue[c->head];
+			c->head = (c->head + 1) % srv->qlen;
+			c->len--;
+			/* the idle clock runs from the last request served */
+			c->last_rx = now;
+			uint64_t wait = now - r->arrived;
+			srv->wait_total += wait;
+			if (wait > srv->wait_max) {
+				srv->wait_max = wait;
+			}
+			more = true;
+			lmb_image_t *img = srv_image(srv, r->hdr[6]);
+			int len;
+			if (img) {
+				len = image_reply(img, r->pdu, r->len, rsp);
+			} else if (srv->unknown == LMB_UNKNOWN_EXCEPTION) {
+				len = image_exception(r->pdu, MODBUS_EXCEPTION_GATEWAY_TARGET, rsp);
+			} else {
+				continue;
+			}
+			srv_send(srv, c, r->hdr, rsp, len);
+		}
+		srv->rr = (srv->rr + 1) % srv->nclients;
+	}
+	return next;
+}
+
+/*
+ * Answers a request from the RTU line.  Units without an image of their
+ * own stay silent, as absent slaves do, unless the default image is to
+ * answer for them, and broadcasts are written to every image.
+ */
+static void srv_rtu_request(lmb_srv_t *srv, const uint8_t *adu, int len, uint64_t now)
+{
+	uint8_t raw[MODBUS_MAX_PDU_LENGTH + 1];
+	const uint8_t *pdu = &adu[1];
+	int plen = len - 3;
+
+	srv->requests++;
+	cap_pdu(srv->rtu, LMB_CAP_RX, adu[0], 0, pdu, plen, now);
+	if (adu[0] == MODBUS_BROADCAST_ADDRESS) {
+		switch (pdu[0]) {
+		case MODBUS_FC_WRITE_SINGLE_COIL:
+		case MODBUS_FC_WRITE_SINGLE_REGISTER:
+		case MODBUS_FC_WRITE_MULTIPLE_COILS:
+		case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		case MODBUS_FC_MASK_WRITE_REGISTER:
+			image_reply(&srv->image, pdu, plen, &raw[1]);
+			for (int u = 1; u < 256; u++) {
+				if (srv->units[u]) {
+					image_reply(srv->units[u], pdu, plen, &raw[1]);
+				}
+			}
+			break;
+		}
+		return;
+	}
+	lmb_image_t *img = srv->units[adu[0]];
+	if (!img) {
+		srv->unknown_units++;
+		if (!srv->rtu_default) {
+			return;
+		}
+		img = &srv->image;
+	}
+	raw[0] = adu[0];
+	int rlen = image_reply(img, pdu, plen, &raw[1]);
+	cap_pdu(srv->rtu, LMB_CAP_TX, raw[0], 0, &raw[1], rlen, 0);
+	if (modbus_send_raw_request(srv->rtu->modbus, raw, rlen + 1) < 0) {
+		srv->rtu_errors++;
+		return;
+	}
+	srv->responses++;
+	if (raw[1] & 0x80) {
+		srv->exceptions++;
+	}
+}
+
+/*
+ * Reads what's arrived on the RTU line, answering any whole requests.
+ * A partial request that goes quiet for longer than the line's byte
+ * timeout was garbled, and is dropped, as is anything failing its crc.
+ */
+static void srv_rtu_read(lmb_srv_t *srv, uint64_t now)
+{
+	int s = modbus_get_socket(srv->rtu->modbus);
+	uint32_t byte = timeout_get_us(srv->rtu->modbus, true);
+
+	if (srv->rtu_rx_len && now - srv->rtu_last_rx > (byte ? byte : timeout_get_us(srv->rtu->modbus, false))) {
+		srv->rtu_errors++;
+		srv->rtu_rx_len = 0;
+	}
+#if defined(WIN32)
+	int rc = recv(s, (char *)srv->rtu_rx + srv->rtu_rx_len, sizeof(srv->rtu_rx) - srv->rtu_rx_len, 0);
+#else
+	int rc = read(s, srv->rtu_rx + srv->rtu_rx_len, sizeof(srv->rtu_rx) - srv->rtu_rx_len);
+#endif
+	if (rc <= 0) {
+		return;
+	}
+	srv->rtu_rx_len += rc;
+	srv->rtu_last_rx = now;
+	while (srv->rtu_rx_len > 0) {
+		int want = rtu_request_length(srv->rtu_rx, srv->rtu_rx_len);
+		if (want == 0 || (want > 0 && srv->rtu_rx_len < want)) {
+			if (srv->rtu_rx_len == (int)sizeof(srv->rtu_rx)) {
+				srv->rtu_errors++;
+				srv->rtu_rx_len = 0;
+			}
+			return;
+		}
+		if (want < 0 || crc16(srv->rtu_rx, want - 2) != (srv->rtu_rx[want - 2] | srv->rtu_rx[want - 1] << 8)) {
+			/* lost sync, start again from the next request */
+			srv->rtu_errors++;
+			srv->rtu_rx_len = 0;
+			modbus_flush(srv->rtu->modbus);
+			return;
+		}
+		srv_rtu_request(srv, srv->rtu_rx, want, now);
+		memmove(srv->rtu_rx, srv->rtu_rx + want, srv->rtu_rx_len - want);
+		srv->rtu_rx_len -= want;
+	}
+}
+
+/* Reads the sizes of the four tables from the options table at idx */
+static void image_opts(lua_State *L, int idx, int count[4])
+{
+	for (int t = 0; t < 4; t++) {
+		lua_getfield(L, idx, lmb_table_names[t]);
+		count[t] = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+		if (count[t] < 0 || count[t] > 0x10000) {
+			luaL_argerror(L, idx, "tables must have 0-65536 values");
+		}
+	}
+}
+
+/* Gives a unit an image of its own, sized from the options table at idx */
+/* The table key at idx as a whole number from 0 to max, or -1 if it isn't one */
+static int srv_key(lua_State *L, int idx, int max)
+{
+	if (lua_type(L, idx) != LUA_TNUMBER) {
+		return -1;
+	}
+	lua_Number n = lua_tonumber(L, idx);
+	return n >= 0 && n <= max && n == floor(n) ? (int)n : -1;
+}
+
+static void srv_unit_new(lua_State *L, lmb_srv_t *srv, lua_Integer unit, int idx)
+{
+	int count[4];
+
+	if (unit < 1 || unit > 255) {
+		luaL_error(L, "unit %d invalid, must be 1-255", (int)unit);
+	}
+	if (srv->units[unit]) {
+		luaL_error(L, "unit %d already has an image", (int)unit);
+	}
+	luaL_checktype(L, idx, LUA_TTABLE);
+	image_opts(L, idx, count);
+	lmb_image_t *img = lmb_calloc(1, sizeof(*img));
+	if (!img || image_alloc(img, count) < 0) {
+		if (img) {
+			image_free(img);
+			free(img);
+		}
+		luaL_error(L, "out of memory");
+	}
+	srv->units[unit] = img;
+}
+
+/**
+ * Create a Modbus/TCP server.
+ * The register images are all zero to start with, see @{srv:set}.
+ * Requests for units with an image of their own are answered from it,
+ * others as the unknown option says.
+ * @function new_server
+ * @param opts table of options
+ *  <ul>
+ *  <li>listen a listening socket, from @{tcp_pi_listen}, required unless
+ *  there's an rtu line</li>
+ *  <li>rtu a connected RTU context, to serve on that line too</li>
+ *  <li>bits, input_bits, registers, input_registers: how many of each
+ *  the default image has, from address 0, default none</li>
+ *  <li>units table of virtual devices, unit id (1-255) to a table of
+ *  sizes as above, see also @{srv:add_unit}</li>
+ *  <li>unknown requests for other units are answered from the "default"
+ *  image (the default), with a gateway target "exception", or "ignore"d,
+ *  over TCP</li>
+ *  <li>rtu_default true to answer requests on the RTU line for units
+ *  without an image of their own from the default image.  By default
+ *  they aren't answered at all, as absent slaves aren't.</li>
+ *  <li>clients most clients connected at once, more are turned away, defaults to 16</li>
+ *  <li>queue most requests waiting per client, defaults to 8.  Requests
+ *  beyond that are answered with a busy exception.</li>
+ *  <li>rate most requests per second served per client, default unlimited</li>
+ *  <li>burst requests a client may have served at once, above the rate,
+ *  defaults to the queue length</li>
+ *  <li>idle microseconds a client may go without a request, with none
+ *  queued, before it's disconnected, default never</li>
+ *  </ul>
+ * @return a server
+ * @usage
+ *  local srv = mb.new_tcp_pi("0.0.0.0", "502")
+ *  local s = mb.new_server{listen=srv:tcp_pi_listen(16), registers=1000,
+ *      clients=8, rate=50, idle=60e6}
+ *  while true do
+ *    s:set("registers", 0, latest())
+ *    s:run(100000)
+ *  end
+ *  -- a virtual device per meter, on TCP and a serial line
+ *  local units = {}
+ *  for id = 1, 50 do units[id] = {input_registers=100} end
+ *  local s = mb.new_server{listen=sock, rtu=line, units=units, unknown="exception"}
+ */
+static int libmodbus_new_server(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	lua_getfield(L, 1, "rtu");
+	ctx_t *rtu = lua_isnoneornil(L, -1) ? NULL : ctx_check(L, -1);
+	if (rtu && (!rtu->is_rtu || rtu->shared)) {
+		return luaL_argerror(L, 1, "rtu must be an RTU context, and not shared");
+	}
+	if (rtu && (!rtu->modbus || modbus_get_socket(rtu->modbus) < 0)) {
+		return luaL_argerror(L, 1, "rtu must be connected");
+	}
+	lua_getfield(L, 1, "listen");
+	int listen_fd = rtu ? luaL_optinteger(L, -1, -1) : luaL_checkinteger(L, -1);
+	lua_getfield(L, 1, "clients");
+	int nclients = luaL_optinteger(L, -1, 16);
+	lua_getfield(L, 1, "queue");
+	int qlen = luaL_optinteger(L, -1, 8);
+	lua_getfield(L, 1, "rate");
+	lua_Number rate = luaL_optnumber(L, -1, 0);
+	lua_getfield(L, 1, "burst");
+	lua_Number burst = luaL_optnumber(L, -1, qlen);
+	lua_getfield(L, 1, "idle");
+	lua_Number idle = luaL_optnumber(L, -1, 0);
+	lua_getfield(L, 1, "unknown");
+	enum lmb_srv_unknown unknown = luaL_checkoption(L, -1, "default", lmb_srv_unknown_names);
+	lua_getfield(L, 1, "rtu_default");
+	bool rtu_default = lua_toboolean(L, -1);
+	/* rtu stays, for the reference below */
+	lua_pop(L, 8);
+	if ((listen_fd < 0 && !rtu) || nclients < 1 || qlen < 1) {
+		return luaL_argerror(L, 1, "listen, clients and queue must be positive");
+	}
+	if (rate < 0 || burst < 1 || idle < 0) {
+		return luaL_argerror(L, 1, "rate and idle can't be negative, burst must be at least 1");
+	}
+#if !defined(WIN32)
+	if (listen_fd >= FD_SETSIZE || (rtu && modbus_get_socket(rtu->modbus) >= FD_SETSIZE)) {
+		return luaL_argerror(L, 1, "listen socket or rtu line too high to select on");
+	}
+#endif
+	int count[4];
+	image_opts(L, 1, count);
+
+	lmb_srv_t *srv = lua_newuserdata(L, sizeof(*srv));
+	memset(srv, 0, sizeof(*srv));
+	srv->listen_fd = listen_fd;
+	srv->qlen = qlen;
+	srv->rate = rate;
+	srv->burst = burst;
+	srv->idle_us = idle;
+	srv->unknown = unknown;
+	srv->rtu_default = rtu_default;
+	srv->rtu_ref = LUA_NOREF;
+	luaL_getmetatable(L, MODBUS_META_SRV);
+	lua_setmetatable(L, -2);
+
+	/* from here on, __gc cleans up whatever we got to */
+	srv->clients = lmb_calloc(nclients, sizeof(*srv->clients));
+	if (!srv->clients) {
+		return luaL_error(L, "out of memory");
+	}
+	srv->nclients = nclients;
+	for (int i = 0; i < nclients; i++) {
+		srv->clients[i].fd = -1;
+	}
+	for (int i = 0; i < nclients; i++) {
+		srv->clients[i].queue = lmb_calloc(qlen, sizeof(lmb_srv_req_t));
+		if (!srv->clients[i].queue) {
+			return luaL_error(L, "out of memory");
+		}
+	}
+	if (image_alloc(&srv->image, count) < 0) {
+		return luaL_error(L, "out of memory");
+	}
+	if (rtu) {
+		lua_pushvalue(L, 2);
+		srv->rtu_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		srv->rtu = rtu;
+	}
+	lua_getfield(L, 1, "units");
+	if (!lua_isnil(L, -1)) {
+		luaL_argcheck(L, lua_istable(L, -1), 1, "units must be a table");
+		lua_pushnil(L);
+		while (lua_next(L, -2)) {
+			int unit = srv_key(L, -2, 255);
+			luaL_argcheck(L, unit >= 0, 1, "units must be keyed by unit id");
+			srv_unit_new(L, srv, unit, lua_gettop(L));
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+	return 1;
+}
+
+/**
+ * Serve clients for a while.
+ * @function srv:run
+ * @param[opt] timeout microseconds to run for, defaults to 0, just
+ *  handling whatever is ready
+ * @return[1] count of responses sent
+ * @return[2] nil
+ * @return[2] error message
+ */
+static int srv_run(lua_State *L)
+{
+	lmb_srv_t *srv = srv_check(L, 1);
+	lua_Number timeout = luaL_optnumber(L, 2, 0);
+	uint64_t end = lmb_now_us() + (timeout > 0 ? (uint64_t)timeout : 0);
+	uint32_t before = srv->responses;
+
+	for (;;) {
+		uint64_t now = lmb_now_us();
+		uint64_t wake = end;
+		fd_set rfds;
+		int maxfd = srv->listen_fd;
+		int line = -1;
+
+		uint64_t held = srv_serve(srv, now);
+		if (held && held < wake) {
+			wake = held;
+		}
+		FD_ZERO(&rfds);
+		if (srv->listen_fd >= 0) {
+			FD_SET(srv->listen_fd, &rfds);
+		}
+		if (srv->rtu && srv->rtu->modbus) {
+			line = modbus_get_socket(srv->rtu->modbus);
+		}
+		if (line >= 0) {
+			FD_SET(line, &rfds);
+			maxfd = line > maxfd ? line : maxfd;
+		}
+		for (int i = 0; i < srv->nclients; i++) {
+			lmb_srv_client_t *c = &srv->clients[i];
+			if (c->fd < 0) {
+				continue;
+			}
+			/* clients with requests held back by the rate limit aren't idle */
+			if (srv->idle_us && c->len == 0 && now - c->last_rx >= srv->idle_us) {
+				srv->evicted++;
+				srv_client_close(c);
+				continue;
+			}
+			if (srv->idle_us && c->len == 0 && c->last_rx + srv->idle_us < wake) {
+				wake = c->last_rx + srv->idle_us;
+			}
+			FD_SET(c->fd, &rfds);
+			maxfd = c->fd > maxfd ? c->fd : maxfd;
+		}
+
+		uint64_t us = wake > now ? wake - now : 0;
+		struct timeval tv = { .tv_sec = us / 1000000, .tv_usec = us % 1000000 };
+		int rc = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+		if (rc < 0 && errno != EINTR) {
+			return libmodbus_rc_to_nil_error(L, -1, 0);
+		}
+
+		now = lmb_now_us();
+		if (rc > 0) {
+			for (int i = 0; i < srv->nclients; i++) {
+				lmb_srv_client_t *c = &srv->clients[i];
+				if (c->fd >= 0 && FD_ISSET(c->fd, &rfds)) {
+					srv_client_read(srv, c, now);
+				}
+			}
+			if (srv->listen_fd >= 0 && FD_ISSET(srv->listen_fd, &rfds)) {
+				srv_accept(srv, now);
+			}
+			if (line >= 0 && FD_ISSET(line, &rfds)) {
+				srv_rtu_read(srv, now);
+			}
+		}
+		srv_serve(srv, now);
+		if (now >= end) {
+			break;
+		}
+	}
+	lua_pushinteger(L, srv->responses - before);
+	return 1;
+}
+
+static void image_range(lua_State *L, const lmb_image_t *img, enum lmb_table table, int addr, int count, int arg)
+{
+	if (addr < 0 || count < 0 || addr + count > img->count[table]) {
+		luaL_argerror(L, arg, "outside the image");
+	}
+}
+
+/* Checks a table name and range of the image, returning the table */
+static enum lmb_table image_check(lua_State *L, const lmb_image_t *img, int idx, int addr, int count)
+{
+	enum lmb_table table = luaL_checkoption(L, idx, NULL, lmb_table_names);
+	image_range(L, img, table, addr, count, idx + 1);
+	return table;
+}
+
+/* Stores the array at idx into a table of the image, arg is for errors */
+static void image_store(lua_State *L, lmb_image_t *img, enum lmb_table table, int addr, int idx, int arg)
+{
+	luaL_checktype(L, idx, LUA_TTABLE);
+	int n = lua_rawlen(L, idx);
+	image_range(L, img, table, addr, n, arg);
+	bool bits = table == LMB_BITS || table == LMB_INPUT_BITS;
+
+	for (int i = 0; i < n; i++) {
+		lua_rawgeti(L, idx, i + 1);
+		uint16_t v;
+		if (bits && lua_type(L, -1) == LUA_TBOOLEAN) {
+			v = lua_toboolean(L, -1);
+		} else if (lua_type(L, -1) == LUA_TNUMBER) {
+			lua_Number num = lua_tonumber(L, -1);
+			/* as for write_registers, keeping the sign */
+			v = bits ? num != 0 : (uint16_t)(int16_t)num;
+		} else {
+			luaL_argerror(L, arg, "values must be numeric");
+			return;
+		}
+		lua_pop(L, 1);
+		img->vals[table][addr + i] = v;
+	}
+}
+
+/* Sets values of the image from the array at idx, as image_check() */
+static void image_set(lua_State *L, lmb_image_t *img, int tidx, int addr, int idx)
+{
+	enum lmb_table table = luaL_checkoption(L, tidx, NULL, lmb_table_names);
+	image_store(L, img, table, addr, idx, idx);
+}
+
+static int image_get(lua_State *L, const lmb_image_t *img, int tidx, int addr, int n)
+{
+	enum lmb_table table = image_check(L, img, tidx, addr, n);
+
+	lua_createtable(L, n, 0);
+	for (int i = 0; i < n; i++) {
+		lua_pushnumber(L, img->vals[table][addr + i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+/* The image of the unit at idx, the default image if none is given */
+static lmb_image_t *srv_check_image(lua_State *L, lmb_srv_t *srv, int idx)
+{
+	if (lua_isnoneornil(L, idx)) {
+		return &srv->image;
+	}
+	lua_Integer unit = luaL_checkinteger(L, idx);
+	if (unit < 1 || unit > 255 || !srv->units[unit]) {
+		luaL_argerror(L, idx, "no such unit");
+	}
+	return srv->units[unit];
+}
+
+/**
+ * Update an image.
+ * @function srv:set
+ * @param table one of "bits", "input_bits", "registers" or "input_registers"
+ * @param address
+ * @param values array of numbers, or booleans for bits
+ * @param[opt] unit the virtual device to update, defaults to the default image
+ */
+static int srv_set(lua_State *L)
+{
+	lmb_srv_t *srv = srv_check(L, 1);
+	image_set(L, srv_check_image(L, srv, 5), 2, luaL_checkinteger(L, 3), 4);
+	return 0;
+}
+
+/**
+ * Read an image, including what clients have written.
+ * @function srv:get
+ * @param table one of "bits", "input_bits", "registers" or "input_registers"
+ * @param address
+ * @param count
+ * @param[opt] unit the virtual device to read, defaults to the default image
+ * @return array of values
+ */
+static int srv_get(lua_State *L)
+{
+	lmb_srv_t *srv = srv_check(L, 1);
+	return image_get(L, srv_check_image(L, srv, 5), 2, luaL_checkinteger(L, 3), luaL_checkinteger(L, 4));
+}
+
+/**
+ * Update many units at once.
+ * Updates are applied in order, and stop at the first error, with
+ * whatever came before it applied.
+ * @function srv:update
+ * @param units table of unit id to a table of that unit's updates, each
+ *  keyed by table name, of address to an array of values, as @{srv:set}
+ * @usage
+ *  s:update{
+ *    [1] = {input_registers={[0]=meter1, [100]=status1}},
+ *    [2] = {input_registers={[0]=meter2}, bits={[4]={true, false}}},
+ *  }
+ */
+static int srv_update(lua_State *L)
+{
+	lmb_srv_t *srv = srv_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+
+	lua_pushnil(L);
+	while (lua_next(L, 2)) {
+		int unit = srv_key(L, -2, 255);
+		if (unit < 1 || !srv->units[unit] || !lua_istable(L, -1)) {
+			return luaL_argerror(L, 2, "must map units with images to tables of updates");
+		}
+		lmb_image_t *img = srv->units[unit];
+		for (int t = 0; t < 4; t++) {
+			lua_getfield(L, 4, lmb_table_names[t]);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				continue;
+			}
+			luaL_argcheck(L, lua_istable(L, -1), 2, "updates of a table must map addresses to values");
+			lua_pushnil(L);
+			while (lua_next(L, 5)) {
+				int addr = srv_key(L, -2, 0xffff);
+				luaL_argcheck(L, addr >= 0, 2, "updates of a table must map addresses to values");
+				image_store(L, img, t, addr, 7, 2);
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	return 0;
+}
+
+/**
+ * Add a virtual device.
+ * @function srv:add_unit
+ * @param unit the unit id, 1-255, which mustn't have an image already
+ * @param sizes table with how many bits, input_bits, registers and
+ *  input_registers it has, as for @{new_server}
+ */
+static int srv_add_unit(lua_State *L)
+{
+	lmb_srv_t *srv = srv_check(L, 1);
+	srv_unit_new(L, srv, luaL_checkinteger(L, 2), 3);
+	return 0;
+}
+
+/**
+ * Remove a virtual device.
+ * Its requests are treated as any other unknown unit's from now on.
+ * @function srv:remove_unit
+ * @param unit the unit id
+ */
+static int srv_remove_unit(lua_State *L)
+{
+	lmb_srv_t *srv = srv_check(L, 1);
+	lua_Integer unit = luaL_checkinteger(L, 2);
+	if (unit >= 1 && unit <= 255 && srv->units[unit]) {
+		image_free(srv->units[unit]);
+		free(srv->units[unit]);
+		srv->units[unit] = NULL;
+	}
+	return 0;
+}
+
+/**
+ * @function srv:stats
+ * @return table with clients (connected now), accepted, rejected,
+ *  evicted (idle, or not reading their responses), requests, responses,
+ *  exceptions (all, including busy), busy_errors, queue_max,
+ *  wait_avg and wait_max, microseconds requests spent queued,
+ *  unknown_units, requests for units without an image of their own, and
+ *  rtu_errors, requests garbled on the RTU line and responses that
+ *  couldn't be sent
+ */
+static int srv_stats(lua_State *L)
+{
+	lmb_srv_t *srv = srv_check(L, 1);
+	uint32_t served = srv->responses - srv->busy_errors;
+	int clients = 0;
+
+	for (int i = 0; i < srv->nclients; i++) {
+		clients += srv->clients[i].fd >= 0;
+	}
+	lua_newtable(L);
+	lua_pushinteger(L, clients);
+	lua_setfield(L, -2, "clients");
+	lua_pushnumber(L, srv->accepted);
+	lua_setfield(L, -2, "accepted");
+	lua_pushnumber(L, srv->rejected);
+	lua_setfield(L, -2, "rejected");
+	lua_pushnumber(L, srv->evicted);
+	lua_setfield(L, -2, "evicted");
+	lua_pushnumber(L, srv->requests);
+	lua_setfield(L, -2, "requests");
+	lua_pushnumber(L, srv->responses);
+	lua_setfield(L, -2, "responses");
+	lua_pushnumber(L, srv->exceptions);
+	lua_setfield(L, -2, "exceptions");
+	lua_pushnumber(L, srv->busy_errors);
+	lua_setfield(L, -2, "busy_errors");
+	lua_pushinteger(L, srv->queue_max);
+	lua_setfield(L, -2, "queue_max");
+	lua_pushnumber(L, served ? (lua_Number)srv->wait_total / served : 0);
+	lua_setfield(L, -2, "wait_avg");
+	lua_pushnumber(L, srv->wait_max);
+	lua_setfield(L, -2, "wait_max");
+	lua_pushnumber(L, srv->unknown_units);
+	lua_setfield(L, -2, "unknown_units");
+	lua_pushnumber(L, srv->rtu_errors);
+	lua_setfield(L, -2, "rtu_errors");
+	return 1;
+}
+
+/**
+ * Disconnect all clients, and drop queued requests.
+ * The listening socket and RTU line are left alone, they belong to the
+ * caller.
+ * @function srv:close
+ */
+static int srv_close(lua_State *L)
+{
+	lmb_srv_t *srv = srv_check(L, 1);
+
+	for (int i = 0; i < srv->nclients; i++) {
+		srv_client_close(&srv->clients[i]);
+	}
+	return 0;
+}
+
+static int srv_gc(lua_State *L)
+{
+	lmb_srv_t *srv = srv_check(L, 1);
+
+	srv_close(L);
+	for (int i = 0; i < srv->nclients; i++) {
+		free(srv->clients[i].queue);
+	}
+	free(srv->clients);
+	srv->clients = NULL;
+	srv->nclients = 0;
+	image_free(&srv->image);
+	for (int u = 0; u < 256; u++) {
+		if (srv->units[u]) {
+			image_free(srv->units[u]);
+			free(srv->units[u]);
+			srv->units[u] = NULL;
+		}
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, srv->rtu_ref);
+	srv->rtu_ref = LUA_NOREF;
+	srv->rtu = NULL;
+	return 0;
+}
+
+static const struct luaL_Reg srv_M[] = {
+	{"run",			srv_run},
+	{"set",			srv_set},
+	{"get",			srv_get},
+	{"update",		srv_update},
+	{"add_unit",		srv_add_unit},
+	{"remove_unit",		srv_remove_unit},
+	{"stats",		srv_stats},
+	{"close",		srv_close},
+	{"__gc",		srv_gc},
+	{NULL, NULL}
+};
+
+/** Hedged requests.
+ * A hedge group holds several contexts reaching the same device, for
+ * example through two gateways.  Reads go to the first path, and if no
+ * answer comes within the hedge delay, the same read goes out on the next
+ * path too, and so on.  The first good answer wins.  The delay follows a
+ * percentile of recent latencies, so only the slowest few percent of
+ * reads are ever sent twice.
+ *
+ * Answers to abandoned requests still arrive later.  On Modbus/TCP they are
+ * recognised by transaction id and dropped, on RTU the path is skipped
+ * until its response timeout has passed.  The contexts should only be
+ * used through the group.
+ * @section hedging
+ */
+
+#define LMB_HEDGE_MAX_PATHS 8
+/* latencies needed before the percentile means anything */
+#define LMB_HEDGE_MIN_SAMPLES 8
+
+typedef struct {
+	ctx_t *ctx;
+	int ctx_ref;
+	uint8_t rx[MODBUS_TCP_MAX_ADU_LENGTH];
+	int rx_len;
+	bool sent;
+	bool failed;
+	uint16_t tid;
+	uint64_t sent_at;
+	/* RTU only, an abandoned response may still come until then */
+	uint64_t stale_until;
+	uint32_t wins;
+	uint32_t failures;
+} lmb_hedge_path_t;
+
+typedef struct {
+	int npaths;
+	lmb_hedge_path_t paths[LMB_HEDGE_MAX_PATHS];
+	/* fixed delay, or 0 to follow the percentile */
+	uint32_t delay_us;
+	uint32_t min_delay_us;
+	uint32_t initial_us;
+	int percentile;
+	int window;
+	int nlat;
+	int lat_pos;
+	uint32_t requests;
+	uint32_t hedged;
+	uint32_t failures;
+	uint32_t lat[];
+} lmb_hedge_t;
+
+static lmb_hedge_t *hedge_check(lua_State *L, int i)
+{
+	return (lmb_hedge_t *) luaL_checkudata(L, i, MODBUS_META_HEDGE);
+}
+
+static uint32_t hedge_delay(const lmb_hedge_t *h)
+{
+	if (h->delay_us) {
+		return h->delay_us;
+	}
+	if (h->nlat < LMB_HEDGE_MIN_SAMPLES) {
+		return h->initial_us;
+	}
+	uint64_t sorted[h->nlat];
+	for (int i = 0; i < h->nlat; i++) {
+		sorted[i] = h->lat[i];
+	}
+	qsort(sorted, h->nlat, sizeof(sorted[0]), cmp_u64);
+	uint64_t d = sorted[(h->nlat - 1) * h->percentile / 100];
+	return d < h->min_delay_us ? h->min_delay_us : d;
+}
+
+static void hedge_sample(lmb_hedge_t *h, uint64_t us)
+{
+	h->lat[h->lat_pos] = us > UINT32_MAX ? UINT32_MAX : us;
+	h->lat_pos = (h->lat_pos + 1) % h->window;
+	if (h->nlat < h->window) {
+		h->nlat++;
+	}
+}
+
+static uint64_t hedge_path_expiry(const lmb_hedge_path_t *p)
+{
+	return p->sent_at + timeout_get_us(p->ctx->modbus, false);
+}
+
+static void hedge_path_fail(lmb_hedge_path_t *p, int err, int *last_err)
+{
+	p->failed = true;
+	p->failures++;
+	*last_err = err;
+}
+
+static void hedge_send(lmb_hedge_path_t *p, const uint8_t *pdu, int len, int *last_err)
+{
+	int rc;
+
+	p->sent = true;
+	p->sent_at = lmb_now_us();
+	if (!p->ctx->modbus || modbus_get_socket(p->ctx->modbus) < 0) {
+		hedge_path_fail(p, EBADF, last_err);
+		return;
+	}
+	if (p->ctx->is_rtu) {
+		uint8_t raw[MODBUS_MAX_PDU_LENGTH + 1];
+		if (p->ctx->slave < 0) {
+			hedge_path_fail(p, EINVAL, last_err);
+			return;
+		}
+		raw[0] = p->ctx->slave;
+		memcpy(&raw[1], pdu, len);
+		modbus_flush(p->ctx->modbus);
+		p->rx_len = 0;
+		cap_pdu(p->ctx, LMB_CAP_TX, raw[0], 0, pdu, len, 0);
+		rc = modbus_send_raw_request(p->ctx->modbus, raw, len + 1);
+	} else {
+		rc = tcp_send_pdu(p->ctx, p->ctx->slave, pdu, len, &p->tid);
+	}
+	if (rc < 0) {
+		hedge_path_fail(p, errno, last_err);
+	}
+}
+
+/*
+ * Reads what has arrived on a path.
+ * @return the length of the response pdu, now at rsp, 0 if not complete
+ * yet, or -1 if the path failed
+ */
+static int hedge_recv(lmb_hedge_path_t *p, uint8_t *rsp)
+{
+	int s = modbus_get_socket(p->ctx->modbus);
+#if defined(WIN32)
+	int rc = recv(s, (char *)p->rx + p->rx_len, sizeof(p->rx) - p->rx_len, 0);
+#else
+	int rc = read(s, p->rx + p->rx_len, sizeof(p->rx) - p->rx_len);
+#endif
+	if (rc < 0 && errno == EINTR) {
+		return 0;
+	}
+	if (rc <= 0) {
+		if (rc == 0) {
+			errno = ECONNRESET;
+		}
+		return -1;
+	}
+	p->rx_len += rc;
+
+	if (p->ctx->is_rtu) {
+		int want = rtu_response_length(p->rx, p->rx_len);
+		if (want == 0 || (want > 0 && p->rx_len < want)) {
+			return 0;
+		}
+		cap_adu(p->ctx, LMB_CAP_RX, p->rx, want > 0 ? want : p->rx_len, NULL, 0, 0);
+		p->rx_len = 0;
+		if (want < 0 || p->rx[0] != p->ctx->slave) {
+			errno = EMBBADDATA;
+			return -1;
+		}
+		if (crc16(p->rx, want - 2) != (p->rx[want - 2] | p->rx[want - 1] << 8)) {
+			errno = EMBBADCRC;
+			return -1;
+		}
+		memcpy(rsp, &p->rx[1], want - 3);
+		return want - 3;
+	}
+
+	while (p->rx_len >= 7) {
+		int want = 6 + (p->rx[4] << 8 | p->rx[5]);
+		if (p->rx[2] || p->rx[3] || want < 8 || want > MODBUS_TCP_MAX_ADU_LENGTH) {
+			p->rx_len = 0;
+			errno = EMBBADDATA;
+			return -1;
+		}
+		if (p->rx_len < want) {
+			break;
+		}
+		uint16_t tid = p->rx[0] << 8 | p->rx[1];
+		int len = want - 7;
+		cap_adu(p->ctx, LMB_CAP_RX, p->rx, want, NULL, 0, 0);
+		if (tid == p->tid) {
+			memcpy(rsp, &p->rx[7], len);
+		}
+		memmove(p->rx, p->rx + want, p->rx_len - want);
+		p->rx_len -= want;
+		if (tid == p->tid) {
+			return len;
+		}
+		/* an answer to a request we gave up on */
+	}
+	return 0;
+}
+
+/*
+ * One hedged request of a read.
+ * @return the values read, or -1
+ */
+static int hedge_chunk(lmb_hedge_t *h, const lmb_xfer_t *x, int addr, int n, lmb_chunk_t *c, int *winner)
+{
+	uint8_t req[MODBUS_MAX_PDU_LENGTH];
+	uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+	int order[LMB_HEDGE_MAX_PATHS];
+	int norder = 0;
+	int last_err = ETIMEDOUT;
+	int len = xfer_build_pdu(x, addr, n, NULL, req);
+	uint64_t now = lmb_now_us();
+
+	/* RTU paths still waiting out an abandoned answer go last */
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < h->npaths; i++) {
+			lmb_hedge_path_t *p = &h->paths[i];
+			bool stale = p->ctx->is_rtu && now < p->stale_until;
+			if (stale == (pass == 1)) {
+				order[norder++] = i;
+			}
+			p->sent = false;
+			p->failed = false;
+		}
+	}
+
+	int next = 0;
+	uint64_t hedge_at = 0;
+	h->requests++;
+	for (;;) {
+		now = lmb_now_us();
+		int active = 0;
+		for (int i = 0; i < h->npaths; i++) {
+			active += h->paths[i].sent && !h->paths[i].failed;
+		}
+		if (next < norder && (active == 0 || now >= hedge_at)) {
+			lmb_hedge_path_t *p = &h->paths[order[next]];
+			if (p->ctx->is_rtu && now < p->stale_until) {
+				if (active > 0) {
+					/* keep listening to the others meanwhile */
+					hedge_at = p->stale_until;
+					goto wait;
+				}
+				lmb_sleep_us(p->stale_until - now);
+			}
+			if (next > 0) {
+				h->hedged++;
+			}
+			next++;
+			hedge_send(p, req, len, &last_err);
+			hedge_at = lmb_now_us() + hedge_delay(h);
+			continue;
+		}
+		if (active == 0) {
+			errno = last_err;
+			return -1;
+		}
+wait:
+		if (x->dl.at && now >= x->dl.at) {
+			errno = ETIMEDOUT;
+			break;
+		}
+
+		fd_set rfds;
+		int maxfd = -1;
+		uint64_t wake = next < norder ? hedge_at : UINT64_MAX;
+		if (x->dl.at && x->dl.at < wake) {
+			wake = x->dl.at;
+		}
+		FD_ZERO(&rfds);
+		for (int i = 0; i < h->npaths; i++) {
+			lmb_hedge_path_t *p = &h->paths[i];
+			if (!p->sent || p->failed) {
+				continue;
+			}
+			int s = modbus_get_socket(p->ctx->modbus);
+			FD_SET(s, &rfds);
+			maxfd = s > maxfd ? s : maxfd;
+			uint64_t at = hedge_path_expiry(p);
+			wake = at < wake ? at : wake;
+		}
+		uint64_t us = wake > now ? wake - now : 0;
+		struct timeval tv = { .tv_sec = us / 1000000, .tv_usec = us % 1000000 };
+		int rc = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+		if (rc < 0 && errno != EINTR) {
+			break;
+		}
+
+		now = lmb_now_us();
+		for (int i = 0; i < h->npaths; i++) {
+			lmb_hedge_path_t *p = &h->paths[i];
+			if (!p->sent || p->failed) {
+				continue;
+			}
+			int got = 0;
+			if (rc > 0 && FD_ISSET(modbus_get_socket(p->ctx->modbus), &rfds)) {
+				got = hedge_recv(p, rsp);
+			}
+			if (got < 0) {
+				hedge_path_fail(p, errno, &last_err);
+				continue;
+			}
+			if (got == 0) {
+				if (now >= hedge_path_expiry(p)) {
+					hedge_path_fail(p, ETIMEDOUT, &last_err);
+				}
+				continue;
+			}
+			int vals = xfer_parse_pdu(x, req, n, rsp, got, c);
+			bool exception = errno > MODBUS_ENOBASE && errno < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX;
+			if (vals < 0 && (!exception || errno == EMBXGPATH || errno == EMBXGTAR)) {
+				/* garbled, or the gateway couldn't reach it, the device may still be there */
+				hedge_path_fail(p, errno, &last_err);
+				continue;
+			}
+			/* a device exception is an answer too */
+			int err = errno;
+			hedge_sample(h, now - p->sent_at);
+			p->wins++;
+			*winner = i;
+			for (int j = 0; j < h->npaths; j++) {
+				lmb_hedge_path_t *o = &h->paths[j];
+				if (j != i && o->sent && !o->failed && o->ctx->is_rtu) {
+					o->stale_until = hedge_path_expiry(o);
+				}
+			}
+			errno = err;
+			return vals;
+		}
+	}
+
+	/* out of time, leave the stragglers to be recognised later */
+	int err = errno;
+	for (int i = 0; i < h->npaths; i++) {
+		lmb_hedge_path_t *o = &h->paths[i];
+		if (o->sent && !o->failed && o->ctx->is_rtu) {
+			o->stale_until = hedge_path_expiry(o);
+		}
+	}
+	errno = err;
+	return -1;
+}
+
+/**
+ * Create a hedge group.
+ * @function new_hedge
+ * @param opts table of options
+ *  <ul>
+ *  <li>ctxs (required) array of connected contexts to the same device,
+ *  in order of preference, each with its slave set.  Up to 8.</li>
+ *  <li>delay fixed hedge delay in microseconds, instead of following latency</li>
+ *  <li>percentile of recent latencies to hedge after, defaults to 95</li>
+ *  <li>window how many recent latencies to keep, defaults to 100</li>
+ *  <li>min_delay lower bound on the hedge delay, defaults to 1000</li>
+ *  <li>initial_delay until enough latencies are known, defaults to 100000</li>
+ *  </ul>
+ * @return a hedge group
+ * @usage
+ *  local h = mb.new_hedge{ctxs={via_gw1, via_gw2}}
+ *  local regs, path = h:read("registers", 0x2000, 10)
+ */
+static int libmodbus_new_hedge(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "delay");
+	lua_Number delay = luaL_optnumber(L, -1, 0);
+	lua_getfield(L, 1, "percentile");
+	int percentile = luaL_optinteger(L, -1, 95);
+	lua_getfield(L, 1, "window");
+	int window = luaL_optinteger(L, -1, 100);
+	lua_getfield(L, 1, "min_delay");
+	lua_Number min_delay = luaL_optnumber(L, -1, 1000);
+	lua_getfield(L, 1, "initial_delay");
+	lua_Number initial = luaL_optnumber(L, -1, 100000);
+	lua_pop(L, 5);
+	if (delay < 0 || min_delay < 0 || initial < 0 || percentile < 1 || percentile > 100 ||
+		window < LMB_HEDGE_MIN_SAMPLES || window > 1000) {
+		return luaL_argerror(L, 1, "delays must not be negative, percentile 1-100, window 8-1000");
+	}
+	lua_getfield(L, 1, "ctxs");
+	int cidx = lua_gettop(L);
+	luaL_checktype(L, cidx, LUA_TTABLE);
+	int n = lua_rawlen(L, cidx);
+	if (n < 1 || n > LMB_HEDGE_MAX_PATHS) {
+		return luaL_argerror(L, 1, "between 1 and 8 contexts are required");
+	}
+
+	lmb_hedge_t *h = lua_newuserdata(L, sizeof(*h) + window * sizeof(h->lat[0]));
+	memset(h, 0, sizeof(*h));
+	h->delay_us = delay;
+	h->min_delay_us = min_delay;
+	h->initial_us = initial;
+	h->percentile = percentile;
+	h->window = window;
+	for (int i = 0; i < LMB_HEDGE_MAX_PATHS; i++) {
+		h->paths[i].ctx_ref = LUA_NOREF;
+	}
+	luaL_getmetatable(L, MODBUS_META_HEDGE);
+	lua_setmetatable(L, -2);
+
+	for (int i = 0; i < n; i++) {
+		lua_rawgeti(L, cidx, i + 1);
+		h->paths[i].ctx = ctx_check(L, -1);
+		if (h->paths[i].ctx->shared) {
+			return luaL_argerror(L, 1, "paths can't be shared contexts");
+		}
+		h->paths[i].ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		h->npaths++;
+	}
+	return 1;
+}
+
+/**
+ * Read, hedged across the group's paths.
+ * Reads larger than one request are split as per the smallest of the
+ * contexts' @{set_request_limits}, each request hedged on its own.
+ * @function hedge:read
+ * @param table one of "bits", "input_bits", "registers" or "input_registers"
+ * @param address
+ * @param count
+ * @param[opt] deadline see @{monotonic}, covering all requests
+ * @return[1] an array of values, as per the context's read methods
+ * @return[1] index of the path that answered (the last request)
+ * @return[2] nil
+ * @return[2] error message, from the last path to fail
+ */
+static int hedge_read(lua_State *L)
+{
+	lmb_hedge_t *h = hedge_check(L, 1);
+	lmb_xfer_t x = { .table = luaL_checkoption(L, 2, NULL, lmb_table_names) };
+	x.addr = luaL_checkinteger(L, 3);
+	x.count = luaL_checkinteger(L, 4);
+	bool bits = x.table == LMB_BITS || x.table == LMB_INPUT_BITS;
+	xfer_check_range(L, x.addr, x.count, 4, bits ? "requested too many bits" : "requested too many registers");
+	deadline_opt(L, 5, &x.dl);
+
+	int per = bits ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+	for (int i = 0; i < h->npaths; i++) {
+		if (!h->paths[i].ctx->modbus) {
+			return luaL_error(L, "context %d has been closed", i + 1);
+		}
+		if (h->paths[i].ctx->shared) {
+			return luaL_error(L, "context %d was shared since", i + 1);
+		}
+		int lim = xfer_limit(h->paths[i].ctx, &x);
+		per = lim < per ? lim : per;
+	}
+
+	lmb_chunk_t c;
+	int winner = 0;
+	lua_createtable(L, x.count, 0);
+	x.idx = lua_gettop(L);
+	for (int off = 0; off < x.count; off += per) {
+		int n = x.count - off < per ? x.count - off : per;
+		int rc = hedge_chunk(h, &x, x.addr + off, n, &c, &winner);
+		if (rc < 0) {
+			h->failures++;
+			return libmodbus_rc_to_nil_error(L, rc, n);
+		}
+		xfer_store(L, &x, off, n, &c);
+	}
+	lua_pushinteger(L, winner + 1);
+	return 2;
+}
+
+/**
+ * @function hedge:stats
+ * @return table with requests, hedged (extra requests sent), failures,
+ *  delay, the current hedge delay, and paths, an array with wins and
+ *  failures for each path
+ */
+static int hedge_stats(lua_State *L)
+{
+	lmb_hedge_t *h = hedge_check(L, 1);
+
+	lua_newtable(L);
+	lua_pushnumber(L, h->requests);
+	lua_setfield(L, -2, "requests");
+	lua_pushnumber(L, h->hedged);
+	lua_setfield(L, -2, "hedged");
+	lua_pushnumber(L, h->failures);
+	lua_setfield(L, -2, "failures");
+	lua_pushnumber(L, hedge_delay(h));
+	lua_setfield(L, -2, "delay");
+	lua_newtable(L);
+	for (int i = 0; i < h->npaths; i++) {
+		lua_newtable(L);
+		lua_pushnumber(L, h->paths[i].wins);
+		lua_setfield(L, -2, "wins");
+		lua_pushnumber(L, h->paths[i].failures);
+		lua_setfield(L, -2, "failures");
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "paths");
+	return 1;
+}
+
+static int hedge_gc(lua_State *L)
+{
+	lmb_hedge_t *h = hedge_check(L, 1);
+
+	for (int i = 0; i < h->npaths; i++) {
+		luaL_unref(L, LUA_REGISTRYINDEX, h->paths[i].ctx_ref);
+		h->paths[i].ctx_ref = LUA_NOREF;
+	}
+	h->npaths = 0;
+	return 0;
+}
+
+static const struct luaL_Reg hedge_M[] = {
+	{"read",		hedge_read},
+	{"stats",		hedge_stats},
+	{"__gc",		hedge_gc},
+	{NULL, NULL}
+};
+
+/** Connection pools.
+ * Gateways often front many units, but accept only a few connections.
+ * A pool keeps a fixed number of connections to one gateway, and hands
+ * them out per request, with the unit id set, or spreads a batch of reads
+ * over all of them at once.
+ * @section pool
+ */
+
+typedef struct {
+	ctx_t *ctx;
+	int ctx_ref;
+	bool leased;
+	uint64_t last_used;
+	/* read_many only, the job in flight */
+	int job;
+	uint8_t req[5];
+	uint16_t tid;
+	uint64_t sent_at;
+	uint8_t rx[MODBUS_TCP_MAX_ADU_LENGTH];
+	int rx_len;
+} lmb_pool_conn_t;
+
+typedef struct {
+	int size;
+	uint32_t keepalive_us;
+	int keepalive_unit;
+	int keepalive_addr;
+	uint32_t leases;
+	uint32_t exhausted;
+	uint32_t connects;
+	uint32_t keepalives;
+	uint32_t requests;
+	lmb_pool_conn_t conns[];
+} lmb_pool_t;
+
+/* One request's worth of a read_many entry */
+typedef struct {
+	int req;
+	int unit;
+	lmb_xfer_t x;
+	int off;
+	int n;
+} lmb_pool_job_t;
+
+static lmb_pool_t *pool_check(lua_State *L, int i)
+{
+	return (lmb_pool_t *) luaL_checkudata(L, i, MODBUS_META_POOL);
+}
+
+static bool pool_connected(const lmb_pool_conn_t *c)
+{
+	return c->ctx->modbus && modbus_get_socket(c->ctx->modbus) >= 0;
+}
+
+static void pool_disconnect(lmb_pool_conn_t *c)
+{
+	modbus_close(c->ctx->modbus);
+	/* older libmodbus leaves the closed socket number behind */
+	modbus_set_socket(c->ctx->modbus, -1);
+	c->rx_len = 0;
+}
+
+static int pool_connect(lmb_pool_t *pool, lmb_pool_conn_t *c)
+{
+	if (pool_connected(c)) {
+		return 0;
+	}
+	if (!c->ctx->modbus) {
+		errno = EBADF;
+		return -1;
+	}
+	pool->connects++;
+	if (modbus_connect(c->ctx->modbus) < 0) {
+		int err = errno;
+		modbus_set_socket(c->ctx->modbus, -1);
+		errno = err;
+		return -1;
+	}
+	c->last_used = lmb_now_us();
+	c->rx_len = 0;
+	return 0;
+}
+
+/**
+ * Create a connection pool.
+ * Connections are made as they are first needed, or by @{pool:maintain}.
+ * @function new_pool
+ * @param opts table of options
+ *  <ul>
+ *  <li>host (required) eg "192.168.1.100"</li>
+ *  <li>service defaults to "502"</li>
+ *  <li>size number of connections, defaults to 4</li>
+ *  <li>response_timeout microseconds, for all connections</li>
+ *  <li>keepalive microseconds a connection may sit idle before
+ *  @{pool:maintain} reads a register on it, defaults to 0, never</li>
+ *  <li>keepalive_unit, keepalive_addr the holding register it reads,
+ *  defaults to unit 1, address 0.  An exception keeps it alive too.</li>
+ *  </ul>
+ * @return a pool
+ * @usage
+ *  local pool = mb.new_pool{host="10.0.0.20", size=4, keepalive=30000000}
+ *  local dev = assert(pool:lease(12))
+ *  local regs = dev:read_registers(0, 10)
+ *  pool:release(dev)
+ *  local all = pool:read_many{{unit=1, table="registers", addr=0, count=10},
+ *      {unit=2, table="input_registers", addr=100, count=4}}
  */
-static int helper_get_s32(lua_State *L)
+static int libmodbus_new_pool(lua_State *L)
 {
-	const uint16_t in1 = luaL_checknumber(L, 1);
-	const uint16_t in2 = luaL_checknumber(L, 2);
-	int32_t out = in1 << 16 | in2;
-	lua_pushinteger(L, out);
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "host");
+	const char *host = luaL_checkstring(L, -1);
+	lua_getfield(L, 1, "service");
+	const char *service = luaL_optstring(L, -1, "502");
+	lua_getfield(L, 1, "size");
+	int size = luaL_optinteger(L, -1, 4);
+	lua_getfield(L, 1, "response_timeout");
+	lua_Number rto = luaL_optnumber(L, -1, 0);
+	lua_getfield(L, 1, "keepalive");
+	lua_Number keepalive = luaL_optnumber(L, -1, 0);
+	lua_getfield(L, 1, "keepalive_unit");
+	int ka_unit = luaL_optinteger(L, -1, 1);
+	lua_getfield(L, 1, "keepalive_addr");
+	int ka_addr = luaL_optinteger(L, -1, 0);
+	if (size < 1 || size > 64) {
+		return luaL_argerror(L, 1, "size must be between 1 and 64");
+	}
+	if (rto < 0 || keepalive < 0 || ka_unit < 0 || ka_unit > 0xff || ka_addr < 0 || ka_addr > 0xffff) {
+		return luaL_argerror(L, 1, "bad timeout or keepalive");
+	}
+
+	lmb_pool_t *pool = lua_newuserdata(L, sizeof(*pool) + size * sizeof(pool->conns[0]));
+	memset(pool, 0, sizeof(*pool));
+	pool->keepalive_us = keepalive;
+	pool->keepalive_unit = ka_unit;
+	pool->keepalive_addr = ka_addr;
+	luaL_getmetatable(L, MODBUS_META_POOL);
+	lua_setmetatable(L, -2);
+
+	for (int i = 0; i < size; i++) {
+		lmb_pool_conn_t *c = &pool->conns[i];
+		memset(c, 0, sizeof(*c));
+		lua_pushcfunction(L, libmodbus_new_tcp_pi);
+		lua_pushstring(L, host);
+		lua_pushstring(L, service);
+		lua_call(L, 2, 1);
+		c->ctx = ctx_check(L, -1);
+		c->ctx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		pool->size++;
+		if (rto > 0) {
+			timeout_set_us(c->ctx->modbus, false, rto);
+		}
+	}
 	return 1;
 }
 
 /**
- * 2x16bit registers as number to signed 32 bit (reverse order)
- * @function get_s32le
- * @param 1 16bit register
- * @param 2 16bit register
- * @return 32bit number
+ * Take a connection for exclusive use, until it is released.
+ * The least recently used free connection is taken, connecting it if needed.
+ * @function pool:lease
+ * @param unit the unit id to address, set as the context's slave
+ * @return[1] a context
+ * @return[2] nil
+ * @return[2] error message, "Resource temporarily unavailable" if all
+ *  connections are leased
  */
-static int helper_get_s32le(lua_State *L)
+static int pool_lease(lua_State *L)
+{
+	lmb_pool_t *pool = pool_check(L, 1);
+	int unit = luaL_checkinteger(L, 2);
+	lmb_pool_conn_t *best = NULL;
+
+	if (unit < 0 || unit > 0xff) {
+		return luaL_argerror(L, 2, "unit must be 0-255");
+	}
+	for (int i = 0; i < pool->size; i++) {
+		lmb_pool_conn_t *c = &pool->conns[i];
+		if (c->leased) {
+			continue;
+		}
+		/* warm connections first, then the longest idle */
+		if (!best || (pool_connected(c) && !pool_connected(best)) ||
+			(pool_connected(c) == pool_connected(best) && c->last_used < best->last_used)) {
+			best = c;
+		}
+	}
+	if (!best) {
+		pool->exhausted++;
+		errno = EAGAIN;
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+	if (pool_connect(pool, best) < 0) {
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+	if (modbus_set_slave(best->ctx->modbus, unit) == 0) {
+		best->ctx->slave = unit;
+	}
+	best->leased = true;
+	pool->leases++;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, best->ctx_ref);
+	return 1;
+}
+
+/**
+ * Return a leased connection.
+ * @function pool:release
+ * @param ctx the context from @{pool:lease}
+ * @param[opt] broken true to close it, if it was left in an unknown state,
+ *  for example after a timeout.  It is reconnected when next needed.
+ */
+static int pool_release(lua_State *L)
+{
+	lmb_pool_t *pool = pool_check(L, 1);
+	ctx_t *ctx = ctx_check(L, 2);
+	bool broken = lua_toboolean(L, 3);
+
+	for (int i = 0; i < pool->size; i++) {
+		lmb_pool_conn_t *c = &pool->conns[i];
+		if (c->ctx == ctx && c->leased) {
+			c->leased = false;
+			c->last_used = lmb_now_us();
+			if (broken) {
+				pool_disconnect(c);
+			}
+			return 0;
+		}
+	}
+	return luaL_argerror(L, 2, "not leased from this pool");
+}
+
+/**
+ * Keep connections warm.
+ * Reconnects any that dropped, and reads a register on any idle for longer
+ * than the keepalive option, so gateways don't close them.  Call this
+ * periodically, it does nothing for leased connections.
+ * @function pool:maintain
+ * @return count of connections up
+ */
+static int pool_maintain(lua_State *L)
+{
+	lmb_pool_t *pool = pool_check(L, 1);
+	int up = 0;
+
+	for (int i = 0; i < pool->size; i++) {
+		lmb_pool_conn_t *c = &pool->conns[i];
+		if (c->leased) {
+			up += pool_connected(c);
+			continue;
+		}
+		if (pool_connect(pool, c) < 0) {
+			continue;
+		}
+		uint64_t now = lmb_now_us();
+		if (pool->keepalive_us && now - c->last_used >= pool->keepalive_us) {
+			uint8_t req[5] = { MODBUS_FC_READ_HOLDING_REGISTERS, pool->keepalive_addr >> 8, pool->keepalive_addr & 0xff, 0, 1 };
+			uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+			pool->keepalives++;
+			if (raw_transact(c->ctx, pool->keepalive_unit, req, sizeof(req), rsp, NULL) < 0 &&
+				!(errno > MODBUS_ENOBASE && errno < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX)) {
+				pool_disconnect(c);
+				if (pool_connect(pool, c) < 0) {
+					continue;
+				}
+			}
+			c->last_used = lmb_now_us();
+		}
+		up++;
+	}
+	lua_pushinteger(L, up);
+	return 1;
+}
+
+/* Reads what arrived for the job in flight on c, 1 when done, 0 if not yet, -1 on error */
+static int pool_recv(lmb_pool_conn_t *c, lmb_pool_job_t *job, lmb_chunk_t *chunk)
+{
+	int s = modbus_get_socket(c->ctx->modbus);
+	int rc = recv(s, (char *)c->rx + c->rx_len, sizeof(c->rx) - c->rx_len, 0);
+	if (rc < 0 && errno == EINTR) {
+		return 0;
+	}
+	if (rc <= 0) {
+		if (rc == 0) {
+			errno = ECONNRESET;
+		}
+		return -1;
+	}
+	c->rx_len += rc;
+	while (c->rx_len >= 7) {
+		int want = 6 + (c->rx[4] << 8 | c->rx[5]);
+		if (c->rx[2] || c->rx[3] || want < 8 || want > MODBUS_TCP_MAX_ADU_LENGTH) {
+			errno = EMBBADDATA;
+			return -1;
+		}
+		if (c->rx_len < want) {
+			return 0;
+		}
+		bool ours = (c->rx[0] << 8 | c->rx[1]) == c->tid && c->rx[6] == job->unit;
+		int parsed = 0;
+		if (ours) {
+			parsed = xfer_parse_pdu(&job->x, c->req, job->n, &c->rx[7], want - 7, chunk);
+		}
+		memmove(c->rx, c->rx + want, c->rx_len - want);
+		c->rx_len -= want;
+		if (ours) {
+			return parsed < 0 ? -1 : 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Read from many units at once.
+ * The reads are split into requests as per the connections' limits, and
+ * these are spread over all free connections, one in flight on each.
+ * A connection that times out is closed, and reconnected when next needed.
+ * @function pool:read_many
+ * @param reqs array of tables, each with unit, table ("bits",
+ *  "input_bits", "registers" or "input_registers"), addr and count
+ * @param[opt] deadline see @{monotonic}, covering everything
+ * @return[1] array of results, in the order of reqs, each an array of
+ *  values, or an error message
+ * @return[2] nil
+ * @return[2] error message, if no connection could be used at all
+ */
+static int pool_read_many(lua_State *L)
+{
+	lmb_pool_t *pool = pool_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lmb_deadline_t dl;
+	deadline_opt(L, 3, &dl);
+	int nreqs = lua_rawlen(L, 2);
+
+	/* a chunk limit any of the connections will take */
+	int max_regs = MODBUS_MAX_READ_REGISTERS, max_bits = MODBUS_MAX_READ_BITS;
+	for (int i = 0; i < pool->size; i++) {
+		ctx_t *ctx = pool->conns[i].ctx;
+		max_regs = ctx->max_read_regs < max_regs ? ctx->max_read_regs : max_regs;
+		max_bits = ctx->max_read_bits < max_bits ? ctx->max_read_bits : max_bits;
+	}
+
+	/* validate and count the jobs first */
+	int njobs = 0;
+	for (int i = 1; i <= nreqs; i++) {
+		lua_rawgeti(L, 2, i);
+		luaL_checktype(L, -1, LUA_TTABLE);
+		lua_getfield(L, -1, "table");
+		enum lmb_table table = luaL_checkoption(L, -1, NULL, lmb_table_names);
+		lua_getfield(L, -2, "unit");
+		int unit = luaL_checkinteger(L, -1);
+		lua_getfield(L, -3, "addr");
+		int addr = luaL_checkinteger(L, -1);
+		lua_getfield(L, -4, "count");
+		int count = luaL_checkinteger(L, -1);
+		lua_pop(L, 5);
+		bool bits = table == LMB_BITS || table == LMB_INPUT_BITS;
+		if (unit < 0 || unit > 0xff || addr < 0 || count < 1 || addr + count > 0x10000) {
+			return luaL_error(L, "read %d: bad unit, address or count", i);
+		}
+		int per = bits ? max_bits : max_regs;
+		njobs += (count + per - 1) / per;
+	}
+
+	lmb_pool_job_t *jobs = lua_newuserdata(L, (njobs ? njobs : 1) * sizeof(*jobs));
+	lmb_chunk_t *chunk = lua_newuserdata(L, sizeof(*chunk));
+	lua_createtable(L, nreqs, 0);
+	int results = lua_gettop(L);
+	int j = 0;
+	for (int i = 1; i <= nreqs; i++) {
+		lua_rawgeti(L, 2, i);
+		lua_getfield(L, -1, "table");
+		enum lmb_table table = luaL_checkoption(L, -1, NULL, lmb_table_names);
+		lua_getfield(L, -2, "unit");
+		int unit = lua_tointeger(L, -1);
+		lua_getfield(L, -3, "addr");
+		int addr = lua_tointeger(L, -1);
+		lua_getfield(L, -4, "count");
+		int count = lua_tointeger(L, -1);
+		lua_pop(L, 5);
+		bool bits = table == LMB_BITS || table == LMB_INPUT_BITS;
+		int per = bits ? max_bits : max_regs;
+		for (int off = 0; off < count; off += per) {
+			lmb_pool_job_t *job = &jobs[j++];
+			memset(job, 0, sizeof(*job));
+			job->req = i;
+			job->unit = unit;
+			job->x.table = table;
+			job->x.addr = addr;
+			job->x.count = count;
+			job->off = off;
+			job->n = count - off < per ? count - off : per;
+		}
+		lua_createtable(L, count, 0);
+		lua_rawseti(L, results, i);
+	}
+
+	/* which connections we may use */
+	lmb_pool_conn_t *use[pool->size];
+	int nuse = 0;
+	int last_err = EAGAIN;
+	for (int i = 0; i < pool->size; i++) {
+		lmb_pool_conn_t *c = &pool->conns[i];
+		if (c->leased) {
+			continue;
+		}
+		if (pool_connect(pool, c) < 0) {
+			last_err = errno;
+			continue;
+		}
+		c->job = -1;
+		use[nuse++] = c;
+	}
+	if (nuse == 0 && njobs > 0) {
+		errno = last_err;
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+
+	int next = 0, done = 0;
+	while (done < njobs) {
+		uint64_t now = lmb_now_us();
+		fd_set rfds;
+		int maxfd = -1, active = 0;
+		uint64_t wake = dl.at ? dl.at : UINT64_MAX;
+		FD_ZERO(&rfds);
+		for (int i = 0; i < nuse; i++) {
+			lmb_pool_conn_t *c = use[i];
+			/* skip the rest of a read that has already failed */
+			while (c->job < 0 && next < njobs) {
+				lua_rawgeti(L, results, jobs[next].req);
+				bool failed = lua_type(L, -1) == LUA_TSTRING;
+				lua_pop(L, 1);
+				if (!failed) {
+					break;
+				}
+				next++;
+				done++;
+			}
+			if (c->job < 0 && next < njobs && pool_connected(c)) {
+				lmb_pool_job_t *job = &jobs[next];
+				int len = xfer_build_pdu(&job->x, job->x.addr + job->off, job->n, NULL, c->req);
+				if (tcp_send_pdu(c->ctx, job->unit, c->req, len, &c->tid) < 0) {
+					pool_disconnect(c);
+					continue;
+				}
+				c->job = next++;
+				c->sent_at = now;
+				pool->requests++;
+			}
+			if (c->job >= 0) {
+				int s = modbus_get_socket(c->ctx->modbus);
+				FD_SET(s, &rfds);
+				maxfd = s > maxfd ? s : maxfd;
+				uint64_t at = c->sent_at + timeout_get_us(c->ctx->modbus, false);
+				wake = at < wake ? at : wake;
+				active++;
+			}
+		}
+		if (active == 0) {
+			/* every connection died under us, fail what's left */
+			for (; next < njobs; next++, done++) {
+				lua_pushstring(L, modbus_strerror(ECONNRESET));
+				lua_rawseti(L, results, jobs[next].req);
+			}
+			break;
+		}
+
+		uint64_t us = wake > now ? wake - now : 0;
+		struct timeval tv = { .tv_sec = us / 1000000, .tv_usec = us % 1000000 };
+		int rc = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+		if (rc < 0 && errno != EINTR) {
+			return libmodbus_rc_to_nil_error(L, -1, 0);
+		}
+		now = lmb_now_us();
+		bool expired = dl.at && now >= dl.at;
+		for (int i = 0; i < nuse; i++) {
+			lmb_pool_conn_t *c = use[i];
+			if (c->job < 0) {
+				continue;
+			}
+			lmb_pool_job_t *job = &jobs[c->job];
+			int got = 0;
+			if (rc > 0 && FD_ISSET(modbus_get_socket(c->ctx->modbus), &rfds)) {
+				got = pool_recv(c, job, chunk);
+			}
+			if (got == 0 && (expired || now >= c->sent_at + timeout_get_us(c->ctx->modbus, false))) {
+				errno = ETIMEDOUT;
+				got = -1;
+			}
+			if (got == 0) {
+				continue;
+			}
+			lua_rawgeti(L, results, job->req);
+			if (got > 0 && lua_istable(L, -1)) {
+				job->x.idx = lua_gettop(L);
+				xfer_store(L, &job->x, job->off, job->n, chunk);
+			} else if (got < 0) {
+				int err = errno;
+				lua_pushstring(L, modbus_strerror(err));
+				lua_rawseti(L, results, job->req);
+				/* exceptions leave the connection fine, anything else doesn't */
+				if (!(err > MODBUS_ENOBASE && err < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX)) {
+					pool_disconnect(c);
+				}
+			}
+			lua_pop(L, 1);
+			c->last_used = now;
+			c->job = -1;
+			done++;
+		}
+		if (expired) {
+			for (; next < njobs; next++, done++) {
+				lua_pushstring(L, modbus_strerror(ETIMEDOUT));
+				lua_rawseti(L, results, jobs[next].req);
+			}
+		}
+	}
+	lua_pushvalue(L, results);
+	return 1;
+}
+
+/**
+ * @function pool:stats
+ * @return table with size, connected, leased, and counts of leases,
+ *  exhausted (leases refused), connects, keepalives and requests
+ *  (made by read_many)
+ */
+static int pool_stats(lua_State *L)
+{
+	lmb_pool_t *pool = pool_check(L, 1);
+	int connected = 0, leased = 0;
+
+	for (int i = 0; i < pool->size; i++) {
+		connected += pool_connected(&pool->conns[i]);
+		leased += pool->conns[i].leased;
+	}
+	lua_newtable(L);
+	lua_pushinteger(L, pool->size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, connected);
+	lua_setfield(L, -2, "connected");
+	lua_pushinteger(L, leased);
+	lua_setfield(L, -2, "leased");
+	lua_pushnumber(L, pool->leases);
+	lua_setfield(L, -2, "leases");
+	lua_pushnumber(L, pool->exhausted);
+	lua_setfield(L, -2, "exhausted");
+	lua_pushnumber(L, pool->connects);
+	lua_setfield(L, -2, "connects");
+	lua_pushnumber(L, pool->keepalives);
+	lua_setfield(L, -2, "keepalives");
+	lua_pushnumber(L, pool->requests);
+	lua_setfield(L, -2, "requests");
+	return 1;
+}
+
+/**
+ * Close all connections, leased or not.
+ * @function pool:close
+ */
+static int pool_close(lua_State *L)
+{
+	lmb_pool_t *pool = pool_check(L, 1);
+
+	for (int i = 0; i < pool->size; i++) {
+		if (pool->conns[i].ctx->modbus) {
+			pool_disconnect(&pool->conns[i]);
+		}
+	}
+	return 0;
+}
+
+static int pool_gc(lua_State *L)
+{
+	lmb_pool_t *pool = pool_check(L, 1);
+
+	for (int i = 0; i < pool->size; i++) {
+		luaL_unref(L, LUA_REGISTRYINDEX, pool->conns[i].ctx_ref);
+		pool->conns[i].ctx_ref = LUA_NOREF;
+	}
+	pool->size = 0;
+	return 0;
+}
+
+static const struct luaL_Reg pool_M[] = {
+	{"lease",		pool_lease},
+	{"release",		pool_release},
+	{"maintain",		pool_maintain},
+	{"read_many",		pool_read_many},
+	{"stats",		pool_stats},
+	{"close",		pool_close},
+	{"__gc",		pool_gc},
+	{NULL, NULL}
+};
+
+/** Encoding.
+ * Reads can be encoded straight to JSON, MessagePack or CBOR, without
+ * building lua tables in between.  Whole numbers are encoded as integers,
+ * anything else as doubles, or floats for "f32" fields (MessagePack, CBOR).
+ * JSON has no NaN or infinities, these become null.
+ * @section encoding
+ */
+
+enum lmb_format {
+	LMB_JSON,
+	LMB_MSGPACK,
+	LMB_CBOR,
+};
+
+static const char *const lmb_format_names[] = {
+	"json", "msgpack", "cbor", NULL
+};
+
+#define LMB_ENC_DEPTH 8
+
+typedef struct {
+	luaL_Buffer *b;
+	enum lmb_format fmt;
+	int depth;
+	struct {
+		bool map;
+		int n;
+	} level[LMB_ENC_DEPTH];
+} lmb_enc_t;
+
+static void enc_be(lmb_enc_t *e, uint64_t v, int bytes)
+{
+	for (int i = bytes - 1; i >= 0; i--) {
+		luaL_addchar(e->b, (char)(v >> (8 * i)));
+	}
+}
+
+/* CBOR initial byte and argument */
+static void enc_cbor_head(lmb_enc_t *e, int major, uint64_t v)
+{
+	major <<= 5;
+	if (v < 24) {
+		luaL_addchar(e->b, (char)(major | v));
+	} else if (v <= 0xff) {
+		luaL_addchar(e->b, (char)(major | 24));
+		enc_be(e, v, 1);
+	} else if (v <= 0xffff) {
+		luaL_addchar(e->b, (char)(major | 25));
+		enc_be(e, v, 2);
+	} else if (v <= 0xffffffff) {
+		luaL_addchar(e->b, (char)(major | 26));
+		enc_be(e, v, 4);
+	} else {
+		luaL_addchar(e->b, (char)(major | 27));
+		enc_be(e, v, 8);
+	}
+}
+
+/* MessagePack type byte and length, for the 8/16/32 bit variants at first */
+static void enc_msgpack_len(lmb_enc_t *e, uint8_t first, uint64_t n)
+{
+	if (n <= 0xff && first == 0xd9) {
+		luaL_addchar(e->b, (char)first);
+		enc_be(e, n, 1);
+	} else if (n <= 0xffff) {
+		luaL_addchar(e->b, (char)(first == 0xd9 ? 0xda : first));
+		enc_be(e, n, 2);
+	} else {
+		luaL_addchar(e->b, (char)(first == 0xd9 ? 0xdb : first + 1));
+		enc_be(e, n, 4);
+	}
+}
+
+/* JSON separators before each key or value */
+static void enc_pre(lmb_enc_t *e)
+{
+	if (e->depth == 0) {
+		return;
+	}
+	int n = e->level[e->depth - 1].n++;
+	if (e->fmt != LMB_JSON) {
+		return;
+	}
+	if (e->level[e->depth - 1].map && n % 2) {
+		luaL_addchar(e->b, ':');
+	} else if (n) {
+		luaL_addchar(e->b, ',');
+	}
+}
+
+static void enc_begin(lmb_enc_t *e, bool map, uint32_t n)
+{
+	enc_pre(e);
+	switch (e->fmt) {
+	case LMB_JSON:
+		luaL_addchar(e->b, map ? '{' : '[');
+		break;
+	case LMB_MSGPACK:
+		if (n < 16) {
+			luaL_addchar(e->b, (char)((map ? 0x80 : 0x90) | n));
+		} else {
+			enc_msgpack_len(e, map ? 0xde : 0xdc, n);
+		}
+		break;
+	case LMB_CBOR:
+		enc_cbor_head(e, map ? 5 : 4, n);
+		break;
+	}
+	assert(e->depth < LMB_ENC_DEPTH);
+	e->level[e->depth].map = map;
+	e->level[e->depth].n = 0;
+	e->depth++;
+}
+
+static void enc_end(lmb_enc_t *e)
+{
+	e->depth--;
+	if (e->fmt == LMB_JSON) {
+		luaL_addchar(e->b, e->level[e->depth].map ? '}' : ']');
+	}
+}
+
+static void enc_str(lmb_enc_t *e, const char *s, size_t len)
+{
+	enc_pre(e);
+	switch (e->fmt) {
+	case LMB_JSON:
+		luaL_addchar(e->b, '"');
+		for (size_t i = 0; i < len; i++) {
+			unsigned char c = s[i];
+			if (c == '"' || c == '\\') {
+				luaL_addchar(e->b, '\\');
+				luaL_addchar(e->b, c);
+			} else if (c < 0x20) {
+				char esc[8];
+				snprintf(esc, sizeof(esc), "\\u%04x", c);
+				luaL_addstring(e->b, esc);
+			} else {
+				luaL_addchar(e->b, c);
+			}
+		}
+		luaL_addchar(e->b, '"');
+		return;
+	case LMB_MSGPACK:
+		if (len < 32) {
+			luaL_addchar(e->b, (char)(0xa0 | len));
+		} else {
+			enc_msgpack_len(e, 0xd9, len);
+		}
+		break;
+	case LMB_CBOR:
+		enc_cbor_head(e, 3, len);
+		break;
+	}
+	luaL_addlstring(e->b, s, len);
+}
+
+static void enc_int(lmb_enc_t *e, int64_t v)
+{
+	char num[32];
+
+	switch (e->fmt) {
+	case LMB_JSON:
+		snprintf(num, sizeof(num), "%lld", (long long)v);
+		luaL_addstring(e->b, num);
+		break;
+	case LMB_MSGPACK:
+		if (v >= 0 && v < 128) {
+			luaL_addchar(e->b, (char)v);
+		} else if (v < 0 && v >= -32) {
+			luaL_addchar(e->b, (char)(0xe0 | (v + 32)));
+		} else if (v >= 0) {
+			int bytes = v <= 0xff ? 1 : v <= 0xffff ? 2 : v <= 0xffffffff ? 4 : 8;
+			luaL_addchar(e->b, (char)(bytes == 1 ? 0xcc : bytes == 2 ? 0xcd : bytes == 4 ? 0xce : 0xcf));
+			enc_be(e, v, bytes);
+		} else {
+			int bytes = v >= INT8_MIN ? 1 : v >= INT16_MIN ? 2 : v >= INT32_MIN ? 4 : 8;
+			luaL_addchar(e->b, (char)(bytes == 1 ? 0xd0 : bytes == 2 ? 0xd1 : bytes == 4 ? 0xd2 : 0xd3));
+			enc_be(e, (uint64_t)v, bytes);
+		}
+		break;
+	case LMB_CBOR:
+		if (v >= 0) {
+			enc_cbor_head(e, 0, v);
+		} else {
+			enc_cbor_head(e, 1, (uint64_t)(-1 - v));
+		}
+		break;
+	}
+}
+
+/* A number, as an integer if it is one, single precision if asked */
+static void enc_num(lmb_enc_t *e, double v, bool single)
+{
+	enc_pre(e);
+	if (v == floor(v) && v >= -9.2233720368547758e18 && v < 9.2233720368547758e18) {
+		enc_int(e, (int64_t)v);
+		return;
+	}
+	switch (e->fmt) {
+	case LMB_JSON:
+		if (v != v || v - v != 0) {
+			luaL_addstring(e->b, "null");
+		} else {
+			char num[32];
+			snprintf(num, sizeof(num), single ? "%.9g" : "%.17g", v);
+			luaL_addstring(e->b, num);
+		}
+		break;
+	case LMB_MSGPACK:
+	case LMB_CBOR:
+		if (single) {
+			float f = v;
+			uint32_t u;
+			memcpy(&u, &f, sizeof(u));
+			luaL_addchar(e->b, (char)(e->fmt == LMB_MSGPACK ? 0xca : 0xfa));
+			enc_be(e, u, 4);
+		} else {
+			uint64_t u;
+			memcpy(&u, &v, sizeof(u));
+			luaL_addchar(e->b, (char)(e->fmt == LMB_MSGPACK ? 0xcb : 0xfb));
+			enc_be(e, u, 8);
+		}
+		break;
+	}
+}
+
+static void enc_key(lmb_enc_t *e, const char *key)
+{
+	enc_str(e, key, strlen(key));
+}
+
+static uint64_t realtime_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* A named, typed value in a range, for encoding */
+typedef struct {
+	/* kept alive by the fields table */
+	const char *name;
+	size_t name_len;
+	int offset;
+	enum lmb_type type;
+	enum lmb_order order;
+	lua_Number scale;
+} lmb_field_t;
+
+/**
+ * Read a range, and encode it.
+ * Without fields, the whole range is encoded as an array of values of the
+ * given type.  With fields, as a map of field names to their values.
+ * @function ctx:read_encoded
+ * @param opts table of options
+ *  <ul>
+ *  <li>format "json", "msgpack" or "cbor"</li>
+ *  <li>table one of "bits", "input_bits", "registers" or "input_registers"</li>
+ *  <li>addr, count the range to read</li>
+ *  <li>unit (optional) defaults to the current slave</li>
+ *  <li>type, order (optional) as per @{ctx:subscribe}, defaults for the fields</li>
+ *  <li>fields (optional) array of tables, each with name, offset in
+ *  registers from addr, and optionally type, order and scale, a factor
+ *  the value is multiplied by</li>
+ *  <li>timestamp (optional) true to include "ts", realtime microseconds.
+ *  Without fields, this makes a map of "ts" and "values".</li>
+ *  <li>deadline (optional) absolute time, from @{monotonic}</li>
+ *  </ul>
+ * @return[1] the encoded string
+ * @return[2] nil
+ * @return[2] error message
+ * @usage
+ *  local json = dev:read_encoded{format="json", table="registers", addr=0, count=6,
+ *  	timestamp=true, fields={
+ *  	{name="voltage", offset=0, type="f32"},
+ *  	{name="energy", offset=2, type="u32", order="cdab", scale=0.1},
+ *  	{name="status", offset=4}}}
+ *  -- {"voltage":230.100006,"energy":1234.5,"status":3,"ts":1700000000000000}
+ */
+static int ctx_read_encoded(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	lua_getfield(L, 2, "format");
+	enum lmb_format fmt = luaL_checkoption(L, -1, NULL, lmb_format_names);
+	lua_getfield(L, 2, "table");
+	enum lmb_table table = luaL_checkoption(L, -1, NULL, lmb_table_names);
+	lua_getfield(L, 2, "addr");
+	int addr = luaL_checkinteger(L, -1);
+	lua_getfield(L, 2, "count");
+	int count = luaL_checkinteger(L, -1);
+	lua_getfield(L, 2, "unit");
+	int unit = luaL_optinteger(L, -1, ctx->slave);
+	lua_getfield(L, 2, "type");
+	enum lmb_type type = luaL_checkoption(L, -1, "u16", lmb_type_names);
+	lua_getfield(L, 2, "order");
+	enum lmb_order order = luaL_checkoption(L, -1, "abcd", lmb_order_names);
+	lua_getfield(L, 2, "timestamp");
+	bool timestamp = lua_toboolean(L, -1);
+	lmb_deadline_t dl;
+	deadline_field(L, 2, &dl);
+	lua_pop(L, 8);
+
+	bool bits = table == LMB_BITS || table == LMB_INPUT_BITS;
+	if (addr < 0 || addr > 0xffff || count < 1 || count > 0x10000 - addr) {
+		return luaL_argerror(L, 2, "range out of bounds");
+	}
+	if (unit < 0 || unit > 0xff) {
+		return luaL_argerror(L, 2, "unit required, or set_slave first");
+	}
+
+	lua_getfield(L, 2, "fields");
+	int fidx = lua_gettop(L);
+	int nfields = lua_isnil(L, fidx) ? 0 : (luaL_checktype(L, fidx, LUA_TTABLE), (int)lua_rawlen(L, fidx));
+	lmb_field_t *fields = lua_newuserdata(L, (nfields ? nfields : 1) * sizeof(*fields));
+	for (int i = 0; i < nfields; i++) {
+		lmb_field_t *f = &fields[i];
+		lua_rawgeti(L, fidx, i + 1);
+		luaL_checktype(L, -1, LUA_TTABLE);
+		lua_getfield(L, -1, "name");
+		if (lua_type(L, -1) != LUA_TSTRING) {
+			return luaL_error(L, "field %d needs a name", i + 1);
+		}
+		f->name = lua_tolstring(L, -1, &f->name_len);
+		lua_getfield(L, -2, "offset");
+		f->offset = luaL_checkinteger(L, -1);
+		lua_getfield(L, -3, "type");
+		f->type = luaL_checkoption(L, -1, lmb_type_names[type], lmb_type_names);
+		lua_getfield(L, -4, "order");
+		f->order = luaL_checkoption(L, -1, lmb_order_names[order], lmb_order_names);
+		lua_getfield(L, -5, "scale");
+		f->scale = luaL_optnumber(L, -1, 1);
+		lua_pop(L, 6);
+		int words = bits ? 1 : lmb_type_words(f->type);
+		if (f->offset < 0 || f->offset + words > count) {
+			return luaL_error(L, "field %d is outside the range", i + 1);
+		}
+	}
+	int words = bits ? 1 : lmb_type_words(type);
+	if (!nfields && count % words) {
+		return luaL_argerror(L, 2, "count is not a whole number of values of type");
+	}
+
+	uint16_t *vals = lua_newuserdata(L, count * sizeof(*vals));
+	int prev = ctx_unit_switch(ctx, unit);
+	int rc = ctx->slave == unit ? xfer_read_buf(ctx, table, addr, count, vals, &dl) : -1;
+	int err = errno;
+	ctx_unit_restore(ctx, prev);
+	if (rc != count) {
+		errno = err;
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+	uint64_t ts = realtime_us();
+
+	luaL_Buffer b;
+	lmb_enc_t e = { .b = &b, .fmt = fmt };
+	luaL_buffinit(L, &b);
+	if (nfields) {
+		enc_begin(&e, true, nfields + timestamp);
+		for (int i = 0; i < nfields; i++) {
+			lmb_field_t *f = &fields[i];
+			lua_Number v = bits ? vals[f->offset] : lmb_decode(&vals[f->offset], f->type, f->order);
+			enc_str(&e, f->name, f->name_len);
+			enc_num(&e, v * f->scale, !bits && f->type == LMB_F32 && f->scale == 1);
+		}
+		if (timestamp) {
+			enc_key(&e, "ts");
+			enc_num(&e, ts, false);
+		}
+		enc_end(&e);
+	} else {
+		int n = count / words;
+		if (timestamp) {
+			enc_begin(&e, true, 2);
+			enc_key(&e, "ts");
+			enc_num(&e, ts, false);
+			enc_key(&e, "values");
+		}
+		enc_begin(&e, false, n);
+		for (int i = 0; i < n; i++) {
+			lua_Number v = bits ? vals[i] : lmb_decode(&vals[i * words], type, order);
+			enc_num(&e, v, !bits && type == LMB_F32);
+		}
+		enc_end(&e);
+		if (timestamp) {
+			enc_end(&e);
+		}
+	}
+	luaL_pushresult(&b);
+	return 1;
+}
+
+/** Ring buffers.
+ * A ring holds a fixed number of samples in native memory, each a
+ * timestamp, point id, value, quality and up to four raw registers.
+ * Quality is 0 for good values, and 1 for points that couldn't be read,
+ * with a NaN value.  Other values are free for your own use.
+ *
+ * Drained samples can come as a packed string, 32 bytes per sample, all
+ * little endian: timestamp (u64, microseconds), point id (u32), quality
+ * (u16), raw register count (u16), value (f64), raw registers (4 x u16).
+ * @section ring
+ */
+
+#define LMB_RING_WORDS	4
+#define LMB_RING_RECORD	32
+
+enum lmb_quality {
+	LMB_Q_GOOD = 0,
+	LMB_Q_BAD = 1,
+};
+
+typedef struct {
+	uint64_t ts;
+	uint32_t point;
+	uint16_t quality;
+	uint16_t nwords;
+	double value;
+	uint16_t raw[LMB_RING_WORDS];
+} lmb_sample_t;
+
+typedef struct {
+	uint32_t cap;
+	uint32_t head;
+	uint32_t len;
+	bool overwrite;
+	bool realtime;
+	uint64_t pushed;
+	uint64_t dropped;
+	uint64_t overwritten;
+	lmb_sample_t samples[];
+} lmb_ring_t;
+
+static const char *const ring_policy_names[] = {
+	"overwrite", "drop", NULL
+};
+
+static const char *const ring_clock_names[] = {
+	"realtime", "monotonic", NULL
+};
+
+static lmb_ring_t *ring_check(lua_State *L, int i)
+{
+	return (lmb_ring_t *) luaL_checkudata(L, i, MODBUS_META_RING);
+}
+
+static uint64_t ring_now(const lmb_ring_t *r)
 {
-	const uint16_t in2 = luaL_checknumber(L, 1);
-	const uint16_t in1 = luaL_checknumber(L, 2);
-	int32_t out = in1 << 16 | in2;
-	lua_pushinteger(L, out);
-	return 1;
+	return r->realtime ? realtime_us() : lmb_now_us();
 }
 
+/* The slot for a new sample, or NULL if it is to be dropped */
+static lmb_sample_t *ring_slot(lmb_ring_t *r)
+{
+	if (r->len == r->cap) {
+		if (!r->overwrite) {
+			r->dropped++;
+			return NULL;
+		}
+		r->head = (r->head + 1) % r->cap;
+		r->len--;
+		r->overwritten++;
+	}
+	lmb_sample_t *s = &r->samples[(r->head + r->len) % r->cap];
+	r->len++;
+	r->pushed++;
+	return s;
+}
 
 /**
- * 2x16bit registers as number to unsigned 32 bit
- * @function get_u32
- * @param 1 16bit register
- * @param 2 16bit register
- * @return 32bit number
+ * Create a ring buffer.
+ * @function new_ring
+ * @param opts table of options
+ *  <ul>
+ *  <li>capacity (required) number of samples</li>
+ *  <li>policy when full, "overwrite" the oldest (the default) or "drop" the newest</li>
+ *  <li>clock for timestamps, "realtime" (the default) or "monotonic", see @{monotonic}</li>
+ *  </ul>
+ * @return a ring
+ * @usage
+ *  local ring = mb.new_ring{capacity=100000}
+ *  local sub = dev:subscribe{table="registers", addr=0, count=20, type="f32", id=1000}
+ *  ring:poll(sub)
+ *  ...
+ *  logger:write(ring:drain_packed())
  */
-static int helper_get_u32(lua_State *L)
+static int libmodbus_new_ring(lua_State *L)
 {
-	const uint16_t in1 = luaL_checknumber(L, 1);
-	const uint16_t in2 = luaL_checknumber(L, 2);
-	uint32_t out = in1 << 16 | in2;
-	lua_pushnumber(L, out);
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "capacity");
+	lua_Number cap = luaL_checknumber(L, -1);
+	lua_getfield(L, 1, "policy");
+	int policy = luaL_checkoption(L, -1, "overwrite", ring_policy_names);
+	lua_getfield(L, 1, "clock");
+	int clock = luaL_checkoption(L, -1, "realtime", ring_clock_names);
+	lua_pop(L, 3);
+	if (cap < 1 || cap > (1 << 24)) {
+		return luaL_argerror(L, 1, "capacity must be between 1 and 16M samples");
+	}
+
+	lmb_ring_t *r = lua_newuserdata(L, sizeof(*r) + (size_t)cap * sizeof(lmb_sample_t));
+	memset(r, 0, sizeof(*r));
+	r->cap = cap;
+	r->overwrite = policy == 0;
+	r->realtime = clock == 0;
+	luaL_getmetatable(L, MODBUS_META_RING);
+	lua_setmetatable(L, -2);
 	return 1;
 }
 
 /**
- * 2x16bit registers as number to unsigned 32 bit (reversed order)
- * @function get_u32le
- * @param 1 16bit register
- * @param 2 16bit register
- * @return 32bit number
+ * Add a sample.
+ * @function ring:push
+ * @param point id
+ * @param value
+ * @param[opt] quality defaults to 0, good
+ * @return true, or false if it was dropped
  */
-static int helper_get_u32le(lua_State *L)
+static int ring_push(lua_State *L)
 {
-	const uint16_t in2 = luaL_checknumber(L, 1);
-	const uint16_t in1 = luaL_checknumber(L, 2);
-	uint32_t out = in1 << 16 | in2;
-	lua_pushnumber(L, out);
+	lmb_ring_t *r = ring_check(L, 1);
+	lua_Number point = luaL_checknumber(L, 2);
+	lua_Number value = luaL_checknumber(L, 3);
+	int quality = luaL_optinteger(L, 4, LMB_Q_GOOD);
+	luaL_argcheck(L, point_id_ok(point), 2, "point ids must be 32 bit unsigned");
+
+	lmb_sample_t *s = ring_slot(r);
+	if (s) {
+		memset(s, 0, sizeof(*s));
+		s->ts = ring_now(r);
+		s->point = point;
+		s->quality = quality;
+		s->value = value;
+	}
+	lua_pushboolean(L, s != NULL);
 	return 1;
 }
 
 /**
- * 2x16bit registers as number to 32 bit float
- * @function get_f32
- * @param 1 16bit register
- * @param 2 16bit register
- * @return 32bit float
+ * Poll a subscription straight into the ring.
+ * Changed points are added with their raw registers, as @{sub:poll} would
+ * report them.  If the read fails, every point is added once with quality
+ * 1 and a NaN value, and all are added again when reads recover.
+ * @function ring:poll
+ * @param sub a subscription, see @{ctx:subscribe}
+ * @param[opt] deadline see @{monotonic}
+ * @return[1] count of samples added
+ * @return[2] nil
+ * @return[2] error message
  */
-static int helper_get_f32(lua_State *L)
+static int ring_poll(lua_State *L)
 {
-	const uint16_t in1 = luaL_checknumber(L, 1);
-	const uint16_t in2 = luaL_checknumber(L, 2);
-
-	uint32_t inval = in1<<16 | in2;
-	float f;
-	memcpy(&f, &inval, sizeof(f));
+	lmb_ring_t *r = ring_check(L, 1);
+	lmb_sub_t *sub = sub_check(L, 2);
+	lmb_deadline_t dl;
+	deadline_opt(L, 3, &dl);
 
-	lua_pushnumber(L, f);
+	if (!sub->ctx->modbus) {
+		return luaL_error(L, "context was destroyed");
+	}
+	int rc = sub_fetch(sub, &dl);
+	int err = errno;
+	uint64_t ts = ring_now(r);
+	int added = 0;
+	for (int i = 0; i < sub->npoints; i++) {
+		lmb_point_t *p = &sub->points[i];
+		lmb_sample_t *s;
+		if (rc < 0) {
+			if (!sub->primed || !(s = ring_slot(r))) {
+				continue;
+			}
+			memset(s, 0, sizeof(*s));
+			s->quality = LMB_Q_BAD;
+			s->value = NAN;
+		} else {
+			lua_Number v = sub_value(sub, p);
+			if (sub->primed && !sub_changed(p, v)) {
+				continue;
+			}
+			p->last = v;
+			if (!(s = ring_slot(r))) {
+				continue;
+			}
+			memset(s, 0, sizeof(*s));
+			s->quality = LMB_Q_GOOD;
+			s->value = v;
+			bool bits = sub->table == LMB_BITS || sub->table == LMB_INPUT_BITS;
+			s->nwords = bits ? 1 : lmb_type_words(p->type);
+			memcpy(s->raw, &sub->vals[p->offset], s->nwords * sizeof(uint16_t));
+		}
+		s->ts = ts;
+		s->point = p->id;
+		added++;
+	}
+	/* after a failure, everything is reported again once it's back */
+	sub->primed = rc == 0;
+	if (rc < 0) {
+		errno = err;
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+	lua_pushinteger(L, added);
 	return 1;
 }
 
-/**
- * 2x16bit registers as number to 32 bit float (Reversed order)
- * @function get_f32le
- * @param 1 16bit register
- * @param 2 16bit register
- * @return 32bit float
- */
-static int helper_get_f32le(lua_State *L)
+static void ring_pack(luaL_Buffer *b, uint64_t v, int bytes)
 {
-	const uint16_t in2 = luaL_checknumber(L, 1);
-	const uint16_t in1 = luaL_checknumber(L, 2);
-
-	uint32_t inval = in1<<16 | in2;
-	float f;
-	memcpy(&f, &inval, sizeof(f));
-
-	lua_pushnumber(L, f);
-	return 1;
+	for (int i = 0; i < bytes; i++) {
+		luaL_addchar(b, (char)(v >> (8 * i)));
+	}
 }
 
 /**
- * 4x16bit registers as number to signed 64 bit
- * @function get_s64
- * @param 1 16bit register
- * @param 2 16bit register
- * @param 3 16bit register
- * @param 4 16bit register
- * @return 64bit number
+ * Take the oldest samples out, as a packed string.
+ * See the start of this section for the format.
+ * @function ring:drain_packed
+ * @param[opt] max most samples to take, defaults to all
+ * @return string, empty if there were none
  */
-static int helper_get_s64(lua_State *L)
+static int ring_drain_packed(lua_State *L)
 {
-	const uint16_t in1 = luaL_checknumber(L, 1);
-	const uint16_t in2 = luaL_checknumber(L, 2);
-	const uint16_t in3 = luaL_checknumber(L, 3);
-	const uint16_t in4 = luaL_checknumber(L, 4);
-	int64_t out = in1;
-	out = out << 16 | in2;
-	out = out << 16 | in3;
-	out = out << 16 | in4;
-	lua_pushnumber(L, out);
+	lmb_ring_t *r = ring_check(L, 1);
+	lua_Number max = luaL_optnumber(L, 2, r->len);
+	uint32_t n = max < r->len ? (max > 0 ? max : 0) : r->len;
+	luaL_Buffer b;
+
+	luaL_buffinit(L, &b);
+	for (uint32_t i = 0; i < n; i++) {
+		const lmb_sample_t *s = &r->samples[r->head];
+		uint64_t value;
+		memcpy(&value, &s->value, sizeof(value));
+		ring_pack(&b, s->ts, 8);
+		ring_pack(&b, s->point, 4);
+		ring_pack(&b, s->quality, 2);
+		ring_pack(&b, s->nwords, 2);
+		ring_pack(&b, value, 8);
+		for (int w = 0; w < LMB_RING_WORDS; w++) {
+			ring_pack(&b, s->raw[w], 2);
+		}
+		r->head = (r->head + 1) % r->cap;
+		r->len--;
+	}
+	luaL_pushresult(&b);
 	return 1;
 }
 
 /**
- * 4x16bit registers as number to unsigned 64 bit
- * @function get_u64
- * @param 1 16bit register
- * @param 2 16bit register
- * @param 3 16bit register
- * @param 4 16bit register
- * @return 64bit number
+ * Take the oldest samples out, encoded.
+ * @function ring:drain_encoded
+ * @param format "json", "msgpack" or "cbor"
+ * @param[opt] max most samples to take, defaults to all
+ * @param[opt] compact true to encode each sample as an array of
+ *  ts, point, value and quality, rather than a map with those keys
+ * @return the encoded array of samples
  */
-static int helper_get_u64(lua_State *L)
+static int ring_drain_encoded(lua_State *L)
 {
-	const uint16_t in1 = luaL_checknumber(L, 1);
-	const uint16_t in2 = luaL_checknumber(L, 2);
-	const uint16_t in3 = luaL_checknumber(L, 3);
-	const uint16_t in4 = luaL_checknumber(L, 4);
-	uint64_t out = (uint64_t)in1 << 48 | (uint64_t)in2 << 32 | (uint64_t)in3 << 16 | in4;
-	lua_pushnumber(L, out);
+	lmb_ring_t *r = ring_check(L, 1);
+	enum lmb_format fmt = luaL_checkoption(L, 2, NULL, lmb_format_names);
+	lua_Number max = luaL_optnumber(L, 3, r->len);
+	bool compact = lua_toboolean(L, 4);
+	uint32_t n = max < r->len ? (max > 0 ? max : 0) : r->len;
+	luaL_Buffer b;
+	lmb_enc_t e = { .b = &b, .fmt = fmt };
+
+	luaL_buffinit(L, &b);
+	enc_begin(&e, false, n);
+	for (uint32_t i = 0; i < n; i++) {
+		const lmb_sample_t *s = &r->samples[r->head];
+		enc_begin(&e, !compact, 4);
+		if (!compact) {
+			enc_key(&e, "ts");
+		}
+		enc_num(&e, s->ts, false);
+		if (!compact) {
+			enc_key(&e, "point");
+		}
+		enc_num(&e, s->point, false);
+		if (!compact) {
+			enc_key(&e, "value");
+		}
+		enc_num(&e, s->value, false);
+		if (!compact) {
+			enc_key(&e, "quality");
+		}
+		enc_num(&e, s->quality, false);
+		enc_end(&e);
+		r->head = (r->head + 1) % r->cap;
+		r->len--;
+	}
+	enc_end(&e);
+	luaL_pushresult(&b);
 	return 1;
 }
 
-
-static ctx_t * ctx_check(lua_State *L, int i)
-{
-	return (ctx_t *) luaL_checkudata(L, i, MODBUS_META_CTX);
-}
-
-static int ctx_destroy(lua_State *L)
+/* Gets (or makes) array field name of the table at idx, leaving it on the stack */
+static int ring_column(lua_State *L, int idx, const char *name, uint32_t n)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	modbus_close(ctx->modbus);
-	modbus_free(ctx->modbus);
-	if (ctx->dev_host) {
-		free(ctx->dev_host);
-	}
-	if (ctx->service) {
-		free(ctx->service);
+	lua_getfield(L, idx, name);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_createtable(L, n, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, idx, name);
 	}
-
-	/* remove all methods operating on ctx */
-	lua_newtable(L);
-	lua_setmetatable(L, -2);
-
-	/* Nothing to return on stack */
-	return 0;
+	return lua_gettop(L);
 }
 
-static int ctx_tostring(lua_State *L)
+/**
+ * Take the oldest samples out, into a table of columns.
+ * Passing the same table each time avoids making garbage: its arrays are
+ * overwritten, and entries past n from earlier drains are cleared.
+ * @function ring:drain
+ * @param[opt] max most samples to take, defaults to all
+ * @param[opt] t a table from an earlier drain, to reuse
+ * @return table with n, the count of samples, and arrays ts, point, value
+ *  and quality
+ * @usage
+ *  local t = {}
+ *  while true do
+ *      ring:drain(1000, t)
+ *      for i = 1, t.n do send(t.point[i], t.ts[i], t.value[i]) end
+ *  end
+ */
+static int ring_drain(lua_State *L)
 {
-	ctx_t *ctx = ctx_check(L, 1);
+	lmb_ring_t *r = ring_check(L, 1);
+	lua_Number max = luaL_optnumber(L, 2, r->len);
+	uint32_t n = max < r->len ? (max > 0 ? max : 0) : r->len;
 
-	if (ctx->databits) {
-		lua_pushfstring(L, "ModbusRTU<%s@%d/%c%d>", ctx->dev_host, ctx->databits, ctx->parity, ctx->stopbits);
+	if (lua_isnoneornil(L, 3)) {
+		lua_settop(L, 2);
+		lua_newtable(L);
 	} else {
-		lua_pushfstring(L, "ModbusTCP<%s@%s>", ctx->dev_host, ctx->service);
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_settop(L, 3);
+	}
+	lua_getfield(L, 3, "n");
+	uint32_t old = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	int ts = ring_column(L, 3, "ts", n);
+	int point = ring_column(L, 3, "point", n);
+	int value = ring_column(L, 3, "value", n);
+	int quality = ring_column(L, 3, "quality", n);
+	for (uint32_t i = 1; i <= n; i++) {
+		const lmb_sample_t *s = &r->samples[r->head];
+		lua_pushnumber(L, s->ts);
+		lua_rawseti(L, ts, i);
+		lua_pushnumber(L, s->point);
+		lua_rawseti(L, point, i);
+		lua_pushnumber(L, s->value);
+		lua_rawseti(L, value, i);
+		lua_pushinteger(L, s->quality);
+		lua_rawseti(L, quality, i);
+		r->head = (r->head + 1) % r->cap;
+		r->len--;
+	}
+	for (uint32_t i = n + 1; i <= old; i++) {
+		for (int c = ts; c <= quality; c++) {
+			lua_pushnil(L);
+			lua_rawseti(L, c, i);
+		}
 	}
+	lua_pushinteger(L, n);
+	lua_setfield(L, 3, "n");
+	lua_settop(L, 3);
 	return 1;
 }
 
-/** Context Methods.
- * These functions are members of a modbus context, from either new_rtu() or new_tcp_pi()
- * @section context_methods
- */
-
 /**
- * Connect, see modbus_connect()
- * @function ctx:connect
+ * @function ring:stats
+ * @return table with capacity, len (samples held), and counts of samples
+ *  pushed, dropped (policy "drop") and overwritten (policy "overwrite")
  */
-static int ctx_connect(lua_State *L)
+static int ring_stats(lua_State *L)
 {
-	ctx_t *ctx = ctx_check(L, 1);
+	lmb_ring_t *r = ring_check(L, 1);
 
-	int rc = modbus_connect(ctx->modbus);
-	
-	return libmodbus_rc_to_nil_error(L, rc, 0);
+	lua_newtable(L);
+	lua_pushnumber(L, r->cap);
+	lua_setfield(L, -2, "capacity");
+	lua_pushnumber(L, r->len);
+	lua_setfield(L, -2, "len");
+	lua_pushnumber(L, r->pushed);
+	lua_setfield(L, -2, "pushed");
+	lua_pushnumber(L, r->dropped);
+	lua_setfield(L, -2, "dropped");
+	lua_pushnumber(L, r->overwritten);
+	lua_setfield(L, -2, "overwritten");
+	return 1;
 }
 
 /**
- * Close, see modbus_close()
- * @function ctx:close
+ * Throw away all samples.
+ * @function ring:clear
  */
-static int ctx_close(lua_State *L)
+static int ring_clear(lua_State *L)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-
-	modbus_close(ctx->modbus);
-
+	lmb_ring_t *r = ring_check(L, 1);
+	r->head = 0;
+	r->len = 0;
 	return 0;
 }
 
-/**
- * Set debug
- * @function ctx:set_debug
- * @param enable optional bool, defaults to true
- */
-static int ctx_set_debug(lua_State *L)
+static int ring_len(lua_State *L)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	bool opt;
-	if (lua_isnil(L, -1)) {
-		opt = true;
-	} else {
-		opt = lua_toboolean(L, -1);
-	}
-	modbus_set_debug(ctx->modbus, opt);
-	return 0;
+	lmb_ring_t *r = ring_check(L, 1);
+	lua_pushnumber(L, r->len);
+	return 1;
 }
 
-/**
- * Set error recovery, see modbus_set_error_recovery.
- * The arguments will be or'd together.
- * @function ctx:set_error_recovery
- * @param a one of @{error_recovery_constants}
- * @param b one of @{error_recovery_constants}
+static const struct luaL_Reg ring_M[] = {
+	{"push",		ring_push},
+	{"poll",		ring_poll},
+	{"drain",		ring_drain},
+	{"drain_packed",	ring_drain_packed},
+	{"drain_encoded",	ring_drain_encoded},
+	{"stats",		ring_stats},
+	{"clear",		ring_clear},
+	{"__len",		ring_len},
+	{NULL, NULL}
+};
+
+/** Frame capture.
+ * A capture records the ADUs that contexts send and receive, with monotonic
+ * timestamps, into a fixed size ring that overwrites the oldest records.
+ * Attach one to any number of contexts with @{ctx:set_capture}; contexts
+ * without one pay nothing.  Transactions libmodbus does itself are recorded
+ * as the frames it would have put on the wire, differing only in Modbus/TCP
+ * transaction ids.  Captures can be saved as pcap files, loaded back, and
+ * played back against a local device or client with @{replay}.
+ *
+ * Modbus/TCP is saved as raw IPv4 (LINKTYPE_RAW) with made up addresses:
+ * the device is 127.0.0.2:502, and context N is 127.0.0.1, port 1024+N.
+ * Modbus/RTU is saved as DLT_USER0 (147), each frame after a four byte
+ * header of direction (0 to the device, 1 from it), a zero and the context
+ * id (big endian).  For Wireshark, add "User 0 (DLT=147)" to the DLT User
+ * protocol table with payload protocol "mbrtu" and header size 4.
+ * @section capture
  */
-static int ctx_set_error_recovery(lua_State *L)
+
+#define LMB_PCAP_RAW	101
+#define LMB_PCAP_ETHERNET	1
+#define LMB_PCAP_IPV4	228
+#define LMB_PCAP_USER0	147
+/* linux cooked captures, as from tcpdump -i any */
+#define LMB_PCAP_SLL	113
+#define LMB_PCAP_SLL2	276
+#define LMB_PCAP_PORT	502
+
+typedef struct {
+	lmb_cap_rec_t rec;
+	const uint8_t *adu;
+} lmb_cap_item_t;
+
+/* pcap file header, native byte order */
+typedef struct {
+	uint32_t magic;
+	uint16_t major;
+	uint16_t minor;
+	int32_t zone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t link;
+} lmb_pcap_hdr_t;
+
+static const char *const cap_link_names[] = {
+	"tcp", "rtu", NULL
+};
+
+static lmb_capture_t *cap_check(lua_State *L, int i)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	int opt = luaL_checkinteger(L, 2);
-	int opt2 = luaL_optinteger(L, 3, 0);
-	
-	int rc = modbus_set_error_recovery(ctx->modbus, opt | opt2);
-	
-	return libmodbus_rc_to_nil_error(L, rc, 0);
+	return *(lmb_capture_t **) luaL_checkudata(L, i, MODBUS_META_CAP);
 }
 
-/**
- * See also modbus_set_byte_timeout
- * @function ctx:set_byte_timeout
- * @param seconds (required)
- * @param microseconds (optional, defaults to 0)
- */
-static int ctx_set_byte_timeout(lua_State *L)
+/* Pushes a new capture userdata, or raises an error */
+static lmb_capture_t *cap_new(lua_State *L, size_t size)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	int opt = luaL_checkinteger(L, 2);
-	int opt2 = luaL_optinteger(L, 3, 0);
+	lmb_capture_t **box = lua_newuserdata(L, sizeof(*box));
+	*box = NULL;
+	luaL_getmetatable(L, MODBUS_META_CAP);
+	lua_setmetatable(L, -2);
 
-#if LIBMODBUS_VERSION_CHECK(3,1,0)
-	modbus_set_byte_timeout(ctx->modbus, opt, opt2);
-#else
-	struct timeval t = { opt, opt2 };
-	modbus_set_byte_timeout(ctx->modbus, &t);
-#endif
+	lmb_capture_t *cap = lmb_calloc(1, sizeof(*cap));
+	if (cap) {
+		cap->buf = lmb_malloc(size);
+	}
+	if (!cap || !cap->buf) {
+		free(cap);
+		luaL_error(L, "out of memory");
+	}
+	lmb_mutex_init(&cap->lock);
+	cap->refs = 1;
+	cap->size = size;
+	cap->wall0 = realtime_us();
+	cap->mono0 = lmb_now_us();
+	*box = cap;
+	return cap;
+}
 
+static int cap_gc(lua_State *L)
+{
+	lmb_capture_t **box = lua_touserdata(L, 1);
+	if (box && *box) {
+		cap_release(*box);
+		*box = NULL;
+	}
 	return 0;
 }
 
+/*
+ * Pushes a userdata holding a copy of all records, oldest first, as items
+ * followed by their bytes.  Lua owns it, so nothing leaks if a later push
+ * fails, but it has to be sized outside the lock.
+ */
+static lmb_cap_item_t *cap_snapshot(lua_State *L, lmb_capture_t *cap, uint32_t *n)
+{
+	for (;;) {
+		lmb_mutex_lock(&cap->lock);
+		size_t need = cap->records * sizeof(lmb_cap_item_t) + cap->used;
+		lmb_mutex_unlock(&cap->lock);
+
+		lmb_cap_item_t *items = lua_newuserdata(L, need ? need : 1);
+		lmb_mutex_lock(&cap->lock);
+		if (cap->records * sizeof(lmb_cap_item_t) + cap->used > need) {
+			/* grew meanwhile, try again */
+			lmb_mutex_unlock(&cap->lock);
+			lua_pop(L, 1);
+			continue;
+		}
+		uint8_t *data = (uint8_t *)&items[cap->records];
+		size_t off = cap->head;
+		for (uint32_t i = 0; i < cap->records; i++) {
+			cap_copy_out(cap, off, &items[i].rec, sizeof(items[i].rec));
+			cap_copy_out(cap, off + sizeof(items[i].rec), data, items[i].rec.len);
+			items[i].adu = data;
+			data += items[i].rec.len;
+			off += sizeof(items[i].rec) + items[i].rec.len;
+		}
+		*n = cap->records;
+		lmb_mutex_unlock(&cap->lock);
+		return items;
+	}
+}
+
 /**
- * @function ctx:get_byte_timeout
- * @return[1] seconds
- * @return[1] microseconds
+ * Create a frame capture.
+ * @function new_capture
+ * @param[opt] opts table of options
+ *  <ul>
+ *  <li>size of the ring in bytes, defaults to 1MB.  Each record takes 16
+ *  bytes plus the ADU</li>
+ *  </ul>
+ * @return a capture
+ * @usage
+ *  local cap = mb.new_capture{size=16 * 1024 * 1024}
+ *  dev:set_capture(cap)
+ *  ...
+ *  cap:dump("/tmp/site.pcap")
  */
-static int ctx_get_byte_timeout(lua_State *L)
+static int libmodbus_new_capture(lua_State *L)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	uint32_t opt1, opt2;
-	
-#if LIBMODBUS_VERSION_CHECK(3,1,0)
-	modbus_get_byte_timeout(ctx->modbus, &opt1, &opt2);
-#else
-	struct timeval t;
-	modbus_get_byte_timeout(ctx->modbus, &t);
-	opt1 = t.tv_sec;
-	opt2 = t.tv_usec;
-#endif
-	lua_pushnumber(L, opt1);
-	lua_pushnumber(L, opt2);
+	lua_Number size = 1 << 20;
 
-	return 2;
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		lua_getfield(L, 1, "size");
+		size = luaL_optnumber(L, -1, size);
+		lua_pop(L, 1);
+	}
+	if (size < 4096 || size > (1 << 30)) {
+		return luaL_argerror(L, 1, "size must be between 4kB and 1GB");
+	}
+	cap_new(L, size);
+	return 1;
 }
 
 /**
- * @function ctx:set_response_timeout
- * @param seconds (required)
- * @param microseconds (optional, defaults to 0)
+ * Record this context's traffic into a capture, see @{new_capture}.
+ * @function ctx:set_capture
+ * @param capture a capture, or nil to stop recording
+ * @return the context id its records carry
  */
-static int ctx_set_response_timeout(lua_State *L)
+static int ctx_set_capture(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
-	int opt = luaL_checkinteger(L, 2);
-	int opt2 = luaL_optinteger(L, 3, 0);
-
-#if LIBMODBUS_VERSION_CHECK(3,1,0)
-	modbus_set_response_timeout(ctx->modbus, opt, opt2);
-#else
-	struct timeval t = { opt, opt2 };
-	modbus_set_response_timeout(ctx->modbus, &t);
-#endif
+	lmb_capture_t *cap = NULL;
 
-	return 0;
+	if (!lua_isnoneornil(L, 2)) {
+		cap = cap_check(L, 2);
+		lmb_mutex_lock(&cap->lock);
+		cap->refs++;
+		lmb_mutex_unlock(&cap->lock);
+	}
+	if (ctx->cap) {
+		cap_release(ctx->cap);
+	}
+	ctx->cap = cap;
+	lua_pushinteger(L, ctx->id);
+	return 1;
 }
 
 /**
- * @function ctx:get_response_timeout
- * @return[1] seconds
- * @return[1] microseconds
+ * The records held, oldest first.  Records stay in the capture.
+ * @function capture:records
+ * @return array of tables, each with t (timestamp, microseconds, see
+ *  @{monotonic}, or realtime for loaded captures), ctx (context id), dir
+ *  ("tx", sent by us, or "rx"), link ("tcp" or "rtu") and adu (string)
  */
-static int ctx_get_response_timeout(lua_State *L)
+static int cap_records(lua_State *L)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	uint32_t opt1, opt2;
-	
-#if LIBMODBUS_VERSION_CHECK(3,1,0)
-	modbus_get_response_timeout(ctx->modbus, &opt1, &opt2);
-#else
-	struct timeval t;
-	modbus_get_response_timeout(ctx->modbus, &t);
-	opt1 = t.tv_sec;
-	opt2 = t.tv_usec;
-#endif
-	lua_pushnumber(L, opt1);
-	lua_pushnumber(L, opt2);
+	lmb_capture_t *cap = cap_check(L, 1);
+	uint32_t n;
+	lmb_cap_item_t *items = cap_snapshot(L, cap, &n);
+
+	lua_createtable(L, n, 0);
+	for (uint32_t i = 0; i < n; i++) {
+		lua_createtable(L, 0, 5);
+		lua_pushnumber(L, items[i].rec.ts);
+		lua_setfield(L, -2, "t");
+		lua_pushinteger(L, items[i].rec.ctx);
+		lua_setfield(L, -2, "ctx");
+		lua_pushstring(L, items[i].rec.dir == LMB_CAP_TX ? "tx" : "rx");
+		lua_setfield(L, -2, "dir");
+		lua_pushstring(L, cap_link_names[items[i].rec.rtu]);
+		lua_setfield(L, -2, "link");
+		lua_pushlstring(L, (const char *)items[i].adu, items[i].rec.len);
+		lua_setfield(L, -2, "adu");
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
 
-	return 2;
+static void pcap_put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
 }
 
-/**
- * @function ctx:get_socket
- * @return the socket number
- */
-static int ctx_get_socket(lua_State *L)
+static void pcap_put32(uint8_t *p, uint32_t v)
 {
-	ctx_t *ctx = ctx_check(L, 1);
+	p[0] = v >> 24;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
 
-	lua_pushinteger(L, modbus_get_socket(ctx->modbus));
+static uint16_t inet_csum(const uint8_t *p, int len, uint32_t sum)
+{
+	for (int i = 0; i + 1 < len; i += 2) {
+		sum += p[i] << 8 | p[i + 1];
+	}
+	if (len & 1) {
+		sum += p[len - 1] << 8;
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return ~sum & 0xffff;
+}
 
-	return 1;
+/*
+ * Wraps a Modbus/TCP record in made up IPv4 and TCP headers.
+ * @return the packet length
+ */
+static int pcap_tcp_packet(uint8_t *pkt, const lmb_cap_item_t *it, uint32_t seq, uint32_t ack)
+{
+	static const uint8_t client[4] = { 127, 0, 0, 1 };
+	static const uint8_t device[4] = { 127, 0, 0, 2 };
+	bool tx = it->rec.dir == LMB_CAP_TX;
+	uint16_t port = 1024 + it->rec.ctx % (0x10000 - 1024);
+	int len = 40 + it->rec.len;
+	uint8_t *ip = pkt;
+	uint8_t *tcp = pkt + 20;
+
+	memset(pkt, 0, 40);
+	ip[0] = 0x45;
+	pcap_put16(&ip[2], len);
+	ip[6] = 0x40;
+	ip[8] = 64;
+	ip[9] = IPPROTO_TCP;
+	memcpy(&ip[12], tx ? client : device, 4);
+	memcpy(&ip[16], tx ? device : client, 4);
+	pcap_put16(&ip[10], inet_csum(ip, 20, 0));
+
+	pcap_put16(&tcp[0], tx ? port : LMB_PCAP_PORT);
+	pcap_put16(&tcp[2], tx ? LMB_PCAP_PORT : port);
+	pcap_put32(&tcp[4], seq);
+	pcap_put32(&tcp[8], ack);
+	tcp[12] = 5 << 4;
+	/* PSH, ACK */
+	tcp[13] = 0x18;
+	pcap_put16(&tcp[14], 0xffff);
+	memcpy(&tcp[20], it->adu, it->rec.len);
+	/* pseudo header: addresses, protocol and tcp length */
+	uint32_t sum = (ip[12] << 8 | ip[13]) + (ip[14] << 8 | ip[15]) +
+		(ip[16] << 8 | ip[17]) + (ip[18] << 8 | ip[19]) + IPPROTO_TCP + (len - 20);
+	pcap_put16(&tcp[16], inet_csum(tcp, len - 20, sum));
+	return len;
 }
 
 /**
- * @function ctx:set_socket
- * @param sock integer socket number to set
+ * Save the records as a pcap file, see the section introduction for the
+ * link types used.
+ * @function capture:dump
+ * @param path file to write
+ * @param[opt] link "tcp" or "rtu", which records to save, defaults to
+ *  the link of the oldest record
+ * @return the number of records saved, or nil, error
  */
-static int ctx_set_socket(lua_State *L)
+static int cap_dump(lua_State *L)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	int newfd = luaL_checknumber(L, 2);
+	lmb_capture_t *cap = cap_check(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	int link = lua_isnoneornil(L, 3) ? -1 : luaL_checkoption(L, 3, NULL, cap_link_names);
+	uint32_t n;
+	lmb_cap_item_t *items = cap_snapshot(L, cap, &n);
+
+	if (link < 0) {
+		link = n ? items[0].rec.rtu : 0;
+	}
+	/* tcp sequence numbers, per context and direction */
+	struct {
+		uint32_t ctx;
+		uint32_t seq[2];
+	} *conns = NULL;
+	int nconns = 0;
+
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+	const lmb_pcap_hdr_t hdr = {
+		.magic = 0xa1b2c3d4,
+		.major = 2,
+		.minor = 4,
+		.snaplen = 0xffff,
+		.link = link ? LMB_PCAP_USER0 : LMB_PCAP_RAW,
+	};
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+
+	int saved = 0;
+	for (uint32_t i = 0; ok && i < n; i++) {
+		const lmb_cap_item_t *it = &items[i];
+		uint8_t pkt[40 + MODBUS_TCP_MAX_ADU_LENGTH];
+		int len;
+		if (it->rec.rtu != link || it->rec.len > MODBUS_TCP_MAX_ADU_LENGTH) {
+			continue;
+		}
+		if (link) {
+			pkt[0] = it->rec.dir;
+			pkt[1] = 0;
+			pcap_put16(&pkt[2], it->rec.ctx);
+			memcpy(&pkt[4], it->adu, it->rec.len);
+			len = 4 + it->rec.len;
+		} else {
+			int c;
+			for (c = 0; c < nconns && conns[c].ctx != it->rec.ctx; c++) {
+			}
+			if (c == nconns) {
+				void *p = lmb_realloc(conns, (nconns + 1) * sizeof(*conns));
+				if (!p) {
+					errno = ENOMEM;
+					ok = false;
+					break;
+				}
+				conns = p;
+				conns[c].ctx = it->rec.ctx;
+				conns[c].seq[0] = 1;
+				conns[c].seq[1] = 1;
+				nconns++;
+			}
+			uint32_t *seq = conns[c].seq;
+			len = pcap_tcp_packet(pkt, it, seq[it->rec.dir], seq[!it->rec.dir]);
+			seq[it->rec.dir] += it->rec.len;
+		}
+		uint64_t ts = cap->wall0 + (it->rec.ts - cap->mono0);
+		const uint32_t rec[4] = { ts / 1000000, ts % 1000000, len, len };
+		ok = fwrite(rec, sizeof(rec), 1, f) == 1 && fwrite(pkt, len, 1, f) == 1;
+		saved++;
+	}
+	free(conns);
+	if (fclose(f) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+	lua_pushinteger(L, saved);
+	return 1;
+}
 
-	modbus_set_socket(ctx->modbus, newfd);
+static uint32_t pcap_swap32(uint32_t v, bool swap)
+{
+	if (!swap) {
+		return v;
+	}
+	return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
 
-	return 0;
+/* Adds the Modbus/TCP ADUs in a captured IPv4 packet, whole frames only */
+static void pcap_load_ip(lmb_capture_t *cap, uint64_t ts, const uint8_t *p, int len, int port)
+{
+	if (len < 20 || p[0] >> 4 != 4 || p[9] != IPPROTO_TCP) {
+		return;
+	}
+	int ihl = (p[0] & 0x0f) * 4;
+	int total = p[2] << 8 | p[3];
+	if (total < len) {
+		len = total;
+	}
+	if (len < ihl + 20) {
+		return;
+	}
+	const uint8_t *tcp = p + ihl;
+	int sport = tcp[0] << 8 | tcp[1];
+	int dport = tcp[2] << 8 | tcp[3];
+	int off = ihl + (tcp[12] >> 4) * 4;
+	lmb_cap_rec_t rec = { .ts = ts };
+	int peer;
+	if (dport == port) {
+		rec.dir = LMB_CAP_TX;
+		peer = sport;
+	} else if (sport == port) {
+		rec.dir = LMB_CAP_RX;
+		peer = dport;
+	} else {
+		return;
+	}
+	rec.ctx = peer >= 1024 ? peer - 1024 : peer;
+	while (len - off >= 8) {
+		int adu = 6 + (p[off + 4] << 8 | p[off + 5]);
+		if (adu < 8 || adu > len - off || adu > MODBUS_TCP_MAX_ADU_LENGTH) {
+			break;
+		}
+		rec.len = adu;
+		cap_put(cap, &rec, &p[off], adu, NULL, 0);
+		off += adu;
+	}
 }
 
 /**
- * @function ctx:rtu_get_serial_mode
- * @return @{rtu_constants} the serial mode, either RTU_RS232 or RTU_RS485
+ * Load a pcap file, as saved by @{capture:dump}.  Modbus/TCP is also read
+ * from other captures, such as tcpdump's, on ethernet, raw IP or Linux
+ * cooked (tcpdump -i any), as long as frames aren't split across packets.  Records keep the file's realtime
+ * timestamps.
+ * @function load_capture
+ * @param path file to read
+ * @param[opt] opts table of options
+ *  <ul>
+ *  <li>size of the capture, defaults to the larger of 1MB and the file size</li>
+ *  <li>port the devices' tcp port, defaults to 502</li>
+ *  </ul>
+ * @return a capture, or nil, error
  */
-static int ctx_rtu_get_serial_mode(lua_State *L)
+static int libmodbus_load_capture(lua_State *L)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	if (!ctx->is_rtu) {
-		return luaL_error(L, "Cannot call RTU methods on an TCP context");
+	const char *path = luaL_checkstring(L, 1);
+	lua_Number size = 0;
+	int port = LMB_PCAP_PORT;
+
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "size");
+		size = luaL_optnumber(L, -1, 0);
+		lua_getfield(L, 2, "port");
+		port = luaL_optinteger(L, -1, port);
+		lua_pop(L, 2);
+	}
+	if (size && (size < 4096 || size > (1 << 30))) {
+		return luaL_argerror(L, 2, "size must be between 4kB and 1GB");
 	}
 
-	lua_pushinteger(L, modbus_rtu_get_serial_mode(ctx->modbus));
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+	if (!size) {
+		fseek(f, 0, SEEK_END);
+		long flen = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		size = flen > (1 << 20) ? flen : (1 << 20);
+		size = size > (1 << 30) ? (1 << 30) : size;
+	}
+	lmb_pcap_hdr_t hdr;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1) {
+		fclose(f);
+		lua_pushnil(L);
+		lua_pushstring(L, "not a pcap file");
+		return 2;
+	}
+	bool swap = hdr.magic == 0xd4c3b2a1 || hdr.magic == 0x4d3cb2a1;
+	bool nano = hdr.magic == 0xa1b23c4d || hdr.magic == 0x4d3cb2a1;
+	uint32_t link = pcap_swap32(hdr.link, swap);
+	if (!swap && !nano && hdr.magic != 0xa1b2c3d4) {
+		fclose(f);
+		lua_pushnil(L);
+		lua_pushstring(L, "not a pcap file");
+		return 2;
+	}
+	if (link != LMB_PCAP_RAW && link != LMB_PCAP_IPV4 && link != LMB_PCAP_ETHERNET && link != LMB_PCAP_USER0 &&
+			link != LMB_PCAP_SLL && link != LMB_PCAP_SLL2) {
+		fclose(f);
+		lua_pushnil(L);
+		lua_pushfstring(L, "unsupported link type %d", (int)link);
+		return 2;
+	}
 
+	lmb_capture_t *cap = cap_new(L, size);
+	cap->wall0 = 0;
+	cap->mono0 = 0;
+	uint32_t rec[4];
+	const uint32_t max = 0x40000;
+	uint8_t *pkt = lmb_malloc(max);
+	if (!pkt) {
+		fclose(f);
+		return luaL_error(L, "out of memory");
+	}
+	while (fread(rec, sizeof(rec), 1, f) == 1) {
+		uint32_t incl = pcap_swap32(rec[2], swap);
+		if (incl > max || fread(pkt, incl, 1, f) != 1) {
+			break;
+		}
+		uint64_t ts = (uint64_t)pcap_swap32(rec[0], swap) * 1000000 +
+			pcap_swap32(rec[1], swap) / (nano ? 1000 : 1);
+		const uint8_t *p = pkt;
+		int len = incl;
+		switch (link) {
+		case LMB_PCAP_USER0:
+			if (len > 4 && len - 4 <= MODBUS_RTU_MAX_ADU_LENGTH) {
+				lmb_cap_rec_t r = {
+					.ts = ts,
+					.ctx = p[2] << 8 | p[3],
+					.len = len - 4,
+					.dir = p[0] ? LMB_CAP_RX : LMB_CAP_TX,
+					.rtu = 1,
+				};
+				cap_put(cap, &r, &p[4], len - 4, NULL, 0);
+			}
+			break;
+		case LMB_PCAP_ETHERNET:
+			if (len >= 18 && p[12] == 0x81 && p[13] == 0x00) {
+				/* 802.1Q tagged */
+				p += 4;
+				len -= 4;
+			}
+			if (len >= 14 && p[12] == 0x08 && p[13] == 0x00) {
+				pcap_load_ip(cap, ts, p + 14, len - 14, port);
+			}
+			break;
+		case LMB_PCAP_SLL:
+			/* the protocol is last in the 16 byte header */
+			if (len >= 16 && p[14] == 0x08 && p[15] == 0x00) {
+				pcap_load_ip(cap, ts, p + 16, len - 16, port);
+			}
+			break;
+		case LMB_PCAP_SLL2:
+			/* and first in the 20 byte one */
+			if (len >= 20 && p[0] == 0x08 && p[1] == 0x00) {
+				pcap_load_ip(cap, ts, p + 20, len - 20, port);
+			}
+			break;
+		default:
+			pcap_load_ip(cap, ts, p, len, port);
+			break;
+		}
+	}
+	free(pkt);
+	fclose(f);
 	return 1;
 }
 
 /**
- * Sets the mode of a serial port.
- * Remember, this is only required if your kernel is handling rs485 natively.
- * If you are using a USB adapter, you do NOT need this.
- * @function ctx:rtu_set_serial_mode
- * @param mode The selected serial mode from @{rtu_constants}, either RTU_RS232 or RTU_RS485.
+ * Throw away all records.
+ * @function capture:clear
  */
-static int ctx_rtu_set_serial_mode(lua_State *L)
+static int cap_clear(lua_State *L)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	if (!ctx->is_rtu) {
-		return luaL_error(L, "Cannot call RTU methods on an TCP context");
-	}
-	int mode = luaL_checknumber(L, 2);
-
-	int rc = modbus_rtu_set_serial_mode(ctx->modbus, mode);
-
-	return libmodbus_rc_to_nil_error(L, rc, 0);
+	lmb_capture_t *cap = cap_check(L, 1);
+	lmb_mutex_lock(&cap->lock);
+	cap->head = 0;
+	cap->used = 0;
+	cap->records = 0;
+	lmb_mutex_unlock(&cap->lock);
+	return 0;
 }
 
 /**
- * @function ctx:rtu_get_rts
- * @return @{rtu_rts_constants} the RTS handling mode, up/down/none
+ * @function capture:stats
+ * @return table with size and used (bytes), records held, and counts of
+ *  records captured and overwritten
  */
-static int ctx_rtu_get_rts(lua_State *L)
+static int cap_stats(lua_State *L)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	if (!ctx->is_rtu) {
-		return luaL_error(L, "Cannot call RTU methods on an TCP context");
-	}
+	lmb_capture_t *cap = cap_check(L, 1);
 
-	lua_pushinteger(L, modbus_rtu_get_rts(ctx->modbus));
+	lmb_mutex_lock(&cap->lock);
+	size_t size = cap->size;
+	size_t used = cap->used;
+	uint32_t records = cap->records;
+	uint64_t captured = cap->captured;
+	uint64_t overwritten = cap->overwritten;
+	lmb_mutex_unlock(&cap->lock);
 
+	lua_newtable(L);
+	lua_pushnumber(L, size);
+	lua_setfield(L, -2, "size");
+	lua_pushnumber(L, used);
+	lua_setfield(L, -2, "used");
+	lua_pushnumber(L, records);
+	lua_setfield(L, -2, "records");
+	lua_pushnumber(L, captured);
+	lua_setfield(L, -2, "captured");
+	lua_pushnumber(L, overwritten);
+	lua_setfield(L, -2, "overwritten");
 	return 1;
 }
 
-/**
- * Sets the RTS handling of a serial port.
- * @function ctx:rtu_set_rts
- * @param mode The selected RTS handling mode from @{rtu_rts_constants}, up/down/none.
+static int cap_len(lua_State *L)
+{
+	lmb_capture_t *cap = cap_check(L, 1);
+	lmb_mutex_lock(&cap->lock);
+	lua_Number n = cap->records;
+	lmb_mutex_unlock(&cap->lock);
+	lua_pushnumber(L, n);
+	return 1;
+}
+
+/* A request from a capture, and the response recorded to it, if any */
+typedef struct {
+	uint64_t ts;
+	int unit;
+	const uint8_t *pdu;
+	int len;
+	const uint8_t *rsp;
+	int rsplen;
+	uint64_t latency;
+	bool used;
+} lmb_replay_t;
+
+/* The unit and pdu of a record, or NULL if it's too short to have one */
+static const uint8_t *replay_pdu(const lmb_cap_item_t *it, int *unit, int *len, uint16_t *tid)
+{
+	if (it->rec.rtu) {
+		if (it->rec.len < 4) {
+			return NULL;
+		}
+		*unit = it->adu[0];
+		*len = it->rec.len - 3;
+		*tid = 0;
+		return &it->adu[1];
+	}
+	if (it->rec.len < 8) {
+		return NULL;
+	}
+	*unit = it->adu[6];
+	*len = it->rec.len - 7;
+	*tid = it->adu[0] << 8 | it->adu[1];
+	return &it->adu[7];
+}
+
+/*
+ * Pairs the requests in a capture up with their responses: the next record
+ * received on the same context, with the same transaction id on tcp.
+ * Pushes two userdata, the records and the pairs pointing into them.
+ * @param id only requests from this context, or -1 for all
  */
-static int ctx_rtu_set_rts(lua_State *L)
+static lmb_replay_t *replay_pairs(lua_State *L, lmb_capture_t *cap, lua_Integer id, uint32_t *npairs)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	if (!ctx->is_rtu) {
-		return luaL_error(L, "Cannot call RTU methods on an TCP context");
+	uint32_t n;
+	const lmb_cap_item_t *items = cap_snapshot(L, cap, &n);
+	lmb_replay_t *pairs = lua_newuserdata(L, (n ? n : 1) * sizeof(*pairs));
+	uint32_t np = 0;
+
+	for (uint32_t i = 0; i < n; i++) {
+		const lmb_cap_item_t *it = &items[i];
+		lmb_replay_t *p = &pairs[np];
+		uint16_t tid;
+		if (it->rec.dir != LMB_CAP_TX || (id >= 0 && it->rec.ctx != id)) {
+			continue;
+		}
+		p->pdu = replay_pdu(it, &p->unit, &p->len, &tid);
+		if (!p->pdu) {
+			continue;
+		}
+		p->ts = it->rec.ts;
+		p->rsp = NULL;
+		p->rsplen = 0;
+		p->latency = 0;
+		p->used = false;
+		bool broadcast = it->rec.rtu && p->unit == MODBUS_BROADCAST_ADDRESS;
+		for (uint32_t j = i + 1; !broadcast && j < n && j < i + 256; j++) {
+			const lmb_cap_item_t *r = &items[j];
+			int runit, rlen;
+			uint16_t rtid;
+			if (r->rec.ctx != it->rec.ctx || r->rec.rtu != it->rec.rtu) {
+				continue;
+			}
+			if (r->rec.dir == LMB_CAP_TX) {
+				/* on a serial line, that was a timeout */
+				if (it->rec.rtu) {
+					break;
+				}
+				continue;
+			}
+			const uint8_t *rsp = replay_pdu(r, &runit, &rlen, &rtid);
+			if (rsp && runit == p->unit && rtid == tid) {
+				p->rsp = rsp;
+				p->rsplen = rlen;
+				p->latency = r->rec.ts - it->rec.ts;
+				break;
+			}
+			if (it->rec.rtu) {
+				break;
+			}
+		}
+		np++;
 	}
-	int mode = luaL_checknumber(L, 2);
+	*npairs = np;
+	return pairs;
+}
 
-	int rc = modbus_rtu_set_rts(ctx->modbus, mode);
+typedef struct {
+	uint32_t n;
+	uint64_t min;
+	uint64_t max;
+	uint64_t total;
+} lmb_replay_lat_t;
 
-	return libmodbus_rc_to_nil_error(L, rc, 0);
+static void replay_lat_add(lmb_replay_lat_t *l, uint64_t us)
+{
+	if (!l->n || us < l->min) {
+		l->min = us;
+	}
+	if (us > l->max) {
+		l->max = us;
+	}
+	l->total += us;
+	l->n++;
 }
 
-/**
- * @function ctx:rtu_get_rts_delay
- * @return usecs
- */
-static int ctx_rtu_get_rts_delay(lua_State *L)
+static void replay_lat_push(lua_State *L, const lmb_replay_lat_t *l, const char *name)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	if (!ctx->is_rtu) {
-		return luaL_error(L, "Cannot call RTU methods on an TCP context");
+	if (!l->n) {
+		return;
 	}
+	lua_createtable(L, 0, 3);
+	lua_pushnumber(L, l->min);
+	lua_setfield(L, -2, "min");
+	lua_pushnumber(L, (lua_Number)l->total / l->n);
+	lua_setfield(L, -2, "avg");
+	lua_pushnumber(L, l->max);
+	lua_setfield(L, -2, "max");
+	lua_setfield(L, -2, name);
+}
 
-	lua_pushinteger(L, modbus_rtu_get_rts_delay(ctx->modbus));
-
-	return 1;
+static void replay_stat(lua_State *L, const char *name, uint64_t v)
+{
+	lua_pushnumber(L, v);
+	lua_setfield(L, -2, name);
 }
 
-/**
- * Sets the RTS delay of a serial port.
- * @function ctx:rtu_set_rts_delay
- * @param usecs
- */
-static int ctx_rtu_set_rts_delay(lua_State *L)
+/* Sends the recorded requests to a device, at the recorded pace */
+static int replay_client(lua_State *L, ctx_t *ctx, lmb_replay_t *pairs, uint32_t n, lua_Number speed)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	if (!ctx->is_rtu) {
-		return luaL_error(L, "Cannot call RTU methods on an TCP context");
+	uint64_t responses = 0, exceptions = 0, timeouts = 0, errors = 0, mismatches = 0;
+	uint64_t max_lag = 0;
+	lmb_replay_lat_t lat = { 0 }, rec_lat = { 0 };
+	uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+	uint64_t start = lmb_now_us();
+
+	for (uint32_t i = 0; i < n; i++) {
+		lmb_replay_t *p = &pairs[i];
+		uint64_t due = start + (uint64_t)((p->ts - pairs[0].ts) / speed);
+		uint64_t now = lmb_now_us();
+		if (now < due) {
+			lmb_sleep_us(due - now);
+			now = lmb_now_us();
+		}
+		if (now - due > max_lag) {
+			max_lag = now - due;
+		}
+		if (p->rsp) {
+			replay_lat_add(&rec_lat, p->latency);
+		}
+
+		ctx_lock(ctx);
+		if (ctx->is_rtu && p->unit == MODBUS_BROADCAST_ADDRESS) {
+			uint8_t raw[MODBUS_MAX_PDU_LENGTH + 1];
+			raw[0] = MODBUS_BROADCAST_ADDRESS;
+			memcpy(&raw[1], p->pdu, p->len);
+			cap_pdu(ctx, LMB_CAP_TX, MODBUS_BROADCAST_ADDRESS, 0, p->pdu, p->len, 0);
+			if (modbus_send_raw_request(ctx->modbus, raw, p->len + 1) < 0) {
+				errors++;
+			}
+			ctx_unlock(ctx);
+			continue;
+		}
+		lmb_deadline_t dl = { 0 };
+		int rlen = raw_transact(ctx, p->unit, p->pdu, p->len, rsp, &dl);
+		int err = errno;
+		if (rlen < 0 && ctx->is_rtu && ctx->modbus) {
+			modbus_flush(ctx->modbus);
+		}
+		ctx_unlock(ctx);
+
+		bool match;
+		if (rlen >= 0) {
+			responses++;
+			replay_lat_add(&lat, lmb_now_us() - now);
+			match = p->rsp && p->rsplen == rlen && memcmp(p->rsp, rsp, rlen) == 0;
+		} else if (err > MODBUS_ENOBASE && err <= EMBXGTAR) {
+			exceptions++;
+			replay_lat_add(&lat, lmb_now_us() - now);
+			match = p->rsp && p->rsplen >= 2 && (p->rsp[0] & 0x80) && p->rsp[1] == err - MODBUS_ENOBASE;
+		} else if (err == ETIMEDOUT) {
+			timeouts++;
+			match = !p->rsp;
+		} else {
+			errors++;
+			match = false;
+		}
+		mismatches += !match;
 	}
-	int usecs = luaL_checknumber(L, 2);
 
-	int rc = modbus_rtu_set_rts_delay(ctx->modbus, usecs);
+	lua_newtable(L);
+	replay_stat(L, "requests", n);
+	replay_stat(L, "responses", responses);
+	replay_stat(L, "exceptions", exceptions);
+	replay_stat(L, "timeouts", timeouts);
+	replay_stat(L, "errors", errors);
+	replay_stat(L, "mismatches", mismatches);
+	replay_stat(L, "max_lag", max_lag);
+	replay_lat_push(L, &lat, "latency");
+	replay_lat_push(L, &rec_lat, "recorded_latency");
+	return 1;
+}
 
-	return libmodbus_rc_to_nil_error(L, rc, 0);
+/* Reads exactly len bytes, waiting no more than us for each read */
+static int replay_read(int s, uint8_t *buf, int len, uint64_t us)
+{
+	int got = 0;
+	while (got < len) {
+		if (sock_wait(s, false, us) < 0) {
+			return -1;
+		}
+#if defined(WIN32)
+		int rc = recv(s, (char *)buf + got, len - got, 0);
+#else
+		int rc = read(s, buf + got, len - got);
+#endif
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc <= 0) {
+			if (rc == 0) {
+				errno = ECONNRESET;
+			}
+			return -1;
+		}
+		got += rc;
+	}
+	return got;
 }
 
-/**
- * Returns the header length of the transport
- * @function ctx:get_header_length
- * @return the length in bytes
+/*
+ * Reads one request, either framing.  Garbled RTU requests are skipped.
+ * @return the length of the pdu, or -1
  */
-static int ctx_get_header_length(lua_State *L)
+static int replay_recv_request(ctx_t *rtu, int s, uint8_t *adu, uint64_t idle, int *unit, uint16_t *tid)
 {
-	ctx_t *ctx = ctx_check(L, 1);
+	if (!rtu) {
+		if (replay_read(s, adu, 7, idle) < 0) {
+			return -1;
+		}
+		int len = (adu[4] << 8 | adu[5]) - 1;
+		if (adu[2] || adu[3] || len < 1 || len > MODBUS_MAX_PDU_LENGTH) {
+			errno = EMBBADDATA;
+			return -1;
+		}
+		if (replay_read(s, &adu[7], len, idle) < 0) {
+			return -1;
+		}
+		*tid = adu[0] << 8 | adu[1];
+		*unit = adu[6];
+		return len;
+	}
+	for (;;) {
+		int got = 0, want;
+		if (replay_read(s, adu, 2, idle) < 0) {
+			return -1;
+		}
+		got = 2;
+		while ((want = rtu_request_length(adu, got)) == 0) {
+			if (replay_read(s, &adu[got], 1, idle) < 0) {
+				return -1;
+			}
+			got++;
+		}
+		if (want > got && replay_read(s, &adu[got], want - got, idle) < 0) {
+			return -1;
+		}
+		if (want > 0 && crc16(adu, want - 2) == (adu[want - 2] | adu[want - 1] << 8)) {
+			*tid = 0;
+			*unit = adu[0];
+			return want - 3;
+		}
+		/* lost sync, drop whatever else is in flight */
+		modbus_flush(rtu->modbus);
+	}
+}
 
-	lua_pushinteger(L, modbus_get_header_length(ctx->modbus));
+/* Answers requests as recorded, after the recorded response times */
+static int replay_server(lua_State *L, ctx_t *rtu, int s, lmb_replay_t *pairs, uint32_t n, lua_Number speed, uint64_t idle)
+{
+	uint64_t requests = 0, replied = 0, silent = 0, unmatched = 0, max_lag = 0;
+	uint32_t cursor = 0, used = 0;
+	uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+
+	while (cursor < n) {
+		int unit;
+		uint16_t tid;
+		int len = replay_recv_request(rtu, s, adu, idle, &unit, &tid);
+		if (len < 0) {
+			break;
+		}
+		const uint8_t *pdu = rtu ? &adu[1] : &adu[7];
+		uint64_t due = lmb_now_us();
+		requests++;
+
+		/* the first unanswered recorded request that's the same */
+		uint32_t k;
+		for (k = cursor; k < n && k - cursor < 1024; k++) {
+			lmb_replay_t *p = &pairs[k];
+			if (!p->used && p->unit == unit && p->len == len && memcmp(p->pdu, pdu, len) == 0) {
+				break;
+			}
+		}
+		uint8_t exc[2] = { pdu[0] | 0x80, MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE };
+		const uint8_t *rsp = exc;
+		int rsplen = sizeof(exc);
+		if (k < n && k - cursor < 1024) {
+			pairs[k].used = true;
+			used++;
+			while (cursor < n && pairs[cursor].used) {
+				cursor++;
+			}
+			rsp = pairs[k].rsp;
+			rsplen = pairs[k].rsplen;
+			due += (uint64_t)(pairs[k].latency / speed);
+		} else {
+			unmatched++;
+		}
+		if (!rsp || (rtu && unit == MODBUS_BROADCAST_ADDRESS)) {
+			silent++;
+			continue;
+		}
 
+		uint64_t now = lmb_now_us();
+		if (now < due) {
+			lmb_sleep_us(due - now);
+			now = lmb_now_us();
+		}
+		if (now - due > max_lag) {
+			max_lag = now - due;
+		}
+		int rc;
+		if (rtu) {
+			uint8_t raw[MODBUS_MAX_PDU_LENGTH + 1];
+			raw[0] = unit;
+			memcpy(&raw[1], rsp, rsplen);
+			cap_pdu(rtu, LMB_CAP_TX, unit, 0, rsp, rsplen, 0);
+			rc = modbus_send_raw_request(rtu->modbus, raw, rsplen + 1);
+		} else {
+			uint8_t out[MODBUS_TCP_MAX_ADU_LENGTH];
+			pcap_put16(&out[0], tid);
+			pcap_put16(&out[2], 0);
+			pcap_put16(&out[4], rsplen + 1);
+			out[6] = unit;
+			memcpy(&out[7], rsp, rsplen);
+			rc = sock_send_all(s, out, rsplen + 7);
+		}
+		if (rc < 0) {
+			break;
+		}
+		replied++;
+	}
+
+	lua_newtable(L);
+	replay_stat(L, "requests", requests);
+	replay_stat(L, "replied", replied);
+	replay_stat(L, "silent", silent);
+	replay_stat(L, "unmatched", unmatched);
+	replay_stat(L, "unanswered", n - used);
+	replay_stat(L, "max_lag", max_lag);
 	return 1;
 }
 
+static const char *const replay_mode_names[] = {
+	"client", "server", NULL
+};
+
 /**
- * @function ctx:set_slave
- * @param unitid the unit address / slave id to use
+ * Play a capture back.  As a client, the recorded requests are sent to a
+ * device at the recorded pace, and its answers compared with the recorded
+ * ones.  As a server, requests are answered as recorded, after the
+ * recorded response times, so a client sees the field's timing.  Use it on
+ * a development machine, against a simulator or the code under test.
+ * @function replay
+ * @param opts table of options
+ *  <ul>
+ *  <li>capture (required) from @{new_capture} or @{load_capture}</li>
+ *  <li>mode "client" (the default) or "server"</li>
+ *  <li>ctx a connected context, the device to send requests to, or for a
+ *  server, the RTU line to answer on</li>
+ *  <li>listen for a Modbus/TCP server, a listening socket, from
+ *  @{tcp_pi_listen}.  One client is served</li>
+ *  <li>id only replay requests from this context id, see @{ctx:set_capture}</li>
+ *  <li>speed multiplies the pace, defaults to 1</li>
+ *  <li>timeout for a server, microseconds to wait for the client and each
+ *  request, defaults to 5 seconds</li>
+ *  </ul>
+ * @return table of stats.  For a client: requests, responses, exceptions,
+ *  timeouts, errors, mismatches (answered differently than recorded),
+ *  max_lag (how late requests went out, microseconds), and latency and
+ *  recorded_latency, each with min, avg and max.  For a server: requests,
+ *  replied, silent (recorded without an answer), unmatched (not recorded,
+ *  answered with a server failure exception), unanswered (recorded
+ *  requests that never came) and max_lag.
+ * @usage
+ *  local cap = assert(mb.load_capture("site.pcap"))
+ *  local sock = mb.new_tcp_pi("127.0.0.1", 1502):tcp_pi_listen()
+ *  local stats = mb.replay{capture=cap, mode="server", listen=sock}
  */
-static int ctx_set_slave(lua_State *L)
-{
-	ctx_t *ctx = ctx_check(L, 1);
-	int slave = luaL_checknumber(L, 2);
-
-	int rc = modbus_set_slave(ctx->modbus, slave);
-	
-	return libmodbus_rc_to_nil_error(L, rc, 0);
-}
-
-static int _ctx_read_bits(lua_State *L, bool input)
+static int libmodbus_replay(lua_State *L)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	int addr = luaL_checknumber(L, 2);
-	int count = luaL_checknumber(L, 3);
-	int rcount = 0;
-	int rc;
-
-	if (count > MODBUS_MAX_READ_BITS) {
-		return luaL_argerror(L, 3, "requested too many bits");
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "capture");
+	lmb_capture_t *cap = cap_check(L, -1);
+	lua_getfield(L, 1, "mode");
+	int server = luaL_checkoption(L, -1, "client", replay_mode_names);
+	lua_getfield(L, 1, "ctx");
+	ctx_t *ctx = lua_isnil(L, -1) ? NULL : ctx_check(L, -1);
+	lua_getfield(L, 1, "listen");
+	int listen_fd = luaL_optinteger(L, -1, -1);
+	lua_getfield(L, 1, "id");
+	lua_Integer id = luaL_optinteger(L, -1, -1);
+	lua_getfield(L, 1, "speed");
+	lua_Number speed = luaL_optnumber(L, -1, 1);
+	lua_getfield(L, 1, "timeout");
+	lua_Integer idle = luaL_optinteger(L, -1, 5000000);
+	lua_pop(L, 7);
+
+	if (speed <= 0) {
+		return luaL_argerror(L, 1, "speed must be positive");
 	}
-
-	uint8_t *buf = malloc(count * sizeof(uint8_t));
-	assert(buf);
-	if (input) {
-		rc = modbus_read_input_bits(ctx->modbus, addr, count, buf);
-	} else {
-		rc = modbus_read_bits(ctx->modbus, addr, count, buf);
+	if (idle <= 0) {
+		return luaL_argerror(L, 1, "timeout must be positive");
 	}
-
-	if (rc == count) {
-		lua_newtable(L);
-		/* nota bene, lua style offsets! */
-		for (int i = 1; i <= rc; i++) {
-			lua_pushnumber(L, i);
-			/* TODO - push number or push bool? what's a better lua api? */
-			lua_pushnumber(L, buf[i-1]);
-			lua_settable(L, -3);
-		}
-		rcount = 1;
-	} else {
-		rcount = libmodbus_rc_to_nil_error(L, rc, count);
+	if (!server && !ctx) {
+		return luaL_argerror(L, 1, "a client needs a ctx to send to");
+	}
+	if (server && (listen_fd < 0) == (ctx == NULL)) {
+		return luaL_argerror(L, 1, "a server needs either a listen socket, or an RTU ctx");
+	}
+	if (server && ctx && !ctx->is_rtu) {
+		return luaL_argerror(L, 1, "tcp servers need a listen socket");
+	}
+	if (ctx && (!ctx->modbus || modbus_get_socket(ctx->modbus) < 0)) {
+		lua_pushnil(L);
+		lua_pushstring(L, modbus_strerror(EBADF));
+		return 2;
 	}
 
-	free(buf);
-	return rcount;
+	uint32_t n;
+	lmb_replay_t *pairs = replay_pairs(L, cap, id, &n);
+	if (!server) {
+		return replay_client(L, ctx, pairs, n, speed);
+	}
+	if (ctx) {
+		ctx_lock(ctx);
+		replay_server(L, ctx, modbus_get_socket(ctx->modbus), pairs, n, speed, idle);
+		ctx_unlock(ctx);
+		return 1;
+	}
+	if (sock_wait(listen_fd, false, idle) < 0) {
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		return libmodbus_rc_to_nil_error(L, -1, 0);
+	}
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+	replay_server(L, NULL, fd, pairs, n, speed, idle);
+	nb_close(fd);
+	return 1;
 }
 
-/**
- * @function ctx:read_input_bits
- * @param address
- * @param count
- * @return an array of results
+static const struct luaL_Reg cap_M[] = {
+	{"records",		cap_records},
+	{"dump",		cap_dump},
+	{"clear",		cap_clear},
+	{"stats",		cap_stats},
+	{"__len",		cap_len},
+	{"__gc",		cap_gc},
+	{NULL, NULL}
+};
+
+/** LuaJIT FFI.
+ * Under LuaJIT, libmodbus_ffi.lua is loaded automatically if installed,
+ * adding methods that read into and write from FFI arrays, through a plain
+ * C interface.  These calls don't abort trace compilation, and values are
+ * never converted to lua numbers.  Check for mb.ffi before relying on them.
+ * The C functions are lmb_ffi_*, see libmodbus_ffi.lua for their
+ * declarations.  The context handle they take is from ctx:_ptr(), and is
+ * only valid as long as the context userdata itself.  Shared contexts are
+ * locked as for the regular methods.
+ * @section ffi
+ * @usage
+ *  local regs = mb.ffi.registers(100)
+ *  while true do
+ *    assert(dev:read_registers_into(0, 100, regs))
+ *    total = total + regs[7]
+ *  end
  */
-static int ctx_read_input_bits(lua_State *L)
+
+#if defined(WIN32)
+#define LMB_FFI_API __declspec(dllexport)
+#else
+#define LMB_FFI_API __attribute__((visibility("default")))
+#endif
+
+/* Bumped for any incompatible change to the lmb_ffi_* functions */
+#define LMB_FFI_ABI 1
+
+/* Locks a shared context for a call, as ctx_call() does */
+static void ffi_enter(ctx_box_t *box)
 {
-	return _ctx_read_bits(L, true);
+	ctx_t *ctx = box->ctx;
+	ctx_lock(ctx);
+	if (ctx->shared && ctx->modbus && box->slave >= 0) {
+		ctx_unit_switch(ctx, box->slave);
+	}
 }
 
-/**
- * @function ctx:read_bits
- * @param address
- * @param count
- * @return an array of results
- */
-static int ctx_read_bits(lua_State *L)
+static int ffi_leave(ctx_box_t *box, int rc)
 {
-	return _ctx_read_bits(L, false);
+	int err = errno;
+	ctx_unlock(box->ctx);
+	errno = err;
+	return rc;
 }
 
-static int _ctx_read_regs(lua_State *L, bool input)
+/* Prepares a transfer of native values, or fails with errno EINVAL/EBADF */
+static int ffi_xfer_init(ctx_t *ctx, lmb_xfer_t *x, int table, int addr, int count, void *buf, double deadline)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	int addr = luaL_checknumber(L, 2);
-	int count = luaL_checknumber(L, 3);
-	int rcount = 0;
-	int rc;
-	
-	if (count > MODBUS_MAX_READ_REGISTERS) {
-		return luaL_argerror(L, 3, "requested too many registers");
+	if (!ctx->modbus) {
+		errno = EBADF;
+		return -1;
 	}
-	
-	// better malloc as much space as we need to return data here...
-	uint16_t *buf = malloc(count * sizeof(uint16_t));
-	assert(buf);
-	if (input) {
-		rc = modbus_read_input_registers(ctx->modbus, addr, count, buf);
-	} else {
-		rc = modbus_read_registers(ctx->modbus, addr, count, buf);
-	}
-	if (rc == count) {
-		lua_newtable(L);
-		/* nota bene, lua style offsets! */
-		for (int i = 1; i <= rc; i++) {
-			lua_pushnumber(L, i);
-			lua_pushnumber(L, buf[i-1]);
-			lua_settable(L, -3);
-		}
-		rcount = 1;
-	} else {
-		rcount = libmodbus_rc_to_nil_error(L, rc, count);
+	if (table < LMB_BITS || table > LMB_INPUT_REGISTERS || !buf ||
+		addr < 0 || addr > 0xffff || count < 1 || count > 0x10000 - addr) {
+		errno = EINVAL;
+		return -1;
 	}
-	
-	free(buf);
-	return rcount;
+	x->table = table;
+	x->addr = addr;
+	x->count = count;
+	x->buf = buf;
+	/* an already expired deadline must still read as "set" */
+	x->dl.at = deadline >= 1 ? deadline : deadline > 0 ? 1 : 0;
+	return 0;
 }
 
-/**
- * @function ctx:read_input_registers
- * @param address
- * @param count
- * @return an array of results
- */
-static int ctx_read_input_registers(lua_State *L)
+LMB_FFI_API int lmb_ffi_abi(void)
 {
-	return _ctx_read_regs(L, true);
+	return LMB_FFI_ABI;
 }
 
-/**
- * @function ctx:read_registers
- * @param address
- * @param count
- * @return an array of results
- */
-static int ctx_read_registers(lua_State *L)
+/* The underlying libmodbus context, for calling libmodbus directly */
+LMB_FFI_API modbus_t *lmb_ffi_modbus(void *handle)
 {
-	return _ctx_read_regs(L, false);
+	ctx_box_t *box = handle;
+	return box && box->ctx ? box->ctx->modbus : NULL;
 }
 
-/**
- * @function ctx:report_slave_id
- * @return a luastring with the raw result (lua strings can contain nulls)
- */
-static int ctx_report_slave_id(lua_State *L)
+/* As monotonic(), the clock for deadlines */
+LMB_FFI_API double lmb_ffi_monotonic(void)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-
-	uint8_t *buf = malloc(ctx->max_len);
-	assert(buf);
-#if LIBMODBUS_VERSION_CHECK(3,1,0)
-	int rc = modbus_report_slave_id(ctx->modbus, ctx->max_len, buf);
-#else
-	int rc = modbus_report_slave_id(ctx->modbus, buf);
-#endif
-	if (rc < 0) {
-		return libmodbus_rc_to_nil_error(L, rc, 0);
-	}
+	return lmb_now_us();
+}
 
-	lua_pushlstring(L, (char *)buf, rc);
-	return 1;
+LMB_FFI_API const char *lmb_ffi_strerror(int errnum)
+{
+	return modbus_strerror(errnum);
 }
 
-/**
- * @function ctx:write_bit
- * @param address
- * @param value either a number or a boolean
+/*
+ * Reads count values into dest, uint8_t for the bit tables, uint16_t for
+ * the register tables.  Splitting, pipelining and the cache all apply.
+ * @param table 0-3, bits, input_bits, registers, input_registers
+ * @param deadline absolute, see @{monotonic}, or 0 for none
+ * @return count, or -1 with errno set
  */
-static int ctx_write_bit(lua_State *L)
+static int ffi_read(ctx_t *ctx, int table, int addr, int count, void *dest, double deadline)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	int addr = luaL_checknumber(L, 2);
-	int val;
+	lmb_xfer_t x = { .write = false };
 
-	if (lua_type(L, 3) == LUA_TNUMBER) {
-		val = lua_tonumber(L, 3);
-	} else if (lua_type(L, 3) == LUA_TBOOLEAN) {
-		val = lua_toboolean(L, 3);
-	} else {
-		return luaL_argerror(L, 3, "bit must be numeric or boolean");
+	if (ffi_xfer_init(ctx, &x, table, addr, count, dest, deadline) < 0) {
+		return -1;
 	}
-
-	int rc = modbus_write_bit(ctx->modbus, addr, val);
-
-	return libmodbus_rc_to_nil_error(L, rc, 1);
+	lmb_cache_block_t *b = cache_find(ctx, x.table, addr, count);
+	if (b) {
+		if (cache_fill(ctx, b, &x.dl) < 0) {
+			return -1;
+		}
+		const uint16_t *v = &b->vals[addr - b->addr];
+		if (table == LMB_BITS || table == LMB_INPUT_BITS) {
+			for (int i = 0; i < count; i++) {
+				((uint8_t *)dest)[i] = v[i];
+			}
+		} else {
+			memcpy(dest, v, count * sizeof(*v));
+		}
+		return count;
+	}
+	return xfer_run(NULL, ctx, &x);
 }
 
-/**
- * @function ctx:write_register
- * @param address
- * @param value
- */
-static int ctx_write_register(lua_State *L)
+LMB_FFI_API int lmb_ffi_read(void *handle, int table, int addr, int count, void *dest, double deadline)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	int addr = luaL_checknumber(L, 2);
-	int val = luaL_checknumber(L, 3);
-
-	int rc = modbus_write_register(ctx->modbus, addr, val);
-	
-	return libmodbus_rc_to_nil_error(L, rc, 1);
+	ctx_box_t *box = handle;
+	if (!box || !box->ctx) {
+		errno = EBADF;
+		return -1;
+	}
+	ffi_enter(box);
+	return ffi_leave(box, ffi_read(box->ctx, table, addr, count, dest, deadline));
 }
 
-
-/**
- * @function ctx:write_bits
- * @param address
- * @param value as a lua array table
+/*
+ * Writes count values from src, as for lmb_ffi_read, to bits or registers.
+ * @return count, or -1 with errno set.  Earlier requests of a split write
+ * may have succeeded.
  */
-static int ctx_write_bits(lua_State *L)
+static int ffi_write(ctx_t *ctx, int table, int addr, int count, const void *src, double deadline)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	int addr = luaL_checknumber(L, 2);
-	int rc;
-	int rcount;
-
-	/*
-	 * TODO - could allow just a series of arguments too? easier for
-	 * smaller sets?"?)
-	 */
-	luaL_checktype(L, 3, LUA_TTABLE);
-	/* array style table only! */
-	int count = lua_rawlen(L, 3);
+	lmb_xfer_t x = { .write = true };
 
-	if (count > MODBUS_MAX_WRITE_BITS) {
-		return luaL_argerror(L, 3, "requested too many bits");
+	if (ffi_xfer_init(ctx, &x, table, addr, count, (void *)src, deadline) < 0) {
+		return -1;
 	}
-
-	/* Convert table to uint8_t array */
-	uint8_t *buf = malloc(count * sizeof(uint8_t));
-	assert(buf);
-	for (int i = 1; i <= count; i++) {
-		bool ok = false;
-		lua_rawgeti(L, 3, i);
-		if (lua_type(L, -1) == LUA_TNUMBER) {
-			buf[i-1] = lua_tonumber(L, -1);
-			ok = true;
-		}
-		if (lua_type(L, -1) == LUA_TBOOLEAN) {
-			buf[i-1] = lua_toboolean(L, -1);
-			ok = true;
-		}
-
-		if (ok) {
-			lua_pop(L, 1);
-		} else {
-			free(buf);
-			return luaL_argerror(L, 3, "table values must be numeric or bool");
-		}
-	}
-	rc = modbus_write_bits(ctx->modbus, addr, count, buf);
-	if (rc == count) {
-		rcount = 1;
-		lua_pushboolean(L, true);
-	} else {
-		rcount = libmodbus_rc_to_nil_error(L, rc, count);
+	if (table != LMB_BITS && table != LMB_REGISTERS) {
+		errno = EINVAL;
+		return -1;
 	}
-
-	free(buf);
-	return rcount;
+	int rc = xfer_run(NULL, ctx, &x);
+	cache_invalidate(ctx, x.table, x.addr, x.count);
+	return rc;
 }
 
+LMB_FFI_API int lmb_ffi_write(void *handle, int table, int addr, int count, const void *src, double deadline)
+{
+	ctx_box_t *box = handle;
+	if (!box || !box->ctx) {
+		errno = EBADF;
+		return -1;
+	}
+	ffi_enter(box);
+	return ffi_leave(box, ffi_write(box->ctx, table, addr, count, src, deadline));
+}
 
 /**
- * @function ctx:write_registers
- * @param address base address to write to
- * @param value as a lua array table, or a sequence of values.
- * @usage either
- *  ctx:write_registers(0x2000, {1,2,3})
- *  ctx:write_registers(0x2000, 1, 2, 3)
+ * The context's handle for the lmb_ffi_* functions.
+ * @function ctx:_ptr
+ * @return lightuserdata
  */
-static int ctx_write_registers(lua_State *L)
+static int ctx_ptr(lua_State *L)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	int addr = luaL_checknumber(L, 2);
-	int rc;
-	int rcount;
-	uint16_t *buf;
-	int count;
-
-	if (lua_type(L, 3) == LUA_TTABLE) {
-		/* array style table only! */
-		count = lua_rawlen(L, 3);
-
-		if (count > MODBUS_MAX_WRITE_REGISTERS) {
-			return luaL_argerror(L, 3, "requested too many registers");
-		}
+	lua_pushlightuserdata(L, ctx_box_check(L, 1));
+	return 1;
+}
 
-		/* Convert table to uint16_t array */
-		buf = malloc(count * sizeof(uint16_t));
-		assert(buf);
-		for (int i = 1; i <= count; i++) {
-			lua_rawgeti(L, 3, i);
-			/* user beware! we're not range checking your values */
-			if (lua_type(L, -1) != LUA_TNUMBER) {
-				free(buf);
-				return luaL_argerror(L, 3, "table values must be numeric yo");
-			}
-			/* This preserves sign and fractions better than tointeger() */
-			lua_Number n = lua_tonumber(L, -1);
-			buf[i-1] = (int16_t)n;
-			lua_pop(L, 1);
-		}
-	} else {
-		/* Assume sequence of values then... */
-		int total_args = lua_gettop(L);
-		if (total_args < 3) {
-			return luaL_argerror(L, 3, "No values provided to write!");
-		}
-		count = total_args - 2;
-		buf = malloc(count * sizeof(uint16_t));
-		assert(buf);
-		for (int i = 0; i < count; i++) {
-			buf[i] = (int16_t)lua_tonumber(L, i + 3);
-		}
+/*
+ * Under LuaJIT, lets libmodbus_ffi.lua add its methods, if it's installed.
+ * Expects the module table on the top of the stack.
+ */
+static void ffi_install(lua_State *L)
+{
+	lua_getglobal(L, "jit");
+	bool jit = lua_istable(L, -1);
+	lua_pop(L, 1);
+	if (!jit) {
+		return;
 	}
-	rc = modbus_write_registers(ctx->modbus, addr, count, buf);
-	if (rc == count) {
-		rcount = 1;
-		lua_pushboolean(L, true);
-	} else {
-		rcount = libmodbus_rc_to_nil_error(L, rc, count);
+	lua_getglobal(L, "require");
+	lua_pushliteral(L, "libmodbus_ffi");
+	if (lua_pcall(L, 1, 1, 0) != 0 || !lua_isfunction(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pushvalue(L, -2);
+	luaL_getmetatable(L, MODBUS_META_CTX);
+	if (lua_pcall(L, 2, 0, 0) != 0) {
+		lua_pop(L, 1);
 	}
-	
-	free(buf);
-	return rcount;
 }
 
 static int ctx_send_raw_request(lua_State *L)
@@ -1080,18 +11989,23 @@ static int ctx_send_raw_request(lua_State *L)
 	/* array style table only! */
 
 	/* Convert table to uint8_t array */
-	uint8_t *buf = malloc(lua_rawlen(L, 2) * sizeof(uint8_t));
-	assert(buf);
+	uint8_t *buf = ctx->scratch;
+	if (count > (int)sizeof(ctx->scratch)) {
+		return luaL_argerror(L, 2, "request too long");
+	}
 	for (int i = 1; i <= count; i++) {
 		lua_rawgeti(L, 2, i);
 		/* user beware! we're not range checking your values */
 		if (lua_type(L, -1) != LUA_TNUMBER) {
-			free(buf);
 			return luaL_argerror(L, 2, "table values must be numeric");
 		}
 		buf[i-1] = lua_tonumber(L, -1);
 		lua_pop(L, 1);
 	};
+	if (count > 1) {
+		/* libmodbus sends these with transaction id 0 */
+		cap_pdu(ctx, LMB_CAP_TX, buf[0], 0, &buf[1], count - 1, 0);
+	}
 	rc = modbus_send_raw_request(ctx->modbus, buf, count);
 
 	if (rc < 0) {
@@ -1114,7 +12028,6 @@ static int ctx_send_raw_request(lua_State *L)
 		};
 	}
 
-	free(buf);
 	return rcount;
 
 }
@@ -1175,9 +12088,10 @@ static int ctx_receive(lua_State *L)
 	ctx_t *ctx = ctx_check(L, 1);
 	int rcount;
 
-	uint8_t *req = malloc(ctx->max_len);
+	uint8_t *req = ctx->scratch;
 	int rc = modbus_receive(ctx->modbus, req);
 	if (rc > 0) {
+		cap_adu(ctx, LMB_CAP_RX, req, rc, NULL, 0, 0);
 		lua_pushnumber(L, rc);
 		lua_pushlstring(L, (char *)req, rc);
 		rcount = 2;
@@ -1338,9 +12252,28 @@ static const struct luaL_Reg R[] = {
 	{"new_rtu",	libmodbus_new_rtu},
 	{"new_tcp_pi",	libmodbus_new_tcp_pi},
 	{"version",	libmodbus_version},
+	{"monotonic",	libmodbus_monotonic},
+	{"attach",	libmodbus_attach},
+#if defined(LMB_DEBUG_ALLOC)
+	{"allocations",	libmodbus_allocations},
+#endif
+	{"save_profiles",	libmodbus_save_profiles},
+	{"load_profiles",	libmodbus_load_profiles},
+	{"scan",	libmodbus_scan},
+	{"connect_all",	libmodbus_connect_all},
+	{"new_gateway",	libmodbus_new_gateway},
+	{"new_server",	libmodbus_new_server},
+	{"new_hedge",	libmodbus_new_hedge},
+	{"new_pool",	libmodbus_new_pool},
+	{"new_ring",	libmodbus_new_ring},
+	{"new_capture",	libmodbus_new_capture},
+	{"load_capture",	libmodbus_load_capture},
+	{"replay",	libmodbus_replay},
+	{"new_scheduler",	libmodbus_new_scheduler},
 
 	{"set_s32",	helper_set_s32},
 	{"set_f32",	helper_set_f32},
+	{"encode",	helper_encode},
 
 	{"get_s16",	helper_get_s16},
 	{"get_s32",	helper_get_s32},
@@ -1368,6 +12301,7 @@ static const struct luaL_Reg ctx_M[] = {
 	{"read_input_bits",	ctx_read_input_bits},
 	{"read_input_registers",ctx_read_input_registers},
 	{"read_registers",	ctx_read_registers},
+	{"read_encoded",	ctx_read_encoded},
 	{"report_slave_id",	ctx_report_slave_id},
 	{"set_debug",		ctx_set_debug},
 	{"set_byte_timeout",	ctx_set_byte_timeout},
@@ -1375,12 +12309,31 @@ static const struct luaL_Reg ctx_M[] = {
 	{"set_response_timeout",ctx_set_response_timeout},
 	{"set_slave",		ctx_set_slave},
 	{"set_socket",		ctx_set_socket},
+	{"set_request_limits",	ctx_set_request_limits},
+	{"probe_capabilities",	ctx_probe_capabilities},
+	{"apply_profile",	ctx_apply_profile},
+	{"cache_add",		ctx_cache_add},
+	{"cache_invalidate",	ctx_cache_invalidate},
+	{"cache_clear",		ctx_cache_clear},
+	{"cache_stats",		ctx_cache_stats},
+	{"subscribe",		ctx_subscribe},
+	{"new_arbiter",		ctx_new_arbiter},
+	{"get_request_limits",	ctx_get_request_limits},
 	{"write_bit",		ctx_write_bit},
 	{"write_bits",		ctx_write_bits},
 	{"write_register",	ctx_write_register},
 	{"write_registers",	ctx_write_registers},
+	{"write_registers_as",	ctx_write_registers_as},
+	{"write_points",	ctx_write_points},
+	{"read_file_record",	ctx_read_file_record},
+	{"write_file_record",	ctx_write_file_record},
+	{"read_fifo_queue",	ctx_read_fifo_queue},
+	{"broadcast_write",	ctx_broadcast_write},
 	{"send_raw_request",	ctx_send_raw_request},
-	{"__gc",		ctx_destroy},
+	{"_ptr",		ctx_ptr},
+	{"share",		ctx_share},
+	{"set_capture",		ctx_set_capture},
+	{"__gc",		ctx_box_gc},
 	{"__tostring",		ctx_tostring},
 	
 	{"tcp_pi_listen",	ctx_tcp_pi_listen},
@@ -1392,6 +12345,8 @@ static const struct luaL_Reg ctx_M[] = {
 	{"rtu_set_rts",		ctx_rtu_set_rts},
 	{"rtu_get_rts_delay",	ctx_rtu_get_rts_delay},
 	{"rtu_set_rts_delay",	ctx_rtu_set_rts_delay},
+	{"rtu_tune",		ctx_rtu_tune},
+	{"rtu_get_stats",	ctx_rtu_get_stats},
 
 	{"receive",		ctx_receive},
 	{"reply",		ctx_reply}, /* Totally busted */
@@ -1413,11 +12368,57 @@ int luaopen_libmodbus(lua_State *L)
 	luaL_newmetatable(L, MODBUS_META_CTX);
 	lua_pushvalue(L, -1);
 	lua_setfield(L, -2, "__index");
-	luaL_setfuncs(L, ctx_M, 0);
+	ctx_setfuncs(L, ctx_M);
+
+	luaL_newmetatable(L, MODBUS_META_SUB);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, sub_M, 0);
+
+	luaL_newmetatable(L, MODBUS_META_SCHED);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, sched_M, 0);
+
+	luaL_newmetatable(L, MODBUS_META_ARB);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, arb_M, 0);
+
+	luaL_newmetatable(L, MODBUS_META_GW);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, gw_M, 0);
+
+	luaL_newmetatable(L, MODBUS_META_HEDGE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, hedge_M, 0);
+
+	luaL_newmetatable(L, MODBUS_META_POOL);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, pool_M, 0);
+
+	luaL_newmetatable(L, MODBUS_META_RING);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, ring_M, 0);
+
+	luaL_newmetatable(L, MODBUS_META_CAP);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, cap_M, 0);
+
+	luaL_newmetatable(L, MODBUS_META_SRV);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, srv_M, 0);
 
 	luaL_newlib(L, R);
 
 	modbus_register_defs(L, D, S);
+	ffi_install(L);
 
 	return 1;
 }
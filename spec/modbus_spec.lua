@@ -38,6 +38,865 @@ describe("basic arg passing", function()
 		tv = {x:get_response_timeout()}
 		assert.is_same({1, 250*1000}, tv)
 	end)
+	it("should fail expired deadlines without touching the bus", function()
+		x = mb.new_tcp_pi("blah", 123)
+		local res, err = x:read_registers(0, 2, {deadline = mb.monotonic() - 1})
+		assert.is_nil(res)
+		assert.truthy(err)
+		-- and leave the configured timeouts alone
+		assert.is_same({0, 500*1000}, {x:get_response_timeout()})
+		assert.has_error(function() x:read_registers(0, 2, "soon") end)
+		assert.has_error(function() x:read_registers(0, 2, {deadline = -5}) end)
+		-- a table with neither field is no deadline at all, not an expired one
+		local _, err2 = x:read_registers(0, 2, {})
+		assert.is_true(err ~= err2)
+	end)
+	it("should get/set request limits", function()
+		x = mb.new_tcp_pi("blah", 123)
+		local l = x:get_request_limits()
+		assert.is_same({read_registers=125, write_registers=123, read_bits=2000, write_bits=1968, pipeline=1}, l)
+		x:set_request_limits{read_registers=64, pipeline=4}
+		l = x:get_request_limits()
+		assert.are.equal(64, l.read_registers)
+		assert.are.equal(123, l.write_registers)
+		assert.are.equal(4, l.pipeline)
+		assert.has_error(function() x:set_request_limits{read_registers=126} end)
+		assert.has_error(function() x:set_request_limits{write_bits=0} end)
+		-- splitting allows anything up to the end of the address space
+		assert.has_error(function() x:read_registers(0xff00, 0x101) end)
+		assert.has_error(function() x:read_registers(0, -1) end)
+		assert.has_error(function() x:read_bits(0, 0) end)
+		assert.has_error(function() x:write_registers(0, {}) end)
+		assert.has_error(function() mb.new_rtu("/dev/null"):set_request_limits{pipeline=2} end)
+	end)
+
+	it("should save and load profiles", function()
+		local path = os.tmpname()
+		local p = {read_registers=64, write_registers=32, fc16_single=false, fc43=true, latency=1500}
+		assert.is_true(mb.save_profiles(path, {meter=p, other={read_registers=10}}))
+		local q = mb.load_profiles(path)
+		os.remove(path)
+		assert.is_same(p, q.meter)
+		assert.is_same({read_registers=10}, q.other)
+		assert.has_error(function() mb.save_profiles(path, {["bad name"]={}}) end)
+		x = mb.new_tcp_pi("blah", 123)
+		x:apply_profile(p)
+		local l = x:get_request_limits()
+		assert.are.equal(64, l.read_registers)
+		assert.are.equal(32, l.write_registers)
+		assert.has_error(function() x:probe_capabilities{addr=0, timeout=-1} end)
+	end)
+
+	it("should manage cache blocks", function()
+		x = mb.new_tcp_pi("blah", 123)
+		x:cache_add{table="registers", addr=0, count=100, ttl=1000000}
+		assert.are.equal(1, x:cache_stats().blocks)
+		assert.has_error(function() x:cache_add{table="coils", addr=0, count=1, ttl=1} end)
+		assert.has_error(function() x:cache_add{table="bits", addr=0xffff, count=2, ttl=1} end)
+		-- rtu has no default unit
+		assert.has_error(function() mb.new_rtu("/dev/null"):cache_add{table="bits", addr=0, count=1, ttl=1} end)
+		x:cache_clear()
+		assert.are.equal(0, x:cache_stats().blocks)
+	end)
+
+	it("should validate subscriptions", function()
+		x = mb.new_tcp_pi("blah", 123)
+		local sub = x:subscribe{table="registers", addr=0, count=4, type="f32", deadband=0.5}
+		assert.is_truthy(tostring(sub):match("registers@0%+4"))
+		assert.has_error(function() x:subscribe{table="registers", addr=0, count=1, type="u128"} end)
+		assert.has_error(function() x:subscribe{table="registers", addr=0, count=2, points={{offset=1, type="u32"}}} end)
+		assert.has_error(function() x:subscribe{table="bits", addr=0, count=2, points={{offset=0}}} end)
+		assert.has_error(function() x:subscribe{table="registers", addr=0, count=1, deadband=-1} end)
+	end)
+
+	it("should validate scheduler jobs", function()
+		x = mb.new_tcp_pi("blah", 123)
+		local sch = mb.new_scheduler{tick=500}
+		assert.has_error(function() mb.new_scheduler{tick=0} end)
+		assert.has_error(function() sch:add{ctx=x, table="registers", addr=0, count=1, interval=100} end)
+		assert.has_error(function() sch:add{ctx=x, table="registers", addr=0, count=1, interval=1000, phase=1000} end)
+		local id = sch:add{ctx=x, table="registers", addr=0, count=1, interval=1e6}
+		assert.are.equal(0, sch:stats()[id].runs)
+		sch:remove(id)
+		assert.is_nil(sch:stats()[id])
+		-- nothing to run, returns straight away
+		assert.are.same({}, sch:run())
+		assert.has_error(function() sch:run(-1) end)
+	end)
+
+	it("should size arbiter gaps from the line settings", function()
+		assert.are.equal(4011, mb.new_rtu("/dev/null", 9600, "E", 8, 1):new_arbiter():stats().gap)
+		assert.are.equal(1750, mb.new_rtu("/dev/null", 115200):new_arbiter():stats().gap)
+		assert.are.equal(0, mb.new_tcp_pi("blah", 123):new_arbiter():stats().gap)
+		local arb = mb.new_tcp_pi("blah", 123):new_arbiter{gap=500}
+		assert.are.equal(500, arb:stats().gap)
+		local id = arb:submit{table="registers", addr=0, count=10, priority="control"}
+		assert.are.equal(1, arb:stats().queued)
+		assert.has_error(function() arb:submit{table="registers", addr=0, count=1, priority="urgent"} end)
+		assert.has_error(function() arb:submit{table="input_bits", addr=0, values={1}} end)
+		assert.is_true(arb:cancel(id))
+		assert.are.equal(0, arb:stats().queued)
+		-- deadlines are absolute times, an expired one times out unsent
+		arb:submit{table="registers", addr=0, count=1, deadline=mb.monotonic() - 1}
+		arb:submit{table="registers", addr=0, count=1, deadline=mb.monotonic() + 1e6}
+		local res = arb:run()
+		assert.are.equal(2, #res)
+		assert.is_true(res[1].err ~= res[2].err)
+		assert.has_error(function() arb:submit{table="registers", addr=0, count=1, deadline=-1} end)
+		assert.has_error(function() arb:run(-1) end)
+	end)
+
+	it("should compute rtu timing", function()
+		x = mb.new_rtu("/dev/null", 115200, "N", 8, 1)
+		local t = x:rtu_tune{}
+		assert.are.equal(1750, t.t35)
+		assert.are.equal(87, t.char)
+		t = x:rtu_tune{exact_t35=true, adaptive=true, turnaround=5000}
+		assert.are.equal(304, t.t35)
+		assert.has_error(function() x:rtu_tune{adaptive=true, turnaround=0} end)
+		assert.are.equal(0, x:rtu_get_stats().transactions)
+		assert.has_error(function() mb.new_tcp_pi("blah", 123):rtu_tune{} end)
+		-- tuning the port itself needs it open
+		assert.is_nil(x:rtu_tune{vmin=0})
+	end)
+
+	it("should validate broadcast writes", function()
+		x = mb.new_rtu("/dev/null", 115200, "N", 8, 1)
+		assert.has_error(function() x:broadcast_write{table="input_registers", addr=0, values={1}} end)
+		assert.has_error(function() x:broadcast_write{table="registers", addr=0} end)
+		assert.has_error(function() x:broadcast_write{table="registers", addr=0, values={1}, verify={0}} end)
+		assert.has_error(function() x:broadcast_write{table="registers", addr=0, values={1}, turnaround=-1} end)
+	end)
+
+	it("should validate scans", function()
+		assert.has_error(function() mb.scan{} end)
+		assert.has_error(function() mb.scan{hosts="10.0.0.0/8"} end)
+		x = mb.new_rtu("/dev/null", 115200, "N", 8, 1)
+		assert.has_error(function() mb.scan{ctx=x, first=0} end)
+		-- needs to be connected
+		assert.is_nil(mb.scan{ctx=x})
+		local r, stats = mb.scan{hosts={}}
+		assert.are.equal(0, #r)
+		assert.are.equal(0, stats.probed)
+	end)
+
+	it("should validate gateways", function()
+		x = mb.new_rtu("/dev/null", 115200, "N", 8, 1)
+		assert.has_error(function() mb.new_gateway{lines={{ctx=x, units={1}}}} end)
+		assert.has_error(function() mb.new_gateway{listen=3, lines={}} end)
+		assert.has_error(function() mb.new_gateway{listen=3, lines={{ctx=mb.new_tcp_pi("blah", 123), units={1}}}} end)
+		assert.has_error(function() mb.new_gateway{listen=3, lines={{ctx=x, units={1}}, {ctx=x, units={1}}}} end)
+		assert.has_error(function() mb.new_gateway{listen=-1, lines={{ctx=x, units={1}}}} end)
+		-- not connected
+		assert.has_error(function() mb.new_gateway{listen=3, lines={{ctx=x, units={1, 2}}}} end)
+	end)
+
+	it("should validate hedge groups", function()
+		x = mb.new_tcp_pi("blah", 123)
+		assert.has_error(function() mb.new_hedge{} end)
+		assert.has_error(function() mb.new_hedge{ctxs={}} end)
+		assert.has_error(function() mb.new_hedge{ctxs={x}, percentile=0} end)
+		local h = mb.new_hedge{ctxs={x, x}, delay=5000}
+		assert.has_error(function() h:read("holding", 0, 1) end)
+		assert.are.equal(5000, h:stats().delay)
+		-- not connected, both paths fail
+		assert.is_nil(h:read("registers", 0, 1))
+		assert.are.equal(1, h:stats().failures)
+	end)
+
+	it("should validate pools", function()
+		assert.has_error(function() mb.new_pool{} end)
+		assert.has_error(function() mb.new_pool{host="blah", size=0} end)
+		local pool = mb.new_pool{host="blah", service="123", size=2}
+		assert.are.equal(2, pool:stats().size)
+		assert.are.equal(0, pool:stats().connected)
+		assert.has_error(function() pool:lease(300) end)
+		assert.has_error(function() pool:read_many{{unit=1, table="registers", addr=0, count=0}} end)
+		assert.has_error(function() pool:release(mb.new_tcp_pi("blah", 123)) end)
+	end)
+
+	it("should keep samples in rings", function()
+		assert.has_error(function() mb.new_ring{capacity=0} end)
+		assert.has_error(function() mb.new_ring{capacity=4, policy="spill"} end)
+		local ring = mb.new_ring{capacity=3}
+		for i = 1, 5 do ring:push(i, i * 10) end
+		assert.are.equal(2, ring:stats().overwritten)
+		local t = ring:drain(2)
+		assert.are.same({3, 4}, t.point)
+		assert.are.same({30, 40}, t.value)
+		assert.are.equal(t, ring:drain(nil, t))
+		assert.are.same({5}, t.point)
+		ring = mb.new_ring{capacity=1, policy="drop"}
+		assert.is_true(ring:push(1, 1))
+		assert.is_false(ring:push(2, 2))
+		assert.are.equal(32, #ring:drain_packed())
+		-- point ids are 32 bit unsigned, however lua stores numbers
+		assert.has_error(function() ring:push(-1, 1) end)
+		assert.has_error(function() ring:push(2^32, 1) end)
+		assert.has_error(function() ring:push(1.5, 1) end)
+		ring:drain()
+		assert.is_true(ring:push(2^32 - 1, 1))
+		assert.are.same({2^32 - 1}, ring:drain().point)
+		local x = mb.new_tcp_pi("blah", 123)
+		assert.has_error(function() x:subscribe{table="registers", addr=0, count=1, id=-1} end)
+		assert.has_error(function() x:subscribe{table="registers", addr=0, count=2, id=2^32 - 1} end)
+		assert.has_error(function() x:subscribe{table="registers", addr=0, count=1, points={{offset=0, id=2^33}}} end)
+		assert.has_error(function() x:subscribe{table="registers", addr=0, count=1, points={{offset=0, id=0.5}}} end)
+		x:subscribe{table="registers", addr=0, count=1, id=2^32 - 2}
+	end)
+
+	it("should refuse oversized raw requests", function()
+		local x = mb.new_tcp_pi("blah", 123)
+		local big = {}
+		for i = 1, 300 do big[i] = 0 end
+		assert.has_error(function() x:send_raw_request(big) end)
+	end)
+
+	it("should offer the ffi fast path under luajit", function()
+		local x = mb.new_tcp_pi("blah", 123)
+		assert.are.equal("userdata", type(x:_ptr()))
+		if not jit then
+			assert.is_nil(mb.ffi)
+			return
+		end
+		assert.is_truthy(mb.ffi)
+		local regs = mb.ffi.registers(4)
+		assert.has_error(function() x:read_registers_into(0, 5, regs) end)
+		local res, err = x:read_registers_into(0, 4, regs)
+		assert.is_nil(res)
+		assert.is_truthy(err)
+	end)
+
+	it("should encode straight from C", function()
+		local x = mb.new_tcp_pi("blah", 123)
+		assert.has_error(function() x:read_encoded{format="xml", table="registers", addr=0, count=1} end)
+		assert.has_error(function() x:read_encoded{format="json", table="registers", addr=0, count=3, type="u32"} end)
+		assert.has_error(function() x:read_encoded{format="json", table="registers", addr=0, count=3,
+			fields={{name="a", offset=2, type="u32"}}} end)
+		local ring = mb.new_ring{capacity=2}
+		ring:push(7, 2.5)
+		ring:push(8, 0/0, 1)
+		local s = ring:drain_encoded("json", nil, true)
+		assert.is_truthy(s:match("^%[%[%d+,7,2%.5,0%],%[%d+,8,null,1%]%]$"))
+		assert.are.equal("[]", ring:drain_encoded("json"))
+		assert.has_error(function() ring:drain_encoded("yaml") end)
+	end)
+
+	it("should share contexts between states", function()
+		local x = mb.new_tcp_pi("blah", 123)
+		local h = x:share()
+		local y = mb.attach(h)
+		assert.has_error(function() mb.attach(h) end)
+		assert.has_error(function() mb.attach({}) end)
+		assert.has_error(function() mb.new_hedge{ctxs={x, y}} end)
+		x:set_slave(3)
+		y:set_slave(4)
+		x:destroy()
+		y:close()
+		y:destroy()
+	end)
+
+	it("should capture frames", function()
+		assert.has_error(function() mb.new_capture{size=10} end)
+		local cap = mb.new_capture{size=65536}
+		local x = mb.new_tcp_pi("blah", 123)
+		assert.are.equal("number", type(x:set_capture(cap)))
+		assert.are.equal(0, #cap)
+		assert.are.equal(0, cap:stats().records)
+		assert.are.same({}, cap:records())
+		local fn = os.tmpname()
+		assert.are.equal(0, cap:dump(fn))
+		assert.is_truthy(mb.load_capture(fn))
+		local f = io.open(fn, "w")
+		f:write("not a pcap file at all")
+		f:close()
+		assert.is_falsy(mb.load_capture(fn))
+		-- a linux cooked capture, as tcpdump -i any makes, of one request
+		local function le32(n)
+			return string.char(n % 256, math.floor(n / 256) % 256, math.floor(n / 65536) % 256, math.floor(n / 16777216))
+		end
+		local function be16(n) return string.char(math.floor(n / 256), n % 256) end
+		local adu = "\0\1\0\0\0\6\1\3\0\0\0\2"
+		local ip = "\69\0" .. be16(40 + #adu) .. "\0\0\0\0\64\6\0\0\127\0\0\1\127\0\0\2"
+			.. be16(40000) .. be16(502) .. le32(1) .. le32(1) .. "\80\24\1\0\0\0\0\0" .. adu
+		local pkt = "\0\0\3\4\0\6\0\0\0\0\0\0\0\0\8\0" .. ip
+		f = io.open(fn, "wb")
+		f:write(le32(0xa1b2c3d4) .. "\2\0\4\0" .. le32(0) .. le32(0) .. le32(65535) .. le32(113))
+		f:write(le32(1700000000) .. le32(5) .. le32(#pkt) .. le32(#pkt) .. pkt)
+		f:close()
+		local recs = assert(mb.load_capture(fn)):records()
+		assert.are.equal(1, #recs)
+		assert.are.equal("tx", recs[1].dir)
+		assert.are.equal("tcp", recs[1].link)
+		assert.are.equal(adu, recs[1].adu)
+		assert.are.equal(1700000000000005, recs[1].t)
+		os.remove(fn)
+		assert.has_error(function() mb.replay{} end)
+		assert.has_error(function() mb.replay{capture=cap, mode="blah"} end)
+		x:set_capture(nil)
+		cap:clear()
+	end)
+
+	it("should validate file record args", function()
+		local x = mb.new_tcp_pi("blah", 123)
+		assert.has_error(function() x:read_file_record() end)
+		assert.has_error(function() x:read_file_record{{file=0, record=0, count=1}} end)
+		assert.has_error(function() x:read_file_record{{file=1, record=9999, count=2}} end)
+		assert.has_error(function() x:write_file_record{{file=1, record=0, values={"a"}}} end)
+		assert.has_error(function() x:read_fifo_queue(70000) end)
+		assert.are.same({}, x:read_file_record{})
+		assert.is_true(x:write_file_record{})
+	end)
+
+	it("should encode typed values", function()
+		assert.are.same({0x3fc0, 0, 0xc000, 0}, mb.encode("f32", {1.5, -2}))
+		assert.are.same({0, 0x3fc0}, mb.encode("f32", {1.5}, "cdab"))
+		assert.are.same({0x7856, 0x3412}, mb.encode("u32", {0x12345678}, "dcba"))
+		assert.are.same({0xffff, 0xfffe}, mb.encode("s32", {-2}))
+		assert.has_error(function() mb.encode("f16", {1}) end)
+		assert.has_error(function() mb.encode("u16", {"x"}) end)
+		local x = mb.new_tcp_pi("blah", 123)
+		assert.has_error(function() x:write_registers_as(65534, {1, 2}, "u32") end)
+		assert.has_error(function() x:write_registers_as(0, {1}, "u32", "abdc") end)
+	end)
+
+	it("should validate write points", function()
+		local x = mb.new_tcp_pi("blah", 123)
+		assert.has_error(function() x:write_points() end)
+		assert.has_error(function() x:write_points{{table="input_registers", addr=1, value=1}} end)
+		assert.has_error(function() x:write_points{{addr=70000, value=1}} end)
+		assert.has_error(function() x:write_points{{addr=1, value="x"}} end)
+		local res, failed = x:write_points{}
+		assert.are.same({}, res)
+		assert.are.equal(0, failed)
+		x:apply_profile{write_gap=4}
+	end)
+
+	it("should validate server args", function()
+		assert.has_error(function() mb.new_server() end)
+		assert.has_error(function() mb.new_server{} end)
+		assert.has_error(function() mb.new_server{listen=0, registers=70000} end)
+		assert.has_error(function() mb.new_server{listen=0, burst=0} end)
+		assert.has_error(function() mb.new_server{listen=-1} end)
+		local s = mb.new_server{listen=0, registers=10}
+		assert.has_error(function() s:set("registers", 9, {1, 2}) end)
+		assert.has_error(function() s:get("coils", 0, 1) end)
+		s:set("registers", 8, {1, -1})
+		assert.are.same({1, 0xffff}, s:get("registers", 8, 2))
+		assert.are.equal(0, s:stats().clients)
+		s:close()
+	end)
+
+	it("should validate server units", function()
+		assert.has_error(function() mb.new_server{listen=0, units={[256]={registers=1}}} end)
+		assert.has_error(function() mb.new_server{listen=0, units={[2.5]={registers=1}}} end)
+		assert.has_error(function() mb.new_server{listen=0, unknown="maybe"} end)
+		assert.has_error(function() mb.new_server{rtu=mb.new_tcp_pi("blah", 123)} end)
+		local s = mb.new_server{listen=0, units={[3]={registers=4}}, unknown="ignore"}
+		assert.has_error(function() s:add_unit(3, {bits=1}) end)
+		assert.has_error(function() s:set("registers", 0, {1}, 4) end)
+		assert.has_error(function() s:update{[3]={registers={[3]={1, 2}}}} end)
+		assert.has_error(function() s:update{[3.5]={registers={[0]={1}}}} end)
+		assert.has_error(function() s:update{[3]={registers={[0.5]={1}}}} end)
+		s:add_unit(4, {bits=2})
+		s:update{[3]={registers={[0]={7}, [2]={9}}}, [4]={bits={[1]={true}}}}
+		assert.are.same({7, 0, 9, 0}, s:get("registers", 0, 4, 3))
+		assert.are.same({0, 1}, s:get("bits", 0, 2, 4))
+		s:remove_unit(4)
+		assert.has_error(function() s:get("bits", 0, 2, 4) end)
+		s:close()
+	end)
+
+	it("should validate connect_all args", function()
+		assert.has_error(function() mb.connect_all() end)
+		assert.has_error(function() mb.connect_all{"x"} end)
+		assert.has_error(function() mb.connect_all({}, {concurrency=0}) end)
+		local res, n = mb.connect_all({}, {timeout=1000})
+		assert.are.same({}, res)
+		assert.are.equal(0, n)
+	end)
+
+	it("should connect many contexts at once", function()
+		local srv = mb.new_tcp_pi("127.0.0.1", "15518")
+		assert.is_truthy(srv:tcp_pi_listen(8))
+		local devs = {}
+		for i = 1, 4 do devs[i] = mb.new_tcp_pi("127.0.0.1", "15518") end
+		-- nothing listens here
+		devs[5] = mb.new_tcp_pi("127.0.0.1", "15599")
+		local res, n = mb.connect_all(devs, {timeout=1000000})
+		for i = 1, 4 do assert.is_true(res[i]) end
+		assert.are.equal("string", type(res[5]))
+		assert.are.equal(4, n)
+		for _, d in ipairs(devs) do d:close() end
+		srv:close()
+	end)
+
+end)
+
+--[[
+Servers (and gateways) of our own, each in a lua of its own, as they can't
+serve while we wait on them.  body is lua returning the object to run,
+with mb and listen(port) in scope.  Returns a function stopping it, which
+returns its stats.
+--]]
+local function serve_lua(body)
+	local lua, i = "lua", 0
+	while arg and arg[i - 1] do
+		i = i - 1
+		lua = arg[i]
+	end
+	local script, stop = os.tmpname(), os.tmpname()
+	os.remove(stop)
+	local f = assert(io.open(script, "w"))
+	f:write(string.format([[
+package.path = %q
+package.cpath = %q
+mb = require("libmodbus")
+local keep = {}
+function listen(port)
+	local lsn = mb.new_tcp_pi("127.0.0.1", port)
+	keep[#keep + 1] = lsn
+	return assert(lsn:tcp_pi_listen(8))
+end
+local s = (function() %s end)()
+print("ready")
+io.stdout:flush()
+local t0 = mb.monotonic()
+while not io.open(%q) and mb.monotonic() - t0 < 60e6 do
+	s:run(10000)
+end
+for k, v in pairs(s:stats()) do
+	if type(v) == "number" then print(k, v) end
+end
+print("done")
+]], package.path, package.cpath, body, stop))
+	f:close()
+	local p = io.popen(string.format("'%s' '%s'", lua, script))
+	assert.are.equal("ready", p:read("*l"))
+	return function()
+		f = assert(io.open(stop, "w"))
+		f:close()
+		local st = {}
+		local line = p:read("*l")
+		while line and line ~= "done" do
+			local k, v = line:match("^(%S+)\t(%S+)$")
+			st[k] = tonumber(v)
+			line = p:read("*l")
+		end
+		p:close()
+		os.remove(script)
+		os.remove(stop)
+		return st
+	end
+end
+
+-- A server on port, its default image holding each register's address
+local function serve(port, opts)
+	return serve_lua(string.format([[
+local s = mb.new_server{listen=listen(%q), registers=300, %s}
+local regs = {}
+for i = 1, 300 do regs[i] = i - 1 end
+s:set("registers", 0, regs)
+return s
+]], port, opts or ""))
+end
+
+local function client(port)
+	local x = mb.new_tcp_pi("127.0.0.1", port)
+	assert.is_truthy(x:connect())
+	x:set_slave(1)
+	return x
+end
+
+-- Checks res holds count registers of the default image from addr
+local function check(res, addr, count)
+	assert.is_truthy(res)
+	assert.are.equal(count, #res)
+	for i = 1, count do
+		assert.are.equal(addr + i - 1, res[i])
+	end
+end
+
+-- A linked pair of serial ports, from socat, or nil without it
+local function pty_pair()
+	local ok = os.execute("socat -V >/dev/null 2>&1")
+	if ok ~= true and ok ~= 0 then
+		return nil
+	end
+	local a, b = os.tmpname(), os.tmpname()
+	os.remove(a)
+	os.remove(b)
+	local p = io.popen(string.format("socat pty,raw,echo=0,link=%s pty,raw,echo=0,link=%s >/dev/null 2>&1 & echo $!", a, b))
+	local pid = p:read("*l")
+	p:close()
+	local t0 = mb.monotonic()
+	local function linked(path)
+		local f = io.open(path)
+		if f then f:close() end
+		return f ~= nil
+	end
+	while not (linked(a) and linked(b)) and mb.monotonic() - t0 < 5e6 do
+		os.execute("sleep 0.05")
+	end
+	return a, b, function()
+		os.execute("kill " .. pid)
+		os.remove(a)
+		os.remove(b)
+	end
+end
+
+-- An RTU server on the line at path, with images for units 7 and 8
+local function serve_rtu(path, opts)
+	return serve_lua(string.format([[
+local line = mb.new_rtu(%q, 115200, "N", 8, 1)
+assert(line:connect())
+return mb.new_server{rtu=line, registers=4, units={[7]={registers=4}, [8]={registers=4}}, %s}
+]], path, opts or ""))
+end
+
+local function rtu_client(path)
+	local x = mb.new_rtu(path, 115200, "N", 8, 1)
+	assert.is_truthy(x:connect())
+	x:set_response_timeout(0, 200000)
+	return x
+end
+
+describe("loopback", function()
+
+	it("should split and pipeline reads over the request limits", function()
+		local stop = serve("15502")
+		local x = client("15502")
+		x:set_request_limits{read_registers=10}
+		check(x:read_registers(0, 95), 0, 95)
+		x:set_request_limits{pipeline=4}
+		check(x:read_registers(5, 250), 5, 250)
+		x:close()
+		assert.are.equal(10 + 25, stop().requests)
+	end)
+
+	it("should count what a failed pipelined write did write", function()
+		local stop = serve("15505")
+		local x = client("15505")
+		x:set_request_limits{write_registers=10, pipeline=4}
+		local vals = {}
+		for i = 1, 100 do vals[i] = 1000 + i end
+		-- the image ends at 300, 5 requests make it
+		local res, err, n = x:write_registers(250, vals)
+		assert.is_nil(res)
+		assert.is_truthy(err)
+		assert.are.equal(50, n)
+		assert.are.equal(1050, x:read_registers(299, 1)[1])
+		x:close()
+		stop()
+	end)
+
+	it("should serve reads from the cache until written", function()
+		local stop = serve("15503")
+		local x = client("15503")
+		x:cache_add{table="registers", addr=100, count=20, ttl=60e6}
+		check(x:read_registers(100, 2), 100, 2)
+		check(x:read_registers(110, 4), 110, 4)
+		assert.is_truthy(x:write_registers(105, {7}))
+		assert.are.equal(7, x:read_registers(105, 1)[1])
+		local st = x:cache_stats()
+		x:close()
+		assert.are.equal(1, st.hits)
+		assert.are.equal(2, st.misses)
+		-- the block twice, and the write
+		assert.are.equal(3, stop().requests)
+	end)
+
+	it("should wait out the turnaround after a TCP broadcast", function()
+		local stop = serve("15507", "rate=5, burst=1")
+		local x = client("15507")
+		check(x:read_registers(11, 2), 11, 2)
+		-- the server answers unit 0 after the response timeout, waiting for
+		-- its rate limit, but within the turnaround
+		x:set_response_timeout(0, 20000)
+		local t0 = mb.monotonic()
+		assert.is_truthy(x:broadcast_write{table="registers", addr=10, values={5}, turnaround=300000})
+		assert.is_true(mb.monotonic() - t0 >= 300000)
+		x:set_response_timeout(1, 0)
+		check(x:read_registers(11, 2), 11, 2)
+		assert.are.equal(5, x:read_registers(10, 1)[1])
+		x:close()
+		assert.are.equal(4, stop().responses)
+	end)
+
+	it("should probe timeouts from the device's latency", function()
+		local stop = serve("15506")
+		local x = client("15506")
+		local p = assert(x:probe_capabilities{addr=0, samples=10})
+		x:close()
+		stop()
+		assert.are.equal(125, p.read_registers)
+		assert.is_true(p.latency <= p.latency_max)
+		assert.are.equal(2 * p.latency_max + 20000, p.response_timeout)
+		assert.are.equal(p.latency_max + 20000, p.byte_timeout)
+	end)
+
+	it("should answer each unit from its own image", function()
+		local stop = serve("15504", "units={[3]={registers=4}}")
+		local x = client("15504")
+		x:set_slave(3)
+		assert.is_truthy(x:write_registers(0, {30, 31, 32, 33}))
+		check(x:read_registers(0, 4), 30, 4)
+		assert.is_falsy(x:read_registers(4, 1))
+		x:set_slave(1)
+		check(x:read_registers(0, 4), 0, 4)
+		x:close()
+		assert.are.equal(1, stop().unknown_units)
+	end)
+
+	it("should hedge a slow read onto the second path", function()
+		local stop_slow = serve("15509", "rate=2, burst=1")
+		local stop = serve("15510")
+		local slow, fast = client("15509"), client("15510")
+		-- takes the slow server's only token, its next answer waits 500ms
+		check(slow:read_registers(0, 1), 0, 1)
+		local h = mb.new_hedge{ctxs={slow, fast}, delay=20000}
+		local t0 = mb.monotonic()
+		local regs, path = h:read("registers", 20, 4)
+		check(regs, 20, 4)
+		assert.are.equal(2, path)
+		assert.is_true(mb.monotonic() - t0 < 400000)
+		local st = h:stats()
+		assert.are.equal(1, st.requests)
+		assert.are.equal(1, st.hedged)
+		assert.are.equal(0, st.paths[1].wins)
+		assert.are.equal(1, st.paths[2].wins)
+		slow:close()
+		fast:close()
+		assert.are.equal(1, stop().requests)
+		stop_slow()
+	end)
+
+	it("should lease, reuse and share pooled connections", function()
+		local stop = serve("15511", "units={[2]={registers=4}}")
+		local pool = mb.new_pool{host="127.0.0.1", service="15511", size=2}
+		local x = assert(pool:lease(1))
+		check(x:read_registers(0, 4), 0, 4)
+		pool:release(x)
+		-- the free connection is used again
+		local y = assert(pool:lease(2))
+		assert.are.equal(x, y)
+		local z = assert(pool:lease(1))
+		assert.is_true(z ~= y)
+		local res, err = pool:lease(1)
+		assert.is_nil(res)
+		assert.is_truthy(err)
+		pool:release(y)
+		pool:release(z)
+		local all = pool:read_many{{unit=1, table="registers", addr=10, count=4},
+			{unit=1, table="registers", addr=100, count=2}}
+		check(all[1], 10, 4)
+		check(all[2], 100, 2)
+		local st = pool:stats()
+		assert.are.equal(2, st.connects)
+		assert.are.equal(3, st.leases)
+		assert.are.equal(1, st.exhausted)
+		assert.are.equal(2, st.requests)
+		pool:close()
+		st = stop()
+		assert.are.equal(2, st.accepted)
+		assert.are.equal(3, st.requests)
+	end)
+
+	it("should merge scattered writes into few requests", function()
+		local stop = serve("15512", "bits=8")
+		local x = client("15512")
+		local res, failed = x:write_points{
+			{addr=102, value=22}, {addr=100, value=20}, {addr=101, value=21},
+			{addr=150, value=50}, {table="bits", addr=3, value=true},
+			{addr=101, value=-1},
+		}
+		assert.are.equal(0, failed)
+		assert.are.same({true, true, true, true, true, true}, res)
+		assert.are.same({20, 65535, 22, 103}, x:read_registers(100, 4))
+		assert.are.equal(50, x:read_registers(150, 1)[1])
+		assert.are.same({0, 0, 0, 1}, x:read_bits(0, 4))
+		x:close()
+		-- one FC16, one FC06 and one FC05, then the three reads
+		assert.are.equal(3 + 3, stop().requests)
+	end)
+
+	it("should answer busy past a client's queue", function()
+		local stop = serve("15514", "queue=1, rate=1, burst=1")
+		local x = client("15514")
+		x:set_response_timeout(2, 0)
+		-- spends the only token, the next request waits in the queue
+		check(x:read_registers(0, 1), 0, 1)
+		x:set_request_limits{read_registers=1, pipeline=4}
+		local res, err = x:read_registers(0, 4)
+		assert.is_nil(res)
+		assert.is_truthy(err)
+		x:close()
+		local st = stop()
+		assert.is_true(st.busy_errors >= 1)
+		assert.are.equal(1, st.queue_max)
+	end)
+
+	it("should hold requests over the rate back", function()
+		local stop = serve("15515", "rate=20, burst=1")
+		local x = client("15515")
+		x:set_request_limits{read_registers=1, pipeline=4}
+		check(x:read_registers(0, 4), 0, 4)
+		x:close()
+		local st = stop()
+		-- the last of the four waits three periods of 50ms
+		assert.is_true(st.wait_max >= 140000)
+		assert.are.equal(0, st.busy_errors)
+	end)
+
+	it("should evict idle clients, but not while requests are held", function()
+		local stop = serve("15516", "rate=10, burst=1, idle=150000")
+		local x = client("15516")
+		x:set_response_timeout(1, 0)
+		x:set_request_limits{read_registers=1, pipeline=4}
+		-- the last is served 300ms after they all arrived
+		check(x:read_registers(0, 4), 0, 4)
+		os.execute("sleep 0.4")
+		assert.is_nil(x:read_registers(0, 1))
+		x:close()
+		local st = stop()
+		assert.are.equal(1, st.evicted)
+		assert.are.equal(4, st.responses)
+	end)
+
+	it("should turn away clients over the limit", function()
+		local stop = serve("15517", "clients=1")
+		local x = client("15517")
+		check(x:read_registers(0, 2), 0, 2)
+		local y = mb.new_tcp_pi("127.0.0.1", "15517")
+		assert.is_truthy(y:connect())
+		y:set_response_timeout(0, 500000)
+		assert.is_nil(y:read_registers(0, 2))
+		check(x:read_registers(2, 2), 2, 2)
+		y:close()
+		x:close()
+		local st = stop()
+		assert.are.equal(1, st.accepted)
+		assert.are.equal(1, st.rejected)
+	end)
+
+	it("should capture, dump, load and replay real frames", function()
+		local stop = serve("15513")
+		local x = client("15513")
+		local cap = mb.new_capture{size=65536}
+		local id = x:set_capture(cap)
+		check(x:read_registers(0, 4), 0, 4)
+		assert.is_truthy(x:write_registers(20, {20, 21}))
+		check(x:read_registers(20, 2), 20, 2)
+		x:set_capture(nil)
+		local recs = cap:records()
+		assert.are.equal(6, #recs)
+		local fn = os.tmpname()
+		assert.are.equal(6, cap:dump(fn))
+		local loaded = assert(mb.load_capture(fn))
+		os.remove(fn)
+		local again = loaded:records()
+		assert.are.equal(6, #again)
+		for i, r in ipairs(recs) do
+			assert.are.equal(i % 2 == 1 and "tx" or "rx", r.dir)
+			assert.are.equal(r.dir, again[i].dir)
+			assert.are.equal("tcp", again[i].link)
+			assert.are.equal(id, again[i].ctx)
+			assert.are.equal(r.adu, again[i].adu)
+		end
+		local st = mb.replay{capture=loaded, ctx=x, speed=10}
+		assert.are.equal(3, st.requests)
+		assert.are.equal(3, st.responses)
+		assert.are.equal(0, st.mismatches)
+		x:close()
+		assert.are.equal(6, stop().requests)
+	end)
+
+	it("should serve units with images on an RTU line", function()
+		local a, b, unlink = pty_pair()
+		if not a then return end -- needs socat
+		local stop = serve_rtu(a)
+		local x = rtu_client(b)
+		x:set_slave(7)
+		assert.is_truthy(x:write_registers(0, {1, 2, 3, 4}))
+		assert.are.same({1, 2, 3, 4}, x:read_registers(0, 4))
+		-- no image, no answer
+		x:set_slave(9)
+		assert.is_nil(x:read_registers(0, 4))
+		-- broadcasts go to every image, unanswered
+		x:set_slave(0)
+		x:write_register(3, 99)
+		x:set_slave(8)
+		assert.are.same({0, 0, 0, 99}, x:read_registers(0, 4))
+		x:set_slave(7)
+		assert.are.same({1, 2, 3, 99}, x:read_registers(0, 4))
+		local st = stop()
+		assert.are.equal(1, st.unknown_units)
+		-- unless the default image is to answer for them
+		stop = serve_rtu(a, "rtu_default=true")
+		x:set_slave(9)
+		assert.are.same({0, 0, 0, 0}, x:read_registers(0, 4))
+		x:close()
+		stop()
+		unlink()
+	end)
+
+	it("should forward requests from TCP to an RTU line and back", function()
+		local a, b, unlink = pty_pair()
+		if not a then return end -- needs socat
+		local stop_srv = serve_rtu(a)
+		local stop = serve_lua(string.format([[
+local line = mb.new_rtu(%q, 115200, "N", 8, 1)
+assert(line:connect())
+line:set_response_timeout(0, 100000)
+return mb.new_gateway{listen=listen("15508"), lines={{ctx=line, units={7, 9}}}}
+]], b))
+		local x = client("15508")
+		x:set_slave(7)
+		assert.is_truthy(x:write_registers(0, {1, 2, 3, 4}))
+		assert.are.same({1, 2, 3, 4}, x:read_registers(0, 4))
+		-- routed, but nothing answers
+		x:set_slave(9)
+		local res, err = x:read_registers(0, 1)
+		assert.is_nil(res)
+		assert.is_truthy(err:find("Target"))
+		-- no route
+		x:set_slave(5)
+		res, err = x:read_registers(0, 1)
+		assert.is_nil(res)
+		assert.is_truthy(err:find("path"))
+		x:close()
+		local st = stop()
+		assert.are.equal(4, st.requests)
+		assert.are.equal(4, st.responses)
+		assert.are.equal(1, st.path_errors)
+		stop_srv()
+		unlink()
+	end)
+
+	it("should time transactions on an RTU line", function()
+		local a, b, unlink = pty_pair()
+		if not a then return end -- needs socat
+		local stop = serve_rtu(a)
+		local x = rtu_client(b)
+		x:set_slave(7)
+		local t = x:rtu_tune{exact_t35=true, adaptive=true, turnaround=100000}
+		assert.are.equal(304, t.t35)
+		for i = 1, 5 do
+			assert.is_truthy(x:read_registers(0, 4))
+		end
+		local st = x:rtu_get_stats(true)
+		assert.are.equal(5, st.transactions)
+		assert.is_true(st.turnaround_min <= st.turnaround_avg)
+		assert.is_true(st.turnaround_avg <= st.turnaround_max)
+		-- 8 bytes out and 13 back, at 87us each
+		assert.are.equal(21 * 87, st.wire_avg)
+		-- a pty doesn't keep to the line speed, so no more than that
+		assert.is_true(st.elapsed_avg > 0)
+		assert.are.equal(0, x:rtu_get_stats().transactions)
+		x:close()
+		stop()
+		unlink()
+	end)
 
 end)
 
@@ -60,6 +919,19 @@ describe("functional tcp pi tests #real", function()
 		local res, err = x:read_registers(9999, 8)
 		assert.falsy(res, "should have failed with illegal address")
 	end)
+
+	it("should not allocate per transaction", function()
+		if not mb.allocations then return end -- needs -DLMB_DEBUG_ALLOC
+		assert.is_truthy(x:connect())
+		assert.is_truthy(x:set_slave(D.slave))
+		assert.is_truthy(x:read_registers(D.base, D.count))
+		local n = mb.allocations()
+		for i = 1, 100 do
+			x:read_registers(D.base, D.count)
+			x:report_slave_id()
+		end
+		assert.are.equal(n, mb.allocations())
+	end)
 		
 	
 end)
\ No newline at end of file